@@ -0,0 +1,75 @@
+#!/bin/bash
+# Writes a synthetic btrfs-assemble input with roughly the given number of
+# items in the FS tree, for benchmarking:
+#
+#   bench/gen-corpus.sh 1000000 crc32 > corpus.txt
+#
+# The output is the same every time for the same arguments. It has a single
+# device, with one system and one metadata chunk, a chunk tree, and an FS
+# tree of empty files in the top-level directory. The trees are given as item
+# streams, so btrfs-assemble does the layout. There's no extent tree, so the
+# result can be dumped but not mounted.
+
+set -e
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 <items> <crc32|xxhash|sha256|blake2>" >&2
+    exit 1
+fi
+
+awk -v items="$1" -v csum="$2" '
+# mawk, the default awk on Debian, gives ffffffff for anything of 2^32 or
+# more with %x, so larger numbers have to be done in two halves
+function hex64(v) {
+    if (v < 4294967296)
+        return sprintf("%x", v)
+
+    return sprintf("%x%08x", int(v / 4294967296), v % 4294967296)
+}
+
+BEGIN {
+    fsid = "5eb1f2d0-8a4c-4b0e-9d1e-6c3a2f7b9e01"
+    dev_uuid = "0d8f4a26-3c1b-4e5f-a7d9-2b6e8c1f4a03"
+    chunk_tree_uuid = "9a7c5e3b-1d2f-4068-b4a2-c6e8f0a1b305"
+    ts = "2026-01-01T00:00:00"
+    mib = 1048576
+
+    # each file is a DIR_INDEX, an INODE_ITEM and an INODE_REF, of about
+    # 100 bytes apiece including the item header
+    files = int((items - 2) / 3)
+    if (files < 0)
+        files = 0
+
+    sys_start = mib
+    sys_len = 4 * mib
+    meta_start = 16 * mib
+    meta_len = (int((items * 110) / mib) + 32) * mib
+    total = meta_start + meta_len
+    used = sys_len + meta_len
+
+    printf "superblock fsid=%s generation=1 root=0 chunk_root=0 log_root=0 total_bytes=%s bytes_used=%s root_dir_objectid=6 num_devices=1 sectorsize=1000 nodesize=4000 leafsize=4000 stripesize=1000 chunk_root_generation=1 compat_flags=0 compat_ro_flags=0 incompat_flags=mixed_backref,big_metadata,extended_iref,skinny_metadata,no_holes csum_type=%s root_level=0 chunk_root_level=0 log_root_level=0 (dev_item devid=1 total_bytes=%s bytes_used=%s io_align=1000 io_width=1000 sector_size=1000 type=0 generation=0 start_offset=0 dev_group=0 seek_speed=0 bandwidth=0 uuid=%s fsid=%s)\n", fsid, hex64(total), hex64(used), csum, hex64(total), hex64(used), dev_uuid, fsid
+
+    sys_chunk = sprintf("chunk_item length=%x owner=2 stripe_len=10000 type=system io_align=10000 io_width=10000 sector_size=1000 num_stripes=1 sub_stripes=1 stripe(0) devid=1 offset=%x dev_uuid=%s", sys_len, sys_start, dev_uuid)
+    meta_chunk = sprintf("chunk_item length=%s owner=2 stripe_len=10000 type=metadata io_align=10000 io_width=10000 sector_size=1000 num_stripes=1 sub_stripes=1 stripe(0) devid=1 offset=%x dev_uuid=%s", hex64(meta_len), meta_start, dev_uuid)
+
+    printf "bootstrap 100,e4,%x\n%s\n", sys_start, sys_chunk
+
+    printf "tree id=3 generation=1 chunk_tree_uuid=%s\n", chunk_tree_uuid
+    printf "1,d8,1\ndev_item devid=1 total_bytes=%s bytes_used=%s io_align=1000 io_width=1000 sector_size=1000 type=0 generation=0 start_offset=0 dev_group=0 seek_speed=0 bandwidth=0 uuid=%s fsid=%s\n", hex64(total), hex64(used), dev_uuid, fsid
+    printf "100,e4,%x\n%s\n", sys_start, sys_chunk
+    printf "100,e4,%x\n%s\n", meta_start, meta_chunk
+
+    printf "tree id=5 generation=1 chunk_tree_uuid=%s\n", chunk_tree_uuid
+    printf "100,1,0\ninode_item generation=1 transid=1 size=%s nbytes=0 block_group=0 nlink=1 uid=0 gid=0 mode=40755 rdev=0 flags=0 sequence=0 atime=%s ctime=%s mtime=%s otime=%s\n", hex64(files * 18), ts, ts, ts, ts
+    printf "100,c,100\ninode_ref index=0 name_len=2 name=..\n"
+
+    for (i = 0; i < files; i++)
+        printf "100,60,%x\ndir_index location=%x,1,0 transid=1 data_len=0 name_len=9 type=reg_file name=f%08x\n", i + 2, i + 257, i
+
+    for (i = 0; i < files; i++) {
+        printf "%x,1,0\ninode_item generation=1 transid=1 size=0 nbytes=0 block_group=0 nlink=1 uid=0 gid=0 mode=100644 rdev=0 flags=0 sequence=0 atime=%s ctime=%s mtime=%s otime=%s\n", i + 257, ts, ts, ts, ts
+        printf "%x,c,100\ninode_ref index=%x name_len=9 name=f%08x\n", i + 257, i + 2, i
+    }
+
+    printf "tree id=1 generation=1 chunk_tree_uuid=%s\n", chunk_tree_uuid
+}'
@@ -0,0 +1,44 @@
+#!/bin/bash
+# Times btrfs-assemble on a text dump, to compare the speed of the parser
+# between builds:
+#
+#   bench/parse.sh dump.txt old/btrfs-assemble new/btrfs-assemble
+#
+# Each binary is run single-threaded, so that the numbers reflect the cost of
+# parsing rather than how many CPUs there are. The image is written to
+# $TMPDIR (or /tmp), which should be a tmpfs so that disk I/O doesn't
+# dominate. Set RUNS to change the number of runs per binary (default 5).
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <dump.txt> <btrfs-assemble> [btrfs-assemble...]" >&2
+    exit 1
+fi
+
+dump=$1
+shift
+
+runs=${RUNS:-5}
+img=$(mktemp "${TMPDIR:-/tmp}/parse-bench.XXXXXX")
+trap 'rm -f "$img"' EXIT
+
+lines=$(wc -l < "$dump")
+
+for bin in "$@"; do
+    times=()
+
+    for ((i = 0; i < runs; i++)); do
+        start=$(date +%s%N)
+        "$bin" -j 1 "$dump" "$img"
+        end=$(date +%s%N)
+        times+=($(((end - start) / 1000000)))
+        rm -f "$img"
+    done
+
+    sorted=($(printf '%s\n' "${times[@]}" | sort -n))
+    best=${sorted[0]}
+    median=${sorted[$((runs / 2))]}
+
+    echo "$bin: best ${best} ms, median ${median} ms, $((lines * 1000 / (best > 0 ? best : 1))) lines/s"
+done
@@ -0,0 +1,96 @@
+#!/bin/bash
+# Runs the benchmark suite, as used by the "bench" target:
+#
+#   bench/run.sh btrfs-dump btrfs-assemble outdir "10000 1000000" "crc32 xxhash"
+#
+# For each number of items and csum type, this generates a corpus with
+# gen-corpus.sh and assembles it, then times a full dump, a dump of just the
+# FS tree, and assembling the full dump again. The results are appended to
+# outdir/results.jsonl, one JSON object per line, with the best and median
+# of RUNS runs (default 3) in milliseconds. The round trip also checks that
+# dumping the reassembled image gives the same text, and records whether it
+# did as "match".
+#
+# Only one image exists at a time, and it is deleted afterwards unless
+# BENCH_KEEP is set, as the largest ones take up several gigabytes.
+
+set -e
+
+if [ $# -ne 5 ]; then
+    echo "Usage: $0 <btrfs-dump> <btrfs-assemble> <outdir> <items...> <csums...>" >&2
+    exit 1
+fi
+
+dump_bin=$1
+assemble_bin=$2
+outdir=$3
+scales=($4)
+csums=($5)
+runs=${RUNS:-3}
+gen=$(dirname "$0")/gen-corpus.sh
+
+mkdir -p "$outdir"
+results=$outdir/results.jsonl
+version=$("$dump_bin" --version | awk '{ print $2 }')
+
+# times the command given RUNS times, setting best and median
+time_runs() {
+    local times=()
+
+    for ((i = 0; i < runs; i++)); do
+        local start=$(date +%s%N)
+        "$@"
+        local end=$(date +%s%N)
+        times+=($(((end - start) / 1000000)))
+    done
+
+    local sorted=($(printf '%s\n' "${times[@]}" | sort -n))
+    best=${sorted[0]}
+    median=${sorted[$((runs / 2))]}
+}
+
+record() {
+    local op=$1 extra=$2
+
+    printf '{"version":"%s","items":%s,"csum":"%s","op":"%s","runs":%s,"best_ms":%s,"median_ms":%s%s}\n' \
+        "$version" "$items" "$csum" "$op" "$runs" "$best" "$median" "$extra" >> "$results"
+
+    echo "$items items, $csum, $op: best ${best} ms, median ${median} ms"
+}
+
+for items in "${scales[@]}"; do
+    for csum in "${csums[@]}"; do
+        corpus=$outdir/corpus-$items-$csum.txt
+        img=$outdir/image-$items-$csum.img
+        rt_txt=$outdir/roundtrip-$items-$csum.txt
+        rt_img=$outdir/roundtrip-$items-$csum.img
+
+        "$gen" "$items" "$csum" > "$corpus"
+
+        time_runs "$assemble_bin" "$corpus" "$img"
+        record assemble ",\"image_bytes\":$(du -B1 "$img" | cut -f1)"
+        rm -f "$corpus"
+
+        time_runs sh -c '"$0" "$1" > /dev/null' "$dump_bin" "$img"
+        record dump
+
+        time_runs sh -c '"$0" -t 5 "$1" > /dev/null' "$dump_bin" "$img"
+        record dump_tree
+
+        "$dump_bin" "$img" > "$rt_txt"
+
+        time_runs "$assemble_bin" "$rt_txt" "$rt_img"
+
+        if "$dump_bin" "$rt_img" | cmp -s - "$rt_txt"; then
+            match=true
+        else
+            match=false
+        fi
+
+        record roundtrip ",\"match\":$match"
+
+        if [ -z "$BENCH_KEEP" ]; then
+            rm -f "$img" "$rt_txt" "$rt_img"
+        fi
+    done
+done
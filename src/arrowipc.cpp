@@ -0,0 +1,565 @@
+module;
+
+#include <stdint.h>
+#include <string.h>
+#include <ostream>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <memory>
+
+export module arrowipc;
+
+using namespace std;
+
+// Minimal writer for the Arrow IPC file format, enough for flat tables of
+// non-nullable integer, string and binary columns. The metadata is flatbuffers,
+// which we serialize by hand rather than pulling in the flatbuffers and
+// Arrow libraries.
+
+// A flatbuffers object, built up as a tree and then serialized in one go.
+// Children always come after their parents, as uoffsets can only point
+// forwards.
+struct fb_node {
+    enum class kind {
+        table,
+        string,
+        vector_of_tables,
+        vector_of_structs
+    };
+
+    struct field {
+        uint16_t slot;
+        vector<uint8_t> scalar;
+        unique_ptr<fb_node> child;
+    };
+
+    kind k;
+    vector<field> fields; // table
+    vector<fb_node> elements; // vector_of_tables
+    string bytes; // string or vector_of_structs
+    uint32_t count = 0; // vector_of_structs
+
+    static fb_node table() {
+        return fb_node{kind::table};
+    }
+
+    static fb_node str(string_view sv) {
+        fb_node n{kind::string};
+
+        n.bytes = sv;
+
+        return n;
+    }
+
+    static fb_node tables(vector<fb_node> elements) {
+        fb_node n{kind::vector_of_tables};
+
+        n.elements = move(elements);
+
+        return n;
+    }
+
+    template<typename T>
+    static fb_node structs(span<const T> items) {
+        fb_node n{kind::vector_of_structs};
+
+        n.bytes.assign((const char*)items.data(), items.size_bytes());
+        n.count = (uint32_t)items.size();
+
+        return n;
+    }
+
+    template<typename T>
+    fb_node& add(uint16_t slot, T val) {
+        auto& f = fields.emplace_back();
+
+        f.slot = slot;
+        f.scalar.resize(sizeof(T));
+        memcpy(f.scalar.data(), &val, sizeof(T));
+
+        return *this;
+    }
+
+    fb_node& add(uint16_t slot, fb_node&& child) {
+        auto& f = fields.emplace_back();
+
+        f.slot = slot;
+        f.child = make_unique<fb_node>(move(child));
+
+        return *this;
+    }
+};
+
+class fb_serializer {
+public:
+    vector<uint8_t> finish(const fb_node& root) {
+        buf.clear();
+        buf.resize(sizeof(uint32_t));
+        patch(0, write(root));
+
+        return move(buf);
+    }
+
+private:
+    void align(size_t a) {
+        while (buf.size() % a) {
+            buf.push_back(0);
+        }
+    }
+
+    template<typename T>
+    void put(T val) {
+        auto pos = buf.size();
+
+        buf.resize(pos + sizeof(T));
+        memcpy(buf.data() + pos, &val, sizeof(T));
+    }
+
+    // write the uoffset at pos pointing to target
+    void patch(size_t pos, size_t target) {
+        uint32_t off = (uint32_t)(target - pos);
+
+        memcpy(buf.data() + pos, &off, sizeof(off));
+    }
+
+    size_t write(const fb_node& n) {
+        switch (n.k) {
+            case fb_node::kind::string: {
+                align(sizeof(uint32_t));
+
+                auto pos = buf.size();
+
+                put((uint32_t)n.bytes.size());
+                buf.insert(buf.end(), n.bytes.begin(), n.bytes.end());
+                buf.push_back(0);
+
+                return pos;
+            }
+
+            case fb_node::kind::vector_of_structs: {
+                // all our structs are 8-byte aligned, and the length comes
+                // immediately before the first one
+                while ((buf.size() + sizeof(uint32_t)) % 8) {
+                    buf.push_back(0);
+                }
+
+                auto pos = buf.size();
+
+                put(n.count);
+                buf.insert(buf.end(), n.bytes.begin(), n.bytes.end());
+
+                return pos;
+            }
+
+            case fb_node::kind::vector_of_tables: {
+                align(sizeof(uint32_t));
+
+                auto pos = buf.size();
+
+                put((uint32_t)n.elements.size());
+                buf.resize(buf.size() + (n.elements.size() * sizeof(uint32_t)));
+
+                for (size_t i = 0; i < n.elements.size(); i++) {
+                    auto child = write(n.elements[i]);
+
+                    patch(pos + sizeof(uint32_t) + (i * sizeof(uint32_t)), child);
+                }
+
+                return pos;
+            }
+
+            case fb_node::kind::table:
+                break;
+        }
+
+        // vtable
+
+        uint16_t num_slots = 0;
+
+        for (const auto& f : n.fields) {
+            num_slots = max(num_slots, (uint16_t)(f.slot + 1));
+        }
+
+        align(sizeof(uint16_t));
+
+        auto vtable_pos = buf.size();
+
+        buf.resize(buf.size() + ((2 + num_slots) * sizeof(uint16_t)));
+
+        // table, with each field aligned to its own size
+
+        align(sizeof(uint32_t));
+
+        auto table_pos = buf.size();
+        vector<size_t> field_pos;
+
+        put((int32_t)(table_pos - vtable_pos));
+
+        for (const auto& f : n.fields) {
+            auto size = f.child ? sizeof(uint32_t) : f.scalar.size();
+
+            align(size);
+            field_pos.push_back(buf.size());
+
+            if (f.child)
+                put((uint32_t)0);
+            else
+                buf.insert(buf.end(), f.scalar.begin(), f.scalar.end());
+        }
+
+        auto vt = (uint16_t*)(buf.data() + vtable_pos);
+        auto table_size = (uint16_t)(buf.size() - table_pos);
+
+        vt[0] = (uint16_t)((2 + num_slots) * sizeof(uint16_t));
+        vt[1] = table_size;
+
+        for (size_t i = 0; i < n.fields.size(); i++) {
+            vt = (uint16_t*)(buf.data() + vtable_pos);
+            vt[2 + n.fields[i].slot] = (uint16_t)(field_pos[i] - table_pos);
+        }
+
+        for (size_t i = 0; i < n.fields.size(); i++) {
+            if (n.fields[i].child)
+                patch(field_pos[i], write(*n.fields[i].child));
+        }
+
+        return table_pos;
+    }
+
+    vector<uint8_t> buf;
+};
+
+// from Schema.fbs and Message.fbs
+
+constexpr int16_t METADATA_V5 = 4;
+
+constexpr uint8_t TYPE_INT = 2;
+constexpr uint8_t TYPE_BINARY = 4;
+constexpr uint8_t TYPE_UTF8 = 5;
+
+constexpr uint8_t HEADER_SCHEMA = 1;
+constexpr uint8_t HEADER_RECORD_BATCH = 3;
+
+struct field_node {
+    int64_t length;
+    int64_t null_count;
+};
+
+struct buffer {
+    int64_t offset;
+    int64_t length;
+};
+
+struct block {
+    int64_t offset;
+    int32_t meta_data_length;
+    int32_t padding;
+    int64_t body_length;
+};
+
+static_assert(sizeof(block) == 24);
+
+constexpr char MAGIC[] = "ARROW1";
+
+export namespace arrowipc {
+
+enum class column_type {
+    uint8,
+    uint16,
+    uint32,
+    uint64,
+    int64,
+    utf8,
+    binary
+};
+
+struct column {
+    string name;
+    column_type type;
+};
+
+// Writes a table to an Arrow IPC file, in record batches of batch_rows rows,
+// so memory use doesn't depend on the size of the table.
+class writer {
+public:
+    writer(const filesystem::path& fn, vector<column> columns_, size_t batch_rows = 65536)
+        : f(fn, ios::binary), batch_rows(batch_rows) {
+        if (!f)
+            throw runtime_error("failed to open " + fn.string());
+
+        for (auto& c : columns_) {
+            auto& b = builders.emplace_back();
+
+            b.col = move(c);
+
+            if (b.variable_width())
+                b.offsets.push_back(0);
+        }
+
+        f.write(MAGIC, 6);
+        f.write("\0\0", 2);
+        pos = 8;
+
+        write_message(HEADER_SCHEMA, schema(), {});
+    }
+
+    writer(const writer&) = delete;
+    writer& operator=(const writer&) = delete;
+
+    void append(size_t col, uint64_t val) {
+        auto& b = builders[col];
+
+        switch (b.col.type) {
+            case column_type::uint8:
+                b.data.push_back((uint8_t)val);
+                break;
+
+            case column_type::uint16:
+                put(b.data, (uint16_t)val);
+                break;
+
+            case column_type::uint32:
+                put(b.data, (uint32_t)val);
+                break;
+
+            case column_type::uint64:
+            case column_type::int64:
+                put(b.data, val);
+                break;
+
+            case column_type::utf8:
+            case column_type::binary:
+                throw runtime_error("integer appended to string column " + b.col.name);
+        }
+    }
+
+    void append(size_t col, string_view sv) {
+        auto& b = builders[col];
+
+        if (!b.variable_width())
+            throw runtime_error("string appended to integer column " + b.col.name);
+
+        b.data.insert(b.data.end(), sv.begin(), sv.end());
+        b.offsets.push_back((int32_t)b.data.size());
+    }
+
+    void end_row() {
+        rows++;
+
+        if (rows == batch_rows)
+            flush();
+    }
+
+    void finish() {
+        if (rows > 0)
+            flush();
+
+        // end-of-stream marker, then the footer
+
+        uint32_t eos[2] = { 0xffffffff, 0 };
+
+        write(eos, sizeof(eos));
+
+        auto start = pos;
+        auto footer = fb_node::table();
+
+        footer.add(0, METADATA_V5);
+        footer.add(1, schema());
+        footer.add(2, fb_node::structs(span<const block>{}));
+        footer.add(3, fb_node::structs(span<const block>(batches)));
+
+        auto buf = fb_serializer().finish(footer);
+
+        write(buf.data(), buf.size());
+
+        auto len = (int32_t)(pos - start);
+
+        write(&len, sizeof(len));
+        write(MAGIC, 6);
+
+        f.flush();
+
+        if (f.fail())
+            throw runtime_error("error writing Arrow file");
+    }
+
+private:
+    struct builder {
+        bool variable_width() const {
+            return col.type == column_type::utf8 || col.type == column_type::binary;
+        }
+
+        arrowipc::column col;
+        vector<uint8_t> data;
+        vector<int32_t> offsets;
+    };
+
+    template<typename T>
+    static void put(vector<uint8_t>& v, T val) {
+        auto p = v.size();
+
+        v.resize(p + sizeof(T));
+        memcpy(v.data() + p, &val, sizeof(T));
+    }
+
+    void write(const void* ptr, size_t len) {
+        f.write((const char*)ptr, len);
+
+        if (f.fail())
+            throw runtime_error("error writing Arrow file");
+
+        pos += len;
+    }
+
+    void pad(size_t len) {
+        static const uint8_t zeroes[8] = {};
+
+        write(zeroes, len);
+    }
+
+    fb_node schema() const {
+        vector<fb_node> fields;
+
+        for (const auto& b : builders) {
+            auto fld = fb_node::table();
+
+            fld.add(0, fb_node::str(b.col.name));
+            fld.add(1, (uint8_t)0); // nullable
+
+            if (b.variable_width()) {
+                fld.add(2, b.col.type == column_type::utf8 ? TYPE_UTF8 : TYPE_BINARY);
+                fld.add(3, fb_node::table());
+            } else {
+                int32_t bits;
+
+                switch (b.col.type) {
+                    case column_type::uint8:
+                        bits = 8;
+                        break;
+                    case column_type::uint16:
+                        bits = 16;
+                        break;
+                    case column_type::uint32:
+                        bits = 32;
+                        break;
+                    default:
+                        bits = 64;
+                        break;
+                }
+
+                auto type = fb_node::table();
+
+                type.add(0, bits);
+                type.add(1, (uint8_t)(b.col.type == column_type::int64 ? 1 : 0));
+
+                fld.add(2, TYPE_INT);
+                fld.add(3, move(type));
+            }
+
+            fld.add(5, fb_node::tables({}));
+
+            fields.push_back(move(fld));
+        }
+
+        auto s = fb_node::table();
+
+        s.add(0, (int16_t)0); // little-endian
+        s.add(1, fb_node::tables(move(fields)));
+
+        return s;
+    }
+
+    void flush() {
+        vector<field_node> nodes;
+        vector<buffer> buffers;
+        int64_t body_len = 0;
+
+        auto add_buffer = [&](size_t len) {
+            buffers.push_back({body_len, (int64_t)len});
+            body_len += (len + 7) & ~7;
+        };
+
+        for (const auto& b : builders) {
+            nodes.push_back({(int64_t)rows, 0});
+
+            add_buffer(0); // validity bitmap, omitted as nothing is null
+
+            if (b.variable_width())
+                add_buffer(b.offsets.size() * sizeof(int32_t));
+
+            add_buffer(b.data.size());
+        }
+
+        auto rb = fb_node::table();
+
+        rb.add(0, (int64_t)rows);
+        rb.add(1, fb_node::structs(span<const field_node>(nodes)));
+        rb.add(2, fb_node::structs(span<const buffer>(buffers)));
+
+        auto write_body = [&]() {
+            auto write_buf = [&](const void* ptr, size_t len) {
+                write(ptr, len);
+                pad(((len + 7) & ~7) - len);
+            };
+
+            for (auto& b : builders) {
+                if (b.variable_width())
+                    write_buf(b.offsets.data(), b.offsets.size() * sizeof(int32_t));
+
+                write_buf(b.data.data(), b.data.size());
+
+                b.data.clear();
+                b.offsets.clear();
+
+                if (b.variable_width())
+                    b.offsets.push_back(0);
+            }
+        };
+
+        auto& blk = batches.emplace_back();
+
+        blk.offset = (int64_t)pos;
+        blk.padding = 0;
+        blk.body_length = body_len;
+        blk.meta_data_length = (int32_t)write_message(HEADER_RECORD_BATCH, move(rb), body_len);
+
+        write_body();
+
+        rows = 0;
+    }
+
+    // Writes the encapsulated message, returning the length of the metadata
+    // including its prefix. The body is written by the caller.
+    size_t write_message(uint8_t header_type, fb_node&& header, int64_t body_len) {
+        auto msg = fb_node::table();
+
+        msg.add(0, METADATA_V5);
+        msg.add(1, header_type);
+        msg.add(2, move(header));
+        msg.add(3, body_len);
+
+        auto buf = fb_serializer().finish(msg);
+        auto padded = (buf.size() + 8 + 7) & ~7;
+        uint32_t prefix[2] = { 0xffffffff, (uint32_t)(padded - 8) };
+
+        write(prefix, sizeof(prefix));
+        write(buf.data(), buf.size());
+        pad(padded - 8 - buf.size());
+
+        return padded;
+    }
+
+    ofstream f;
+    size_t batch_rows;
+    uint64_t pos = 0;
+    size_t rows = 0;
+    vector<builder> builders;
+    vector<block> batches;
+};
+
+}
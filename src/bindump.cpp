@@ -0,0 +1,285 @@
+module;
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <ostream>
+#include <stdexcept>
+#include <optional>
+#include <filesystem>
+#include <vector>
+#include <span>
+#include <algorithm>
+#include <unordered_map>
+#include <format>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+export module bindump;
+
+import cxxbtrfs;
+import formatted_error;
+
+using namespace std;
+
+export namespace bindump {
+
+// Binary dump layout:
+//
+//   file_header
+//   super_block (4096 bytes, as read from the first device)
+//   node images (nodesize bytes each, in dump order, each bytenr stored once)
+//   index_entry array, sorted by bytenr then tree
+//   trailer
+//
+// Everything is little-endian. The trailer is at the end so that the file
+// can be written to a pipe in one pass.
+
+constexpr uint64_t MAGIC = 0x504d554453465242; // "BRFSDUMP"
+constexpr uint32_t VERSION = 1;
+
+struct file_header {
+    btrfs::le64 magic;
+    btrfs::le32 version;
+    btrfs::le32 nodesize;
+    btrfs::le64 reserved[6];
+} __attribute__((packed));
+
+static_assert(sizeof(file_header) == 64);
+
+struct index_entry {
+    btrfs::le64 tree;
+    btrfs::le64 bytenr;
+    btrfs::le64 generation;
+    btrfs::le64 offset;
+    btrfs::le32 flags;
+    uint8_t level;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+static_assert(sizeof(index_entry) == 40);
+
+struct trailer {
+    btrfs::le64 index_offset;
+    btrfs::le64 num_entries;
+    btrfs::le64 magic;
+} __attribute__((packed));
+
+static_assert(sizeof(trailer) == 24);
+
+constexpr uint64_t nodes_offset = sizeof(file_header) + sizeof(btrfs::super_block);
+
+bool is_archive(const filesystem::path& fn) {
+    int fd = open(fn.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        return false;
+
+    file_header fh;
+    auto ret = pread(fd, &fh, sizeof(fh), 0);
+
+    close(fd);
+
+    return ret == sizeof(fh) && fh.magic == MAGIC;
+}
+
+class writer {
+public:
+    writer(ostream& out, const btrfs::super_block& sb) : out(out), nodesize(sb.nodesize) {
+        file_header fh;
+
+        memset(&fh, 0, sizeof(fh));
+        fh.magic = MAGIC;
+        fh.version = VERSION;
+        fh.nodesize = sb.nodesize;
+
+        write(&fh, sizeof(fh));
+        write(&sb, sizeof(sb));
+    }
+
+    void add_node(uint64_t tree, span<const uint8_t> node) {
+        const auto& h = *(const btrfs::header*)node.data();
+        uint64_t node_off;
+
+        if (node.size() != nodesize)
+            throw formatted_error("node at {:x} is {:x} bytes, expected {:x}", h.bytenr, node.size(), nodesize);
+
+        // nodes shared between snapshots only get written once
+
+        if (auto it = written.find(h.bytenr); it != written.end())
+            node_off = it->second;
+        else {
+            node_off = offset;
+            write(node.data(), node.size());
+            written.emplace(h.bytenr, node_off);
+        }
+
+        auto& e = index.emplace_back();
+
+        memset(&e, 0, sizeof(e));
+        e.tree = tree;
+        e.bytenr = h.bytenr;
+        e.generation = h.generation;
+        e.offset = node_off;
+        e.level = h.level;
+    }
+
+    void finish() {
+        ranges::sort(index, [](const index_entry& a, const index_entry& b) {
+            if (a.bytenr != b.bytenr)
+                return a.bytenr < b.bytenr;
+
+            return a.tree < b.tree;
+        });
+
+        trailer t;
+
+        t.index_offset = offset;
+        t.num_entries = index.size();
+        t.magic = MAGIC;
+
+        write(index.data(), index.size() * sizeof(index_entry));
+        write(&t, sizeof(t));
+
+        out.flush();
+    }
+
+private:
+    void write(const void* ptr, size_t len) {
+        out.write((const char*)ptr, len);
+
+        if (out.fail())
+            throw runtime_error("error writing binary dump");
+
+        offset += len;
+    }
+
+    ostream& out;
+    uint32_t nodesize;
+    uint64_t offset = 0;
+    vector<index_entry> index;
+    unordered_map<uint64_t, uint64_t> written;
+};
+
+class reader {
+public:
+    reader(const filesystem::path& fn) {
+        int fd = open(fn.c_str(), O_RDONLY);
+
+        if (fd < 0)
+            throw formatted_error("failed to open {} (errno {})", fn.string(), errno);
+
+        struct stat st;
+
+        if (fstat(fd, &st) < 0) {
+            auto err = errno;
+            close(fd);
+            throw formatted_error("fstat failed on {} (errno {})", fn.string(), err);
+        }
+
+        len = st.st_size;
+
+        if (len < nodes_offset + sizeof(trailer)) {
+            close(fd);
+            throw formatted_error("{} is too short to be a binary dump", fn.string());
+        }
+
+        addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (addr == MAP_FAILED)
+            throw formatted_error("mmap failed on {} (errno {})", fn.string(), errno);
+
+        try {
+            check(fn);
+        } catch (...) {
+            munmap(addr, len);
+            throw;
+        }
+
+        madvise(addr, len, MADV_WILLNEED);
+    }
+
+    ~reader() {
+        munmap(addr, len);
+    }
+
+    reader(const reader&) = delete;
+    reader& operator=(const reader&) = delete;
+
+    const btrfs::super_block& superblock() const {
+        return *(const btrfs::super_block*)((const uint8_t*)addr + sizeof(file_header));
+    }
+
+    span<const index_entry> index() const {
+        return idx;
+    }
+
+    span<const uint8_t> node_at(uint64_t offset) const {
+        return span((const uint8_t*)addr + offset, nodesize);
+    }
+
+    // node images in the order they were written, i.e. the order btrfs-dump visited them
+    size_t num_nodes() const {
+        return (nodes_end - nodes_offset) / nodesize;
+    }
+
+    span<const uint8_t> node(size_t i) const {
+        return node_at(nodes_offset + (i * nodesize));
+    }
+
+    optional<span<const uint8_t>> find(uint64_t bytenr) const {
+        auto it = ranges::lower_bound(idx, bytenr, {}, [](const index_entry& e) {
+            return (uint64_t)e.bytenr;
+        });
+
+        if (it == idx.end() || it->bytenr != bytenr)
+            return nullopt;
+
+        return node_at(it->offset);
+    }
+
+private:
+    void check(const filesystem::path& fn) {
+        auto& fh = *(const file_header*)addr;
+
+        if (fh.magic != MAGIC)
+            throw formatted_error("{} is not a binary dump", fn.string());
+
+        if (fh.version != VERSION)
+            throw formatted_error("unsupported binary dump version {}", fh.version);
+
+        nodesize = fh.nodesize;
+
+        if (nodesize == 0)
+            throw formatted_error("binary dump {} has invalid nodesize", fn.string());
+
+        auto& t = *(const trailer*)((const uint8_t*)addr + len - sizeof(trailer));
+
+        if (t.magic != MAGIC)
+            throw formatted_error("binary dump {} is truncated", fn.string());
+
+        if (t.index_offset < nodes_offset ||
+            t.index_offset + (t.num_entries * sizeof(index_entry)) != len - sizeof(trailer)) {
+            throw formatted_error("binary dump {} has invalid index", fn.string());
+        }
+
+        idx = span((const index_entry*)((const uint8_t*)addr + t.index_offset), t.num_entries);
+        nodes_end = t.index_offset;
+
+        for (const auto& e : idx) {
+            if (e.offset < nodes_offset || e.offset + nodesize > nodes_end)
+                throw formatted_error("index entry for {:x} points outside file", e.bytenr);
+        }
+    }
+
+    void* addr;
+    uint64_t len;
+    uint32_t nodesize;
+    uint64_t nodes_end;
+    span<const index_entry> idx;
+};
+
+}
@@ -2,13 +2,30 @@
 #include <fstream>
 #include <format>
 #include <map>
+#include <set>
 #include <vector>
 #include <charconv>
 #include <chrono>
 #include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <algorithm>
 #include <getopt.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <limits.h>
 #include "config.h"
+#include "probes.h"
 
 import cxxbtrfs;
 import formatted_error;
@@ -17,6 +34,12 @@ import crc32c;
 import xxhash;
 import sha256;
 import blake2b;
+import bindump;
+import zstdio;
+import phash;
+import hex;
+import raid56;
+import trace;
 
 using namespace std;
 
@@ -31,29 +54,16 @@ static uint8_t hex_char(char c) {
     throw formatted_error("invalid hex character '{}'", c);
 }
 
-static vector<uint8_t> parse_hex_bytes(string_view sv) {
-    vector<uint8_t> ret;
-
-    if (sv.size() % 2 != 0)
-        throw formatted_error("hex string has odd length");
-
-    ret.reserve(sv.size() / 2);
-
-    for (size_t i = 0; i < sv.size(); i += 2) {
-        ret.push_back((hex_char(sv[i]) << 4) | hex_char(sv[i + 1]));
-    }
-
-    return ret;
-}
-
 template<integral T>
 static T parse_hex(string_view sv) {
     T val;
 
     auto [ptr, ec] = from_chars(sv.data(), sv.data() + sv.size(), val, 16);
 
-    if (ec != errc{} || ptr != sv.data() + sv.size())
-        throw formatted_error("could not parse hex value '{}'", sv);
+    if (ec == errc::result_out_of_range)
+        throw formatted_error("hex value '{}' out of range", sv);
+    else if (ec != errc{} || ptr != sv.data() + sv.size())
+        throw formatted_error("could not parse hex value '{}' (invalid character at position {})", sv, ptr - sv.data());
 
     return val;
 }
@@ -215,95 +225,57 @@ static pair<string_view, string_view> next_field(string_view& line) {
     }
 }
 
+static constexpr auto key_types = phash::make_table<btrfs::key_type>({
+    { "INODE_ITEM", btrfs::key_type::INODE_ITEM },
+    { "INODE_REF", btrfs::key_type::INODE_REF },
+    { "INODE_EXTREF", btrfs::key_type::INODE_EXTREF },
+    { "XATTR_ITEM", btrfs::key_type::XATTR_ITEM },
+    { "VERITY_DESC_ITEM", btrfs::key_type::VERITY_DESC_ITEM },
+    { "VERITY_MERKLE_ITEM", btrfs::key_type::VERITY_MERKLE_ITEM },
+    { "ORPHAN_ITEM", btrfs::key_type::ORPHAN_ITEM },
+    { "DIR_LOG_INDEX", btrfs::key_type::DIR_LOG_INDEX },
+    { "DIR_ITEM", btrfs::key_type::DIR_ITEM },
+    { "DIR_INDEX", btrfs::key_type::DIR_INDEX },
+    { "EXTENT_DATA", btrfs::key_type::EXTENT_DATA },
+    { "EXTENT_CSUM", btrfs::key_type::EXTENT_CSUM },
+    { "ROOT_ITEM", btrfs::key_type::ROOT_ITEM },
+    { "ROOT_BACKREF", btrfs::key_type::ROOT_BACKREF },
+    { "ROOT_REF", btrfs::key_type::ROOT_REF },
+    { "EXTENT_ITEM", btrfs::key_type::EXTENT_ITEM },
+    { "METADATA_ITEM", btrfs::key_type::METADATA_ITEM },
+    { "EXTENT_OWNER_REF", btrfs::key_type::EXTENT_OWNER_REF },
+    { "TREE_BLOCK_REF", btrfs::key_type::TREE_BLOCK_REF },
+    { "EXTENT_DATA_REF", btrfs::key_type::EXTENT_DATA_REF },
+    { "SHARED_BLOCK_REF", btrfs::key_type::SHARED_BLOCK_REF },
+    { "SHARED_DATA_REF", btrfs::key_type::SHARED_DATA_REF },
+    { "BLOCK_GROUP_ITEM", btrfs::key_type::BLOCK_GROUP_ITEM },
+    { "FREE_SPACE_INFO", btrfs::key_type::FREE_SPACE_INFO },
+    { "FREE_SPACE_EXTENT", btrfs::key_type::FREE_SPACE_EXTENT },
+    { "FREE_SPACE_BITMAP", btrfs::key_type::FREE_SPACE_BITMAP },
+    { "DEV_EXTENT", btrfs::key_type::DEV_EXTENT },
+    { "DEV_ITEM", btrfs::key_type::DEV_ITEM },
+    { "CHUNK_ITEM", btrfs::key_type::CHUNK_ITEM },
+    { "RAID_STRIPE", btrfs::key_type::RAID_STRIPE },
+    { "IDENTITY_REMAP", btrfs::key_type::IDENTITY_REMAP },
+    { "REMAP", btrfs::key_type::REMAP },
+    { "REMAP_BACKREF", btrfs::key_type::REMAP_BACKREF },
+    { "QGROUP_STATUS", btrfs::key_type::QGROUP_STATUS },
+    { "QGROUP_INFO", btrfs::key_type::QGROUP_INFO },
+    { "QGROUP_LIMIT", btrfs::key_type::QGROUP_LIMIT },
+    { "QGROUP_RELATION", btrfs::key_type::QGROUP_RELATION },
+    { "TEMPORARY_ITEM", btrfs::key_type::TEMPORARY_ITEM },
+    { "PERSISTENT_ITEM", btrfs::key_type::PERSISTENT_ITEM },
+    { "DEV_REPLACE", btrfs::key_type::DEV_REPLACE },
+    { "UUID_SUBVOL", btrfs::key_type::UUID_SUBVOL },
+    { "UUID_RECEIVED_SUBVOL", btrfs::key_type::UUID_RECEIVED_SUBVOL },
+    { "STRING_ITEM", btrfs::key_type::STRING_ITEM },
+});
+
 static btrfs::key_type parse_key_type(string_view sv) {
-    if (sv == "INODE_ITEM")
-        return btrfs::key_type::INODE_ITEM;
-    else if (sv == "INODE_REF")
-        return btrfs::key_type::INODE_REF;
-    else if (sv == "INODE_EXTREF")
-        return btrfs::key_type::INODE_EXTREF;
-    else if (sv == "XATTR_ITEM")
-        return btrfs::key_type::XATTR_ITEM;
-    else if (sv == "VERITY_DESC_ITEM")
-        return btrfs::key_type::VERITY_DESC_ITEM;
-    else if (sv == "VERITY_MERKLE_ITEM")
-        return btrfs::key_type::VERITY_MERKLE_ITEM;
-    else if (sv == "ORPHAN_ITEM")
-        return btrfs::key_type::ORPHAN_ITEM;
-    else if (sv == "DIR_LOG_INDEX")
-        return btrfs::key_type::DIR_LOG_INDEX;
-    else if (sv == "DIR_ITEM")
-        return btrfs::key_type::DIR_ITEM;
-    else if (sv == "DIR_INDEX")
-        return btrfs::key_type::DIR_INDEX;
-    else if (sv == "EXTENT_DATA")
-        return btrfs::key_type::EXTENT_DATA;
-    else if (sv == "EXTENT_CSUM")
-        return btrfs::key_type::EXTENT_CSUM;
-    else if (sv == "ROOT_ITEM")
-        return btrfs::key_type::ROOT_ITEM;
-    else if (sv == "ROOT_BACKREF")
-        return btrfs::key_type::ROOT_BACKREF;
-    else if (sv == "ROOT_REF")
-        return btrfs::key_type::ROOT_REF;
-    else if (sv == "EXTENT_ITEM")
-        return btrfs::key_type::EXTENT_ITEM;
-    else if (sv == "METADATA_ITEM")
-        return btrfs::key_type::METADATA_ITEM;
-    else if (sv == "EXTENT_OWNER_REF")
-        return btrfs::key_type::EXTENT_OWNER_REF;
-    else if (sv == "TREE_BLOCK_REF")
-        return btrfs::key_type::TREE_BLOCK_REF;
-    else if (sv == "EXTENT_DATA_REF")
-        return btrfs::key_type::EXTENT_DATA_REF;
-    else if (sv == "SHARED_BLOCK_REF")
-        return btrfs::key_type::SHARED_BLOCK_REF;
-    else if (sv == "SHARED_DATA_REF")
-        return btrfs::key_type::SHARED_DATA_REF;
-    else if (sv == "BLOCK_GROUP_ITEM")
-        return btrfs::key_type::BLOCK_GROUP_ITEM;
-    else if (sv == "FREE_SPACE_INFO")
-        return btrfs::key_type::FREE_SPACE_INFO;
-    else if (sv == "FREE_SPACE_EXTENT")
-        return btrfs::key_type::FREE_SPACE_EXTENT;
-    else if (sv == "FREE_SPACE_BITMAP")
-        return btrfs::key_type::FREE_SPACE_BITMAP;
-    else if (sv == "DEV_EXTENT")
-        return btrfs::key_type::DEV_EXTENT;
-    else if (sv == "DEV_ITEM")
-        return btrfs::key_type::DEV_ITEM;
-    else if (sv == "CHUNK_ITEM")
-        return btrfs::key_type::CHUNK_ITEM;
-    else if (sv == "RAID_STRIPE")
-        return btrfs::key_type::RAID_STRIPE;
-    else if (sv == "IDENTITY_REMAP")
-        return btrfs::key_type::IDENTITY_REMAP;
-    else if (sv == "REMAP")
-        return btrfs::key_type::REMAP;
-    else if (sv == "REMAP_BACKREF")
-        return btrfs::key_type::REMAP_BACKREF;
-    else if (sv == "QGROUP_STATUS")
-        return btrfs::key_type::QGROUP_STATUS;
-    else if (sv == "QGROUP_INFO")
-        return btrfs::key_type::QGROUP_INFO;
-    else if (sv == "QGROUP_LIMIT")
-        return btrfs::key_type::QGROUP_LIMIT;
-    else if (sv == "QGROUP_RELATION")
-        return btrfs::key_type::QGROUP_RELATION;
-    else if (sv == "TEMPORARY_ITEM")
-        return btrfs::key_type::TEMPORARY_ITEM;
-    else if (sv == "PERSISTENT_ITEM")
-        return btrfs::key_type::PERSISTENT_ITEM;
-    else if (sv == "DEV_REPLACE")
-        return btrfs::key_type::DEV_REPLACE;
-    else if (sv == "UUID_SUBVOL")
-        return btrfs::key_type::UUID_SUBVOL;
-    else if (sv == "UUID_RECEIVED_SUBVOL")
-        return btrfs::key_type::UUID_RECEIVED_SUBVOL;
-    else if (sv == "STRING_ITEM")
-        return btrfs::key_type::STRING_ITEM;
-    else
-        return (btrfs::key_type)parse_hex<uint8_t>(sv);
+    if (auto t = key_types.find(sv))
+        return *t;
+
+    return (btrfs::key_type)parse_hex<uint8_t>(sv);
 }
 
 static btrfs::key parse_key(string_view sv) {
@@ -890,6 +862,44 @@ static void compute_csum(btrfs::csum_type type, span<const uint8_t> data,
     }
 }
 
+enum class inode_item_field {
+    generation,
+    transid,
+    size,
+    nbytes,
+    block_group,
+    nlink,
+    uid,
+    gid,
+    mode,
+    rdev,
+    flags,
+    sequence,
+    atime,
+    ctime,
+    mtime,
+    otime
+};
+
+static constexpr auto inode_item_fields = phash::make_table<inode_item_field>({
+    { "generation", inode_item_field::generation },
+    { "transid", inode_item_field::transid },
+    { "size", inode_item_field::size },
+    { "nbytes", inode_item_field::nbytes },
+    { "block_group", inode_item_field::block_group },
+    { "nlink", inode_item_field::nlink },
+    { "uid", inode_item_field::uid },
+    { "gid", inode_item_field::gid },
+    { "mode", inode_item_field::mode },
+    { "rdev", inode_item_field::rdev },
+    { "flags", inode_item_field::flags },
+    { "sequence", inode_item_field::sequence },
+    { "atime", inode_item_field::atime },
+    { "ctime", inode_item_field::ctime },
+    { "mtime", inode_item_field::mtime },
+    { "otime", inode_item_field::otime },
+});
+
 static void parse_inode_item(string_view line, btrfs::inode_item& ii) {
     memset(&ii, 0, sizeof(ii));
 
@@ -898,40 +908,79 @@ static void parse_inode_item(string_view line, btrfs::inode_item& ii) {
 
         if (name.empty())
             break;
-        else if (name == "generation")
-            ii.generation = parse_hex<uint64_t>(val);
-        else if (name == "transid")
-            ii.transid = parse_hex<uint64_t>(val);
-        else if (name == "size")
-            ii.size = parse_hex<uint64_t>(val);
-        else if (name == "nbytes")
-            ii.nbytes = parse_hex<uint64_t>(val);
-        else if (name == "block_group")
-            ii.block_group = parse_hex<uint64_t>(val);
-        else if (name == "nlink")
-            ii.nlink = parse_hex<uint32_t>(val);
-        else if (name == "uid")
-            ii.uid = parse_hex<uint32_t>(val);
-        else if (name == "gid")
-            ii.gid = parse_hex<uint32_t>(val);
-        else if (name == "mode")
-            ii.mode = parse_octal(val);
-        else if (name == "rdev")
-            ii.rdev = parse_hex<uint64_t>(val);
-        else if (name == "flags")
-            ii.flags = parse_inode_flags(val);
-        else if (name == "sequence")
-            ii.sequence = parse_hex<uint64_t>(val);
-        else if (name == "atime")
-            ii.atime = parse_timestamp(val);
-        else if (name == "ctime")
-            ii.ctime = parse_timestamp(val);
-        else if (name == "mtime")
-            ii.mtime = parse_timestamp(val);
-        else if (name == "otime")
-            ii.otime = parse_timestamp(val);
-        else
+
+        auto f = inode_item_fields.find(name);
+
+        if (!f)
             throw formatted_error("unrecognized inode_item field '{}'", name);
+
+        switch (*f) {
+            using enum inode_item_field;
+
+            case generation:
+                ii.generation = parse_hex<uint64_t>(val);
+                break;
+
+            case transid:
+                ii.transid = parse_hex<uint64_t>(val);
+                break;
+
+            case size:
+                ii.size = parse_hex<uint64_t>(val);
+                break;
+
+            case nbytes:
+                ii.nbytes = parse_hex<uint64_t>(val);
+                break;
+
+            case block_group:
+                ii.block_group = parse_hex<uint64_t>(val);
+                break;
+
+            case nlink:
+                ii.nlink = parse_hex<uint32_t>(val);
+                break;
+
+            case uid:
+                ii.uid = parse_hex<uint32_t>(val);
+                break;
+
+            case gid:
+                ii.gid = parse_hex<uint32_t>(val);
+                break;
+
+            case mode:
+                ii.mode = parse_octal(val);
+                break;
+
+            case rdev:
+                ii.rdev = parse_hex<uint64_t>(val);
+                break;
+
+            case flags:
+                ii.flags = parse_inode_flags(val);
+                break;
+
+            case sequence:
+                ii.sequence = parse_hex<uint64_t>(val);
+                break;
+
+            case atime:
+                ii.atime = parse_timestamp(val);
+                break;
+
+            case ctime:
+                ii.ctime = parse_timestamp(val);
+                break;
+
+            case mtime:
+                ii.mtime = parse_timestamp(val);
+                break;
+
+            case otime:
+                ii.otime = parse_timestamp(val);
+                break;
+        }
     }
 }
 
@@ -945,15 +994,13 @@ struct chunk_entry_stripe {
 struct chunk_entry {
     uint64_t offset; // logical address
     uint64_t length;
+    uint64_t type;
+    uint64_t stripe_len;
     uint16_t num_stripes;
+    uint16_t sub_stripes;
     chunk_entry_stripe stripes[MAX_STRIPES];
 };
 
-struct leaf_item {
-    btrfs::key key;
-    vector<uint8_t> data;
-};
-
 struct node_state {
     node_state() {
         memset(&fsid, 0, sizeof(fsid));
@@ -971,982 +1018,1193 @@ struct node_state {
     bool has_chunk_tree_uuid = false;
     unsigned int indent = 0;
     vector<btrfs::key_ptr> key_ptrs;
-    vector<leaf_item> items;
-};
+    vector<pair<btrfs::key, string_view>> item_lines; // not yet parsed
+    deque<string> line_copies; // backing for item_lines, if input is streamed
+    vector<uint8_t> packed; // leaf already laid out by tree_builder
+
+    // roughly how much memory this takes up, including the node it will become
+    size_t memory_usage(uint32_t nodesize) const {
+        auto ret = sizeof(node_state) + nodesize;
 
-static vector<uint64_t> resolve_physical(uint64_t log_addr, uint32_t size,
-                                         const map<uint64_t, chunk_entry>& chunks) {
-    vector<uint64_t> result;
+        ret += key_ptrs.capacity() * sizeof(btrfs::key_ptr);
+        ret += packed.capacity();
+        ret += item_lines.capacity() * sizeof(pair<btrfs::key, string_view>);
 
-    if (chunks.empty())
-        throw formatted_error("no chunk map available for address {:x}", log_addr);
+        for (const auto& l : line_copies) {
+            ret += sizeof(string) + l.capacity();
+        }
 
-    auto it = chunks.upper_bound(log_addr);
-    if (it == chunks.begin())
-        throw formatted_error("could not find address {:x} in chunk map", log_addr);
+        return ret;
+    }
+};
 
-    it--;
-    auto& ce = it->second;
+// The chunk map. This is a sorted array rather than a std::map, as chunk
+// items come out of the chunk tree in order, so nearly every insert is an
+// append, and a lookup is a binary search over contiguous memory. The stripes
+// are kept in an array of their own, so that each chunk only takes up as
+// much room as the stripes it actually has.
+class chunk_map {
+public:
+    struct chunk {
+        uint64_t offset; // logical address
+        uint64_t length;
+        uint64_t type;
+        uint64_t stripe_len;
+        uint32_t first_stripe;
+        uint16_t num_stripes;
+        uint16_t sub_stripes;
+    };
 
-    if (log_addr < ce.offset || log_addr + size > ce.offset + ce.length)
-        throw formatted_error("address {:x} not fully within chunk at {:x}", log_addr, ce.offset);
+    void add(const chunk_entry& ce) {
+        auto it = ranges::lower_bound(chunks, ce.offset, {}, &chunk::offset);
+        bool replace = it != chunks.end() && it->offset == ce.offset;
+        chunk c;
+
+        c.offset = ce.offset;
+        c.length = ce.length;
+        c.type = ce.type;
+        c.stripe_len = ce.stripe_len;
+        c.num_stripes = ce.num_stripes;
+        c.sub_stripes = ce.sub_stripes;
+
+        // reuse the old stripes if we can, as the same chunk can be seen
+        // more than once (e.g. in the sys_chunk_array and the chunk tree)
+        if (replace && it->num_stripes >= ce.num_stripes)
+            c.first_stripe = it->first_stripe;
+        else {
+            c.first_stripe = (uint32_t)stripe_array.size();
+            stripe_array.resize(stripe_array.size() + ce.num_stripes);
+        }
 
-    uint64_t offset_in_chunk = log_addr - ce.offset;
+        memcpy(stripe_array.data() + c.first_stripe, ce.stripes, ce.num_stripes * sizeof(chunk_entry_stripe));
 
-    for (uint16_t i = 0; i < ce.num_stripes; i++) {
-        result.push_back(ce.stripes[i].offset + offset_in_chunk);
+        if (replace)
+            *it = c;
+        else
+            chunks.insert(it, c);
     }
 
-    return result;
-}
+    const chunk& find(uint64_t log_addr, size_t size) const {
+        if (chunks.empty())
+            throw formatted_error("no chunk map available for address {:x}", log_addr);
 
-static void write_node(fstream& out, const node_state& node, const btrfs::super_block& sb,
-                        const map<uint64_t, chunk_entry>& chunks) {
-    vector<uint8_t> buf(sb.nodesize, 0);
+        auto it = ranges::upper_bound(chunks, log_addr, {}, &chunk::offset);
 
-    auto& h = *(btrfs::header*)buf.data();
+        if (it == chunks.begin())
+            throw formatted_error("could not find address {:x} in chunk map", log_addr);
 
-    h.bytenr = node.bytenr;
-    h.generation = node.generation;
-    h.owner = node.owner;
-    h.flags = node.flags;
-    h.level = node.level;
+        it--;
 
-    if (node.has_fsid)
-        h.fsid = node.fsid;
-    else
-        h.fsid = sb.fsid;
+        if (log_addr < it->offset || log_addr + size > it->offset + it->length)
+            throw formatted_error("address {:x} not fully within chunk at {:x}", log_addr, it->offset);
 
-    if (node.has_chunk_tree_uuid)
-        h.chunk_tree_uuid = node.chunk_tree_uuid;
+        return *it;
+    }
 
-    if (node.level > 0) {
-        h.nritems = node.key_ptrs.size();
+    auto begin() const {
+        return chunks.begin();
+    }
 
-        auto ptrs = (btrfs::key_ptr*)(buf.data() + sizeof(btrfs::header));
-        for (size_t i = 0; i < h.nritems; i++) {
-            ptrs[i] = node.key_ptrs[i];
-        }
-    } else {
-        h.nritems = node.items.size();
+    auto end() const {
+        return chunks.end();
+    }
 
-        // calculate total data size and check overflow
-        size_t items_array_size = node.items.size() * sizeof(btrfs::item);
-        size_t total_data_size = 0;
+    span<const chunk_entry_stripe> stripes(const chunk& c) const {
+        return span(stripe_array).subspan(c.first_stripe, c.num_stripes);
+    }
 
-        for (const auto& it : node.items) {
-            total_data_size += it.data.size();
-        }
+    size_t size() const {
+        return chunks.size();
+    }
 
-        if (sizeof(btrfs::header) + items_array_size + total_data_size > sb.nodesize) {
-            throw formatted_error("node at bytenr {:x} overflows: {} bytes of items + {} bytes of data + {} byte header > {} nodesize",
-                                  node.bytenr, items_array_size, total_data_size, sizeof(btrfs::header), sb.nodesize);
-        }
+    size_t memory_usage() const {
+        return (chunks.capacity() * sizeof(chunk)) +
+               (stripe_array.capacity() * sizeof(chunk_entry_stripe));
+    }
 
-        // pack items: item array after header, data from end backwards
-        uint32_t data_end = sb.nodesize;
+private:
+    vector<chunk> chunks;
+    vector<chunk_entry_stripe> stripe_array;
+};
 
-        auto item_dest = (btrfs::item*)(buf.data() + sizeof(btrfs::header));
+static unsigned int data_stripes(const chunk_map::chunk& c) {
+    if (c.type & btrfs::BLOCK_GROUP_RAID6) {
+        if (c.num_stripes < 3)
+            throw formatted_error("RAID6 chunk at {:x} has only {} stripes", c.offset, c.num_stripes);
 
-        for (const auto& it : node.items) {
-            data_end -= it.data.size();
+        return c.num_stripes - 2;
+    } else if (c.type & btrfs::BLOCK_GROUP_RAID5) {
+        if (c.num_stripes < 2)
+            throw formatted_error("RAID5 chunk at {:x} has only {} stripes", c.offset, c.num_stripes);
 
-            item_dest->key = it.key;
-            item_dest->offset = data_end - sizeof(btrfs::header);
-            item_dest->size = it.data.size();
+        return c.num_stripes - 1;
+    } else
+        return c.num_stripes;
+}
 
-            memcpy(buf.data() + data_end, it.data.data(), it.data.size());
+struct stripe_write {
+    uint64_t devid;
+    uint64_t physical;
+    size_t buf_offset;
+    size_t length;
+};
 
-            item_dest++;
+// Works out where on which devices the range of the chunk starting at
+// log_addr goes. This is the same calculation as read_data in btrfs-dump,
+// except that we return every copy rather than just the first.
+static vector<stripe_write> map_to_stripes(const chunk_map::chunk& c, span<const chunk_entry_stripe> stripes,
+                                           uint64_t log_addr, size_t size) {
+    static constexpr uint64_t striped = btrfs::BLOCK_GROUP_RAID0 | btrfs::BLOCK_GROUP_RAID10 |
+                                        btrfs::BLOCK_GROUP_RAID5 | btrfs::BLOCK_GROUP_RAID6;
+    vector<stripe_write> ret;
+
+    if (!(c.type & striped)) { // SINGLE, DUP, RAID1, RAID1C3, RAID1C4
+        for (const auto& s : stripes) {
+            ret.push_back({s.devid, s.offset + log_addr - c.offset, 0, size});
         }
+
+        return ret;
     }
 
-    compute_csum(sb.csum_type, {buf.data() + h.csum.size(), sb.nodesize - h.csum.size()}, h.csum);
+    if (c.stripe_len == 0)
+        throw formatted_error("chunk at {:x} has a stripe_len of 0", c.offset);
 
-    auto phys_addrs = resolve_physical(node.bytenr, sb.nodesize, chunks);
-    for (auto phys : phys_addrs) {
-        out.seekp(phys);
-        out.write((char*)buf.data(), sb.nodesize);
-    }
-}
+    if (c.type & btrfs::BLOCK_GROUP_RAID10 && (c.sub_stripes == 0 || c.num_stripes < c.sub_stripes))
+        throw formatted_error("RAID10 chunk at {:x} has invalid sub_stripes {}", c.offset, c.sub_stripes);
 
-static void write_superblock(fstream& out, btrfs::super_block& sb) {
-    out.seekp(0, ios::end);
-    auto file_size = out.tellp();
+    size_t done = 0;
 
-    for (unsigned int i = 0; i < sizeof(btrfs::superblock_addrs) / sizeof(*btrfs::superblock_addrs); i++) {
-        auto addr = btrfs::superblock_addrs[i];
+    while (done < size) {
+        auto off = log_addr + done - c.offset;
+        auto stripe_num = off / c.stripe_len;
+        auto stripe_offset = off % c.stripe_len;
+        auto len = (size_t)min((uint64_t)(size - done), c.stripe_len - stripe_offset);
 
-        if (file_size < (streamoff)(addr + sizeof(btrfs::super_block)))
-            break;
+        if (c.type & btrfs::BLOCK_GROUP_RAID0) {
+            const auto& s = stripes[stripe_num % c.num_stripes];
 
-        sb.bytenr = addr;
+            ret.push_back({s.devid, s.offset + ((stripe_num / c.num_stripes) * c.stripe_len) + stripe_offset,
+                           done, len});
+        } else if (c.type & btrfs::BLOCK_GROUP_RAID10) {
+            auto groups = c.num_stripes / c.sub_stripes;
+            auto first = (stripe_num % groups) * c.sub_stripes;
 
-        compute_csum(sb.csum_type, {(uint8_t*)&sb.fsid, sizeof(btrfs::super_block) - sizeof(sb.csum)}, sb.csum);
+            for (uint16_t i = 0; i < c.sub_stripes; i++) {
+                const auto& s = stripes[first + i];
+
+                ret.push_back({s.devid, s.offset + ((stripe_num / groups) * c.stripe_len) + stripe_offset,
+                               done, len});
+            }
+        } else { // RAID5 and RAID6
+            auto ds = data_stripes(c);
+            auto full_stripe = stripe_num / ds;
+            const auto& s = stripes[(full_stripe + (stripe_num % ds)) % c.num_stripes];
 
-        out.seekp(addr);
-        out.write((char*)&sb, sizeof(sb));
+            ret.push_back({s.devid, s.offset + (full_stripe * c.stripe_len) + stripe_offset, done, len});
+        }
+
+        done += len;
     }
+
+    return ret;
 }
 
-static vector<uint8_t> parse_item_data(string_view type_line, const btrfs::key& key,
-                                       const btrfs::super_block& sb) {
-    vector<uint8_t> data;
+static chunk_entry make_chunk_entry(uint64_t offset, const btrfs::chunk& c) {
+    chunk_entry ce;
 
-    auto append = [&](const void* ptr, size_t len) {
-        auto p = (const uint8_t*)ptr;
-        data.insert(data.end(), p, p + len);
-    };
+    if (c.num_stripes > MAX_STRIPES)
+        throw formatted_error("chunk at {:x} has too many stripes ({})", offset, c.num_stripes);
 
-    string_view type_word, rest;
+    ce.offset = offset;
+    ce.length = c.length;
+    ce.type = c.type;
+    ce.stripe_len = c.stripe_len;
+    ce.num_stripes = c.num_stripes;
+    ce.sub_stripes = c.sub_stripes;
 
-    if (auto sp = type_line.find(' '); sp != string_view::npos) {
-        type_word = type_line.substr(0, sp);
-        rest = type_line.substr(sp + 1);
-    } else {
-        type_word = type_line;
-        rest = "";
+    for (uint16_t i = 0; i < c.num_stripes; i++) {
+        ce.stripes[i].devid = c.stripe[i].devid;
+        ce.stripes[i].offset = c.stripe[i].offset;
     }
 
-    if (type_word == "raw")
-        return parse_hex_bytes(rest);
-    else if (type_word == "inode_item") {
-        btrfs::inode_item ii;
+    return ce;
+}
 
-        parse_inode_item(rest, ii);
+// Collects writes to the image and issues them in batches, sorted by offset,
+// with physically adjacent writes merged into a single pwritev. Most of the
+// nodes btrfs allocates are next to each other on disk, so this turns what
+// would be one seek and write per node into a handful of large writes.
+class image_writer {
+public:
+    image_writer(const filesystem::path& fn) {
+        fd = open(fn.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+        if (fd < 0)
+            throw formatted_error("failed to open output file '{}' (errno {})", fn.string(), errno);
+    }
 
-        append(&ii, sizeof(ii));
-    } else if (type_word == "inode_ref") {
-        // multiple entries: index=X name_len=X name=Y
+    ~image_writer() {
+        close(fd);
+    }
 
-        while (!rest.empty()) {
-            string name;
-            btrfs::inode_ref ir;
+    image_writer(const image_writer&) = delete;
+    image_writer& operator=(const image_writer&) = delete;
 
-            memset(&ir, 0, sizeof(ir));
+    void write(uint64_t offset, span<const uint8_t> data) {
+        if (data.empty())
+            return;
 
-            while (!rest.empty()) {
-                auto [fname, fval] = next_field(rest);
-                if (fname.empty())
-                    break;
+        // Writes that overlap one already queued have to be done in the
+        // order they were made, so flush what we have first. This shouldn't
+        // happen with sane input.
+        if (overlaps(offset, data.size()) || staging.size() + data.size() > batch_size)
+            flush();
 
-                if (fname == "index")
-                    ir.index = parse_hex<uint64_t>(fval);
-                else if (fname == "name_len")
-                    ir.name_len = parse_hex<uint16_t>(fval);
-                else if (fname == "name") {
-                    name = unescape_name(fval);
-                    break;
-                } else
-                    throw formatted_error("unrecognized inode_ref field '{}'", fname);
-            }
+        pending.emplace(offset, pending_write{staging.size(), data.size()});
+        staging.insert(staging.end(), data.begin(), data.end());
 
-            if (name.empty() && (uint16_t)ir.name_len == 0)
-                break;
+        file_size = max(file_size, offset + data.size());
 
-            append(&ir, sizeof(ir));
-            append(name.data(), name.size());
-        }
-    } else if (type_word == "inode_extref") {
-        while (!rest.empty()) {
-            string name;
-            btrfs::inode_extref ier;
+        add_extent(offset, offset + data.size());
+    }
 
-            memset(&ier, 0, sizeof(ier));
+    // Makes the image at least size bytes long. Anything not written to is
+    // left as a hole.
+    void extend(uint64_t size) {
+        if (size <= file_size)
+            return;
 
-            while (!rest.empty()) {
-                auto [fname, fval] = next_field(rest);
-                if (fname.empty())
-                    break;
+        if (ftruncate(fd, size) < 0)
+            throw formatted_error("ftruncate failed (errno {})", errno);
 
-                if (fname == "parent_objectid")
-                    ier.parent_objectid = parse_hex<uint64_t>(fval);
-                else if (fname == "index")
-                    ier.index = parse_hex<uint64_t>(fval);
-                else if (fname == "name_len")
-                    ier.name_len = parse_hex<uint16_t>(fval);
-                else if (fname == "name") {
-                    name = unescape_name(fval);
-                    break;
-                } else
-                    throw formatted_error("unrecognized inode_extref field '{}'", fname);
-            }
+        file_size = size;
+    }
 
-            if (name.empty() && (uint16_t)ier.name_len == 0)
+    uint64_t size() const {
+        return file_size;
+    }
+
+    // Caps how much gets held back before it's written out.
+    void limit_batch(size_t limit) {
+        batch_size = min(limit, DEFAULT_BATCH_SIZE);
+
+        if (staging.size() > batch_size)
+            flush();
+    }
+
+    // Reads back what has been written, with anything beyond the end of the
+    // file as zeroes.
+    void read(uint64_t offset, span<uint8_t> buf) {
+        flush();
+
+        while (!buf.empty()) {
+            auto ret = pread(fd, buf.data(), buf.size(), offset);
+
+            if (ret < 0 && errno == EINTR)
+                continue;
+
+            if (ret < 0)
+                throw formatted_error("pread failed at offset {:x} (errno {})", offset, errno);
+
+            if (ret == 0) {
+                memset(buf.data(), 0, buf.size());
                 break;
+            }
 
-            append(&ier, offsetof(btrfs::inode_extref, name));
-            append(name.data(), name.size());
+            buf = buf.subspan(ret);
+            offset += ret;
         }
-    } else if (type_word == "dir_item" || type_word == "dir_index" ||
-               type_word == "xattr_item") {
-        // can have multiple entries (dir_item, xattr_item) or single (dir_index)
+    }
 
-        while (!rest.empty()) {
-            string name;
-            vector<uint8_t> di_data;
-            btrfs::dir_item di;
+    // the space the image actually takes up on disk
+    uint64_t allocated() const {
+        struct stat st;
 
-            memset(&di, 0, sizeof(di));
+        if (fstat(fd, &st) < 0)
+            throw formatted_error("fstat failed (errno {})", errno);
 
-            while (!rest.empty()) {
-                auto [fname, fval] = next_field(rest);
-                if (fname.empty())
-                    break;
+        return (uint64_t)st.st_blocks * 512;
+    }
 
-                if (fname == "location")
-                    di.location = parse_key(fval);
-                else if (fname == "transid")
-                    di.transid = parse_hex<uint64_t>(fval);
-                else if (fname == "data_len")
-                    di.data_len = parse_hex<uint16_t>(fval);
-                else if (fname == "name_len")
-                    di.name_len = parse_hex<uint16_t>(fval);
-                else if (fname == "type")
-                    di.type = parse_dir_item_type(fval);
-                else if (fname == "name") {
-                    name = unescape_name(fval);
+    // Turns the image into a metadata-only one: everything that was written
+    // is moved down to sit back to back at the start of the file, which is
+    // then truncated, and the block map needed to put it back is written to
+    // map_fn. Node images and superblocks are all multiples of 4 KiB, so the
+    // packed extents stay block-aligned and can be reflinked back into place.
+    void compact(const filesystem::path& map_fn) {
+        flush();
 
-                    // after name, optionally data=
-                    while (!rest.empty()) {
-                        auto saved2 = rest;
-                        auto [fname2, fval2] = next_field(rest);
-                        if (fname2.empty())
-                            break;
+        // There's no undoing the packing, so the map has to be safely written
+        // before anything is moved.
 
-                        if (fname2 == "data") {
-                            auto unescaped = unescape_name(fval2);
+        {
+            ofstream map_file(map_fn);
+            if (!map_file)
+                throw formatted_error("failed to open block map '{}'", map_fn.string());
 
-                            di_data.assign(unescaped.begin(), unescaped.end());
-                        } else {
-                            // not data= (could be location= for next entry, or extra=), put it back
-                            rest = saved2;
-                            break;
-                        }
-                    }
-                    break;
-                } else
-                    throw formatted_error("unrecognized dir_item field '{}'", fname);
+            map_file << format("size {:x}\n", file_size);
+
+            uint64_t packed = 0;
+
+            for (auto [start, end] : extents) {
+                map_file << format("extent {:x} {:x} {:x}\n", start, end - start, packed);
+                packed += end - start;
             }
 
-            if (name.empty() && (uint16_t)di.name_len == 0)
-                break;
+            map_file.close();
 
-            append(&di, sizeof(di));
-            append(name.data(), name.size());
-            append(di_data.data(), di_data.size());
+            if (map_file.fail())
+                throw formatted_error("error writing block map '{}'", map_fn.string());
         }
-    } else if (type_word == "extent_data") {
-        btrfs::file_extent_item fei;
 
-        memset(&fei, 0, sizeof(fei));
+        vector<uint8_t> buf(1024 * 1024);
+        uint64_t packed = 0;
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+        for (auto [start, end] : extents) {
+            // the destination is never after the source, so copying forwards
+            // is safe even if they overlap
+            for (uint64_t off = 0; off < end - start; off += buf.size()) {
+                auto len = (size_t)min((uint64_t)buf.size(), end - start - off);
 
-            if (fname == "generation")
-                fei.generation = parse_hex<uint64_t>(fval);
-            else if (fname == "ram_bytes")
-                fei.ram_bytes = parse_hex<uint64_t>(fval);
-            else if (fname == "compression")
-                fei.compression = parse_compression_type(fval);
-            else if (fname == "encryption")
-                fei.encryption = parse_hex<uint8_t>(fval);
-            else if (fname == "other_encoding")
-                fei.other_encoding = parse_hex<uint16_t>(fval);
-            else if (fname == "type")
-                fei.type = parse_file_extent_type(fval);
-            else if (fname == "disk_bytenr")
-                fei.disk_bytenr = parse_hex<uint64_t>(fval);
-            else if (fname == "disk_num_bytes")
-                fei.disk_num_bytes = parse_hex<uint64_t>(fval);
-            else if (fname == "offset")
-                fei.offset = parse_hex<uint64_t>(fval);
-            else if (fname == "num_bytes")
-                fei.num_bytes = parse_hex<uint64_t>(fval);
-            else
-                throw formatted_error("unrecognized extent_data field '{}'", fname);
+                read_all(start + off, span(buf).subspan(0, len));
+                write_all(packed + off, span(buf).subspan(0, len));
+            }
+
+            packed += end - start;
         }
 
-        if (fei.type == btrfs::file_extent_item_type::inline_extent) {
-            append(&fei, offsetof(btrfs::file_extent_item, disk_bytenr));
+        if (ftruncate(fd, packed) < 0)
+            throw formatted_error("ftruncate failed (errno {})", errno);
 
-            // inline data would follow - ram_bytes of zero data
+        file_size = packed;
+    }
 
-            vector<uint8_t> inline_data(fei.ram_bytes, 0);
+    void flush() {
+        vector<iovec> iov;
 
-            append(inline_data.data(), inline_data.size());
-        } else
-            append(&fei, sizeof(fei));
-    } else if (type_word == "extent_csum") {
-        // space-separated hex csum values
-        while (!rest.empty()) {
-            while (!rest.empty() && rest.front() == ' ') {
-                rest.remove_prefix(1);
-            }
-
-            if (rest.empty())
-                break;
-
-            string_view token;
-
-            if (auto sp = rest.find(' '); sp != string_view::npos) {
-                token = rest.substr(0, sp);
-                rest = rest.substr(sp);
-            } else {
-                token = rest;
-                rest = "";
-            }
+        auto it = pending.begin();
 
-            if (token.empty())
-                continue;
+        while (it != pending.end()) {
+            auto start = it->first;
+            auto end = start;
 
-            switch (sb.csum_type) {
-                case btrfs::csum_type::CRC32: {
-                    btrfs::le32 le = parse_hex<uint32_t>(token);
-                    append(&le, sizeof(le));
-                    break;
-                }
+            iov.clear();
 
-                case btrfs::csum_type::XXHASH: {
-                    btrfs::le64 le = parse_hex<uint64_t>(token);
-                    append(&le, sizeof(le));
-                    break;
-                }
+            do {
+                iov.push_back({staging.data() + it->second.pos, it->second.len});
+                end += it->second.len;
+                it++;
+            } while (it != pending.end() && it->first == end && iov.size() < IOV_MAX);
 
-                case btrfs::csum_type::SHA256:
-                case btrfs::csum_type::BLAKE2: {
-                    // 64-char hex = 32 bytes
-                    auto bytes = parse_hex_bytes(token);
-                    append(bytes.data(), bytes.size());
-                    break;
-                }
-            }
+            write_run(start, iov);
         }
-    } else if (type_word == "root_item") {
-        btrfs::root_item ri;
 
-        memset(&ri, 0, sizeof(ri));
+        pending.clear();
+        staging.clear();
+    }
 
-        // format: inode_item fields; root-specific fields
+private:
+    static constexpr size_t DEFAULT_BATCH_SIZE = 64 * 1024 * 1024;
 
-        if (auto sc = rest.find(';'); sc != string_view::npos) {
-            auto inode_part = rest.substr(0, sc);
+    struct pending_write {
+        size_t pos;
+        size_t len;
+    };
 
-            parse_inode_item(inode_part, ri.inode);
+    void add_extent(uint64_t start, uint64_t end) {
+        auto it = extents.upper_bound(start);
 
-            rest = rest.substr(sc + 1);
+        if (it != extents.begin() && prev(it)->second >= start) {
+            it--;
+            start = it->first;
         }
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
-
-            if (fname == "generation")
-                ri.generation = parse_hex<uint64_t>(fval);
-            else if (fname == "root_dirid")
-                ri.root_dirid = parse_hex<uint64_t>(fval);
-            else if (fname == "bytenr")
-                ri.bytenr = parse_hex<uint64_t>(fval);
-            else if (fname == "byte_limit")
-                ri.byte_limit = parse_hex<uint64_t>(fval);
-            else if (fname == "bytes_used")
-                ri.bytes_used = parse_hex<uint64_t>(fval);
-            else if (fname == "last_snapshot")
-                ri.last_snapshot = parse_hex<uint64_t>(fval);
-            else if (fname == "flags")
-                ri.flags = parse_root_item_flags(fval);
-            else if (fname == "refs")
-                ri.refs = parse_hex<uint32_t>(fval);
-            else if (fname == "drop_progress")
-                ri.drop_progress = parse_key(fval);
-            else if (fname == "drop_level")
-                ri.drop_level = parse_hex<uint8_t>(fval);
-            else if (fname == "level")
-                ri.level = parse_hex<uint8_t>(fval);
-            else if (fname == "generation_v2")
-                ri.generation_v2 = parse_hex<uint64_t>(fval);
-            else if (fname == "uuid")
-                ri.uuid = parse_uuid(fval);
-            else if (fname == "parent_uuid")
-                ri.parent_uuid = parse_uuid(fval);
-            else if (fname == "received_uuid")
-                ri.received_uuid = parse_uuid(fval);
-            else if (fname == "ctransid")
-                ri.ctransid = parse_hex<uint64_t>(fval);
-            else if (fname == "otransid")
-                ri.otransid = parse_hex<uint64_t>(fval);
-            else if (fname == "stransid")
-                ri.stransid = parse_hex<uint64_t>(fval);
-            else if (fname == "rtransid")
-                ri.rtransid = parse_hex<uint64_t>(fval);
-            else if (fname == "ctime")
-                ri.ctime = parse_timestamp(fval);
-            else if (fname == "otime")
-                ri.otime = parse_timestamp(fval);
-            else if (fname == "stime")
-                ri.stime = parse_timestamp(fval);
-            else if (fname == "rtime")
-                ri.rtime = parse_timestamp(fval);
-            else
-                throw formatted_error("unrecognized root_item field '{}'", fname);
+        while (it != extents.end() && it->first <= end) {
+            end = max(end, it->second);
+            it = extents.erase(it);
         }
 
-        append(&ri, sizeof(ri));
-    } else if (type_word == "root_backref" || type_word == "root_ref") {
-        string name;
-        btrfs::root_ref rr;
+        extents.emplace(start, end);
+    }
 
-        memset(&rr, 0, sizeof(rr));
+    void read_all(uint64_t offset, span<uint8_t> buf) {
+        while (!buf.empty()) {
+            auto ret = pread(fd, buf.data(), buf.size(), offset);
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+            if (ret < 0 && errno == EINTR)
+                continue;
 
-            if (fname == "dirid")
-                rr.dirid = parse_hex<uint64_t>(fval);
-            else if (fname == "sequence")
-                rr.sequence = parse_hex<uint64_t>(fval);
-            else if (fname == "name_len")
-                rr.name_len = parse_hex<uint16_t>(fval);
-            else if (fname == "name") {
-                name = unescape_name(fval);
-                break;
-            } else
-                throw formatted_error("unrecognized root_ref field '{}'", fname);
+            if (ret <= 0)
+                throw formatted_error("pread failed at offset {:x} (errno {})", offset, ret < 0 ? errno : 0);
+
+            buf = buf.subspan(ret);
+            offset += ret;
         }
+    }
 
-        append(&rr, sizeof(rr));
-        append(name.data(), name.size());
-    } else if (type_word == "extent_item" || type_word == "metadata_item") {
-        btrfs::extent_item ei;
+    void write_all(uint64_t offset, span<const uint8_t> buf) {
+        iovec iov = { (void*)buf.data(), buf.size() };
 
-        memset(&ei, 0, sizeof(ei));
+        write_run(offset, span(&iov, 1));
+    }
 
-        // parse: refs=X generation=X flags=names [inline refs...]
+    bool overlaps(uint64_t offset, size_t len) const {
+        auto it = pending.lower_bound(offset);
 
-        // first parse the extent_item fields
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+        if (it != pending.end() && it->first < offset + len)
+            return true;
 
-            if (fname == "refs")
-                ei.refs = parse_hex<uint64_t>(fval);
-            else if (fname == "generation")
-                ei.generation = parse_hex<uint64_t>(fval);
-            else if (fname == "flags") {
-                ei.flags = parse_extent_flags(fval);
-                break; // inline refs follow after flags
-            } else
-                throw formatted_error("unrecognized extent_item field '{}'", fname);
+        if (it != pending.begin()) {
+            it--;
+
+            if (it->first + it->second.len > offset)
+                return true;
         }
 
-        append(&ei, sizeof(ei));
+        return false;
+    }
 
-        while (!rest.empty() && rest.front() == ' ') {
-            rest.remove_prefix(1);
-        }
+    void write_run(uint64_t offset, span<iovec> iov) {
+        while (!iov.empty()) {
+            auto ret = pwritev(fd, iov.data(), (int)iov.size(), offset);
 
-        if (rest.starts_with("key=")) {
-            btrfs::tree_block_info tbi;
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
 
-            memset(&tbi, 0, sizeof(tbi));
+                throw formatted_error("pwritev failed at offset {:x} (errno {})", offset, errno);
+            }
 
-            while (!rest.empty()) {
-                auto saved = rest;
+            offset += ret;
 
-                auto [fname, fval] = next_field(rest);
-                if (fname.empty())
-                    break;
+            // deal with short writes
 
-                if (fname == "key")
-                    tbi.key = parse_key(fval);
-                else if (fname == "level") {
-                    tbi.level = parse_hex<uint8_t>(fval);
-                    break;
-                } else {
-                    rest = saved;
-                    break;
-                }
+            while (!iov.empty() && (size_t)ret >= iov.front().iov_len) {
+                ret -= iov.front().iov_len;
+                iov = iov.subspan(1);
             }
 
-            append(&tbi, sizeof(tbi));
+            if (ret > 0) {
+                iov.front().iov_base = (uint8_t*)iov.front().iov_base + ret;
+                iov.front().iov_len -= ret;
+            }
         }
+    }
 
-        // now parse inline refs
-        while (!rest.empty()) {
-            while (!rest.empty() && rest.front() == ' ') {
-                rest.remove_prefix(1);
-            }
+    int fd;
+    size_t batch_size = DEFAULT_BATCH_SIZE;
+    uint64_t file_size = 0;
+    map<uint64_t, pending_write> pending;
+    vector<uint8_t> staging;
+    map<uint64_t, uint64_t> extents; // start -> end, of everything written
+};
 
-            if (rest.empty())
-                break;
+static void write_superblock(image_writer& out, btrfs::super_block& sb) {
+    auto file_size = out.size();
 
-            if (rest.starts_with("extra="))
-                break; // will be handled below
+    for (unsigned int i = 0; i < sizeof(btrfs::superblock_addrs) / sizeof(*btrfs::superblock_addrs); i++) {
+        auto addr = btrfs::superblock_addrs[i];
 
-            string_view ref_type;
+        if (file_size < addr + sizeof(btrfs::super_block))
+            break;
 
-            if (auto sp = rest.find(' '); sp != string_view::npos) {
-                ref_type = rest.substr(0, sp);
-                rest = rest.substr(sp);
-            } else {
-                ref_type = rest;
-                rest = "";
-            }
+        sb.bytenr = addr;
 
-            if (ref_type == "tree_block_ref") {
-                btrfs::extent_inline_ref eir;
+        compute_csum(sb.csum_type, {(uint8_t*)&sb.fsid, sizeof(btrfs::super_block) - sizeof(sb.csum)}, sb.csum);
 
-                memset(&eir, 0, sizeof(eir));
+        out.write(addr, {(const uint8_t*)&sb, sizeof(sb)});
+    }
 
-                eir.type = btrfs::key_type::TREE_BLOCK_REF;
+    out.flush();
+}
 
-                auto [fname, fval] = next_field(rest);
-                if (fname == "root")
-                    eir.offset = parse_hex<uint64_t>(fval);
-                else
-                    throw formatted_error("unrecognized tree_block_ref field '{}'", fname);
+// The images being written, one per device. The device the dump was taken
+// from goes to the filename we were given, and any others go alongside it
+// with their devid appended, e.g. output.img.2.
+class device_images {
+public:
+    struct device {
+        device(const filesystem::path& fn) : fn(fn), image(fn) { }
 
-                append(&eir, sizeof(eir));
-            } else if (ref_type == "shared_block_ref") {
-                btrfs::extent_inline_ref eir;
+        filesystem::path fn;
+        image_writer image;
+    };
 
-                memset(&eir, 0, sizeof(eir));
+    device_images(const filesystem::path& fn) : fn(fn) { }
 
-                eir.type = btrfs::key_type::SHARED_BLOCK_REF;
+    // Shares out limit between the write batches of all the devices.
+    void limit_memory(size_t limit) {
+        mem_limit = limit;
 
-                auto [fname, fval] = next_field(rest);
-                if (fname == "offset")
-                    eir.offset = parse_hex<uint64_t>(fval);
-                else
-                    throw formatted_error("unrecognized shared_block_ref field '{}'", fname);
+        for (auto& [devid, d] : devs) {
+            d->image.limit_batch(mem_limit / devs.size());
+        }
+    }
 
-                append(&eir, sizeof(eir));
-            } else if (ref_type == "extent_data_ref") {
-                btrfs::extent_inline_ref eir;
-                btrfs::extent_data_ref edr;
+    void set_primary(uint64_t devid) {
+        primary = devid;
+    }
 
-                memset(&eir, 0, sizeof(eir));
-                memset(&edr, 0, sizeof(edr));
+    uint64_t primary_devid() const {
+        return primary;
+    }
 
-                eir.type = btrfs::key_type::EXTENT_DATA_REF;
+    device& get(uint64_t devid) {
+        if (auto it = devs.find(devid); it != devs.end())
+            return *it->second;
 
-                while (!rest.empty()) {
-                    auto saved2 = rest;
-                    auto [fname, fval] = next_field(rest);
-                    if (fname.empty())
-                        break;
+        if (primary == 0)
+            primary = devid;
 
-                    if (fname == "root")
-                        edr.root = parse_hex<uint64_t>(fval);
-                    else if (fname == "objectid")
-                        edr.objectid = parse_hex<uint64_t>(fval);
-                    else if (fname == "offset")
-                        edr.offset = (uint64_t)parse_hex<int64_t>(fval);
-                    else if (fname == "count") {
-                        edr.count = parse_hex<uint32_t>(fval);
-                        break;
-                    } else {
-                        rest = saved2;
-                        break;
-                    }
-                }
+        auto dev_fn = devid == primary ? fn : filesystem::path{format("{}.{}", fn.string(), devid)};
 
-                // extent_inline_ref type then extent_data_ref packed as: type + edr overlapping offset
-                append(&eir.type, sizeof(eir.type));
-                append(&edr, sizeof(edr));
-            } else if (ref_type == "shared_data_ref") {
-                btrfs::extent_inline_ref eir;
-                btrfs::shared_data_ref sdr;
+        auto& d = *devs.emplace(devid, make_unique<device>(dev_fn)).first->second;
 
-                memset(&eir, 0, sizeof(eir));
-                memset(&sdr, 0, sizeof(sdr));
+        if (mem_limit != 0)
+            limit_memory(mem_limit);
 
-                eir.type = btrfs::key_type::SHARED_DATA_REF;
+        return d;
+    }
 
-                while (!rest.empty()) {
-                    auto saved2 = rest;
-                    auto [fname, fval] = next_field(rest);
-                    if (fname.empty())
-                        break;
+    const map<uint64_t, unique_ptr<device>>& devices() const {
+        return devs;
+    }
 
-                    if (fname == "offset")
-                        eir.offset = parse_hex<uint64_t>(fval);
-                    else if (fname == "count") {
-                        sdr.count = parse_hex<uint32_t>(fval);
-                        break;
-                    } else {
-                        rest = saved2;
-                        break;
-                    }
-                }
+    void add_dev_item(const btrfs::dev_item& di) {
+        dev_items[di.devid] = di;
+    }
 
-                append(&eir, sizeof(eir));
-                append(&sdr, sizeof(sdr));
-            } else if (ref_type == "extent_owner_ref") {
-                btrfs::extent_inline_ref eir;
+    void add_chunk(const chunk_entry& ce) {
+        chunks.add(ce);
+    }
 
-                memset(&eir, 0, sizeof(eir));
+    const chunk_map& get_chunks() const {
+        return chunks;
+    }
 
-                eir.type = btrfs::key_type::EXTENT_OWNER_REF;
+    void write_node(span<const uint8_t> buf, uint64_t bytenr) {
+        trace::span sp("write_node");
 
-                auto [fname, fval] = next_field(rest);
-                if (fname == "root")
-                    eir.offset = parse_hex<uint64_t>(fval);
-                else
-                    throw formatted_error("unrecognized extent_owner_ref field '{}'", fname);
+        sp.hex_arg("bytenr", bytenr);
 
-                append(&eir, sizeof(eir));
-            } else
-                throw formatted_error("unrecognized inline ref type '{}'", ref_type);
+        PROBE(btrfs_assemble, write_node_entry, bytenr, buf.size());
+
+        const auto& c = chunks.find(bytenr, buf.size());
+
+        for (const auto& w : map_to_stripes(c, chunks.stripes(c), bytenr, buf.size())) {
+            PROBE(btrfs_assemble, write_stripe, bytenr, w.devid, w.physical, w.length);
+
+            get(w.devid).image.write(w.physical, buf.subspan(w.buf_offset, w.length));
         }
-    } else if (type_word == "block_group_item") {
-        btrfs::block_group_item_v2 bgi;
-        bool has_v2 = false;
 
-        // parse: used=X chunk_objectid=X flags=names [remap_bytes=X identity_remap_count=X]
+        // note which RAID5/6 stripes will need their parity working out
 
-        memset(&bgi, 0, sizeof(bgi));
+        if (c.type & (btrfs::BLOCK_GROUP_RAID5 | btrfs::BLOCK_GROUP_RAID6)) {
+            auto full_stripe_len = c.stripe_len * data_stripes(c);
+            auto first = (bytenr - c.offset) / full_stripe_len;
+            auto last = (bytenr + buf.size() - 1 - c.offset) / full_stripe_len;
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+            for (auto i = first; i <= last; i++) {
+                dirty_stripes.emplace(c.offset, i);
+            }
+        }
 
-            if (fname == "used")
-                bgi.used = parse_hex<uint64_t>(fval);
-            else if (fname == "chunk_objectid")
-                bgi.chunk_objectid = parse_hex<uint64_t>(fval);
-            else if (fname == "flags")
-                bgi.flags = parse_block_group_flags(fval);
-            else if (fname == "remap_bytes") {
-                bgi.remap_bytes = parse_hex<uint64_t>(fval);
-                has_v2 = true;
-            } else if (fname == "identity_remap_count") {
-                bgi.identity_remap_count = parse_hex<uint32_t>(fval);
-                has_v2 = true;
-            } else
-                throw formatted_error("unrecognized block_group_item field '{}'", fname);
+        PROBE(btrfs_assemble, write_node_return, bytenr, buf.size());
+    }
+
+    // Writes the parity and the superblocks, once all the nodes are done.
+    // The primary device keeps the superblock's own dev_item, in case it has
+    // been edited on purpose; the others get theirs from the chunk tree.
+    void finish(const btrfs::super_block& sb) {
+        write_parity();
+
+        for (const auto& [devid, di] : dev_items) {
+            get(devid);
         }
 
-        if (has_v2)
-            append(&bgi, sizeof(bgi));
-        else
-            append(&bgi, sizeof(btrfs::block_group_item));
-    } else if (type_word == "free_space_info") {
-        btrfs::free_space_info fsi;
+        for (auto& [devid, d] : devs) {
+            auto dev_sb = sb;
 
-        memset(&fsi, 0, sizeof(fsi));
+            if (devid != primary) {
+                if (auto it = dev_items.find(devid); it != dev_items.end())
+                    dev_sb.dev_item = it->second;
+                else
+                    dev_sb.dev_item.devid = devid;
+            }
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+            // sb.total_bytes is the whole filesystem, across all devices
+            d->image.extend(dev_sb.dev_item.total_bytes);
 
-            if (fname == "extent_count")
-                fsi.extent_count = parse_hex<uint32_t>(fval);
-            else if (fname == "flags")
-                fsi.flags = parse_free_space_info_flags(fval);
-            else
-                throw formatted_error("unrecognized free_space_info field '{}'", fname);
+            write_superblock(d->image, dev_sb);
         }
+    }
 
-        append(&fsi, sizeof(fsi));
-    } else if (type_word == "free_space_extent") {
-        // zero-length
-    } else if (type_word == "free_space_bitmap") {
-        auto bitmap_size = key.offset / (sb.sectorsize * 8);
+private:
+    // Parity is worked out from what has actually been written to the data
+    // stripes, so that it covers metadata in any order, and any other nodes
+    // which happen to share the stripe.
+    void write_parity() {
+        trace::span sp("write_parity");
+
+        sp.arg("stripes", dirty_stripes.size());
+
+        for (const auto& [chunk_offset, full_stripe] : dirty_stripes) {
+            const auto& c = chunks.find(chunk_offset, 1);
+            auto stripes = chunks.stripes(c);
+            auto ds = data_stripes(c);
+            bool raid6 = c.type & btrfs::BLOCK_GROUP_RAID6;
+            auto phys_off = full_stripe * c.stripe_len;
+            vector<vector<uint8_t>> data(ds, vector<uint8_t>(c.stripe_len));
+            vector<span<const uint8_t>> data_spans;
+            vector<uint8_t> p(c.stripe_len), q(raid6 ? c.stripe_len : 0);
+
+            for (unsigned int i = 0; i < ds; i++) {
+                const auto& st = stripes[(full_stripe + i) % c.num_stripes];
+
+                get(st.devid).image.read(st.offset + phys_off, data[i]);
+                data_spans.emplace_back(data[i]);
+            }
 
-        // dump format is "addr, len; addr, len; ..." where addr and len are hex
-        // each bit in the 256-byte bitmap represents one sector
+            if (raid6)
+                raid56::gen_pq(data_spans, p, q);
+            else
+                raid56::gen_p(data_spans, p);
 
-        data.resize(bitmap_size, 0);
+            const auto& p_st = stripes[(full_stripe + ds) % c.num_stripes];
 
-        while (!rest.empty()) {
-            while (!rest.empty() && (rest.front() == ' ' || rest.front() == ';')) {
-                rest.remove_prefix(1);
+            get(p_st.devid).image.write(p_st.offset + phys_off, p);
+
+            if (raid6) {
+                const auto& q_st = stripes[(full_stripe + ds + 1) % c.num_stripes];
+
+                get(q_st.devid).image.write(q_st.offset + phys_off, q);
             }
+        }
+    }
 
-            if (rest.empty())
-                break;
+    filesystem::path fn;
+    uint64_t primary = 0;
+    map<uint64_t, unique_ptr<device>> devs;
+    map<uint64_t, btrfs::dev_item> dev_items;
+    chunk_map chunks;
+    set<pair<uint64_t, uint64_t>> dirty_stripes; // (chunk, full stripe)
+    size_t mem_limit = 0;
+};
 
-            // parse addr
+// Picks out the items in a leaf that affect where things get written: chunk
+// items, for the chunk map, and dev items, for the other devices' superblocks.
+static void scan_leaf(span<const uint8_t> node, vector<chunk_entry>& chunks,
+                      vector<btrfs::dev_item>& dev_items) {
+    const auto& h = *(const btrfs::header*)node.data();
+    auto items = span((const btrfs::item*)(node.data() + sizeof(btrfs::header)), h.nritems);
 
-            string_view addr_sv;
+    for (const auto& it : items) {
+        auto data = node.data() + sizeof(btrfs::header) + it.offset;
 
-            if (auto comma = rest.find(','); comma != string_view::npos) {
-                addr_sv = rest.substr(0, comma);
-                rest.remove_prefix(comma + 1);
-            } else
-                break;
+        if (it.key.type == btrfs::key_type::CHUNK_ITEM && it.size >= offsetof(btrfs::chunk, stripe))
+            chunks.push_back(make_chunk_entry(it.key.offset, *(const btrfs::chunk*)data));
+        else if (it.key.type == btrfs::key_type::DEV_ITEM && it.size >= sizeof(btrfs::dev_item))
+            dev_items.push_back(*(const btrfs::dev_item*)data);
+    }
+}
 
-            while (!addr_sv.empty() && addr_sv.back() == ' ') {
-                addr_sv.remove_suffix(1);
-            }
+// Hands out bytenrs for the nodes of trees given as item streams. Nodes go
+// in the metadata chunks, or the system chunks for the chunk tree, skipping
+// over anything used by nodes given explicitly and anything that would land
+// on one of the superblocks. Each chunk is filled from the start, so the
+// nodes of a tree are laid out next to each other. The explicit nodes are
+// kept as ranges, merged where they touch, as there can be tens of millions
+// of them but they're usually in runs.
+class node_allocator {
+public:
+    void add_chunk(const chunk_entry& ce) {
+        chunks.add(ce);
+        cursors.try_emplace(ce.offset, ce.offset);
+    }
 
-            auto addr = parse_hex<uint64_t>(addr_sv);
+    void mark_used(uint64_t bytenr, uint32_t nodesize) {
+        if (allocated(bytenr, nodesize))
+            throw formatted_error("node at {:x} overlaps automatically laid out node", bytenr);
 
-            while (!rest.empty() && rest.front() == ' ') {
-                rest.remove_prefix(1);
-            }
+        auto start = bytenr, end = bytenr + nodesize;
+        auto it = used.upper_bound(start);
 
-            // parse len
+        if (it != used.begin() && prev(it)->second >= start) {
+            it--;
+            start = it->first;
+        }
 
-            string_view len_sv;
+        while (it != used.end() && it->first <= end) {
+            end = max(end, it->second);
+            it = used.erase(it);
+        }
 
-            if (auto sc = rest.find(';'); sc != string_view::npos) {
-                len_sv = rest.substr(0, sc);
-                rest = rest.substr(sc);
-            } else {
-                len_sv = rest;
-                rest = "";
-            }
+        used.emplace(start, end);
+    }
 
-            while (!len_sv.empty() && len_sv.back() == ' ') {
-                len_sv.remove_suffix(1);
-            }
+    // Roughly, as the map's nodes are each a few pointers on top of the value.
+    size_t memory_usage() const {
+        return used.size() * (sizeof(decltype(used)::value_type) + (4 * sizeof(void*)));
+    }
 
-            auto len = parse_hex<uint64_t>(len_sv);
+    uint64_t alloc(bool system, uint32_t nodesize) {
+        auto type = system ? btrfs::BLOCK_GROUP_SYSTEM : btrfs::BLOCK_GROUP_METADATA;
 
-            // set bits in bitmap
+        for (const auto& c : chunks) {
+            if (!(c.type & type))
+                continue;
 
-            if (sb.sectorsize > 0) {
-                auto bit_start = (addr - key.objectid) / sb.sectorsize;
-                auto bit_count = len / sb.sectorsize;
+            auto& cursor = cursors.at(c.offset);
 
-                for (uint64_t b = bit_start; b < bit_start + bit_count && b / 8 < data.size(); b++) {
-                    data[b / 8] |= (1 << (b % 8));
-                }
+            while (cursor + nodesize <= c.offset + c.length) {
+                auto bytenr = cursor;
+
+                cursor += nodesize;
+
+                if (is_free(c, bytenr, nodesize))
+                    return bytenr;
             }
         }
-    } else if (type_word == "dev_extent") {
-        btrfs::dev_extent de;
 
-        memset(&de, 0, sizeof(de));
+        throw formatted_error("no space left in {} chunks for automatically laid out nodes",
+                              system ? "system" : "metadata");
+    }
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+private:
+    bool is_free(const chunk_map::chunk& c, uint64_t bytenr, uint32_t nodesize) const {
+        if (auto it = used.upper_bound(bytenr + nodesize - 1); it != used.begin() &&
+            prev(it)->second > bytenr) {
+            return false;
+        }
 
-            if (fname == "chunk_tree")
-                de.chunk_tree = parse_hex<uint64_t>(fval);
-            else if (fname == "chunk_objectid")
-                de.chunk_objectid = parse_hex<uint64_t>(fval);
-            else if (fname == "chunk_offset")
-                de.chunk_offset = parse_hex<uint64_t>(fval);
-            else if (fname == "length")
-                de.length = parse_hex<uint64_t>(fval);
-            else if (fname == "chunk_tree_uuid")
-                de.chunk_tree_uuid = parse_uuid(fval);
-            else
-                throw formatted_error("unrecognized dev_extent field '{}'", fname);
+        for (const auto& w : map_to_stripes(c, chunks.stripes(c), bytenr, nodesize)) {
+            for (auto addr : btrfs::superblock_addrs) {
+                if (w.physical < addr + sizeof(btrfs::super_block) && w.physical + w.length > addr)
+                    return false;
+            }
         }
 
-        append(&de, sizeof(de));
-    } else if (type_word == "dev_item") {
-        btrfs::dev_item d;
+        return true;
+    }
 
-        memset(&d, 0, sizeof(d));
+    bool allocated(uint64_t bytenr, uint32_t nodesize) const {
+        auto it = cursors.upper_bound(bytenr + nodesize - 1);
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+        if (it == cursors.begin())
+            return false;
 
-            if (fname == "devid")
-                d.devid = parse_hex<uint64_t>(fval);
-            else if (fname == "total_bytes")
-                d.total_bytes = parse_hex<uint64_t>(fval);
-            else if (fname == "bytes_used")
-                d.bytes_used = parse_hex<uint64_t>(fval);
-            else if (fname == "io_align")
-                d.io_align = parse_hex<uint32_t>(fval);
-            else if (fname == "io_width")
-                d.io_width = parse_hex<uint32_t>(fval);
-            else if (fname == "sector_size")
-                d.sector_size = parse_hex<uint32_t>(fval);
-            else if (fname == "type")
-                d.type = parse_hex<uint64_t>(fval);
-            else if (fname == "generation")
-                d.generation = parse_hex<uint64_t>(fval);
-            else if (fname == "start_offset")
-                d.start_offset = parse_hex<uint64_t>(fval);
-            else if (fname == "dev_group")
-                d.dev_group = parse_hex<uint32_t>(fval);
-            else if (fname == "seek_speed")
-                d.seek_speed = parse_hex<uint8_t>(fval);
-            else if (fname == "bandwidth")
-                d.bandwidth = parse_hex<uint8_t>(fval);
-            else if (fname == "uuid")
-                d.uuid = parse_uuid(fval);
-            else if (fname == "fsid")
-                d.fsid = parse_uuid(fval);
-            else
-                throw formatted_error("unrecognized dev_item field '{}'", fname);
-        }
+        it--;
 
-        append(&d, sizeof(d));
-    } else if (type_word == "chunk_item") {
-        struct {
-            btrfs::chunk c;
-            btrfs::stripe extra_stripes[MAX_STRIPES - 1];
-        } __attribute__((packed)) chunk_buf;
+        return bytenr + nodesize > it->first && bytenr < it->second;
+    }
 
-        memset(&chunk_buf, 0, sizeof(chunk_buf));
+    chunk_map chunks;
+    map<uint64_t, uint64_t> cursors; // chunk offset to next free bytenr
+    map<uint64_t, uint64_t> used; // start to end of explicit nodes
+};
 
-        auto& c = chunk_buf.c;
+// Where parse_item_data puts an item: the free space of the node it's going
+// into, so that items can be parsed without any allocations or copies.
+class item_buffer {
+public:
+    item_buffer(span<uint8_t> space, uint64_t bytenr) : space(space), bytenr(bytenr) { }
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+    size_t size() const {
+        return len;
+    }
 
-            if (fname == "length")
-                c.length = parse_hex<uint64_t>(fval);
-            else if (fname == "owner")
-                c.owner = parse_hex<uint64_t>(fval);
-            else if (fname == "stripe_len")
-                c.stripe_len = parse_hex<uint64_t>(fval);
-            else if (fname == "type")
-                c.type = parse_block_group_flags(fval);
-            else if (fname == "io_align")
-                c.io_align = parse_hex<uint32_t>(fval);
-            else if (fname == "io_width")
-                c.io_width = parse_hex<uint32_t>(fval);
-            else if (fname == "sector_size")
-                c.sector_size = parse_hex<uint32_t>(fval);
-            else if (fname == "num_stripes")
-                c.num_stripes = parse_hex<uint16_t>(fval);
-            else if (fname == "sub_stripes")
-                c.sub_stripes = parse_hex<uint16_t>(fval);
-            else if (fname.starts_with("stripe(")) {
-                // stripe(N) devid=X offset=X dev_uuid=U
+    uint8_t& operator[](size_t i) {
+        return space[i];
+    }
 
-                auto open = fname.find('(');
-                auto close = fname.find(')');
+    // Grows the item by n bytes, and returns the new bytes, which are left
+    // uninitialized.
+    span<uint8_t> extend(size_t n) {
+        if (n > space.size() - len)
+            throw formatted_error("node at bytenr {:x} overflows", bytenr);
 
-                if (open == string_view::npos || close == string_view::npos || close < open)
-                    throw formatted_error("could not parse {}", rest);
+        auto ret = space.subspan(len, n);
 
-                auto stripe_idx = parse_hex<uint16_t>(fname.substr(open + 1, close - open - 1));
+        len += n;
 
-                auto& s = c.stripe[stripe_idx];
+        return ret;
+    }
 
-                // fname is "stripe(N)", skip it and parse devid/offset/dev_uuid
-                while (!rest.empty()) {
-                    auto saved2 = rest;
+    void resize(size_t n) {
+        if (n <= len) {
+            len = n;
+            return;
+        }
 
-                    auto [fname2, fval2] = next_field(rest);
-                    if (fname2.empty())
-                        break;
+        auto added = extend(n - len);
 
-                    if (fname2 == "devid")
-                        s.devid = parse_hex<uint64_t>(fval2);
-                    else if (fname2 == "offset")
-                        s.offset = parse_hex<uint64_t>(fval2);
-                    else if (fname2 == "dev_uuid") {
-                        s.dev_uuid = parse_uuid(fval2);
-                        break;
-                    } else {
-                        rest = saved2;
-                        break;
-                    }
-                }
-            } else
-                throw formatted_error("unrecognized chunk_item field '{}'", fname);
-        }
+        memset(added.data(), 0, added.size());
+    }
 
-        size_t total = offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe));
+    void append(const void* ptr, size_t n) {
+        memcpy(extend(n).data(), ptr, n);
+    }
 
-        append(&chunk_buf, total);
-    } else if (type_word == "orphan_item") {
-        // zero-length
-    } else if (type_word == "qgroup_status") {
-        btrfs::qgroup_status_item qsi;
+    void assign(const void* ptr, size_t n) {
+        len = 0;
+        append(ptr, n);
+    }
 
-        memset(&qsi, 0, sizeof(qsi));
+private:
+    span<uint8_t> space;
+    uint64_t bytenr;
+    size_t len = 0;
+};
+
+enum class extent_data_field {
+    generation,
+    ram_bytes,
+    compression,
+    encryption,
+    other_encoding,
+    type,
+    disk_bytenr,
+    disk_num_bytes,
+    offset,
+    num_bytes
+};
+
+static constexpr auto extent_data_fields = phash::make_table<extent_data_field>({
+    { "generation", extent_data_field::generation },
+    { "ram_bytes", extent_data_field::ram_bytes },
+    { "compression", extent_data_field::compression },
+    { "encryption", extent_data_field::encryption },
+    { "other_encoding", extent_data_field::other_encoding },
+    { "type", extent_data_field::type },
+    { "disk_bytenr", extent_data_field::disk_bytenr },
+    { "disk_num_bytes", extent_data_field::disk_num_bytes },
+    { "offset", extent_data_field::offset },
+    { "num_bytes", extent_data_field::num_bytes },
+});
+
+enum class item_word {
+    raw,
+    inode_item,
+    inode_ref,
+    inode_extref,
+    dir_item,
+    dir_index,
+    xattr_item,
+    extent_data,
+    extent_csum,
+    root_item,
+    root_backref,
+    root_ref,
+    extent_item,
+    metadata_item,
+    block_group_item,
+    free_space_info,
+    free_space_extent,
+    free_space_bitmap,
+    dev_extent,
+    dev_item,
+    chunk_item,
+    orphan_item,
+    qgroup_status,
+    qgroup_info,
+    qgroup_limit,
+    qgroup_relation,
+    dev_stats,
+    free_space,
+    balance,
+    uuid_subvol,
+    uuid_rec_subvol,
+    dev_replace,
+    raid_stripe,
+    identity_remap,
+    remap,
+    remap_backref,
+    dir_log_index,
+    extent_data_ref,
+    shared_data_ref,
+    tree_block_ref,
+    shared_block_ref,
+    string_item,
+    verity_desc_item,
+    fsverity_descriptor,
+    verity_merkle_item,
+    unknown,
+    invalid
+};
+
+static constexpr auto item_words = phash::make_table<item_word>({
+    { "raw", item_word::raw },
+    { "inode_item", item_word::inode_item },
+    { "inode_ref", item_word::inode_ref },
+    { "inode_extref", item_word::inode_extref },
+    { "dir_item", item_word::dir_item },
+    { "dir_index", item_word::dir_index },
+    { "xattr_item", item_word::xattr_item },
+    { "extent_data", item_word::extent_data },
+    { "extent_csum", item_word::extent_csum },
+    { "root_item", item_word::root_item },
+    { "root_backref", item_word::root_backref },
+    { "root_ref", item_word::root_ref },
+    { "extent_item", item_word::extent_item },
+    { "metadata_item", item_word::metadata_item },
+    { "block_group_item", item_word::block_group_item },
+    { "free_space_info", item_word::free_space_info },
+    { "free_space_extent", item_word::free_space_extent },
+    { "free_space_bitmap", item_word::free_space_bitmap },
+    { "dev_extent", item_word::dev_extent },
+    { "dev_item", item_word::dev_item },
+    { "chunk_item", item_word::chunk_item },
+    { "orphan_item", item_word::orphan_item },
+    { "qgroup_status", item_word::qgroup_status },
+    { "qgroup_info", item_word::qgroup_info },
+    { "qgroup_limit", item_word::qgroup_limit },
+    { "qgroup_relation", item_word::qgroup_relation },
+    { "dev_stats", item_word::dev_stats },
+    { "free_space", item_word::free_space },
+    { "balance", item_word::balance },
+    { "uuid_subvol", item_word::uuid_subvol },
+    { "uuid_rec_subvol", item_word::uuid_rec_subvol },
+    { "dev_replace", item_word::dev_replace },
+    { "raid_stripe", item_word::raid_stripe },
+    { "identity_remap", item_word::identity_remap },
+    { "remap", item_word::remap },
+    { "remap_backref", item_word::remap_backref },
+    { "dir_log_index", item_word::dir_log_index },
+    { "extent_data_ref", item_word::extent_data_ref },
+    { "shared_data_ref", item_word::shared_data_ref },
+    { "tree_block_ref", item_word::tree_block_ref },
+    { "shared_block_ref", item_word::shared_block_ref },
+    { "string_item", item_word::string_item },
+    { "verity_desc_item", item_word::verity_desc_item },
+    { "fsverity_descriptor", item_word::fsverity_descriptor },
+    { "verity_merkle_item", item_word::verity_merkle_item },
+    { "unknown", item_word::unknown },
+});
+
+static void parse_item_data(string_view type_line, const btrfs::key& key,
+                            const btrfs::super_block& sb, item_buffer& data) {
+    auto append = [&](const void* ptr, size_t len) {
+        data.append(ptr, len);
+    };
+
+    auto append_hex = [&](string_view hex_str) {
+        if (hex_str.size() % 2 != 0)
+            throw formatted_error("hex string has odd length");
+
+        hex::decode(hex_str, data.extend(hex_str.size() / 2));
+    };
+
+    string_view type_word, rest;
+
+    if (auto sp = type_line.find(' '); sp != string_view::npos) {
+        type_word = type_line.substr(0, sp);
+        rest = type_line.substr(sp + 1);
+    } else {
+        type_word = type_line;
+        rest = "";
+    }
+
+    auto word = item_words.find(type_word).value_or(item_word::invalid);
+
+    if (word == item_word::raw) {
+        append_hex(rest);
+        return;
+    } else if (word == item_word::inode_item) {
+        btrfs::inode_item ii;
+
+        parse_inode_item(rest, ii);
+
+        append(&ii, sizeof(ii));
+    } else if (word == item_word::inode_ref) {
+        // multiple entries: index=X name_len=X name=Y
 
         while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
+            string name;
+            btrfs::inode_ref ir;
+
+            memset(&ir, 0, sizeof(ir));
+
+            while (!rest.empty()) {
+                auto [fname, fval] = next_field(rest);
+                if (fname.empty())
+                    break;
+
+                if (fname == "index")
+                    ir.index = parse_hex<uint64_t>(fval);
+                else if (fname == "name_len")
+                    ir.name_len = parse_hex<uint16_t>(fval);
+                else if (fname == "name") {
+                    name = unescape_name(fval);
+                    break;
+                } else
+                    throw formatted_error("unrecognized inode_ref field '{}'", fname);
+            }
+
+            if (name.empty() && (uint16_t)ir.name_len == 0)
                 break;
 
-            if (fname == "version")
-                qsi.version = parse_hex<uint64_t>(fval);
-            else if (fname == "generation")
-                qsi.generation = parse_hex<uint64_t>(fval);
-            else if (fname == "flags")
-                qsi.flags = parse_qgroup_status_flags(fval);
-            else if (fname == "rescan")
-                qsi.rescan = parse_hex<uint64_t>(fval);
-            else if (fname == "enable_gen")
-                qsi.enable_gen = parse_hex<uint64_t>(fval);
-            else
-                throw formatted_error("unrecognized qgroup_status field '{}'", fname);
+            append(&ir, sizeof(ir));
+            append(name.data(), name.size());
         }
+    } else if (word == item_word::inode_extref) {
+        while (!rest.empty()) {
+            string name;
+            btrfs::inode_extref ier;
 
-        append(&qsi, sizeof(qsi));
-    } else if (type_word == "qgroup_info") {
-        btrfs::qgroup_info_item qi;
+            memset(&ier, 0, sizeof(ier));
 
-        memset(&qi, 0, sizeof(qi));
+            while (!rest.empty()) {
+                auto [fname, fval] = next_field(rest);
+                if (fname.empty())
+                    break;
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
+                if (fname == "parent_objectid")
+                    ier.parent_objectid = parse_hex<uint64_t>(fval);
+                else if (fname == "index")
+                    ier.index = parse_hex<uint64_t>(fval);
+                else if (fname == "name_len")
+                    ier.name_len = parse_hex<uint16_t>(fval);
+                else if (fname == "name") {
+                    name = unescape_name(fval);
+                    break;
+                } else
+                    throw formatted_error("unrecognized inode_extref field '{}'", fname);
+            }
+
+            if (name.empty() && (uint16_t)ier.name_len == 0)
                 break;
 
-            if (fname == "generation")
-                qi.generation = parse_hex<uint64_t>(fval);
-            else if (fname == "rfer")
-                qi.rfer = parse_hex<uint64_t>(fval);
-            else if (fname == "rfer_cmpr")
-                qi.rfer_cmpr = parse_hex<uint64_t>(fval);
-            else if (fname == "excl")
-                qi.excl = parse_hex<uint64_t>(fval);
-            else if (fname == "excl_cmpr")
-                qi.excl_cmpr = parse_hex<uint64_t>(fval);
-            else
-                throw formatted_error("unrecognized qgroup_info field '{}'", fname);
+            append(&ier, offsetof(btrfs::inode_extref, name));
+            append(name.data(), name.size());
         }
+    } else if (word == item_word::dir_item || word == item_word::dir_index ||
+               word == item_word::xattr_item) {
+        // can have multiple entries (dir_item, xattr_item) or single (dir_index)
 
-        append(&qi, sizeof(qi));
-    } else if (type_word == "qgroup_limit") {
-        btrfs::qgroup_limit_item qli;
+        while (!rest.empty()) {
+            string name;
+            vector<uint8_t> di_data;
+            btrfs::dir_item di;
 
-        memset(&qli, 0, sizeof(qli));
+            memset(&di, 0, sizeof(di));
+
+            while (!rest.empty()) {
+                auto [fname, fval] = next_field(rest);
+                if (fname.empty())
+                    break;
+
+                if (fname == "location")
+                    di.location = parse_key(fval);
+                else if (fname == "transid")
+                    di.transid = parse_hex<uint64_t>(fval);
+                else if (fname == "data_len")
+                    di.data_len = parse_hex<uint16_t>(fval);
+                else if (fname == "name_len")
+                    di.name_len = parse_hex<uint16_t>(fval);
+                else if (fname == "type")
+                    di.type = parse_dir_item_type(fval);
+                else if (fname == "name") {
+                    name = unescape_name(fval);
+
+                    // after name, optionally data=
+                    while (!rest.empty()) {
+                        auto saved2 = rest;
+                        auto [fname2, fval2] = next_field(rest);
+                        if (fname2.empty())
+                            break;
+
+                        if (fname2 == "data") {
+                            auto unescaped = unescape_name(fval2);
+
+                            di_data.assign(unescaped.begin(), unescaped.end());
+                        } else {
+                            // not data= (could be location= for next entry, or extra=), put it back
+                            rest = saved2;
+                            break;
+                        }
+                    }
+                    break;
+                } else
+                    throw formatted_error("unrecognized dir_item field '{}'", fname);
+            }
+
+            if (name.empty() && (uint16_t)di.name_len == 0)
+                break;
+
+            append(&di, sizeof(di));
+            append(name.data(), name.size());
+            append(di_data.data(), di_data.size());
+        }
+    } else if (word == item_word::extent_data) {
+        btrfs::file_extent_item fei;
+
+        memset(&fei, 0, sizeof(fei));
 
         while (!rest.empty()) {
             auto [fname, fval] = next_field(rest);
             if (fname.empty())
                 break;
 
-            if (fname == "flags")
-                qli.flags = parse_qgroup_limit_flags(fval);
-            else if (fname == "max_rfer")
-                qli.max_rfer = parse_hex<uint64_t>(fval);
-            else if (fname == "max_excl")
-                qli.max_excl = parse_hex<uint64_t>(fval);
-            else if (fname == "rsv_rfer")
-                qli.rsv_rfer = parse_hex<uint64_t>(fval);
-            else if (fname == "rsv_excl")
-                qli.rsv_excl = parse_hex<uint64_t>(fval);
-            else
-                throw formatted_error("unrecognized qgroup_limit field '{}'", fname);
+            auto f = extent_data_fields.find(fname);
+
+            if (!f)
+                throw formatted_error("unrecognized extent_data field '{}'", fname);
+
+            switch (*f) {
+                using enum extent_data_field;
+
+                case generation:
+                    fei.generation = parse_hex<uint64_t>(fval);
+                    break;
+
+                case ram_bytes:
+                    fei.ram_bytes = parse_hex<uint64_t>(fval);
+                    break;
+
+                case compression:
+                    fei.compression = parse_compression_type(fval);
+                    break;
+
+                case encryption:
+                    fei.encryption = parse_hex<uint8_t>(fval);
+                    break;
+
+                case other_encoding:
+                    fei.other_encoding = parse_hex<uint16_t>(fval);
+                    break;
+
+                case type:
+                    fei.type = parse_file_extent_type(fval);
+                    break;
+
+                case disk_bytenr:
+                    fei.disk_bytenr = parse_hex<uint64_t>(fval);
+                    break;
+
+                case disk_num_bytes:
+                    fei.disk_num_bytes = parse_hex<uint64_t>(fval);
+                    break;
+
+                case offset:
+                    fei.offset = parse_hex<uint64_t>(fval);
+                    break;
+
+                case num_bytes:
+                    fei.num_bytes = parse_hex<uint64_t>(fval);
+                    break;
+            }
         }
 
-        append(&qli, sizeof(qli));
-    } else if (type_word == "qgroup_relation") {
-        // zero-length
-    } else if (type_word == "dev_stats") {
-        // space-separated hex values as le64
+        if (fei.type == btrfs::file_extent_item_type::inline_extent) {
+            append(&fei, offsetof(btrfs::file_extent_item, disk_bytenr));
+
+            // inline data would follow - ram_bytes of zero data
+
+            data.resize(data.size() + fei.ram_bytes);
+        } else
+            append(&fei, sizeof(fei));
+    } else if (word == item_word::extent_csum) {
+        // space-separated hex csum values
         while (!rest.empty()) {
             while (!rest.empty() && rest.front() == ' ') {
                 rest.remove_prefix(1);
@@ -1968,138 +2226,802 @@ static vector<uint8_t> parse_item_data(string_view type_line, const btrfs::key&
             if (token.empty())
                 continue;
 
-            btrfs::le64 val = parse_hex<uint64_t>(token);
-            append(&val, sizeof(val));
-        }
-    } else if (type_word == "free_space") {
-        btrfs::free_space_header fsh;
-
-        memset(&fsh, 0, sizeof(fsh));
+            switch (sb.csum_type) {
+                case btrfs::csum_type::CRC32: {
+                    btrfs::le32 le = parse_hex<uint32_t>(token);
+                    append(&le, sizeof(le));
+                    break;
+                }
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+                case btrfs::csum_type::XXHASH: {
+                    btrfs::le64 le = parse_hex<uint64_t>(token);
+                    append(&le, sizeof(le));
+                    break;
+                }
 
-            if (fname == "location")
-                fsh.location = parse_key(fval);
-            else if (fname == "generation")
-                fsh.generation = parse_hex<uint64_t>(fval);
-            else if (fname == "num_entries")
-                fsh.num_entries = parse_hex<uint64_t>(fval);
-            else if (fname == "num_bitmaps")
-                fsh.num_bitmaps = parse_hex<uint64_t>(fval);
-            else
-                throw formatted_error("unrecognized free_space field '{}'", fname);
+                case btrfs::csum_type::SHA256:
+                case btrfs::csum_type::BLAKE2: {
+                    // 64-char hex = 32 bytes
+                    append_hex(token);
+                    break;
+                }
+            }
         }
+    } else if (word == item_word::root_item) {
+        btrfs::root_item ri;
 
-        append(&fsh, sizeof(fsh));
-    } else if (type_word == "balance") {
-        btrfs::balance_item bi;
+        memset(&ri, 0, sizeof(ri));
 
-        // balance flags=X data=(args) meta=(args) sys=(args)
+        // format: inode_item fields; root-specific fields
 
-        memset(&bi, 0, sizeof(bi));
+        if (auto sc = rest.find(';'); sc != string_view::npos) {
+            auto inode_part = rest.substr(0, sc);
+
+            parse_inode_item(inode_part, ri.inode);
+
+            rest = rest.substr(sc + 1);
+        }
 
         while (!rest.empty()) {
             auto [fname, fval] = next_field(rest);
             if (fname.empty())
                 break;
 
-            if (fname == "flags")
-                bi.flags = parse_balance_flags(fval);
-            else if (fname == "data" || fname == "meta" || fname == "sys") {
-                // parse disk_balance_args from values in brackets
-                auto& dba = fname == "data" ? bi.data : (fname == "meta" ? bi.meta : bi.sys);
+            if (fname == "generation")
+                ri.generation = parse_hex<uint64_t>(fval);
+            else if (fname == "root_dirid")
+                ri.root_dirid = parse_hex<uint64_t>(fval);
+            else if (fname == "bytenr")
+                ri.bytenr = parse_hex<uint64_t>(fval);
+            else if (fname == "byte_limit")
+                ri.byte_limit = parse_hex<uint64_t>(fval);
+            else if (fname == "bytes_used")
+                ri.bytes_used = parse_hex<uint64_t>(fval);
+            else if (fname == "last_snapshot")
+                ri.last_snapshot = parse_hex<uint64_t>(fval);
+            else if (fname == "flags")
+                ri.flags = parse_root_item_flags(fval);
+            else if (fname == "refs")
+                ri.refs = parse_hex<uint32_t>(fval);
+            else if (fname == "drop_progress")
+                ri.drop_progress = parse_key(fval);
+            else if (fname == "drop_level")
+                ri.drop_level = parse_hex<uint8_t>(fval);
+            else if (fname == "level")
+                ri.level = parse_hex<uint8_t>(fval);
+            else if (fname == "generation_v2")
+                ri.generation_v2 = parse_hex<uint64_t>(fval);
+            else if (fname == "uuid")
+                ri.uuid = parse_uuid(fval);
+            else if (fname == "parent_uuid")
+                ri.parent_uuid = parse_uuid(fval);
+            else if (fname == "received_uuid")
+                ri.received_uuid = parse_uuid(fval);
+            else if (fname == "ctransid")
+                ri.ctransid = parse_hex<uint64_t>(fval);
+            else if (fname == "otransid")
+                ri.otransid = parse_hex<uint64_t>(fval);
+            else if (fname == "stransid")
+                ri.stransid = parse_hex<uint64_t>(fval);
+            else if (fname == "rtransid")
+                ri.rtransid = parse_hex<uint64_t>(fval);
+            else if (fname == "ctime")
+                ri.ctime = parse_timestamp(fval);
+            else if (fname == "otime")
+                ri.otime = parse_timestamp(fval);
+            else if (fname == "stime")
+                ri.stime = parse_timestamp(fval);
+            else if (fname == "rtime")
+                ri.rtime = parse_timestamp(fval);
+            else
+                throw formatted_error("unrecognized root_item field '{}'", fname);
+        }
 
-                memset(&dba, 0, sizeof(dba));
+        append(&ri, sizeof(ri));
+    } else if (word == item_word::root_backref || word == item_word::root_ref) {
+        string name;
+        btrfs::root_ref rr;
 
-                auto args = fval;
-                while (!args.empty()) {
-                    auto [aname, aval] = next_field(args);
-                    if (aname.empty())
-                        break;
+        memset(&rr, 0, sizeof(rr));
 
-                    if (aname == "profiles")
-                        dba.profiles = parse_hex<uint64_t>(aval);
-                    else if (aname == "usage")
-                        dba.usage = parse_hex<uint64_t>(aval);
-                    else if (aname == "usage_min")
-                        dba.s1.usage_min = parse_hex<uint32_t>(aval);
-                    else if (aname == "usage_max")
-                        dba.s1.usage_max = parse_hex<uint32_t>(aval);
-                    else if (aname == "devid")
-                        dba.devid = parse_hex<uint64_t>(aval);
-                    else if (aname == "pstart")
-                        dba.pstart = parse_hex<uint64_t>(aval);
-                    else if (aname == "pend")
-                        dba.pend = parse_hex<uint64_t>(aval);
-                    else if (aname == "vstart")
-                        dba.vstart = parse_hex<uint64_t>(aval);
-                    else if (aname == "vend")
-                        dba.vend = parse_hex<uint64_t>(aval);
-                    else if (aname == "target")
-                        dba.target = parse_hex<uint64_t>(aval);
-                    else if (aname == "flags")
-                        dba.flags = parse_balance_args_flags(aval);
-                    else if (aname == "limit")
-                        dba.limit = parse_hex<uint64_t>(aval);
-                    else if (aname == "limit_min")
-                        dba.s2.limit_min = parse_hex<uint32_t>(aval);
-                    else if (aname == "limit_max")
-                        dba.s2.limit_max = parse_hex<uint32_t>(aval);
-                    else if (aname == "stripes_min")
-                        dba.stripes_min = parse_hex<uint32_t>(aval);
-                    else if (aname == "stripes_max")
-                        dba.stripes_max = parse_hex<uint32_t>(aval);
-                    else
-                        throw formatted_error("unrecognized balance field '{}'", aname);
-                }
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "dirid")
+                rr.dirid = parse_hex<uint64_t>(fval);
+            else if (fname == "sequence")
+                rr.sequence = parse_hex<uint64_t>(fval);
+            else if (fname == "name_len")
+                rr.name_len = parse_hex<uint16_t>(fval);
+            else if (fname == "name") {
+                name = unescape_name(fval);
+                break;
             } else
-                throw formatted_error("unrecognized balance field '{}'", fname);
+                throw formatted_error("unrecognized root_ref field '{}'", fname);
         }
 
-        append(&bi, sizeof(bi));
-    } else if (type_word == "uuid_subvol" || type_word == "uuid_rec_subvol") {
-        btrfs::le64 val = parse_hex<uint64_t>(rest);
-        append(&val, sizeof(val));
-    } else if (type_word == "dev_replace") {
-        btrfs::dev_replace_item dri;
+        append(&rr, sizeof(rr));
+        append(name.data(), name.size());
+    } else if (word == item_word::extent_item || word == item_word::metadata_item) {
+        btrfs::extent_item ei;
 
-        memset(&dri, 0, sizeof(dri));
+        memset(&ei, 0, sizeof(ei));
 
+        // parse: refs=X generation=X flags=names [inline refs...]
+
+        // first parse the extent_item fields
         while (!rest.empty()) {
             auto [fname, fval] = next_field(rest);
             if (fname.empty())
                 break;
 
-            if (fname == "src_devid")
-                dri.src_devid = parse_hex<uint64_t>(fval);
-            else if (fname == "cursor_left")
-                dri.cursor_left = parse_hex<uint64_t>(fval);
-            else if (fname == "cursor_right")
-                dri.cursor_right = parse_hex<uint64_t>(fval);
-            else if (fname == "cont_reading_from_srcdev_mode") {
-                if (fval == "always")
-                    dri.cont_reading_from_srcdev_mode = 0;
-                else if (fval == "avoid")
-                    dri.cont_reading_from_srcdev_mode = 1;
-                else
-                    dri.cont_reading_from_srcdev_mode = parse_hex<uint64_t>(fval);
-            } else if (fname == "replace_state") {
-                if (fval == "never_started")
-                    dri.replace_state = 0;
-                else if (fval == "started")
-                    dri.replace_state = 1;
-                else if (fval == "finished")
-                    dri.replace_state = 2;
-                else if (fval == "cancelled")
-                    dri.replace_state = 3;
-                else if (fval == "suspended")
-                    dri.replace_state = 4;
+            if (fname == "refs")
+                ei.refs = parse_hex<uint64_t>(fval);
+            else if (fname == "generation")
+                ei.generation = parse_hex<uint64_t>(fval);
+            else if (fname == "flags") {
+                ei.flags = parse_extent_flags(fval);
+                break; // inline refs follow after flags
+            } else
+                throw formatted_error("unrecognized extent_item field '{}'", fname);
+        }
+
+        append(&ei, sizeof(ei));
+
+        while (!rest.empty() && rest.front() == ' ') {
+            rest.remove_prefix(1);
+        }
+
+        if (rest.starts_with("key=")) {
+            btrfs::tree_block_info tbi;
+
+            memset(&tbi, 0, sizeof(tbi));
+
+            while (!rest.empty()) {
+                auto saved = rest;
+
+                auto [fname, fval] = next_field(rest);
+                if (fname.empty())
+                    break;
+
+                if (fname == "key")
+                    tbi.key = parse_key(fval);
+                else if (fname == "level") {
+                    tbi.level = parse_hex<uint8_t>(fval);
+                    break;
+                } else {
+                    rest = saved;
+                    break;
+                }
+            }
+
+            append(&tbi, sizeof(tbi));
+        }
+
+        // now parse inline refs
+        while (!rest.empty()) {
+            while (!rest.empty() && rest.front() == ' ') {
+                rest.remove_prefix(1);
+            }
+
+            if (rest.empty())
+                break;
+
+            if (rest.starts_with("extra="))
+                break; // will be handled below
+
+            string_view ref_type;
+
+            if (auto sp = rest.find(' '); sp != string_view::npos) {
+                ref_type = rest.substr(0, sp);
+                rest = rest.substr(sp);
+            } else {
+                ref_type = rest;
+                rest = "";
+            }
+
+            if (ref_type == "tree_block_ref") {
+                btrfs::extent_inline_ref eir;
+
+                memset(&eir, 0, sizeof(eir));
+
+                eir.type = btrfs::key_type::TREE_BLOCK_REF;
+
+                auto [fname, fval] = next_field(rest);
+                if (fname == "root")
+                    eir.offset = parse_hex<uint64_t>(fval);
                 else
-                    dri.replace_state = parse_hex<uint64_t>(fval);
-            } else if (fname == "time_started")
+                    throw formatted_error("unrecognized tree_block_ref field '{}'", fname);
+
+                append(&eir, sizeof(eir));
+            } else if (ref_type == "shared_block_ref") {
+                btrfs::extent_inline_ref eir;
+
+                memset(&eir, 0, sizeof(eir));
+
+                eir.type = btrfs::key_type::SHARED_BLOCK_REF;
+
+                auto [fname, fval] = next_field(rest);
+                if (fname == "offset")
+                    eir.offset = parse_hex<uint64_t>(fval);
+                else
+                    throw formatted_error("unrecognized shared_block_ref field '{}'", fname);
+
+                append(&eir, sizeof(eir));
+            } else if (ref_type == "extent_data_ref") {
+                btrfs::extent_inline_ref eir;
+                btrfs::extent_data_ref edr;
+
+                memset(&eir, 0, sizeof(eir));
+                memset(&edr, 0, sizeof(edr));
+
+                eir.type = btrfs::key_type::EXTENT_DATA_REF;
+
+                while (!rest.empty()) {
+                    auto saved2 = rest;
+                    auto [fname, fval] = next_field(rest);
+                    if (fname.empty())
+                        break;
+
+                    if (fname == "root")
+                        edr.root = parse_hex<uint64_t>(fval);
+                    else if (fname == "objectid")
+                        edr.objectid = parse_hex<uint64_t>(fval);
+                    else if (fname == "offset")
+                        edr.offset = (uint64_t)parse_hex<int64_t>(fval);
+                    else if (fname == "count") {
+                        edr.count = parse_hex<uint32_t>(fval);
+                        break;
+                    } else {
+                        rest = saved2;
+                        break;
+                    }
+                }
+
+                // extent_inline_ref type then extent_data_ref packed as: type + edr overlapping offset
+                append(&eir.type, sizeof(eir.type));
+                append(&edr, sizeof(edr));
+            } else if (ref_type == "shared_data_ref") {
+                btrfs::extent_inline_ref eir;
+                btrfs::shared_data_ref sdr;
+
+                memset(&eir, 0, sizeof(eir));
+                memset(&sdr, 0, sizeof(sdr));
+
+                eir.type = btrfs::key_type::SHARED_DATA_REF;
+
+                while (!rest.empty()) {
+                    auto saved2 = rest;
+                    auto [fname, fval] = next_field(rest);
+                    if (fname.empty())
+                        break;
+
+                    if (fname == "offset")
+                        eir.offset = parse_hex<uint64_t>(fval);
+                    else if (fname == "count") {
+                        sdr.count = parse_hex<uint32_t>(fval);
+                        break;
+                    } else {
+                        rest = saved2;
+                        break;
+                    }
+                }
+
+                append(&eir, sizeof(eir));
+                append(&sdr, sizeof(sdr));
+            } else if (ref_type == "extent_owner_ref") {
+                btrfs::extent_inline_ref eir;
+
+                memset(&eir, 0, sizeof(eir));
+
+                eir.type = btrfs::key_type::EXTENT_OWNER_REF;
+
+                auto [fname, fval] = next_field(rest);
+                if (fname == "root")
+                    eir.offset = parse_hex<uint64_t>(fval);
+                else
+                    throw formatted_error("unrecognized extent_owner_ref field '{}'", fname);
+
+                append(&eir, sizeof(eir));
+            } else
+                throw formatted_error("unrecognized inline ref type '{}'", ref_type);
+        }
+    } else if (word == item_word::block_group_item) {
+        btrfs::block_group_item_v2 bgi;
+        bool has_v2 = false;
+
+        // parse: used=X chunk_objectid=X flags=names [remap_bytes=X identity_remap_count=X]
+
+        memset(&bgi, 0, sizeof(bgi));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "used")
+                bgi.used = parse_hex<uint64_t>(fval);
+            else if (fname == "chunk_objectid")
+                bgi.chunk_objectid = parse_hex<uint64_t>(fval);
+            else if (fname == "flags")
+                bgi.flags = parse_block_group_flags(fval);
+            else if (fname == "remap_bytes") {
+                bgi.remap_bytes = parse_hex<uint64_t>(fval);
+                has_v2 = true;
+            } else if (fname == "identity_remap_count") {
+                bgi.identity_remap_count = parse_hex<uint32_t>(fval);
+                has_v2 = true;
+            } else
+                throw formatted_error("unrecognized block_group_item field '{}'", fname);
+        }
+
+        if (has_v2)
+            append(&bgi, sizeof(bgi));
+        else
+            append(&bgi, sizeof(btrfs::block_group_item));
+    } else if (word == item_word::free_space_info) {
+        btrfs::free_space_info fsi;
+
+        memset(&fsi, 0, sizeof(fsi));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "extent_count")
+                fsi.extent_count = parse_hex<uint32_t>(fval);
+            else if (fname == "flags")
+                fsi.flags = parse_free_space_info_flags(fval);
+            else
+                throw formatted_error("unrecognized free_space_info field '{}'", fname);
+        }
+
+        append(&fsi, sizeof(fsi));
+    } else if (word == item_word::free_space_extent) {
+        // zero-length
+    } else if (word == item_word::free_space_bitmap) {
+        auto bitmap_size = key.offset / (sb.sectorsize * 8);
+
+        // dump format is "addr, len; addr, len; ..." where addr and len are hex
+        // each bit in the 256-byte bitmap represents one sector
+
+        data.resize(bitmap_size);
+
+        while (!rest.empty()) {
+            while (!rest.empty() && (rest.front() == ' ' || rest.front() == ';')) {
+                rest.remove_prefix(1);
+            }
+
+            if (rest.empty())
+                break;
+
+            // parse addr
+
+            string_view addr_sv;
+
+            if (auto comma = rest.find(','); comma != string_view::npos) {
+                addr_sv = rest.substr(0, comma);
+                rest.remove_prefix(comma + 1);
+            } else
+                break;
+
+            while (!addr_sv.empty() && addr_sv.back() == ' ') {
+                addr_sv.remove_suffix(1);
+            }
+
+            auto addr = parse_hex<uint64_t>(addr_sv);
+
+            while (!rest.empty() && rest.front() == ' ') {
+                rest.remove_prefix(1);
+            }
+
+            // parse len
+
+            string_view len_sv;
+
+            if (auto sc = rest.find(';'); sc != string_view::npos) {
+                len_sv = rest.substr(0, sc);
+                rest = rest.substr(sc);
+            } else {
+                len_sv = rest;
+                rest = "";
+            }
+
+            while (!len_sv.empty() && len_sv.back() == ' ') {
+                len_sv.remove_suffix(1);
+            }
+
+            auto len = parse_hex<uint64_t>(len_sv);
+
+            // set bits in bitmap
+
+            if (sb.sectorsize > 0) {
+                auto bit_start = (addr - key.objectid) / sb.sectorsize;
+                auto bit_count = len / sb.sectorsize;
+
+                for (uint64_t b = bit_start; b < bit_start + bit_count && b / 8 < data.size(); b++) {
+                    data[b / 8] |= (1 << (b % 8));
+                }
+            }
+        }
+    } else if (word == item_word::dev_extent) {
+        btrfs::dev_extent de;
+
+        memset(&de, 0, sizeof(de));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "chunk_tree")
+                de.chunk_tree = parse_hex<uint64_t>(fval);
+            else if (fname == "chunk_objectid")
+                de.chunk_objectid = parse_hex<uint64_t>(fval);
+            else if (fname == "chunk_offset")
+                de.chunk_offset = parse_hex<uint64_t>(fval);
+            else if (fname == "length")
+                de.length = parse_hex<uint64_t>(fval);
+            else if (fname == "chunk_tree_uuid")
+                de.chunk_tree_uuid = parse_uuid(fval);
+            else
+                throw formatted_error("unrecognized dev_extent field '{}'", fname);
+        }
+
+        append(&de, sizeof(de));
+    } else if (word == item_word::dev_item) {
+        btrfs::dev_item d;
+
+        memset(&d, 0, sizeof(d));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "devid")
+                d.devid = parse_hex<uint64_t>(fval);
+            else if (fname == "total_bytes")
+                d.total_bytes = parse_hex<uint64_t>(fval);
+            else if (fname == "bytes_used")
+                d.bytes_used = parse_hex<uint64_t>(fval);
+            else if (fname == "io_align")
+                d.io_align = parse_hex<uint32_t>(fval);
+            else if (fname == "io_width")
+                d.io_width = parse_hex<uint32_t>(fval);
+            else if (fname == "sector_size")
+                d.sector_size = parse_hex<uint32_t>(fval);
+            else if (fname == "type")
+                d.type = parse_hex<uint64_t>(fval);
+            else if (fname == "generation")
+                d.generation = parse_hex<uint64_t>(fval);
+            else if (fname == "start_offset")
+                d.start_offset = parse_hex<uint64_t>(fval);
+            else if (fname == "dev_group")
+                d.dev_group = parse_hex<uint32_t>(fval);
+            else if (fname == "seek_speed")
+                d.seek_speed = parse_hex<uint8_t>(fval);
+            else if (fname == "bandwidth")
+                d.bandwidth = parse_hex<uint8_t>(fval);
+            else if (fname == "uuid")
+                d.uuid = parse_uuid(fval);
+            else if (fname == "fsid")
+                d.fsid = parse_uuid(fval);
+            else
+                throw formatted_error("unrecognized dev_item field '{}'", fname);
+        }
+
+        append(&d, sizeof(d));
+    } else if (word == item_word::chunk_item) {
+        struct {
+            btrfs::chunk c;
+            btrfs::stripe extra_stripes[MAX_STRIPES - 1];
+        } __attribute__((packed)) chunk_buf;
+
+        memset(&chunk_buf, 0, sizeof(chunk_buf));
+
+        auto& c = chunk_buf.c;
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "length")
+                c.length = parse_hex<uint64_t>(fval);
+            else if (fname == "owner")
+                c.owner = parse_hex<uint64_t>(fval);
+            else if (fname == "stripe_len")
+                c.stripe_len = parse_hex<uint64_t>(fval);
+            else if (fname == "type")
+                c.type = parse_block_group_flags(fval);
+            else if (fname == "io_align")
+                c.io_align = parse_hex<uint32_t>(fval);
+            else if (fname == "io_width")
+                c.io_width = parse_hex<uint32_t>(fval);
+            else if (fname == "sector_size")
+                c.sector_size = parse_hex<uint32_t>(fval);
+            else if (fname == "num_stripes")
+                c.num_stripes = parse_hex<uint16_t>(fval);
+            else if (fname == "sub_stripes")
+                c.sub_stripes = parse_hex<uint16_t>(fval);
+            else if (fname.starts_with("stripe(")) {
+                // stripe(N) devid=X offset=X dev_uuid=U
+
+                auto open = fname.find('(');
+                auto close = fname.find(')');
+
+                if (open == string_view::npos || close == string_view::npos || close < open)
+                    throw formatted_error("could not parse {}", rest);
+
+                auto stripe_idx = parse_hex<uint16_t>(fname.substr(open + 1, close - open - 1));
+
+                auto& s = c.stripe[stripe_idx];
+
+                // fname is "stripe(N)", skip it and parse devid/offset/dev_uuid
+                while (!rest.empty()) {
+                    auto saved2 = rest;
+
+                    auto [fname2, fval2] = next_field(rest);
+                    if (fname2.empty())
+                        break;
+
+                    if (fname2 == "devid")
+                        s.devid = parse_hex<uint64_t>(fval2);
+                    else if (fname2 == "offset")
+                        s.offset = parse_hex<uint64_t>(fval2);
+                    else if (fname2 == "dev_uuid") {
+                        s.dev_uuid = parse_uuid(fval2);
+                        break;
+                    } else {
+                        rest = saved2;
+                        break;
+                    }
+                }
+            } else
+                throw formatted_error("unrecognized chunk_item field '{}'", fname);
+        }
+
+        size_t total = offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe));
+
+        append(&chunk_buf, total);
+    } else if (word == item_word::orphan_item) {
+        // zero-length
+    } else if (word == item_word::qgroup_status) {
+        btrfs::qgroup_status_item qsi;
+
+        memset(&qsi, 0, sizeof(qsi));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "version")
+                qsi.version = parse_hex<uint64_t>(fval);
+            else if (fname == "generation")
+                qsi.generation = parse_hex<uint64_t>(fval);
+            else if (fname == "flags")
+                qsi.flags = parse_qgroup_status_flags(fval);
+            else if (fname == "rescan")
+                qsi.rescan = parse_hex<uint64_t>(fval);
+            else if (fname == "enable_gen")
+                qsi.enable_gen = parse_hex<uint64_t>(fval);
+            else
+                throw formatted_error("unrecognized qgroup_status field '{}'", fname);
+        }
+
+        append(&qsi, sizeof(qsi));
+    } else if (word == item_word::qgroup_info) {
+        btrfs::qgroup_info_item qi;
+
+        memset(&qi, 0, sizeof(qi));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "generation")
+                qi.generation = parse_hex<uint64_t>(fval);
+            else if (fname == "rfer")
+                qi.rfer = parse_hex<uint64_t>(fval);
+            else if (fname == "rfer_cmpr")
+                qi.rfer_cmpr = parse_hex<uint64_t>(fval);
+            else if (fname == "excl")
+                qi.excl = parse_hex<uint64_t>(fval);
+            else if (fname == "excl_cmpr")
+                qi.excl_cmpr = parse_hex<uint64_t>(fval);
+            else
+                throw formatted_error("unrecognized qgroup_info field '{}'", fname);
+        }
+
+        append(&qi, sizeof(qi));
+    } else if (word == item_word::qgroup_limit) {
+        btrfs::qgroup_limit_item qli;
+
+        memset(&qli, 0, sizeof(qli));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "flags")
+                qli.flags = parse_qgroup_limit_flags(fval);
+            else if (fname == "max_rfer")
+                qli.max_rfer = parse_hex<uint64_t>(fval);
+            else if (fname == "max_excl")
+                qli.max_excl = parse_hex<uint64_t>(fval);
+            else if (fname == "rsv_rfer")
+                qli.rsv_rfer = parse_hex<uint64_t>(fval);
+            else if (fname == "rsv_excl")
+                qli.rsv_excl = parse_hex<uint64_t>(fval);
+            else
+                throw formatted_error("unrecognized qgroup_limit field '{}'", fname);
+        }
+
+        append(&qli, sizeof(qli));
+    } else if (word == item_word::qgroup_relation) {
+        // zero-length
+    } else if (word == item_word::dev_stats) {
+        // space-separated hex values as le64
+        while (!rest.empty()) {
+            while (!rest.empty() && rest.front() == ' ') {
+                rest.remove_prefix(1);
+            }
+
+            if (rest.empty())
+                break;
+
+            string_view token;
+
+            if (auto sp = rest.find(' '); sp != string_view::npos) {
+                token = rest.substr(0, sp);
+                rest = rest.substr(sp);
+            } else {
+                token = rest;
+                rest = "";
+            }
+
+            if (token.empty())
+                continue;
+
+            btrfs::le64 val = parse_hex<uint64_t>(token);
+            append(&val, sizeof(val));
+        }
+    } else if (word == item_word::free_space) {
+        btrfs::free_space_header fsh;
+
+        memset(&fsh, 0, sizeof(fsh));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "location")
+                fsh.location = parse_key(fval);
+            else if (fname == "generation")
+                fsh.generation = parse_hex<uint64_t>(fval);
+            else if (fname == "num_entries")
+                fsh.num_entries = parse_hex<uint64_t>(fval);
+            else if (fname == "num_bitmaps")
+                fsh.num_bitmaps = parse_hex<uint64_t>(fval);
+            else
+                throw formatted_error("unrecognized free_space field '{}'", fname);
+        }
+
+        append(&fsh, sizeof(fsh));
+    } else if (word == item_word::balance) {
+        btrfs::balance_item bi;
+
+        // balance flags=X data=(args) meta=(args) sys=(args)
+
+        memset(&bi, 0, sizeof(bi));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "flags")
+                bi.flags = parse_balance_flags(fval);
+            else if (fname == "data" || fname == "meta" || fname == "sys") {
+                // parse disk_balance_args from values in brackets
+                auto& dba = fname == "data" ? bi.data : (fname == "meta" ? bi.meta : bi.sys);
+
+                memset(&dba, 0, sizeof(dba));
+
+                auto args = fval;
+                while (!args.empty()) {
+                    auto [aname, aval] = next_field(args);
+                    if (aname.empty())
+                        break;
+
+                    if (aname == "profiles")
+                        dba.profiles = parse_hex<uint64_t>(aval);
+                    else if (aname == "usage")
+                        dba.usage = parse_hex<uint64_t>(aval);
+                    else if (aname == "usage_min")
+                        dba.s1.usage_min = parse_hex<uint32_t>(aval);
+                    else if (aname == "usage_max")
+                        dba.s1.usage_max = parse_hex<uint32_t>(aval);
+                    else if (aname == "devid")
+                        dba.devid = parse_hex<uint64_t>(aval);
+                    else if (aname == "pstart")
+                        dba.pstart = parse_hex<uint64_t>(aval);
+                    else if (aname == "pend")
+                        dba.pend = parse_hex<uint64_t>(aval);
+                    else if (aname == "vstart")
+                        dba.vstart = parse_hex<uint64_t>(aval);
+                    else if (aname == "vend")
+                        dba.vend = parse_hex<uint64_t>(aval);
+                    else if (aname == "target")
+                        dba.target = parse_hex<uint64_t>(aval);
+                    else if (aname == "flags")
+                        dba.flags = parse_balance_args_flags(aval);
+                    else if (aname == "limit")
+                        dba.limit = parse_hex<uint64_t>(aval);
+                    else if (aname == "limit_min")
+                        dba.s2.limit_min = parse_hex<uint32_t>(aval);
+                    else if (aname == "limit_max")
+                        dba.s2.limit_max = parse_hex<uint32_t>(aval);
+                    else if (aname == "stripes_min")
+                        dba.stripes_min = parse_hex<uint32_t>(aval);
+                    else if (aname == "stripes_max")
+                        dba.stripes_max = parse_hex<uint32_t>(aval);
+                    else
+                        throw formatted_error("unrecognized balance field '{}'", aname);
+                }
+            } else
+                throw formatted_error("unrecognized balance field '{}'", fname);
+        }
+
+        append(&bi, sizeof(bi));
+    } else if (word == item_word::uuid_subvol || word == item_word::uuid_rec_subvol) {
+        btrfs::le64 val = parse_hex<uint64_t>(rest);
+        append(&val, sizeof(val));
+    } else if (word == item_word::dev_replace) {
+        btrfs::dev_replace_item dri;
+
+        memset(&dri, 0, sizeof(dri));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "src_devid")
+                dri.src_devid = parse_hex<uint64_t>(fval);
+            else if (fname == "cursor_left")
+                dri.cursor_left = parse_hex<uint64_t>(fval);
+            else if (fname == "cursor_right")
+                dri.cursor_right = parse_hex<uint64_t>(fval);
+            else if (fname == "cont_reading_from_srcdev_mode") {
+                if (fval == "always")
+                    dri.cont_reading_from_srcdev_mode = 0;
+                else if (fval == "avoid")
+                    dri.cont_reading_from_srcdev_mode = 1;
+                else
+                    dri.cont_reading_from_srcdev_mode = parse_hex<uint64_t>(fval);
+            } else if (fname == "replace_state") {
+                if (fval == "never_started")
+                    dri.replace_state = 0;
+                else if (fval == "started")
+                    dri.replace_state = 1;
+                else if (fval == "finished")
+                    dri.replace_state = 2;
+                else if (fval == "cancelled")
+                    dri.replace_state = 3;
+                else if (fval == "suspended")
+                    dri.replace_state = 4;
+                else
+                    dri.replace_state = parse_hex<uint64_t>(fval);
+            } else if (fname == "time_started")
                 dri.time_started = parse_timestamp(fval).sec;
             else if (fname == "time_stopped")
                 dri.time_stopped = parse_timestamp(fval).sec;
@@ -2108,397 +3030,1203 @@ static vector<uint8_t> parse_item_data(string_view type_line, const btrfs::key&
             else if (fname == "num_uncorrectable_read_errors")
                 dri.num_uncorrectable_read_errors = parse_hex<uint64_t>(fval);
             else
-                throw formatted_error("unrecognized dev_replace field '{}'", fname);
+                throw formatted_error("unrecognized dev_replace field '{}'", fname);
+        }
+
+        append(&dri, sizeof(dri));
+    } else if (word == item_word::raid_stripe) {
+        // multiple entries separated by semicolons:
+        // devid=X physical=X; devid=X physical=X
+
+        while (!rest.empty()) {
+            btrfs::raid_stride rs;
+
+            memset(&rs, 0, sizeof(rs));
+
+            while (!rest.empty() && (rest.front() == ' ' || rest.front() == ';')) {
+                rest.remove_prefix(1);
+            }
+
+            if (rest.empty())
+                break;
+
+            while (!rest.empty()) {
+                if (rest.front() == ';')
+                    break;
+
+                auto [fname, fval] = next_field(rest);
+                if (fname.empty())
+                    break;
+
+                if (fname == "devid")
+                    rs.devid = parse_hex<uint64_t>(fval);
+                else if (fname == "physical") {
+                    rs.physical = parse_hex<uint64_t>(fval);
+                    break;
+                } else
+                    throw formatted_error("unrecognized raid_stripe field '{}'", fname);
+            }
+
+            append(&rs, sizeof(rs));
+        }
+    } else if (word == item_word::identity_remap) {
+        // zero-length
+    } else if (word == item_word::remap || word == item_word::remap_backref) {
+        btrfs::remap_item r;
+
+        memset(&r, 0, sizeof(r));
+
+        while (!rest.empty() && rest.front() == ' ') {
+            rest.remove_prefix(1);
+        }
+
+        if (!rest.empty()) {
+            string_view token;
+
+            if (auto sp = rest.find(' '); sp != string_view::npos) {
+                token = rest.substr(0, sp);
+                rest = rest.substr(sp);
+            } else {
+                token = rest;
+                rest = "";
+            }
+
+            r.address = parse_hex<uint64_t>(token);
+        }
+
+        append(&r, sizeof(r));
+    } else if (word == item_word::dir_log_index) {
+        btrfs::dir_log_item dli;
+
+        memset(&dli, 0, sizeof(dli));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "end")
+                dli.end = parse_hex<uint64_t>(fval);
+            else
+                throw formatted_error("unrecognized dir_log_index field '{}'", fname);
+        }
+
+        append(&dli, sizeof(dli));
+    } else if (word == item_word::extent_data_ref) {
+        btrfs::extent_data_ref edr;
+
+        memset(&edr, 0, sizeof(edr));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "root")
+                edr.root = parse_hex<uint64_t>(fval);
+            else if (fname == "objectid")
+                edr.objectid = parse_hex<uint64_t>(fval);
+            else if (fname == "offset")
+                edr.offset = (uint64_t)parse_hex<int64_t>(fval);
+            else if (fname == "count")
+                edr.count = parse_hex<uint32_t>(fval);
+            else
+                throw formatted_error("unrecognized extent_data_ref field '{}'", fname);
+        }
+
+        append(&edr, sizeof(edr));
+    } else if (word == item_word::shared_data_ref) {
+        btrfs::shared_data_ref sdr;
+
+        memset(&sdr, 0, sizeof(sdr));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "count")
+                sdr.count = parse_hex<uint32_t>(fval);
+            else
+                throw formatted_error("unrecognized shared_data_ref field '{}'", fname);
+        }
+
+        append(&sdr, sizeof(sdr));
+    } else if (word == item_word::tree_block_ref || word == item_word::shared_block_ref) {
+        // zero-length
+    } else if (word == item_word::string_item) {
+        // raw string data
+        data.assign(rest.data(), rest.size());
+        rest = "";
+    } else if (word == item_word::verity_desc_item) {
+        btrfs::verity_descriptor_item vdi;
+
+        memset(&vdi, 0, sizeof(vdi));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "size")
+                vdi.size = parse_hex<uint64_t>(fval);
+            else if (fname == "encryption")
+                vdi.encryption = parse_hex<uint8_t>(fval);
+            else
+                throw formatted_error("unrecognized verity_desc_item field '{}'", fname);
+        }
+
+        append(&vdi, sizeof(vdi));
+    } else if (word == item_word::fsverity_descriptor) {
+        btrfs::fsverity_descriptor desc;
+
+        memset(&desc, 0, sizeof(desc));
+
+        while (!rest.empty()) {
+            auto saved = rest;
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "version")
+                desc.version = parse_hex<uint8_t>(fval);
+            else if (fname == "hash_algorithm") {
+                if (fval == "sha256")
+                    desc.hash_algorithm = btrfs::fsverity_hash_algorithm::SHA256;
+                else if (fval == "sha512")
+                    desc.hash_algorithm = btrfs::fsverity_hash_algorithm::SHA512;
+                else
+                    desc.hash_algorithm = (btrfs::fsverity_hash_algorithm)parse_hex<uint8_t>(fval);
+            } else if (fname == "log_blocksize")
+                desc.log_blocksize = parse_hex<uint8_t>(fval);
+            else if (fname == "salt_size")
+                desc.salt_size = parse_hex<uint8_t>(fval);
+            else if (fname == "data_size")
+                desc.data_size = parse_hex<uint64_t>(fval);
+            else if (fname == "root_hash") {
+                // formatted as concatenated {:016x} le64 values
+
+                auto* dest = (btrfs::le64*)desc.root_hash;
+                for (size_t i = 0; (i * 16) + 16 <= fval.size() && i < sizeof(desc.root_hash) / 8; i++) {
+                    dest[i] = parse_hex<uint64_t>(fval.substr(i * 16, 16));
+                }
+            } else if (fname == "salt") {
+                auto bytes = hex::decode(fval);
+                memcpy(desc.salt, bytes.data(), min(bytes.size(), sizeof(desc.salt)));
+            } else if (fname == "sig") {
+                // sig is base64-encoded, but handled below after append
+                rest = saved;
+                break;
+            } else
+                throw formatted_error("unrecognized fsverity_descriptor field '{}'", fname);
+        }
+
+        append(&desc, sizeof(desc));
+
+        // handle sig= (base64-encoded signature appended after the descriptor)
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "sig") {
+                auto decoded = b64decode(fval);
+                append(decoded.data(), decoded.size());
+            }
+        }
+    } else if (word == item_word::verity_merkle_item) {
+        // space-separated groups of hex bytes (32 bytes per group)
+        while (!rest.empty()) {
+            while (!rest.empty() && rest.front() == ' ') {
+                rest.remove_prefix(1);
+            }
+
+            if (rest.empty())
+                break;
+
+            string_view token;
+
+            if (auto sp = rest.find(' '); sp != string_view::npos) {
+                token = rest.substr(0, sp);
+                rest = rest.substr(sp);
+            } else {
+                token = rest;
+                rest = "";
+            }
+
+            if (token.empty())
+                continue;
+
+            append_hex(token);
+        }
+    } else if (word == item_word::unknown) {
+        // unknown (size=X) - zero-fill with the given size
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+        }
+    } else
+        throw formatted_error("unknown item type '{}'", type_word);
+
+    // handle extra= at end of type_line
+
+    static const string_view extra = " extra=";
+
+    if (auto extra_pos = type_line.find(extra); extra_pos != string_view::npos) {
+        auto hex_str = type_line.substr(extra_pos + extra.size());
+
+        // Remove any trailing whitespace
+
+        while (!hex_str.empty() && (hex_str.back() == ' ' || hex_str.back() == '\n' || hex_str.back() == '\r')) {
+            hex_str.remove_suffix(1);
+        }
+
+        append_hex(hex_str);
+    }
+}
+
+// A leaf laid out by tree_builder is moved out of node, rather than copied.
+static vector<uint8_t> pack_node(node_state&& node, const btrfs::super_block& sb) {
+    vector<uint8_t> buf;
+    bool prebuilt = !node.packed.empty();
+
+    if (prebuilt)
+        buf = move(node.packed);
+    else
+        buf.resize(sb.nodesize);
+
+    auto& h = *(btrfs::header*)buf.data();
+
+    h.bytenr = node.bytenr;
+    h.generation = node.generation;
+    h.owner = node.owner;
+    h.flags = node.flags;
+    h.level = node.level;
+
+    if (node.has_fsid)
+        h.fsid = node.fsid;
+    else
+        h.fsid = sb.fsid;
+
+    if (node.has_chunk_tree_uuid)
+        h.chunk_tree_uuid = node.chunk_tree_uuid;
+
+    if (node.level > 0) {
+        h.nritems = node.key_ptrs.size();
+
+        auto ptrs = (btrfs::key_ptr*)(buf.data() + sizeof(btrfs::header));
+        for (size_t i = 0; i < h.nritems; i++) {
+            ptrs[i] = node.key_ptrs[i];
+        }
+    } else if (!prebuilt) {
+        auto nritems = node.item_lines.size();
+        size_t items_end = sizeof(btrfs::header) + (nritems * sizeof(btrfs::item));
+
+        if (items_end > sb.nodesize) {
+            throw formatted_error("node at bytenr {:x} overflows: {} items + {} byte header > {} nodesize",
+                                  node.bytenr, nritems, sizeof(btrfs::header), sb.nodesize);
+        }
+
+        h.nritems = nritems;
+
+        // Items are parsed last to first straight into the free space after
+        // the item array. This leaves their data in the same order as on
+        // disk, with the first item at the end, so a single memmove puts
+        // it all in place.
+
+        auto items = (btrfs::item*)(buf.data() + sizeof(btrfs::header));
+        size_t data_end = items_end;
+        trace::span sp("parse");
+
+        sp.hex_arg("bytenr", node.bytenr);
+        sp.arg("items", nritems);
+
+        for (size_t i = nritems; i-- > 0; ) {
+            const auto& [key, line] = node.item_lines[i];
+            item_buffer data(span(buf).subspan(data_end), node.bytenr);
+
+            parse_item_data(line, key, sb, data);
+
+            items[i].key = key;
+            items[i].offset = data_end;
+            items[i].size = data.size();
+
+            data_end += data.size();
+        }
+
+        auto shift = sb.nodesize - data_end;
+
+        memmove(buf.data() + items_end + shift, buf.data() + items_end, data_end - items_end);
+        memset(buf.data() + items_end, 0, min(shift, data_end - items_end));
+
+        for (size_t i = 0; i < nritems; i++) {
+            items[i].offset = items[i].offset + shift - sizeof(btrfs::header);
+        }
+    }
+
+    {
+        trace::span sp("checksum");
+
+        compute_csum(sb.csum_type, {buf.data() + h.csum.size(), sb.nodesize - h.csum.size()}, h.csum);
+    }
+
+    return buf;
+}
+
+struct tree_root {
+    uint64_t bytenr;
+    uint8_t level;
+    uint64_t generation;
+};
+
+// Lays out a tree given as a sorted stream of items. Leaves are filled up to
+// nodesize and the internal levels built over them as they fill, so only the
+// open node at each level is ever held, however big the tree is.
+class tree_builder {
+public:
+    tree_builder(uint64_t tree_id, uint64_t generation, const btrfs::uuid& chunk_tree_uuid,
+                 const btrfs::super_block& sb, node_allocator& alloc,
+                 function<void(node_state&)> submit)
+        : tree_id(tree_id), generation(generation), chunk_tree_uuid(chunk_tree_uuid), sb(sb),
+          alloc(alloc), submit(std::move(submit)) {
+        if (sb.nodesize <= sizeof(btrfs::header) + sizeof(btrfs::item))
+            throw formatted_error("invalid nodesize {:x}", sb.nodesize);
+
+        scratch.resize(sb.nodesize - sizeof(btrfs::header) - sizeof(btrfs::item));
+    }
+
+    void add_item(const btrfs::key& key, string_view line) {
+        item_buffer data(scratch, 0);
+
+        parse_item_data(line, key, sb, data);
+
+        auto item = span(scratch).subspan(0, data.size());
+
+        if (key.type == btrfs::key_type::CHUNK_ITEM && item.size() >= offsetof(btrfs::chunk, stripe))
+            alloc.add_chunk(make_chunk_entry(key.offset, *(const btrfs::chunk*)item.data()));
+
+        // point the ROOT_ITEMs at the trees we've laid out
+        if (roots && key.type == btrfs::key_type::ROOT_ITEM && item.size() >= offsetof(btrfs::root_item, generation_v2)) {
+            if (auto it = roots->find(key.objectid); it != roots->end()) {
+                auto& ri = *(btrfs::root_item*)item.data();
+
+                ri.bytenr = it->second.bytenr;
+                ri.level = it->second.level;
+                ri.generation = it->second.generation;
+
+                // otherwise the kernel takes the item to be from before
+                // generation_v2, and ignores the fields after it
+                if (item.size() >= sizeof(btrfs::root_item))
+                    ri.generation_v2 = it->second.generation;
+            }
+        }
+
+        add_item(key, item);
+    }
+
+    // Adds a ROOT_ITEM for a tree we've laid out, like the ones mkfs creates.
+    void add_root_item(uint64_t id, const tree_root& root) {
+        btrfs::root_item ri;
+        btrfs::key key;
+
+        key.objectid = id;
+        key.type = btrfs::key_type::ROOT_ITEM;
+        key.offset = 0;
+
+        memset(&ri, 0, sizeof(ri));
+
+        ri.inode.generation = 1;
+        ri.inode.size = 3;
+        ri.inode.nbytes = sb.nodesize;
+        ri.inode.nlink = 1;
+        ri.inode.mode = 040755;
+        ri.generation = root.generation;
+        ri.bytenr = root.bytenr;
+        ri.level = root.level;
+        ri.refs = 1;
+        ri.generation_v2 = root.generation;
+
+        if (id == btrfs::FS_TREE_OBJECTID || (id >= 0x100 && id <= (uint64_t)-256))
+            ri.root_dirid = 0x100;
+
+        add_item(key, span((const uint8_t*)&ri, sizeof(ri)));
+    }
+
+    // Only used for the root tree: the trees whose ROOT_ITEMs are to be
+    // filled in.
+    void set_roots(const map<uint64_t, tree_root>& r) {
+        roots = &r;
+    }
+
+    uint64_t id() const {
+        return tree_id;
+    }
+
+    tree_root finish() {
+        if (leaf.empty())
+            open_leaf();
+
+        for (unsigned int level = 0; ; level++) {
+            bool top = level >= internal.size();
+
+            if (level == 0)
+                close_leaf(!top);
+            else
+                close_internal(level, !top);
+
+            if (top)
+                return {root_bytenr, (uint8_t)level, generation};
+        }
+    }
+
+private:
+    void add_item(const btrfs::key& key, span<const uint8_t> item) {
+        if (last_key && key <= *last_key) {
+            throw formatted_error("items for tree {:x} not in order at ({:x},{:x},{:x})", tree_id,
+                                  key.objectid, (uint8_t)key.type, key.offset);
+        }
+
+        last_key = key;
+
+        auto max_data = sb.nodesize - sizeof(btrfs::header) - sizeof(btrfs::item);
+
+        if (item.size() > max_data)
+            throw formatted_error("item ({:x},{:x},{:x}) too large for a leaf", key.objectid,
+                                  (uint8_t)key.type, key.offset);
+
+        if (!leaf.empty() && sizeof(btrfs::header) + ((nritems + 1) * sizeof(btrfs::item)) + data_len + item.size() > sb.nodesize)
+            close_leaf(true);
+
+        if (leaf.empty())
+            open_leaf();
+
+        // item data goes at the end of the node, first item last
+
+        data_len += item.size();
+
+        auto& it = ((btrfs::item*)(leaf.data() + sizeof(btrfs::header)))[nritems];
+
+        it.key = key;
+        it.offset = sb.nodesize - data_len - sizeof(btrfs::header);
+        it.size = item.size();
+
+        memcpy(leaf.data() + sb.nodesize - data_len, item.data(), item.size());
+
+        nritems++;
+    }
+
+    node_state new_node(uint8_t level) {
+        node_state node;
+
+        node.bytenr = alloc.alloc(tree_id == btrfs::CHUNK_TREE_OBJECTID, sb.nodesize);
+        node.level = level;
+        node.generation = generation;
+        node.owner = tree_id;
+        node.flags = btrfs::HEADER_FLAG_WRITTEN | btrfs::HEADER_FLAG_MIXED_BACKREF;
+        node.chunk_tree_uuid = chunk_tree_uuid;
+        node.has_chunk_tree_uuid = true;
+
+        return node;
+    }
+
+    void open_leaf() {
+        leaf_node = new_node(0);
+        leaf.assign(sb.nodesize, 0);
+        nritems = 0;
+        data_len = 0;
+    }
+
+    void close_leaf(bool add_ptr) {
+        auto& h = *(btrfs::header*)leaf.data();
+        auto first = ((const btrfs::item*)(leaf.data() + sizeof(btrfs::header)))[0].key;
+
+        h.nritems = nritems;
+
+        leaf_node.packed = std::move(leaf);
+        leaf.clear();
+
+        finish_node(leaf_node, 0, first, add_ptr);
+    }
+
+    void close_internal(unsigned int level, bool add_ptr) {
+        auto& node = internal[level - 1];
+        auto first = node.key_ptrs.front().key;
+
+        finish_node(node, level, first, add_ptr);
+    }
+
+    void finish_node(node_state& node, unsigned int level, const btrfs::key& first, bool add_ptr) {
+        btrfs::key_ptr kp;
+
+        memset(&kp, 0, sizeof(kp));
+        kp.key = first;
+        kp.blockptr = node.bytenr;
+        kp.generation = node.generation;
+
+        root_bytenr = node.bytenr;
+
+        submit(node);
+
+        if (add_ptr)
+            add_key_ptr(level + 1, kp);
+    }
+
+    void add_key_ptr(unsigned int level, const btrfs::key_ptr& kp) {
+        auto max_ptrs = (sb.nodesize - sizeof(btrfs::header)) / sizeof(btrfs::key_ptr);
+
+        if (internal.size() < level) {
+            internal.emplace_back(new_node((uint8_t)level));
+        } else if (internal[level - 1].key_ptrs.size() >= max_ptrs) {
+            close_internal(level, true);
+            internal[level - 1] = new_node((uint8_t)level);
+        }
+
+        internal[level - 1].key_ptrs.push_back(kp);
+    }
+
+    uint64_t tree_id;
+    uint64_t generation;
+    btrfs::uuid chunk_tree_uuid;
+    const btrfs::super_block& sb;
+    node_allocator& alloc;
+    function<void(node_state&)> submit;
+    const map<uint64_t, tree_root>* roots = nullptr;
+    vector<uint8_t> scratch;
+    optional<btrfs::key> last_key;
+    node_state leaf_node;
+    vector<uint8_t> leaf;
+    uint32_t nritems = 0;
+    size_t data_len = 0;
+    vector<node_state> internal; // levels 1 and up
+    uint64_t root_bytenr = 0;
+};
+
+static void parse_superblock_fields(string_view line, btrfs::super_block& sb) {
+    while (!line.empty()) {
+        auto [name, val] = next_field(line);
+
+        if (name.empty())
+            break;
+        else if (name == "csum") {
+            // ignored, computed automatically
+        } else if (name == "fsid")
+            sb.fsid = parse_uuid(val);
+        else if (name == "bytenr")
+            sb.bytenr = parse_hex<uint64_t>(val);
+        else if (name == "flags")
+            sb.flags = parse_super_flags(val);
+        else if (name == "magic")
+            memcpy(&sb.magic, val.data(), min(val.size(), sizeof(uint64_t)));
+        else if (name == "generation")
+            sb.generation = parse_hex<uint64_t>(val);
+        else if (name == "root")
+            sb.root = parse_hex<uint64_t>(val);
+        else if (name == "chunk_root")
+            sb.chunk_root = parse_hex<uint64_t>(val);
+        else if (name == "log_root")
+            sb.log_root = parse_hex<uint64_t>(val);
+        else if (name == "log_root_transid")
+            sb.__unused_log_root_transid = parse_hex<uint64_t>(val);
+        else if (name == "total_bytes")
+            sb.total_bytes = parse_hex<uint64_t>(val);
+        else if (name == "bytes_used")
+            sb.bytes_used = parse_hex<uint64_t>(val);
+        else if (name == "root_dir_objectid")
+            sb.root_dir_objectid = parse_hex<uint64_t>(val);
+        else if (name == "num_devices")
+            sb.num_devices = parse_hex<uint64_t>(val);
+        else if (name == "sectorsize")
+            sb.sectorsize = parse_hex<uint32_t>(val);
+        else if (name == "nodesize")
+            sb.nodesize = parse_hex<uint32_t>(val);
+        else if (name == "leafsize")
+            sb.__unused_leafsize = parse_hex<uint32_t>(val);
+        else if (name == "stripesize")
+            sb.stripesize = parse_hex<uint32_t>(val);
+        else if (name == "sys_chunk_array_size")
+            sb.sys_chunk_array_size = parse_hex<uint32_t>(val);
+        else if (name == "chunk_root_generation")
+            sb.chunk_root_generation = parse_hex<uint64_t>(val);
+        else if (name == "compat_flags")
+            sb.compat_flags = parse_hex<uint64_t>(val);
+        else if (name == "compat_ro_flags")
+            sb.compat_ro_flags = parse_compat_ro_flags(val);
+        else if (name == "incompat_flags")
+            sb.incompat_flags = parse_incompat_flags(val);
+        else if (name == "csum_type")
+            sb.csum_type = parse_csum_type(val);
+        else if (name == "root_level")
+            sb.root_level = parse_hex<uint8_t>(val);
+        else if (name == "chunk_root_level")
+            sb.chunk_root_level = parse_hex<uint8_t>(val);
+        else if (name == "log_root_level")
+            sb.log_root_level = parse_hex<uint8_t>(val);
+        else if (name == "label") {
+            auto size = min(val.size(), sizeof(sb.label) - 1);
+
+            memcpy(sb.label.data(), val.data(), size);
+            memset(sb.label.data() + size, 0, sizeof(sb.label) - size);
+        } else if (name == "cache_generation")
+            sb.cache_generation = parse_hex<uint64_t>(val);
+        else if (name == "uuid_tree_generation")
+            sb.uuid_tree_generation = parse_hex<uint64_t>(val);
+        else if (name == "metadata_uuid")
+            sb.metadata_uuid = parse_uuid(val);
+        else if (name == "remap_root")
+            sb.remap_root = parse_hex<uint64_t>(val);
+        else if (name == "remap_root_generation")
+            sb.remap_root_generation = parse_hex<uint64_t>(val);
+        else if (name == "remap_root_level")
+            sb.remap_root_level = parse_hex<uint8_t>(val);
+        else
+            throw formatted_error("unrecognized superblock field '{}'", name);
+    }
+}
+
+static void parse_dev_item_fields(string_view line, btrfs::dev_item& d) {
+    while (!line.empty()) {
+        auto [name, val] = next_field(line);
+
+        if (name.empty())
+            break;
+        else if (name == "devid")
+            d.devid = parse_hex<uint64_t>(val);
+        else if (name == "total_bytes")
+            d.total_bytes = parse_hex<uint64_t>(val);
+        else if (name == "bytes_used")
+            d.bytes_used = parse_hex<uint64_t>(val);
+        else if (name == "io_align")
+            d.io_align = parse_hex<uint32_t>(val);
+        else if (name == "io_width")
+            d.io_width = parse_hex<uint32_t>(val);
+        else if (name == "sector_size")
+            d.sector_size = parse_hex<uint32_t>(val);
+        else if (name == "type")
+            d.type = parse_hex<uint64_t>(val);
+        else if (name == "generation")
+            d.generation = parse_hex<uint64_t>(val);
+        else if (name == "start_offset")
+            d.start_offset = parse_hex<uint64_t>(val);
+        else if (name == "dev_group")
+            d.dev_group = parse_hex<uint32_t>(val);
+        else if (name == "seek_speed")
+            d.seek_speed = parse_hex<uint8_t>(val);
+        else if (name == "bandwidth")
+            d.bandwidth = parse_hex<uint8_t>(val);
+        else if (name == "uuid")
+            d.uuid = parse_uuid(val);
+        else if (name == "fsid")
+            d.fsid = parse_uuid(val);
+        else
+            throw formatted_error("unrecognized dev_item field '{}'", name);
+    }
+}
+
+// Hands out the input one line at a time. Regular files are mmapped, so the
+// lines point straight into the mapping and stay valid for the lifetime of
+// the object; compressed input and pipes fall back to reading a stream, in
+// which case a line is only valid until the next call to next().
+class text_input {
+public:
+    text_input(const filesystem::path& fn) : file(fn, ios::binary) {
+        if (!file)
+            throw formatted_error("failed to open input file '{}'", fn.string());
+
+        if (zstdio::is_zstd(file)) {
+            zr.emplace(file);
+            in.emplace(&*zr);
+            in->exceptions(ios::badbit); // rethrow decompression errors
+            return;
         }
 
-        append(&dri, sizeof(dri));
-    } else if (type_word == "raid_stripe") {
-        // multiple entries separated by semicolons:
-        // devid=X physical=X; devid=X physical=X
+        int fd = open(fn.c_str(), O_RDONLY);
 
-        while (!rest.empty()) {
-            btrfs::raid_stride rs;
+        if (fd < 0)
+            throw formatted_error("failed to open input file '{}' (errno {})", fn.string(), errno);
 
-            memset(&rs, 0, sizeof(rs));
+        struct stat st;
 
-            while (!rest.empty() && (rest.front() == ' ' || rest.front() == ';')) {
-                rest.remove_prefix(1);
-            }
+        if (fstat(fd, &st) < 0) {
+            auto err = errno;
+            close(fd);
+            throw formatted_error("fstat failed on {} (errno {})", fn.string(), err);
+        }
 
-            if (rest.empty())
-                break;
+        if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+            close(fd);
+            in.emplace(file.rdbuf());
+            return;
+        }
 
-            while (!rest.empty()) {
-                if (rest.front() == ';')
-                    break;
+        len = st.st_size;
+        addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
 
-                auto [fname, fval] = next_field(rest);
-                if (fname.empty())
-                    break;
+        if (addr == MAP_FAILED)
+            throw formatted_error("mmap failed on {} (errno {})", fn.string(), errno);
 
-                if (fname == "devid")
-                    rs.devid = parse_hex<uint64_t>(fval);
-                else if (fname == "physical") {
-                    rs.physical = parse_hex<uint64_t>(fval);
-                    break;
-                } else
-                    throw formatted_error("unrecognized raid_stripe field '{}'", fname);
-            }
+        madvise(addr, len, MADV_SEQUENTIAL);
 
-            append(&rs, sizeof(rs));
-        }
-    } else if (type_word == "identity_remap") {
-        // zero-length
-    } else if (type_word == "remap" || type_word == "remap_backref") {
-        btrfs::remap_item r;
+        rest = string_view((const char*)addr, len);
+    }
 
-        memset(&r, 0, sizeof(r));
+    ~text_input() {
+        if (addr != MAP_FAILED)
+            munmap(addr, len);
+    }
 
-        while (!rest.empty() && rest.front() == ' ') {
-            rest.remove_prefix(1);
-        }
+    text_input(const text_input&) = delete;
+    text_input& operator=(const text_input&) = delete;
 
-        if (!rest.empty()) {
-            string_view token;
+    // Returns the next line without its terminator, or nullopt at the end
+    // of the input.
+    optional<string_view> next() {
+        string_view l;
 
-            if (auto sp = rest.find(' '); sp != string_view::npos) {
-                token = rest.substr(0, sp);
-                rest = rest.substr(sp);
+        if (in) {
+            if (!getline(*in, line))
+                return nullopt;
+
+            l = line;
+        } else {
+            if (rest.empty())
+                return nullopt;
+
+            // glibc's memchr is vectorized, which makes this much quicker
+            // than looking at each character in turn
+            if (auto nl = (const char*)memchr(rest.data(), '\n', rest.size())) {
+                l = rest.substr(0, nl - rest.data());
+                rest.remove_prefix(l.size() + 1);
             } else {
-                token = rest;
-                rest = "";
+                l = rest;
+                rest = {};
             }
 
-            r.address = parse_hex<uint64_t>(token);
+            if (window != 0)
+                release_behind(l.data() - (const char*)addr);
         }
 
-        append(&r, sizeof(r));
-    } else if (type_word == "dir_log_index") {
-        btrfs::dir_log_item dli;
+        if (!l.empty() && l.back() == '\r')
+            l.remove_suffix(1);
 
-        memset(&dli, 0, sizeof(dli));
+        return l;
+    }
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+    // whether lines stay valid after the next call to next()
+    bool stable() const {
+        return !in;
+    }
 
-            if (fname == "end")
-                dli.end = parse_hex<uint64_t>(fval);
-            else
-                throw formatted_error("unrecognized dir_log_index field '{}'", fname);
-        }
+    // Keeps no more than about size bytes of the mapping resident behind
+    // where we're reading. These are clean file pages, so anything still
+    // looking at them just faults them back in, but otherwise the whole file
+    // would end up counting towards our RSS.
+    void limit_window(size_t size) {
+        window = size;
+    }
 
-        append(&dli, sizeof(dli));
-    } else if (type_word == "extent_data_ref") {
-        btrfs::extent_data_ref edr;
+private:
+    static constexpr size_t RELEASE_STEP = 16 * 1024 * 1024;
 
-        memset(&edr, 0, sizeof(edr));
+    void release_behind(size_t pos) {
+        if (pos < released + window + RELEASE_STEP)
+            return;
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+        auto page_size = (size_t)sysconf(_SC_PAGESIZE);
+        auto end = (pos - window) & ~(page_size - 1);
 
-            if (fname == "root")
-                edr.root = parse_hex<uint64_t>(fval);
-            else if (fname == "objectid")
-                edr.objectid = parse_hex<uint64_t>(fval);
-            else if (fname == "offset")
-                edr.offset = (uint64_t)parse_hex<int64_t>(fval);
-            else if (fname == "count")
-                edr.count = parse_hex<uint32_t>(fval);
-            else
-                throw formatted_error("unrecognized extent_data_ref field '{}'", fname);
+        madvise((uint8_t*)addr + released, end - released, MADV_DONTNEED);
+        released = end;
+    }
+
+    ifstream file;
+    optional<zstdio::reader> zr;
+    optional<istream> in;
+    string line;
+    void* addr = MAP_FAILED;
+    size_t len = 0;
+    string_view rest;
+    size_t window = 0;
+    size_t released = 0;
+};
+
+// Assembly is split into three stages: the main thread reads the input and
+// works out the tree structure, a pool of workers parses the items and packs
+// and checksums each node, and a writer thread writes the finished nodes.
+//
+// Nodes are only position-independent until they're written, as the chunk
+// map is needed to find where they go. The writer therefore takes nodes in
+// the order they were submitted, adding the CHUNK_ITEMs of each leaf to the
+// chunk map as it goes, which gives the same result as doing everything on
+// one thread.
+class pipeline {
+public:
+    // If mem_limit isn't 0, submit_node blocks while the nodes in flight
+    // would take up more than that, though there's always at least one.
+    pipeline(device_images& out, unsigned int num_workers, size_t mem_limit = 0)
+        : out(out), mem_limit(mem_limit) {
+        max_in_flight = num_workers * 4;
+
+        try {
+            for (unsigned int i = 0; i < num_workers; i++) {
+                workers.emplace_back([this]() {
+                    trace::thread_name("worker");
+                    worker_thread();
+                });
+            }
+
+            writer = thread([this]() {
+                trace::thread_name("writer");
+                writer_thread();
+            });
+        } catch (...) {
+            stop();
+            throw;
         }
+    }
 
-        append(&edr, sizeof(edr));
-    } else if (type_word == "shared_data_ref") {
-        btrfs::shared_data_ref sdr;
+    ~pipeline() {
+        stop();
+    }
 
-        memset(&sdr, 0, sizeof(sdr));
+    pipeline(const pipeline&) = delete;
+    pipeline& operator=(const pipeline&) = delete;
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+    // reserved is memory the caller is using alongside the nodes, which
+    // comes out of the same limit.
+    void submit_node(node_state&& node, const shared_ptr<const btrfs::super_block>& sb,
+                     size_t reserved = 0) {
+        auto mem = node.memory_usage(sb->nodesize);
+        trace::span sp("submit_node");
+        unique_lock ul(lock);
 
-            if (fname == "count")
-                sdr.count = parse_hex<uint32_t>(fval);
-            else
-                throw formatted_error("unrecognized shared_data_ref field '{}'", fname);
+        cv.wait(ul, [&]() {
+            if (err)
+                return true;
+
+            if (submitted - written >= max_in_flight)
+                return false;
+
+            return mem_limit == 0 || submitted == written || reserved + mem_in_flight + mem <= mem_limit;
+        });
+
+        if (err)
+            rethrow_exception(err);
+
+        jobs.push_back({submitted, move(node), sb, mem});
+        submitted++;
+
+        mem_in_flight += mem;
+        peak_mem_in_flight = max(peak_mem_in_flight, mem_in_flight);
+
+        cv.notify_all();
+    }
+
+    // chunks from the sys_chunk_array, which have to be ordered with the nodes
+    void add_chunk(uint64_t offset, const btrfs::chunk& c) {
+        lock_guard lg(lock);
+
+        if (err)
+            rethrow_exception(err);
+
+        auto& r = results[submitted];
+
+        r.new_chunks.push_back(make_chunk_entry(offset, c));
+        submitted++;
+
+        cv.notify_all();
+    }
+
+    void finish() {
+        {
+            unique_lock ul(lock);
+
+            cv.wait(ul, [this]() { return written == submitted || err; });
         }
 
-        append(&sdr, sizeof(sdr));
-    } else if (type_word == "tree_block_ref" || type_word == "shared_block_ref") {
-        // zero-length
-    } else if (type_word == "string_item") {
-        // raw string data
-        data.assign(rest.begin(), rest.end());
-        rest = "";
-    } else if (type_word == "verity_desc_item") {
-        btrfs::verity_descriptor_item vdi;
+        stop();
 
-        memset(&vdi, 0, sizeof(vdi));
+        if (err)
+            rethrow_exception(err);
+    }
 
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+    // the most memory the nodes in flight took up at any one time
+    size_t peak_memory() const {
+        return peak_mem_in_flight;
+    }
 
-            if (fname == "size")
-                vdi.size = parse_hex<uint64_t>(fval);
-            else if (fname == "encryption")
-                vdi.encryption = parse_hex<uint8_t>(fval);
-            else
-                throw formatted_error("unrecognized verity_desc_item field '{}'", fname);
+private:
+    struct job {
+        uint64_t seq;
+        node_state node;
+        shared_ptr<const btrfs::super_block> sb;
+        size_t mem;
+    };
+
+    struct result {
+        uint64_t bytenr = 0;
+        size_t mem = 0;
+        vector<uint8_t> buf;
+        vector<chunk_entry> new_chunks;
+        vector<btrfs::dev_item> dev_items;
+    };
+
+    void stop() {
+        {
+            lock_guard lg(lock);
+            done = true;
         }
 
-        append(&vdi, sizeof(vdi));
-    } else if (type_word == "fsverity_descriptor") {
-        btrfs::fsverity_descriptor desc;
+        cv.notify_all();
 
-        memset(&desc, 0, sizeof(desc));
+        for (auto& t : workers) {
+            if (t.joinable())
+                t.join();
+        }
 
-        while (!rest.empty()) {
-            auto saved = rest;
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+        if (writer.joinable())
+            writer.join();
+    }
 
-            if (fname == "version")
-                desc.version = parse_hex<uint8_t>(fval);
-            else if (fname == "hash_algorithm") {
-                if (fval == "sha256")
-                    desc.hash_algorithm = btrfs::fsverity_hash_algorithm::SHA256;
-                else if (fval == "sha512")
-                    desc.hash_algorithm = btrfs::fsverity_hash_algorithm::SHA512;
-                else
-                    desc.hash_algorithm = (btrfs::fsverity_hash_algorithm)parse_hex<uint8_t>(fval);
-            } else if (fname == "log_blocksize")
-                desc.log_blocksize = parse_hex<uint8_t>(fval);
-            else if (fname == "salt_size")
-                desc.salt_size = parse_hex<uint8_t>(fval);
-            else if (fname == "data_size")
-                desc.data_size = parse_hex<uint64_t>(fval);
-            else if (fname == "root_hash") {
-                // formatted as concatenated {:016x} le64 values
+    void fail() {
+        lock_guard lg(lock);
 
-                auto* dest = (btrfs::le64*)desc.root_hash;
-                for (size_t i = 0; (i * 16) + 16 <= fval.size() && i < sizeof(desc.root_hash) / 8; i++) {
-                    dest[i] = parse_hex<uint64_t>(fval.substr(i * 16, 16));
+        if (!err)
+            err = current_exception();
+
+        done = true;
+        cv.notify_all();
+    }
+
+    void worker_thread() {
+        try {
+            while (true) {
+                job j;
+
+                {
+                    unique_lock ul(lock);
+
+                    cv.wait(ul, [this]() { return !jobs.empty() || done; });
+
+                    if (done)
+                        return;
+
+                    j = move(jobs.front());
+                    jobs.pop_front();
                 }
-            } else if (fname == "salt") {
-                auto bytes = parse_hex_bytes(fval);
-                memcpy(desc.salt, bytes.data(), min(bytes.size(), sizeof(desc.salt)));
-            } else if (fname == "sig") {
-                // sig is base64-encoded, but handled below after append
-                rest = saved;
-                break;
-            } else
-                throw formatted_error("unrecognized fsverity_descriptor field '{}'", fname);
-        }
 
-        append(&desc, sizeof(desc));
+                result r;
 
-        // handle sig= (base64-encoded signature appended after the descriptor)
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
+                r.bytenr = j.node.bytenr;
+                r.mem = j.mem;
+                auto leaf = j.node.level == 0;
 
-            if (fname == "sig") {
-                auto decoded = b64decode(fval);
-                append(decoded.data(), decoded.size());
+                r.buf = pack_node(move(j.node), *j.sb);
+
+                if (leaf)
+                    scan_leaf(r.buf, r.new_chunks, r.dev_items);
+
+                {
+                    lock_guard lg(lock);
+                    results[j.seq] = move(r);
+                }
+
+                cv.notify_all();
             }
+        } catch (...) {
+            fail();
         }
-    } else if (type_word == "verity_merkle_item") {
-        // space-separated groups of hex bytes (32 bytes per group)
-        while (!rest.empty()) {
-            while (!rest.empty() && rest.front() == ' ') {
-                rest.remove_prefix(1);
+    }
+
+    void writer_thread() {
+        try {
+            while (true) {
+                result r;
+
+                {
+                    unique_lock ul(lock);
+
+                    cv.wait(ul, [this]() { return results.contains(written) || done; });
+
+                    // on a normal finish, done isn't set until everything is written
+                    if (!results.contains(written))
+                        return;
+
+                    r = move(results.at(written));
+                    results.erase(written);
+                }
+
+                for (const auto& ce : r.new_chunks) {
+                    out.add_chunk(ce);
+                }
+
+                for (const auto& di : r.dev_items) {
+                    out.add_dev_item(di);
+                }
+
+                if (!r.buf.empty())
+                    out.write_node(r.buf, r.bytenr);
+
+                {
+                    lock_guard lg(lock);
+                    written++;
+                    mem_in_flight -= r.mem;
+                }
+
+                cv.notify_all();
             }
+        } catch (...) {
+            fail();
+        }
+    }
 
-            if (rest.empty())
-                break;
+    device_images& out;
+    size_t mem_limit;
+    size_t mem_in_flight = 0;
+    size_t peak_mem_in_flight = 0;
+    uint64_t max_in_flight;
+    vector<thread> workers;
+    thread writer;
+    mutex lock;
+    condition_variable cv;
+    deque<job> jobs;
+    map<uint64_t, result> results;
+    uint64_t submitted = 0, written = 0;
+    bool done = false;
+    exception_ptr err;
+};
 
-            string_view token;
+static void assemble_binary(string_view input_path, device_images& out) {
+    bindump::reader archive(filesystem::path{input_path});
+    auto sb = archive.superblock();
 
-            if (auto sp = rest.find(' '); sp != string_view::npos) {
-                token = rest.substr(0, sp);
-                rest = rest.substr(sp);
-            } else {
-                token = rest;
-                rest = "";
+    if (sb.magic != btrfs::MAGIC)
+        throw runtime_error("binary dump does not contain a valid superblock");
+
+    out.set_primary(sb.dev_item.devid);
+
+    // bootstrap the chunk map from the sys_chunk_array
+
+    auto sys_array = span(sb.sys_chunk_array.data(), sb.sys_chunk_array_size);
+
+    while (sys_array.size() >= sizeof(btrfs::key) + offsetof(btrfs::chunk, stripe)) {
+        const auto& k = *(const btrfs::key*)sys_array.data();
+        const auto& c = *(const btrfs::chunk*)(sys_array.data() + sizeof(btrfs::key));
+        auto chunk_size = offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe));
+
+        if (sys_array.size() < sizeof(btrfs::key) + chunk_size)
+            throw runtime_error("sys array truncated");
+
+        out.add_chunk(make_chunk_entry(k.offset, c));
+
+        sys_array = sys_array.subspan(sizeof(btrfs::key) + chunk_size);
+    }
+
+    // Nodes are stored in the order btrfs-dump visited them, so the chunk tree
+    // comes first and is always resolvable through the sys chunks. The images
+    // are written straight out of the mapping, checksums and all.
+
+    for (size_t i = 0; i < archive.num_nodes(); i++) {
+        auto node = archive.node(i);
+        const auto& h = *(const btrfs::header*)node.data();
+
+        if (h.owner == btrfs::CHUNK_TREE_OBJECTID && h.level == 0) {
+            vector<chunk_entry> new_chunks;
+            vector<btrfs::dev_item> dev_items;
+
+            scan_leaf(node, new_chunks, dev_items);
+
+            for (const auto& ce : new_chunks) {
+                out.add_chunk(ce);
             }
 
-            if (token.empty())
-                continue;
+            for (const auto& di : dev_items) {
+                out.add_dev_item(di);
+            }
+        }
+
+        out.write_node(node, h.bytenr);
+    }
+
+    out.finish(sb);
+}
+
+struct assemble_options {
+    unsigned int num_workers;
+    optional<filesystem::path> block_map;
+    bool verbose = false;
+    size_t memory_limit = 0; // bytes, 0 for no limit
+};
+
+static void print_memory_usage(const device_images& out, size_t peak_in_flight,
+                               size_t allocator_usage = 0) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
 
-            auto bytes = parse_hex_bytes(token);
+    const auto& chunks = out.get_chunks();
 
-            append(bytes.data(), bytes.size());
-        }
-    } else if (type_word == "unknown") {
-        // unknown (size=X) - zero-fill with the given size
-        while (!rest.empty()) {
-            auto [fname, fval] = next_field(rest);
-            if (fname.empty())
-                break;
-        }
-    } else
-        throw formatted_error("unknown item type '{}'", type_word);
+    cout << format("chunk map: {} chunks, {} bytes\n", chunks.size(), chunks.memory_usage());
 
-    // handle extra= at end of type_line
+    if (peak_in_flight != 0)
+        cout << format("nodes in flight: peak {} bytes\n", peak_in_flight);
 
-    static const string_view extra = " extra=";
+    if (allocator_usage != 0)
+        cout << format("explicit node ranges: {} bytes\n", allocator_usage);
 
-    if (auto extra_pos = type_line.find(extra); extra_pos != string_view::npos) {
-        auto hex_str = type_line.substr(extra_pos + extra.size());
+    cout << format("peak RSS: {} KiB\n", ru.ru_maxrss);
+}
 
-        // Remove any trailing whitespace
+static void finish_images(device_images& out, const assemble_options& opts) {
+    for (const auto& [devid, d] : out.devices()) {
+        auto& img = d->image;
 
-        while (!hex_str.empty() && (hex_str.back() == ' ' || hex_str.back() == '\n' || hex_str.back() == '\r')) {
-            hex_str.remove_suffix(1);
+        if (opts.verbose) {
+            cout << format("{}: devid {}, size {}, allocated {}\n", d->fn.string(), devid,
+                           img.size(), img.allocated());
         }
 
-        auto extra_bytes = parse_hex_bytes(hex_str);
+        if (opts.block_map) {
+            if (devid == out.primary_devid())
+                img.compact(*opts.block_map);
+            else
+                img.compact(format("{}.{}", opts.block_map->string(), devid));
 
-        data.insert(data.end(), extra_bytes.begin(), extra_bytes.end());
+            if (opts.verbose)
+                cout << format("{}: packed to {}\n", d->fn.string(), img.size());
+        }
     }
-
-    return data;
 }
 
-static void parse_superblock_fields(string_view line, btrfs::super_block& sb) {
-    while (!line.empty()) {
-        auto [name, val] = next_field(line);
+static void assemble(string_view input_path, string_view output_path,
+                     const assemble_options& opts) {
+    // With a memory limit, half goes to the nodes being worked on, and a
+    // quarter each to the write batches and the mapped input.
 
-        if (name.empty())
-            break;
-        else if (name == "csum") {
-            // ignored, computed automatically
-        } else if (name == "fsid")
-            sb.fsid = parse_uuid(val);
-        else if (name == "bytenr")
-            sb.bytenr = parse_hex<uint64_t>(val);
-        else if (name == "flags")
-            sb.flags = parse_super_flags(val);
-        else if (name == "magic")
-            memcpy(&sb.magic, val.data(), min(val.size(), sizeof(uint64_t)));
-        else if (name == "generation")
-            sb.generation = parse_hex<uint64_t>(val);
-        else if (name == "root")
-            sb.root = parse_hex<uint64_t>(val);
-        else if (name == "chunk_root")
-            sb.chunk_root = parse_hex<uint64_t>(val);
-        else if (name == "log_root")
-            sb.log_root = parse_hex<uint64_t>(val);
-        else if (name == "log_root_transid")
-            sb.__unused_log_root_transid = parse_hex<uint64_t>(val);
-        else if (name == "total_bytes")
-            sb.total_bytes = parse_hex<uint64_t>(val);
-        else if (name == "bytes_used")
-            sb.bytes_used = parse_hex<uint64_t>(val);
-        else if (name == "root_dir_objectid")
-            sb.root_dir_objectid = parse_hex<uint64_t>(val);
-        else if (name == "num_devices")
-            sb.num_devices = parse_hex<uint64_t>(val);
-        else if (name == "sectorsize")
-            sb.sectorsize = parse_hex<uint32_t>(val);
-        else if (name == "nodesize")
-            sb.nodesize = parse_hex<uint32_t>(val);
-        else if (name == "leafsize")
-            sb.__unused_leafsize = parse_hex<uint32_t>(val);
-        else if (name == "stripesize")
-            sb.stripesize = parse_hex<uint32_t>(val);
-        else if (name == "sys_chunk_array_size")
-            sb.sys_chunk_array_size = parse_hex<uint32_t>(val);
-        else if (name == "chunk_root_generation")
-            sb.chunk_root_generation = parse_hex<uint64_t>(val);
-        else if (name == "compat_flags")
-            sb.compat_flags = parse_hex<uint64_t>(val);
-        else if (name == "compat_ro_flags")
-            sb.compat_ro_flags = parse_compat_ro_flags(val);
-        else if (name == "incompat_flags")
-            sb.incompat_flags = parse_incompat_flags(val);
-        else if (name == "csum_type")
-            sb.csum_type = parse_csum_type(val);
-        else if (name == "root_level")
-            sb.root_level = parse_hex<uint8_t>(val);
-        else if (name == "chunk_root_level")
-            sb.chunk_root_level = parse_hex<uint8_t>(val);
-        else if (name == "log_root_level")
-            sb.log_root_level = parse_hex<uint8_t>(val);
-        else if (name == "label") {
-            auto size = min(val.size(), sizeof(sb.label) - 1);
+    if (bindump::is_archive(filesystem::path{input_path})) {
+        device_images out(filesystem::path{output_path});
 
-            memcpy(sb.label.data(), val.data(), size);
-            memset(sb.label.data() + size, 0, sizeof(sb.label) - size);
-        } else if (name == "cache_generation")
-            sb.cache_generation = parse_hex<uint64_t>(val);
-        else if (name == "uuid_tree_generation")
-            sb.uuid_tree_generation = parse_hex<uint64_t>(val);
-        else if (name == "metadata_uuid")
-            sb.metadata_uuid = parse_uuid(val);
-        else if (name == "remap_root")
-            sb.remap_root = parse_hex<uint64_t>(val);
-        else if (name == "remap_root_generation")
-            sb.remap_root_generation = parse_hex<uint64_t>(val);
-        else if (name == "remap_root_level")
-            sb.remap_root_level = parse_hex<uint8_t>(val);
-        else
-            throw formatted_error("unrecognized superblock field '{}'", name);
-    }
-}
+        if (opts.memory_limit != 0)
+            out.limit_memory(opts.memory_limit / 4);
 
-static void parse_dev_item_fields(string_view line, btrfs::dev_item& d) {
-    while (!line.empty()) {
-        auto [name, val] = next_field(line);
+        assemble_binary(input_path, out);
+        finish_images(out, opts);
 
-        if (name.empty())
-            break;
-        else if (name == "devid")
-            d.devid = parse_hex<uint64_t>(val);
-        else if (name == "total_bytes")
-            d.total_bytes = parse_hex<uint64_t>(val);
-        else if (name == "bytes_used")
-            d.bytes_used = parse_hex<uint64_t>(val);
-        else if (name == "io_align")
-            d.io_align = parse_hex<uint32_t>(val);
-        else if (name == "io_width")
-            d.io_width = parse_hex<uint32_t>(val);
-        else if (name == "sector_size")
-            d.sector_size = parse_hex<uint32_t>(val);
-        else if (name == "type")
-            d.type = parse_hex<uint64_t>(val);
-        else if (name == "generation")
-            d.generation = parse_hex<uint64_t>(val);
-        else if (name == "start_offset")
-            d.start_offset = parse_hex<uint64_t>(val);
-        else if (name == "dev_group")
-            d.dev_group = parse_hex<uint32_t>(val);
-        else if (name == "seek_speed")
-            d.seek_speed = parse_hex<uint8_t>(val);
-        else if (name == "bandwidth")
-            d.bandwidth = parse_hex<uint8_t>(val);
-        else if (name == "uuid")
-            d.uuid = parse_uuid(val);
-        else if (name == "fsid")
-            d.fsid = parse_uuid(val);
-        else
-            throw formatted_error("unrecognized dev_item field '{}'", name);
+        if (opts.verbose || opts.memory_limit != 0)
+            print_memory_usage(out, 0);
+
+        return;
     }
-}
 
-static void assemble(string_view input_path, string_view output_path) {
-    ifstream in(filesystem::path{input_path});
-    if (!in)
-        throw formatted_error("failed to open input file '{}'", input_path);
+    text_input input(filesystem::path{input_path});
 
-    fstream out(filesystem::path{output_path}, ios::binary | ios::in | ios::out | ios::trunc);
-    if (!out)
-        throw formatted_error("failed to open output file '{}'", output_path);
+    device_images out(filesystem::path{output_path});
+
+    if (opts.memory_limit != 0) {
+        input.limit_window(opts.memory_limit / 4);
+        out.limit_memory(opts.memory_limit / 4);
+    }
 
     btrfs::super_block sb;
 
@@ -2511,34 +4239,152 @@ static void assemble(string_view input_path, string_view output_path) {
     optional<btrfs::key> current_key;
     uint32_t sys_chunk_offset = 0;
     unsigned int backup_index = 0;
-    map<uint64_t, chunk_entry> chunks;
-    string line;
     btrfs::key bootstrap_key;
+    pipeline pl(out, opts.num_workers, opts.memory_limit / 2);
+    shared_ptr<const btrfs::super_block> sb_snapshot;
+    node_allocator alloc;
+    bool in_flat_tree = false;
+    optional<tree_builder> flat_tree; // unset for the root tree
+    optional<trace::span> flat_span;
+    optional<btrfs::key> flat_key;
+    map<uint64_t, tree_root> flat_roots;
+    optional<pair<uint64_t, btrfs::uuid>> flat_root_tree; // generation, chunk_tree_uuid
+    vector<pair<btrfs::key, string_view>> root_tree_items;
+    deque<string> root_tree_copies;
+    vector<uint8_t> chunk_scratch;
 
     memset(&bootstrap_key, 0, sizeof(bootstrap_key));
 
-    auto write_and_collect_chunks = [&](node_state& node) {
-        if (node.level == 0) {
-            for (const auto& it : node.items) {
-                if (it.key.type == btrfs::key_type::CHUNK_ITEM && it.data.size() >= offsetof(btrfs::chunk, stripe)) {
-                    auto& c = *(const btrfs::chunk*)it.data.data();
+    auto submit_node = [&](node_state& node) {
+        // the workers get their own copy of the superblock, as we may
+        // still be changing ours
+        if (!sb_snapshot || memcmp(sb_snapshot.get(), &sb, sizeof(sb)))
+            sb_snapshot = make_shared<const btrfs::super_block>(sb);
+
+        pl.submit_node(move(node), sb_snapshot, alloc.memory_usage());
+    };
 
-                    chunk_entry ce;
-                    ce.offset = it.key.offset;
-                    ce.length = c.length;
-                    ce.num_stripes = c.num_stripes;
+    // Trees given as item streams, rather than as nodes, are laid out as they
+    // come in. The root tree is held back until the end, so that its
+    // ROOT_ITEMs can point to all the others.
 
-                    for (uint16_t i = 0; i < c.num_stripes && i < MAX_STRIPES; i++) {
-                        ce.stripes[i].devid = c.stripe[i].devid;
-                        ce.stripes[i].offset = c.stripe[i].offset;
-                    }
+    auto start_flat_tree = [&](string_view rest) {
+        optional<uint64_t> id;
+        uint64_t generation = sb.generation;
+        btrfs::uuid chunk_tree_uuid;
 
-                    chunks[ce.offset] = ce;
-                }
+        memset(&chunk_tree_uuid, 0, sizeof(chunk_tree_uuid));
+
+        while (!rest.empty()) {
+            auto [fname, fval] = next_field(rest);
+            if (fname.empty())
+                break;
+
+            if (fname == "id")
+                id = parse_hex<uint64_t>(fval);
+            else if (fname == "generation")
+                generation = parse_hex<uint64_t>(fval);
+            else if (fname == "chunk_tree_uuid")
+                chunk_tree_uuid = parse_uuid(fval);
+            else
+                throw formatted_error("unrecognized tree field '{}'", fname);
+        }
+
+        if (!id)
+            throw runtime_error("tree line without id");
+
+        // the tree is laid out using the superblock's nodesize and csum_type
+        if (!have_superblock)
+            throw runtime_error("tree line before superblock");
+
+        if (*id == btrfs::ROOT_TREE_OBJECTID)
+            flat_root_tree.emplace(generation, chunk_tree_uuid);
+        else {
+            flat_span.emplace("tree");
+            flat_span->hex_arg("id", *id);
+            flat_tree.emplace(*id, generation, chunk_tree_uuid, sb, alloc, submit_node);
+        }
+    };
+
+    auto end_flat_tree = [&]() {
+        flat_key.reset();
+
+        if (!flat_tree)
+            return;
+
+        auto id = flat_tree->id();
+        auto root = flat_tree->finish();
+
+        flat_tree.reset();
+        flat_span.reset();
+
+        if (id == btrfs::CHUNK_TREE_OBJECTID) {
+            sb.chunk_root = root.bytenr;
+            sb.chunk_root_level = root.level;
+        } else if (id == btrfs::TREE_LOG_OBJECTID) {
+            sb.log_root = root.bytenr;
+            sb.log_root_level = root.level;
+        } else
+            flat_roots[id] = root;
+    };
+
+    auto build_root_tree = [&]() {
+        trace::span sp("tree");
+
+        sp.hex_arg("id", btrfs::ROOT_TREE_OBJECTID);
+
+        tree_builder tb(btrfs::ROOT_TREE_OBJECTID, flat_root_tree->first, flat_root_tree->second,
+                        sb, alloc, submit_node);
+        auto missing = flat_roots.begin();
+
+        tb.set_roots(flat_roots);
+
+        // add ROOT_ITEMs for any of our trees that don't have one
+        auto add_missing = [&](optional<btrfs::key> before) {
+            while (missing != flat_roots.end()) {
+                btrfs::key k;
+
+                k.objectid = missing->first;
+                k.type = btrfs::key_type::ROOT_ITEM;
+                k.offset = 0;
+
+                if (before && k >= *before)
+                    break;
+
+                tb.add_root_item(missing->first, missing->second);
+                missing++;
+            }
+        };
+
+        for (const auto& [key, line] : root_tree_items) {
+            add_missing(key);
+
+            if (missing != flat_roots.end() && key.objectid == missing->first &&
+                key.type == btrfs::key_type::ROOT_ITEM) {
+                missing++;
             }
+
+            tb.add_item(key, line);
         }
 
-        write_node(out, node, sb, chunks);
+        add_missing(nullopt);
+
+        auto root = tb.finish();
+
+        sb.root = root.bytenr;
+        sb.root_level = root.level;
+    };
+
+    // the allocator needs to know about chunks given in explicit nodes too
+    auto note_chunk_item = [&](const btrfs::key& key, string_view line) {
+        chunk_scratch.resize(sb.nodesize);
+
+        item_buffer data(chunk_scratch, 0);
+
+        parse_item_data(line, key, sb, data);
+
+        if (data.size() >= offsetof(btrfs::chunk, stripe))
+            alloc.add_chunk(make_chunk_entry(key.offset, *(const btrfs::chunk*)chunk_scratch.data()));
     };
 
     auto flush_to_indent = [&](unsigned int indent) {
@@ -2546,7 +4392,7 @@ static void assemble(string_view input_path, string_view output_path) {
             current_key.reset();
 
         while (!node_stack.empty() && node_stack.back().indent >= indent) {
-            write_and_collect_chunks(node_stack.back());
+            submit_node(node_stack.back());
             node_stack.pop_back();
         }
     };
@@ -2555,16 +4401,13 @@ static void assemble(string_view input_path, string_view output_path) {
         current_key.reset();
 
         while (!node_stack.empty()) {
-            write_and_collect_chunks(node_stack.back());
+            submit_node(node_stack.back());
             node_stack.pop_back();
         }
     };
 
-    while (getline(in, line)) {
-        if (!line.empty() && line.back() == '\r')
-            line.pop_back();
-
-        auto stripped = string_view(line);
+    while (auto line = input.next()) {
+        auto stripped = *line;
         unsigned int indent = 0;
 
         while (!stripped.empty() && stripped.front() == ' ') {
@@ -2589,6 +4432,34 @@ static void assemble(string_view input_path, string_view output_path) {
             rest = "";
         }
 
+        if (type == "tree") {
+            flush_all();
+            end_flat_tree();
+            start_flat_tree(rest);
+            in_flat_tree = true;
+            continue;
+        } else if (in_flat_tree && type != "header" && type != "superblock") {
+            if (!flat_key) {
+                flat_key = parse_key(stripped);
+                continue;
+            }
+
+            if (flat_tree)
+                flat_tree->add_item(*flat_key, stripped);
+            else {
+                if (!input.stable())
+                    stripped = root_tree_copies.emplace_back(stripped);
+
+                root_tree_items.emplace_back(*flat_key, stripped);
+            }
+
+            flat_key.reset();
+            continue;
+        } else if (in_flat_tree) {
+            end_flat_tree();
+            in_flat_tree = false;
+        }
+
         if (type == "superblock") {
             flush_all();
 
@@ -2613,6 +4484,10 @@ static void assemble(string_view input_path, string_view output_path) {
             } else
                 parse_superblock_fields(rest, sb);
 
+            // the image named on the command line is for this device
+            if (!have_superblock)
+                out.set_primary(sb.dev_item.devid);
+
             have_superblock = true;
             sys_chunk_offset = 0;
         } else if (type == "bootstrap") {
@@ -2698,18 +4573,8 @@ static void assemble(string_view input_path, string_view output_path) {
 
             // add to chunk map
 
-            chunk_entry ce;
-
-            ce.offset = bootstrap_key.offset;
-            ce.length = c.length;
-            ce.num_stripes = c.num_stripes;
-
-            for (uint16_t i = 0; i < c.num_stripes && i < MAX_STRIPES; i++) {
-                ce.stripes[i].devid = c.stripe[i].devid;
-                ce.stripes[i].offset = c.stripe[i].offset;
-            }
-
-            chunks[ce.offset] = ce;
+            pl.add_chunk(bootstrap_key.offset, c);
+            alloc.add_chunk(make_chunk_entry(bootstrap_key.offset, c));
         } else if (type == "backup") {
             if (backup_index < sb.super_roots.size()) {
                 auto& b = sb.super_roots[backup_index];
@@ -2805,6 +4670,8 @@ static void assemble(string_view input_path, string_view output_path) {
                 } else
                     throw formatted_error("unrecognized header field '{}'", fname);
             }
+
+            alloc.mark_used(current_node.bytenr, sb.nodesize);
         } else if (!node_stack.empty()) {
             // flush any child nodes deeper than this line's indent
             flush_to_indent(indent + 1);
@@ -2872,9 +4739,13 @@ static void assemble(string_view input_path, string_view output_path) {
 
             // if we have a pending key, this line is the item data
             if (current_key.has_value() && active_node.level == 0) {
-                auto item_data = parse_item_data(stripped, *current_key, sb);
+                if (current_key->type == btrfs::key_type::CHUNK_ITEM)
+                    note_chunk_item(*current_key, stripped);
+
+                if (!input.stable())
+                    stripped = active_node.line_copies.emplace_back(stripped);
 
-                active_node.items.push_back({*current_key, move(item_data)});
+                active_node.item_lines.emplace_back(*current_key, stripped);
                 current_key.reset();
             }
         }
@@ -2882,41 +4753,183 @@ static void assemble(string_view input_path, string_view output_path) {
 
     // flush remaining nodes
     flush_all();
+    end_flat_tree();
+
+    if (flat_root_tree)
+        build_root_tree();
+
+    pl.finish();
 
     if (!have_superblock)
         throw runtime_error("no superblock found in input");
 
-    // ensure image covers total_bytes
-    if (sb.total_bytes > 0) {
-        out.seekp(0, ios::end);
+    out.finish(sb);
+
+    finish_images(out, opts);
+
+    if (opts.verbose || opts.memory_limit != 0)
+        print_memory_usage(out, pl.peak_memory(), alloc.memory_usage());
+}
+
+// Rebuilds a sparse image from a metadata-only one and its block map, as
+// written by --metadata-only. copy_file_range lets filesystems that support
+// it share the blocks rather than copying them.
+static void expand_image(const filesystem::path& map_path, string_view packed_path,
+                         string_view output_path) {
+    ifstream map_file(map_path);
+    if (!map_file)
+        throw formatted_error("failed to open block map '{}'", map_path.string());
+
+    int in_fd = open(string{packed_path}.c_str(), O_RDONLY);
+    if (in_fd < 0)
+        throw formatted_error("failed to open input file '{}' (errno {})", packed_path, errno);
+
+    int out_fd = open(string{output_path}.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0) {
+        auto err = errno;
+        close(in_fd);
+        throw formatted_error("failed to open output file '{}' (errno {})", output_path, err);
+    }
+
+    try {
+        string line;
+        optional<uint64_t> size;
+
+        while (getline(map_file, line)) {
+            vector<string_view> words;
+            string_view sv = line;
+
+            while (!sv.empty()) {
+                auto sp = sv.find(' ');
+
+                words.push_back(sv.substr(0, sp));
+                sv = sp == string_view::npos ? string_view{} : sv.substr(sp + 1);
+            }
+
+            if (words.empty())
+                continue;
+
+            if (words[0] == "size" && words.size() == 2) {
+                size = parse_hex<uint64_t>(words[1]);
+                continue;
+            } else if (words[0] != "extent" || words.size() != 4)
+                throw formatted_error("invalid block map line '{}'", line);
+
+            auto offset = parse_hex<uint64_t>(words[1]);
+            auto length = parse_hex<uint64_t>(words[2]);
+            auto packed = parse_hex<uint64_t>(words[3]);
 
-        if ((uint64_t)out.tellp() < sb.total_bytes) {
-            out.seekp(sb.total_bytes - 1);
-            out.put(0);
+            while (length > 0) {
+                auto in_off = (off64_t)packed;
+                auto out_off = (off64_t)offset;
+
+                auto ret = copy_file_range(in_fd, &in_off, out_fd, &out_off, length, 0);
+
+                if (ret < 0 && errno == EINTR)
+                    continue;
+
+                if (ret < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                    // fall back to copying by hand
+
+                    vector<uint8_t> buf((size_t)min(length, (uint64_t)(1024 * 1024)));
+
+                    ret = pread(in_fd, buf.data(), buf.size(), packed);
+
+                    if (ret > 0)
+                        ret = pwrite(out_fd, buf.data(), ret, offset);
+                }
+
+                if (ret < 0)
+                    throw formatted_error("failed to copy extent at {:x} (errno {})", offset, errno);
+                else if (ret == 0)
+                    throw formatted_error("{} is too short for its block map", packed_path);
+
+                offset += ret;
+                packed += ret;
+                length -= ret;
+            }
         }
+
+        if (!size)
+            throw formatted_error("block map '{}' has no size line", map_path.string());
+
+        if (ftruncate(out_fd, *size) < 0)
+            throw formatted_error("ftruncate failed (errno {})", errno);
+    } catch (...) {
+        close(in_fd);
+        close(out_fd);
+        throw;
     }
 
-    write_superblock(out, sb);
+    close(in_fd);
+    close(out_fd);
 }
 
 int main(int argc, char* argv[]) {
     try {
         bool print_version = false, print_usage = false;
+        assemble_options opts;
+        optional<filesystem::path> expand_map;
+
+        opts.num_workers = max(thread::hardware_concurrency(), 1u);
+
+        optional<filesystem::path> trace_fn;
 
         enum {
             GETOPT_VAL_VERSION,
-            GETOPT_VAL_HELP
+            GETOPT_VAL_HELP,
+            GETOPT_VAL_TRACE
         };
 
         static const struct option long_options[] = {
+            { "jobs", required_argument, nullptr, 'j' },
+            { "metadata-only", required_argument, nullptr, 'm' },
+            { "expand", required_argument, nullptr, 'x' },
+            { "verbose", no_argument, nullptr, 'v' },
+            { "memory", required_argument, nullptr, 'M' },
+            { "trace", required_argument, nullptr, GETOPT_VAL_TRACE },
             { "version", no_argument, nullptr, GETOPT_VAL_VERSION },
             { "help", no_argument, nullptr, GETOPT_VAL_HELP },
             { nullptr, 0, nullptr, 0 }
         };
 
         int opt;
-        while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        while ((opt = getopt_long(argc, argv, "j:m:x:vM:", long_options, nullptr)) != -1) {
             switch (opt) {
+                case 'j': {
+                    auto sv = string_view(optarg);
+
+                    auto [ptr, ec] = from_chars(sv.begin(), sv.end(), opts.num_workers);
+
+                    if (ptr != sv.end() || opts.num_workers == 0)
+                        throw formatted_error("invalid number of jobs {}", sv);
+
+                    break;
+                }
+                case 'm':
+                    opts.block_map = optarg;
+                    break;
+                case 'x':
+                    expand_map = optarg;
+                    break;
+                case 'v':
+                    opts.verbose = true;
+                    break;
+                case 'M': {
+                    auto sv = string_view(optarg);
+                    size_t mib;
+
+                    auto [ptr, ec] = from_chars(sv.begin(), sv.end(), mib);
+
+                    if (ptr != sv.end() || mib == 0)
+                        throw formatted_error("invalid memory limit {}", sv);
+
+                    opts.memory_limit = mib * 1024 * 1024;
+                    break;
+                }
+                case GETOPT_VAL_TRACE:
+                    trace_fn = optarg;
+                    break;
                 case GETOPT_VAL_VERSION:
                     print_version = true;
                     break;
@@ -2935,16 +4948,40 @@ int main(int argc, char* argv[]) {
         if (print_usage || optind + 2 > argc) {
             cerr << R"(Usage: btrfs-assemble input.txt output.img
 
-Assemble a text file produced by btrfs-dump into a btrfs image.
+Assemble a text file produced by btrfs-dump into a btrfs image. The input
+may also be compressed with zstd, or a binary dump produced by
+btrfs-dump --format=binary.
 
 Options:
+    -j|--jobs <n>       number of threads to parse and checksum nodes with
+                        (default is the number of CPUs)
+    -m|--metadata-only <map>
+                        pack the written blocks together at the start of
+                        output.img, and write the block map to map
+    -x|--expand <map>   rather than assembling, rebuild a sparse image from
+                        the metadata-only image input.img and its block map
+    -v|--verbose        print the size of the image and the space it takes up
+    -M|--memory <MiB>   keep memory use within roughly this much, and report
+                        the peak at the end
+    --trace <file>      record the time spent parsing, checksumming and
+                        writing each node to file as Chrome trace-event JSON
     --version           print version string
     --help              print this screen
 )";
             return 1;
         }
 
-        assemble(argv[optind], argv[optind + 1]);
+        if (trace_fn) {
+            trace::open(*trace_fn, "btrfs-assemble");
+            trace::thread_name("main");
+        }
+
+        if (expand_map)
+            expand_image(*expand_map, argv[optind], argv[optind + 1]);
+        else
+            assemble(argv[optind], argv[optind + 1], opts);
+
+        trace::close();
     } catch (const exception& e) {
         cerr << "Error: " << e.what() << endl;
         return 1;
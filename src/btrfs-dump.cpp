@@ -1,761 +1,239 @@
 #include <iostream>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <format>
 #include <map>
+#include <set>
 #include <functional>
 #include <memory>
-#include <list>
 #include <getopt.h>
-#include <blkid.h>
+#include <unistd.h>
 #include "config.h"
 
 import cxxbtrfs;
 import formatted_error;
-import b64;
+import bindump;
+import zstdio;
+import jsonl;
+import itemjson;
+import columnar;
+import traverse;
+import itemfmt;
+import stats;
+import trace;
 
 using namespace std;
 
-#define MAX_STRIPES 16
-
-class blkid_cache_putter {
+// Passes everything through to another streambuf, keeping track of how many
+// bytes have been written, so that we know where we are in the output.
+class counting_buf : public streambuf {
 public:
-    using pointer = blkid_cache;
+    counting_buf(streambuf& sb) : sb(sb) { }
 
-    void operator()(blkid_cache cache) {
-        blkid_put_cache(cache);
+    uint64_t count() const {
+        return written;
     }
-};
-
-using blkid_cache_ptr = unique_ptr<blkid_cache, blkid_cache_putter>;
-
-class blkid_dev_iterate_ender {
-public:
-    using pointer = blkid_dev_iterate;
-
-    void operator()(blkid_dev_iterate iter) {
-        blkid_dev_iterate_end(iter);
-    }
-};
-
-using blkid_dev_iterate_ptr = unique_ptr<blkid_dev_iterate, blkid_dev_iterate_ender>;
-
-struct chunk : btrfs::chunk {
-    btrfs::stripe next_stripes[MAX_STRIPES - 1];
-};
-
-struct device {
-    device(ifstream& f, string_view name) : f(f), name(name) { }
-
-    ifstream& f;
-    string name;
-    btrfs::super_block sb;
-};
-
-struct fs_info {
-    map<uint64_t, device> devices;
-    map<uint64_t, chunk> chunks, sys_chunks;
-    map<uint64_t, pair<uint64_t, uint64_t>> remaps;
-};
-
-static void read_superblock(device& d) {
-    d.f.seekg(btrfs::superblock_addrs[0]);
-    d.f.read((char*)&d.sb, sizeof(d.sb));
-}
 
-static const pair<uint64_t, const chunk&> find_chunk(const map<uint64_t, chunk>& chunks,
-                                                     uint64_t address) {
-    auto it = chunks.upper_bound(address);
+protected:
+    int_type overflow(int_type ch) override {
+        if (ch == traits_type::eof())
+            return traits_type::not_eof(ch);
 
-    if (it == chunks.begin())
-        throw formatted_error("could not find address {:x} in chunks", address);
+        if (sb.sputc((char)ch) == traits_type::eof())
+            return traits_type::eof();
 
-    const auto& p = *prev(it);
+        written++;
 
-    if (p.first + p.second.length <= address)
-        throw formatted_error("could not find address {:x} in chunks", address);
-
-    return p;
-}
-
-static string read_data(const fs_info& info, uint64_t addr, uint64_t size,
-                        bool ignore_remap) {
-    auto& chunks = info.chunks.empty() ? info.sys_chunks : info.chunks;
-    auto& [chunk_start, c] = find_chunk(chunks, addr);
-
-    if (!ignore_remap && c.type & btrfs::BLOCK_GROUP_REMAPPED) {
-        auto it = info.remaps.upper_bound(addr);
-
-        if (it == info.remaps.begin())
-            throw formatted_error("could not find address {:x} in remap tree", addr);
-
-        const auto& r = *prev(it);
-
-        if (r.first + r.second.first <= addr)
-            throw formatted_error("could not find address {:x} in remap tree", addr);
-
-        auto new_addr = addr - r.first + r.second.second;
-
-        return read_data(info, new_addr, size, true);
+        return ch;
     }
 
-    string ret;
-
-    ret.resize(size);
-
-    // FIXME - handle degraded reads?
-
-    switch (btrfs::get_chunk_raid_type(c)) {
-        case btrfs::raid_type::RAID5:
-        case btrfs::raid_type::RAID6: {
-            auto data_stripes = c.num_stripes - 1;
+    streamsize xsputn(const char* s, streamsize n) override {
+        auto ret = sb.sputn(s, n);
 
-            if (btrfs::get_chunk_raid_type(c) == btrfs::raid_type::RAID6)
-                data_stripes--;
-
-            auto stripeoff = (addr - chunk_start) % (data_stripes * c.stripe_len);
-            auto parity = (((addr - chunk_start) / (data_stripes * c.stripe_len)) + c.num_stripes - 1) % c.num_stripes;
-            auto stripe2 = stripeoff / c.stripe_len;
-            auto stripe = (parity + stripe2 + 1) % c.num_stripes;
-
-            if (info.devices.count(c.stripe[stripe].devid) == 0)
-                throw formatted_error("device {} not found", c.stripe[stripe].devid);
-
-            auto& d = info.devices.at(c.stripe[stripe].devid);
-
-            d.f.seekg(c.stripe[stripe].offset + (((addr - chunk_start) / (data_stripes * c.stripe_len)) * c.stripe_len) + (stripeoff % c.stripe_len));
-            d.f.read(ret.data(), size);
-
-            break;
-        }
-
-        case btrfs::raid_type::RAID10: {
-            auto stripe_num = (addr - chunk_start) / c.stripe_len;
-            auto stripe_offset = (addr - chunk_start) % c.stripe_len;
-            auto stripe = (stripe_num % (c.num_stripes / c.sub_stripes)) * c.sub_stripes;
-
-            if (info.devices.count(c.stripe[stripe].devid) == 0)
-                throw formatted_error("device {} not found", c.stripe[stripe].devid);
-
-            auto& d = info.devices.at(c.stripe[stripe].devid);
-
-            d.f.seekg(c.stripe[stripe].offset + ((stripe_num / (c.num_stripes / c.sub_stripes)) * c.stripe_len) + stripe_offset);
-            d.f.read(ret.data(), size);
-
-            break;
-        }
-
-        case btrfs::raid_type::RAID0: {
-            auto stripe_num = (addr - chunk_start) / c.stripe_len;
-            auto stripe_offset = (addr - chunk_start) % c.stripe_len;
-            auto stripe = stripe_num % c.num_stripes;
-
-            if (info.devices.count(c.stripe[stripe].devid) == 0)
-                throw formatted_error("device {} not found", c.stripe[stripe].devid);
-
-            auto& d = info.devices.at(c.stripe[stripe].devid);
-
-            d.f.seekg(c.stripe[stripe].offset + ((stripe_num / c.num_stripes) * c.stripe_len) + stripe_offset);
-            d.f.read(ret.data(), size);
-
-            break;
-        }
+        written += ret;
 
-        default: { // SINGLE, DUP, RAID1, RAID1C3, RAID1C4
-            if (info.devices.count(c.stripe[0].devid) == 0)
-                throw formatted_error("device {} not found", c.stripe[0].devid);
-
-            auto& d = info.devices.at(c.stripe[0].devid);
-
-            d.f.seekg(c.stripe[0].offset + addr - chunk_start);
-            d.f.read(ret.data(), size);
-
-            break;
-        }
+        return ret;
     }
 
-    return ret;
-}
-
-static string free_space_bitmap(span<const uint8_t> s, uint64_t offset,
-                                uint32_t sector_size) {
-    string runs;
-
-    uint64_t run_start = 0;
-    bool last_zero = true;
-
-    for (size_t i = 0; i < s.size(); i++) {
-        auto c = s[i];
-
-        for (unsigned int j = 0; j < 8; j++) {
-            if (c & 1) {
-                if (last_zero)
-                    run_start = (i * 8) + j;
-
-                last_zero = false;
-            } else {
-                if (!last_zero) {
-                    if (!runs.empty())
-                        runs += "; ";
-
-                    runs += format("{:x}, {:x}", offset + (run_start * sector_size),
-                                   (((i * 8) + j) - run_start) * sector_size);
-                }
-
-                last_zero = true;
-            }
-
-            c >>= 1;
-        }
+    int sync() override {
+        return sb.pubsync();
     }
 
-    if (!last_zero) {
-        if (!runs.empty())
-            runs += "; ";
+private:
+    streambuf& sb;
+    uint64_t written = 0;
+};
 
-        runs += format("{:x}, {:x}", offset + (run_start * sector_size),
-                       ((s.size() * 8) - run_start) * sector_size);
+// Buffers the output on its way to another streambuf, so that the time spent
+// actually writing it can be measured or traced without reading the clock on
+// every <<.
+class timed_buf : public streambuf {
+public:
+    timed_buf(streambuf& sb) : sb(sb), buf(BUFFER_SIZE) {
+        setp(buf.data(), buf.data() + buf.size());
     }
 
-    return runs;
-}
-
-static void dump_item(span<const uint8_t> s, string_view pref,
-                      const btrfs::key& key, const btrfs::super_block& sb) {
-    // FIXME - handle short items
-
-    cout << pref;
-
-    if ((uint8_t)key.type == 0 && key.objectid == btrfs::FREE_SPACE_OBJECTID) {
-        const auto& fsh = *(btrfs::free_space_header*)s.data();
-
-        cout << format("free_space {}", fsh);
-
-        s = s.subspan(sizeof(btrfs::free_space_header));
-    } else if (key.objectid == btrfs::BALANCE_OBJECTID && key.type == btrfs::key_type::TEMPORARY_ITEM) {
-        const auto& bi = *(btrfs::balance_item*)s.data();
-
-        cout << format("balance {}", bi);
-
-        s = s.subspan(sizeof(btrfs::balance_item));
-    } else {
-        switch (key.type) {
-            using enum btrfs::key_type;
-
-            case INODE_ITEM: {
-                const auto& ii = *(btrfs::inode_item*)s.data();
-
-                cout << format("inode_item {}", ii);
-
-                s = s.subspan(sizeof(btrfs::inode_item));
-
-                break;
-            }
-
-            case INODE_REF: {
-                cout << "inode_ref";
-
-                do {
-                    const auto& ir = *(btrfs::inode_ref*)s.data();
-
-                    cout << format(" {}", ir);
-
-                    s = s.subspan(sizeof(btrfs::inode_ref) + ir.name_len);
-                } while (!s.empty());
-
-                break;
-            }
-
-            case INODE_EXTREF: {
-                cout << "inode_extref";
-
-                do {
-                    const auto& ier = *(btrfs::inode_extref*)s.data();
-
-                    cout << format(" {}", ier);
-
-                    s = s.subspan(offsetof(btrfs::inode_extref, name) + ier.name_len);
-                } while (!s.empty());
-
-                break;
-            }
-
-            case XATTR_ITEM: {
-                cout << "xattr_item";
-
-                do {
-                    const auto& di = *(btrfs::dir_item*)s.data();
-
-                    cout << format(" {}", di);
-
-                    s = s.subspan(sizeof(btrfs::dir_item) + di.data_len + di.name_len);
-                } while (!s.empty());
-
-                break;
-            };
-
-            case VERITY_DESC_ITEM: {
-                if (key.offset == 0) {
-                    const auto& vdi = *(btrfs::verity_descriptor_item*)s.data();
-
-                    cout << format("verity_desc_item {}", vdi);
-                    s = s.subspan(sizeof(btrfs::verity_descriptor_item));
-                } else {
-                    const auto& desc = *(btrfs::fsverity_descriptor*)s.data();
-
-                    cout << format("fsverity_descriptor {}", desc);
-                    s = s.subspan(sizeof(btrfs::fsverity_descriptor));
-
-                    if (!s.empty()) {
-                        cout << format(" sig={}", b64encode(s));
-                        s = s.subspan(s.size());
-                    }
-                }
-
-                break;
-            }
-
-            case VERITY_MERKLE_ITEM: {
-                cout << "verity_merkle_item";
-
-                for (size_t i = 0; i < s.size(); i++) {
-                    if (i % 32 == 0)
-                        cout << " ";
-
-                    cout << format("{:02x}", s[i]);
-                }
-
-                s = s.subspan(s.size());
-
-                break;
-            }
-
-            case ORPHAN_ITEM:
-                cout << "orphan_item";
-                break;
-
-            case DIR_LOG_INDEX: {
-                const auto& dli = *(btrfs::dir_log_item*)s.data();
-
-                cout << format("dir_log_index {}", dli);
-
-                s = s.subspan(sizeof(btrfs::dir_log_item));
-
-                break;
-            }
-
-            case DIR_ITEM: {
-                cout << "dir_item";
-
-                do {
-                    const auto& di = *(btrfs::dir_item*)s.data();
-
-                    cout << format(" {}", di);
-
-                    s = s.subspan(sizeof(btrfs::dir_item) + di.data_len + di.name_len);
-                } while (!s.empty());
-
-                break;
-            }
-
-            case DIR_INDEX: {
-                const auto& di = *(btrfs::dir_item*)s.data();
-
-                cout << format("dir_index {}", di);
-
-                s = s.subspan(sizeof(btrfs::dir_item) + di.data_len + di.name_len);
-
-                break;
-            }
-
-            case EXTENT_DATA: {
-                const auto& fei = *(btrfs::file_extent_item*)s.data();
-
-                cout << format("extent_data {}", fei);
-
-                if (fei.type == btrfs::file_extent_item_type::inline_extent) {
-                    if (fei.compression != btrfs::compression_type::none) {
-                        // if compressed inline extent, don't bother checking for over- or underrun
-                        s = s.subspan(s.size());
-                    } else {
-                        s = s.subspan(offsetof(btrfs::file_extent_item, disk_bytenr));
-                        s = s.subspan(fei.ram_bytes);
-                    }
-                } else
-                    s = s.subspan(sizeof(btrfs::file_extent_item));
-
-                break;
-            }
-
-            case EXTENT_CSUM: {
-                cout << format("extent_csum");
-
-                switch (sb.csum_type) {
-                    case btrfs::csum_type::CRC32: {
-                        auto nums = span((btrfs::le32*)s.data(), s.size() / sizeof(btrfs::le32));
-
-                        for (auto n : nums) {
-                            cout << format(" {:08x}", n);
-                        }
-
-                        s = s.subspan(nums.size_bytes());
-                        break;
-                    }
-
-                    case btrfs::csum_type::XXHASH: {
-                        auto nums = span((btrfs::le64*)s.data(), s.size() / sizeof(btrfs::le64));
-
-                        for (auto n : nums) {
-                            cout << format(" {:016x}", n);
-                        }
-
-                        s = s.subspan(nums.size_bytes());
-                        break;
-                    }
-
-                    case btrfs::csum_type::SHA256:
-                    case btrfs::csum_type::BLAKE2: {
-                        using arr = array<btrfs::le64, 4>;
-                        auto nums = span((arr*)s.data(), s.size() / sizeof(arr));
-
-                        for (auto n : nums) {
-                            cout << format(" {:016x}{:016x}{:016x}{:016x}",
-                                        n[0], n[1], n[2], n[3]);
-                        }
-
-                        s = s.subspan(nums.size_bytes());
-                        break;
-                    }
-                }
-
-                break;
-            }
-
-            case ROOT_ITEM: {
-                const auto& ri = *(btrfs::root_item*)s.data();
-
-                cout << format("root_item {}", ri);
-
-                s = s.subspan(sizeof(btrfs::root_item));
-
-                break;
-            }
-
-            case ROOT_BACKREF:
-            case ROOT_REF: {
-                const auto& rr = *(btrfs::root_ref*)s.data();
-
-                cout << format("{} {}", key.type == ROOT_BACKREF ? "root_backref" : "root_ref",
-                            rr);
-
-                s = s.subspan(sizeof(btrfs::root_ref) + rr.name_len);
-
-                break;
-            }
-
-            case EXTENT_ITEM:
-            case METADATA_ITEM: {
-                const auto& ei = *(btrfs::extent_item*)s.data();
-
-                if (key.type == METADATA_ITEM)
-                    cout << format("metadata_item {}", ei);
-                else
-                    cout << format("extent_item {}", ei);
-
-                // FIXME - EXTENT_ITEM_V0(?)
-
-                s = s.subspan(sizeof(btrfs::extent_item));
-
-                if (key.type == EXTENT_ITEM && ei.flags & btrfs::EXTENT_FLAG_TREE_BLOCK) {
-                    const auto& tbi = *(btrfs::tree_block_info*)s.data();
-
-                    cout << format(" {}", tbi);
-                    s = s.subspan(sizeof(btrfs::tree_block_info));
-                }
-
-                while (s.size() >= sizeof(btrfs::extent_inline_ref)) {
-                    bool handled = true;
-                    const auto& eir = *(btrfs::extent_inline_ref*)s.data();
-
-                    s = s.subspan(sizeof(btrfs::extent_inline_ref));
-
-                    switch (eir.type) {
-                        case TREE_BLOCK_REF:
-                            cout << format(" tree_block_ref root={:x}", eir.offset);
-                        break;
-
-                        case SHARED_BLOCK_REF:
-                            cout << format(" shared_block_ref offset={:x}", eir.offset);
-                        break;
-
-                        case EXTENT_DATA_REF: {
-                            const auto& edr = *(btrfs::extent_data_ref*)&eir.offset;
-
-                            cout << format(" extent_data_ref {}", edr);
-                            s = s.subspan(sizeof(btrfs::extent_data_ref) - sizeof(btrfs::le64));
-                            break;
-                        }
-
-                        case SHARED_DATA_REF: {
-                            const auto& sdr = *(btrfs::shared_data_ref*)((uint8_t*)&eir + sizeof(btrfs::extent_inline_ref));
-
-                            cout << format(" shared_data_ref offset={:x} {}", eir.offset, sdr);
-                            s = s.subspan(sizeof(btrfs::shared_data_ref));
-                            break;
-                        }
-
-                        case EXTENT_OWNER_REF:
-                            cout << format(" extent_owner_ref root={:x}", eir.offset);
-                        break;
-
-                        default:
-                            cout << format(" {:02x}", (uint8_t)eir.type);
-                            handled = false;
-                        break;
-                    }
-
-                    if (!handled)
-                        break;
-                }
-
-                break;
-            }
-
-            case TREE_BLOCK_REF:
-                cout << "tree_block_ref";
-                break;
-
-            case EXTENT_DATA_REF: {
-                const auto& edr = *(btrfs::extent_data_ref*)s.data();
-
-                cout << format("extent_data_ref {}", edr);
-
-                s = s.subspan(sizeof(btrfs::extent_data_ref));
-
-                break;
-            }
-
-            // } elsif ($type == 0xb4) { # EXTENT_REF_V0
-            //     @b = unpack("QQQv", $s);
-            //     $s = substr($s, 28);
-            //
-            //     printf("extent_ref_v0 root=%x gen=%x objid=%x count=%x", @b);
-
-            case SHARED_BLOCK_REF:
-                cout << "shared_block_ref";
-                break;
-
-            case SHARED_DATA_REF: {
-                const auto& sdr = *(btrfs::shared_data_ref*)s.data();
-
-                cout << format("shared_data_ref {}", sdr);
-
-                s = s.subspan(sizeof(btrfs::shared_data_ref));
-
-                break;
-            }
-
-            case BLOCK_GROUP_ITEM: {
-                if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE) {
-                    const auto& bgi = *(btrfs::block_group_item_v2*)s.data();
-
-                    cout << format("block_group_item {}", bgi);
-
-                    s = s.subspan(sizeof(btrfs::block_group_item_v2));
-                } else {
-                    const auto& bgi = *(btrfs::block_group_item*)s.data();
-
-                    cout << format("block_group_item {}", bgi);
-
-                    s = s.subspan(sizeof(btrfs::block_group_item));
-                }
-                break;
-            }
-
-            case FREE_SPACE_INFO: {
-                const auto& fsi = *(btrfs::free_space_info*)s.data();
-
-                cout << format("free_space_info {}", fsi);
-
-                s = s.subspan(sizeof(btrfs::free_space_info));
-                break;
-            }
-
-            case FREE_SPACE_EXTENT: {
-                cout << format("free_space_extent");
-                break;
-            }
-
-            case FREE_SPACE_BITMAP: {
-                cout << format("free_space_bitmap {}",
-                               free_space_bitmap(s, key.objectid, sb.sectorsize));
-                s = s.subspan(s.size());
-                break;
-            }
-
-            case DEV_EXTENT: {
-                const auto& de = *(btrfs::dev_extent*)s.data();
-
-                cout << format("dev_extent {}", de);
-
-                s = s.subspan(sizeof(btrfs::dev_extent));
-                break;
-            }
-
-            case DEV_ITEM: {
-                const auto& d = *(btrfs::dev_item*)s.data();
-
-                cout << format("dev_item {}", d);
-
-                s = s.subspan(sizeof(btrfs::dev_item));
-                break;
-            }
-
-            case CHUNK_ITEM: {
-                const auto& c = *(btrfs::chunk*)s.data();
-
-                cout << format("chunk_item {}", c);
-
-                s = s.subspan(offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)));
-                break;
-            }
-
-            case RAID_STRIPE: {
-                const auto* rs = (btrfs::raid_stride*)s.data();
-
-                cout << "raid_stripe";
-
-                bool first = true;
-                while (s.size() >= sizeof(btrfs::raid_stride)) {
-                    if (!first)
-                        cout << ";";
-
-                    cout << format(" {}", *rs);
-
-                    s = s.subspan(sizeof(btrfs::raid_stride));
-                    rs++;
-                    first = false;
-                }
-
-                break;
-            }
-
-            case IDENTITY_REMAP: {
-                cout << format("identity_remap");
-                break;
-            }
-
-            case REMAP: {
-                const auto& r = *(btrfs::remap_item*)s.data();
+    ~timed_buf() {
+        flush();
+    }
 
-                cout << format("remap {}", r);
+protected:
+    int_type overflow(int_type ch) override {
+        if (!flush())
+            return traits_type::eof();
 
-                s = s.subspan(sizeof(btrfs::remap_item));
-                break;
-            }
+        if (ch != traits_type::eof()) {
+            *pptr() = (char)ch;
+            pbump(1);
+        }
 
-            case REMAP_BACKREF: {
-                const auto& r = *(btrfs::remap_item*)s.data();
+        return traits_type::not_eof(ch);
+    }
 
-                cout << format("remap_backref {}", r);
+    int sync() override {
+        if (!flush())
+            return -1;
 
-                s = s.subspan(sizeof(btrfs::remap_item));
-                break;
-            }
+        stats::scope t(stats::timer::output);
 
-            case QGROUP_STATUS: {
-                const auto& qsi = *(btrfs::qgroup_status_item*)s.data();
+        return sb.pubsync();
+    }
 
-                cout << format("qgroup_status {}", qsi);
+private:
+    bool flush() {
+        auto len = pptr() - pbase();
 
-                s = s.subspan(sizeof(btrfs::qgroup_status_item));
-                break;
-            }
+        if (len == 0)
+            return true;
 
-            case QGROUP_INFO: {
-                const auto& qi = *(btrfs::qgroup_info_item*)s.data();
+        stats::scope t(stats::timer::output);
+        trace::span sp("output");
 
-                cout << format("qgroup_info {}", qi);
+        sp.arg("bytes", len);
 
-                s = s.subspan(sizeof(btrfs::qgroup_info_item));
-                break;
-            }
+        auto ret = sb.sputn(pbase(), len);
 
-            case QGROUP_LIMIT: {
-                const auto& qli = *(btrfs::qgroup_limit_item*)s.data();
+        setp(buf.data(), buf.data() + buf.size());
 
-                cout << format("qgroup_limit {}", qli);
+        return ret == len;
+    }
 
-                s = s.subspan(sizeof(btrfs::qgroup_limit_item));
-                break;
-            }
+    static constexpr size_t BUFFER_SIZE = 65536;
 
-            case QGROUP_RELATION:
-                cout << "qgroup_relation";
-                break;
+    streambuf& sb;
+    vector<char> buf;
+};
 
-            case PERSISTENT_ITEM: {
-                auto nums = span((btrfs::le64*)s.data(), s.size() / sizeof(btrfs::le64));
+// Prints how far through the dump we are to stderr, every second or so (or
+// every ten seconds, if stderr isn't a terminal). It's only ever called from
+// the thread doing the walk, so there's no locking, and the clock is only
+// looked at every so many nodes.
+class progress_meter {
+public:
+    progress_meter() : tty(isatty(STDERR_FILENO)), start(chrono::steady_clock::now()), last(start) { }
 
-                cout << format("dev_stats");
+    // the estimated number of bytes of nodes that will be read in all
+    void set_total(uint64_t t) {
+        total = t;
+    }
 
-                for (auto n : nums) {
-                    cout << format(" {:x}", n);
-                }
+    uint64_t done() const {
+        return bytes;
+    }
 
-                s = s.subspan(nums.size_bytes());
-                break;
-            }
+    void node(uint64_t size) {
+        nodes++;
+        bytes += size;
 
-            case DEV_REPLACE: {
-                const auto& dri = *(btrfs::dev_replace_item*)s.data();
+        if (nodes % CHECK_INTERVAL != 0)
+            return;
 
-                cout << format("dev_replace {}", dri);
+        auto now = chrono::steady_clock::now();
 
-                s = s.subspan(sizeof(btrfs::dev_replace_item));
-                break;
-            }
+        if (now - last < (tty ? chrono::seconds{1} : chrono::seconds{10}))
+            return;
 
-            case UUID_SUBVOL: {
-                auto num = *(btrfs::le64*)s.data();
+        last = now;
+        print(now);
+    }
 
-                cout << format("uuid_subvol {:x}", num);
+    void finish() {
+        print(chrono::steady_clock::now());
 
-                s = s.subspan(sizeof(num));
-                break;
-            }
+        if (tty)
+            cerr << endl;
+    }
 
-            case UUID_RECEIVED_SUBVOL: {
-                auto num = *(btrfs::le64*)s.data();
+private:
+    void print(chrono::steady_clock::time_point now) {
+        auto elapsed = chrono::duration<double>(now - start).count();
+        string line;
 
-                cout << format("uuid_rec_subvol {:x}", num);
+        if (elapsed <= 0.0)
+            elapsed = 1e-9;
 
-                s = s.subspan(sizeof(num));
-                break;
-            }
+        line = format("{} nodes, {} MiB", nodes, bytes / 1048576);
 
-            default:
-                cerr << format("ERROR - unknown type {} (size {:x})", key.type, s.size()) << endl;
+        // the estimate can be out either way, so never claim to be done early
+        if (total != 0) {
+            auto t = max(total, bytes);
 
-                cout << format("unknown (size={:x})", s.size());
+            line += format(" of ~{} MiB ({}%)", t / 1048576, (bytes * 100) / t);
         }
-    }
 
-    if (!s.empty()) {
-        cout << " extra=";
-        for (auto b : s) {
-            cout << format("{:02x}", b);
+        line += format(", {:.0f} nodes/s, {:.1f} MiB/s", (double)nodes / elapsed,
+                       (double)bytes / (elapsed * 1048576.0));
+
+        if (total > bytes && bytes != 0) {
+            auto eta = (uint64_t)(elapsed * (double)(total - bytes) / (double)bytes);
+
+            line += format(", ETA {}:{:02}:{:02}", eta / 3600, (eta / 60) % 60, eta % 60);
         }
+
+        if (tty)
+            cerr << format("\r{}\x1b[K", line) << flush;
+        else
+            cerr << line << endl;
     }
 
-    cout << endl;
-}
+    static constexpr uint64_t CHECK_INTERVAL = 64;
+
+    bool tty;
+    chrono::steady_clock::time_point start, last;
+    uint64_t nodes = 0;
+    uint64_t bytes = 0;
+    uint64_t total = 0;
+};
 
-static string physical_str(const fs_info& info, uint64_t addr) {
+enum class output_format {
+    text,
+    binary,
+    jsonl,
+    arrow
+};
+
+struct dump_output {
+    output_format format = output_format::text;
+    bool print_physical = false;
+    bindump::writer* bin = nullptr;
+    zstdio::writer* zstd = nullptr;
+    ostream* index = nullptr;
+    const counting_buf* counter = nullptr;
+    columnar::exporter* columns = nullptr;
+    bool stats = false;
+    bool trace = false;
+    progress_meter* progress = nullptr;
+};
+
+static string physical_str(const traverse::fs_info& info, uint64_t addr) {
     auto& chunks = info.chunks.empty() ? info.sys_chunks : info.chunks;
     string ret;
 
-    auto& [chunk_start, c] = find_chunk(chunks, addr);
+    if (info.archive)
+        throw runtime_error("physical addresses are not available when reading a binary dump");
+
+    auto& [chunk_start, c] = traverse::find_chunk(chunks, addr);
 
     // FIXME - device names rather than numbers?
 
@@ -819,318 +297,281 @@ static string physical_str(const fs_info& info, uint64_t addr) {
     return ret;
 }
 
-static void dump_tree(const fs_info& info, uint64_t addr, string_view pref,
-                      bool print, bool print_physical,
-                      optional<function<void(const btrfs::key&, span<const uint8_t>)>> func = nullopt) {
-    const auto& sb = info.devices.begin()->second.sb;
-    auto tree = read_data(info, addr, sb.nodesize, false);
-
-    const auto& h = *(btrfs::header*)tree.data();
+static string header_str(const btrfs::header& h, btrfs::csum_type csum_type) {
+    // FIXME - make this less hacky (pass csum_type through to formatter?)
+    switch (csum_type) {
+        case btrfs::csum_type::CRC32:
+            return format("{:a}", h);
 
-    // FIXME - also die on generation or level mismatch? Or option to struggle on manfully?
+        case btrfs::csum_type::XXHASH:
+            return format("{:b}", h);
 
-    if (h.bytenr != addr)
-        throw formatted_error("Address mismatch: expected {:x}, got {:x}", addr, h.bytenr);
+        case btrfs::csum_type::SHA256:
+        case btrfs::csum_type::BLAKE2:
+            return format("{:c}", h);
 
-    if (print) {
-        // FIXME - make this less hacky (pass csum_type through to formatter?)
-        switch (sb.csum_type) {
-            case btrfs::csum_type::CRC32:
-                cout << format("{}header {:a}", pref, h);
-                break;
-
-            case btrfs::csum_type::XXHASH:
-                cout << format("{}header {:b}", pref, h);
-                break;
-
-            case btrfs::csum_type::SHA256:
-            case btrfs::csum_type::BLAKE2:
-                cout << format("{}header {:c}", pref, h);
-                break;
-
-            default:
-                cout << format("{}header {}", pref, h);
-                break;
-        }
-
-        if (print_physical)
-            cout << format(" physical={}", physical_str(info, addr));
-
-        cout << endl;
+        default:
+            return format("{}", h);
     }
+}
 
-    if (h.level == 0) {
-        auto items = span((btrfs::item*)((uint8_t*)&h + sizeof(btrfs::header)), h.nritems);
+// JSON Lines output is built up one object at a time in a reused buffer, so
+// memory use doesn't depend on the size of the filesystem.
 
-        for (const auto& it : items) {
-            if (print)
-                cout << format("{}{:x}\n", pref, it.key);
+static string json_line;
 
-            auto item = span((uint8_t*)tree.data() + sizeof(btrfs::header) + it.offset, it.size);
+static void json_begin(string_view kind, uint64_t tree_id) {
+    json_line.clear();
+    format_to(back_inserter(json_line), "{{\"kind\":\"{}\",\"tree\":{}", kind, tree_id);
+}
 
-            if (print)
-                dump_item(item, pref, it.key, sb);
+static void json_key(uint64_t node, size_t slot, const btrfs::key& key) {
+    format_to(back_inserter(json_line), ",\"node\":{},\"slot\":{},\"objectid\":{},\"type\":",
+              node, slot, (uint64_t)key.objectid);
+    jsonl::escape(json_line, format("{}", key.type));
+    format_to(back_inserter(json_line), ",\"offset\":{}", (uint64_t)key.offset);
+}
 
-            if (func.has_value())
-                func.value()(it.key, item);
-        }
-    } else {
-        auto items = span((btrfs::key_ptr*)((uint8_t*)&h + sizeof(btrfs::header)), h.nritems);
-        auto pref2 = string{pref} + " "; // FIXME
+static void json_end() {
+    json_line += "}\n";
+    cout.write(json_line.data(), json_line.size());
+}
 
-        for (const auto& it : items) {
-            if (print)
-                cout << format("{}{}\n", pref, it);
+static void json_item(uint64_t tree_id, uint64_t node, size_t slot, const btrfs::key& key,
+                      span<const uint8_t> item, const btrfs::super_block& sb) {
+    json_begin("item", tree_id);
+    json_key(node, slot, key);
+    format_to(back_inserter(json_line), ",\"size\":{}", item.size());
 
-            dump_tree(info, it.blockptr, pref2, print, print_physical, func);
-        }
-    }
-}
+    jsonl::writer w(json_line);
 
-static map<uint64_t, chunk> load_sys_chunks(const btrfs::super_block& sb) {
-    map<uint64_t, chunk> sys_chunks;
+    itemjson::item(w, item, key, sb);
+    json_end();
+}
 
-    auto sys_array = span(sb.sys_chunk_array.data(), sb.sys_chunk_array_size);
+static void dump_tree(const traverse::fs_info& info, const dump_output& out, uint64_t tree_id,
+                      uint64_t addr, bool print,
+                      optional<function<void(const btrfs::key&, span<const uint8_t>)>> func = nullopt) {
+    const auto& sb = info.devices.begin()->second.sb;
+    bool print_text = print && out.format == output_format::text;
+    bool print_json = print && out.format == output_format::jsonl;
+    string pref;
 
-    while (!sys_array.empty()) {
-        if (sys_array.size() < sizeof(btrfs::key))
-            throw runtime_error("sys array truncated");
+    for (const auto& ev : traverse::walk(info, tree_id, addr)) {
+        const auto& h = *ev.header;
 
-        auto& k = *(btrfs::key*)sys_array.data();
+        pref.assign(ev.depth, ' ');
 
-        if (k.type != btrfs::key_type::CHUNK_ITEM)
-            throw formatted_error("unexpected key type {} in sys array", k.type);
+        switch (ev.type) {
+            case traverse::event_type::node:
+                if (out.progress)
+                    out.progress->node(ev.node.size());
 
-        sys_array = sys_array.subspan(sizeof(btrfs::key));
+                if (print && out.format == output_format::binary)
+                    out.bin->add_node(tree_id, ev.node);
 
-        if (sys_array.size() < offsetof(btrfs::chunk, stripe))
-            throw runtime_error("sys array truncated");
+                if (print_text && out.index)
+                    *out.index << format("node {:x} {:x} {:x}\n", out.counter->count(), h.bytenr, tree_id);
 
-        auto& c = *(chunk*)sys_array.data();
+                if (print_json) {
+                    jsonl::writer w(json_line);
 
-        if (sys_array.size() < offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)))
-            throw runtime_error("sys array truncated");
+                    json_begin("node", tree_id);
+                    itemjson::header(w, h, sb.csum_type);
+                    json_end();
+                }
 
-        if (c.num_stripes > MAX_STRIPES) {
-            throw formatted_error("chunk num_stripes is {}, maximum supported is {}",
-                                  c.num_stripes, MAX_STRIPES);
-        }
+                if (print_text) {
+                    cout << format("{}header {}", pref, header_str(h, sb.csum_type));
 
-        sys_array = sys_array.subspan(offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)));
+                    if (out.print_physical)
+                        cout << format(" physical={}", physical_str(info, ev.addr));
 
-        sys_chunks.insert(make_pair((uint64_t)k.offset, c));
-    }
+                    cout << endl;
+                }
 
-    return sys_chunks;
-}
+                break;
 
-static vector<string> find_devices(const btrfs::uuid& fsid) {
-    vector<string> ret;
-    blkid_cache_ptr cache;
+            case traverse::event_type::item:
+                if (print_text)
+                    cout << format("{}{:x}\n", pref, ev.key);
 
-    if (blkid_get_cache(out_ptr(cache), nullptr) < 0)
-        throw runtime_error("blkid_get_cache failed");
+                if (print) {
+                    stats::scope t(stats::timer::format);
 
-    if (blkid_probe_all(cache.get()) < 0)
-        throw runtime_error("blkid_probe_all failed");
+                    if (print_text)
+                        itemfmt::dump_item(cout, ev.item, pref, ev.key, sb);
+                    else if (print_json)
+                        json_item(tree_id, ev.addr, ev.slot, ev.key, ev.item, sb);
+                    else if (out.columns)
+                        out.columns->add_item(tree_id, ev.key, ev.item);
+                }
 
-    {
-        blkid_dev_iterate_ptr iter{blkid_dev_iterate_begin(cache.get())};
-        blkid_dev dev;
+                if (func.has_value())
+                    func.value()(ev.key, ev.item);
 
-        auto fsid_str = format("{}", fsid);
+                break;
 
-        blkid_dev_set_search(iter.get(), "TYPE", "btrfs");
-        blkid_dev_set_search(iter.get(), "UUID", fsid_str.c_str());
+            case traverse::event_type::ptr:
+                if (print_text)
+                    cout << format("{}{}\n", pref, *ev.ptr);
+                else if (print_json) {
+                    json_begin("ptr", tree_id);
+                    json_key(ev.addr, ev.slot, ev.key);
+                    format_to(back_inserter(json_line), ",\"blockptr\":{},\"generation\":{}",
+                              (uint64_t)ev.ptr->blockptr, (uint64_t)ev.ptr->generation);
+                    json_end();
+                }
 
-        while (blkid_dev_next(iter.get(), &dev) == 0) {
-            ret.emplace_back(blkid_dev_devname(dev));
+                break;
         }
     }
-
-    return ret;
 }
 
-static void dump(const vector<filesystem::path>& fns, optional<uint64_t> tree_id,
-                 bool print_physical) {
-    map<int64_t, uint64_t> roots, log_roots;
-    list<pair<ifstream, string>> files;
-    fs_info info;
-
-    for (const auto& p : fns) {
-        files.emplace_back(p, p.string());
+static void print_label(const dump_output& out, string_view label) {
+    // each tree gets its own zstd frame, so it can be found from the index
+    if (out.zstd)
+        out.zstd->new_frame(label);
 
-        if (files.back().first.fail())
-            throw formatted_error("Failed to open {}", p.string()); // FIXME - include why
-    }
+    if (out.index)
+        *out.index << format("section {:x} {}\n", out.counter->count(), label);
 
-    auto& devices = info.devices;
+    cout << label << ":" << endl;
+}
 
-    for (auto& f : files) {
-        device d(f.first, f.second);
+// tree_ids is empty to dump everything.
+static void dump(const vector<filesystem::path>& fns, const set<uint64_t>& tree_ids,
+                 dump_output out) {
+    map<int64_t, uint64_t> roots, log_roots;
+    map<uint64_t, uint64_t> root_sizes;
+    traverse::volume vol(fns);
+    auto& info = vol.info();
+    const auto& sb = vol.sb();
+    optional<bindump::writer> bin;
+    auto fmt = out.format;
+    bool text = fmt == output_format::text;
+    bool all = tree_ids.empty();
+
+    // a single tree is printed on its own, several are labelled as in a full dump
+    bool labels = text && tree_ids.size() != 1;
+
+    auto wanted = [&](uint64_t id) {
+        return all || tree_ids.contains(id);
+    };
 
-        read_superblock(d);
+    // A binary dump always has the chunk, remap and root trees, even with -t,
+    // as without them it can't be read back or assembled.
+    auto stored = [&](uint64_t id) {
+        return wanted(id) || fmt == output_format::binary;
+    };
 
-        if (d.sb.magic != btrfs::MAGIC)
-            throw runtime_error("not a btrfs device");
+    auto note_root = [&](uint64_t id, const btrfs::root_item& ri) {
+        roots.insert(make_pair(id, ri.bytenr));
 
-        if (devices.count(d.sb.dev_item.devid) != 0)
-            throw formatted_error("device {} specified more than once", d.sb.dev_item.devid);
+        // for the progress meter - a tree always has at least one node per level
+        root_sizes.insert(make_pair(id, max((uint64_t)ri.bytes_used,
+                                            (ri.level + 1) * (uint64_t)sb.nodesize)));
+    };
 
-        devices.emplace(d.sb.dev_item.devid, move(d));
+    for (const auto& [devid, d] : info.devices) {
+        stats::name_device(devid, d.name);
     }
 
-    const auto& sb = devices.begin()->second.sb;
-
-    if (fns.size() == 1 && sb.num_devices > 1) {
-        auto other_fns = find_devices(sb.fsid);
-
-        for (const auto& n : other_fns) {
-            files.emplace_back(n, n);
-
-            if (files.back().first.fail())
-                cerr << format("Failed to open {}", n) << endl; // FIXME - include why
-        }
-
-        for (auto& f : files) {
-            if (&f == &files.front())
-                continue;
-
-            if (f.first.fail())
-                continue;
-
-            device d(f.first, f.second);
-
-            read_superblock(d);
-
-            // FIXME - close irrelevant files
-
-            if (d.sb.magic != btrfs::MAGIC)
-                continue;
-
-            if (d.sb.fsid != sb.fsid)
-                continue;
-
-            if (devices.count(d.sb.dev_item.devid) != 0)
-                continue;
-
-            devices.emplace(d.sb.dev_item.devid, move(d));
-        }
-
-        if (devices.size() != sb.num_devices) {
-            if (devices.size() == 1) {
-                throw formatted_error("filesystem has {} devices, unable to find the others",
-                                      sb.num_devices);
-            } else {
-                throw formatted_error("filesystem has {} devices, only able to find {} of them",
-                                      sb.num_devices, devices.size());
-            }
-        }
-    } else {
-        if (devices.size() > 1) {
-            for (const auto& [dev_id, d] : devices) {
-                if (d.sb.fsid != sb.fsid) {
-                    throw formatted_error("fsid mismatch (device {} is {}, device {} is {})",
-                                          sb.dev_item.devid, sb.fsid, dev_id,
-                                          d.sb.fsid);
-                }
-            }
-        }
-
-        if (devices.size() != sb.num_devices) {
-            throw formatted_error("filesystem has {} devices, only {} found",
-                                  sb.num_devices, devices.size());
-        }
+    if (fmt == output_format::binary) {
+        bin.emplace(cout, sb);
+        out.bin = &*bin;
     }
 
-    // FIXME - do we need to check that generation numbers match?
-
-    if (!tree_id.has_value())
+    if (text && all)
         cout << format("superblock {}", sb) << endl;
+    else if (fmt == output_format::jsonl && all) {
+        jsonl::writer w(json_line);
 
-    info.sys_chunks = load_sys_chunks(sb);
+        json_line = "{\"kind\":\"superblock\"";
+        itemjson::superblock(w, sb);
+        json_end();
+    }
 
-    if (!tree_id.has_value())
-        cout << "CHUNK:" << endl;
+    if (labels && wanted(btrfs::CHUNK_TREE_OBJECTID))
+        print_label(out, "CHUNK");
 
     decltype(info.chunks) new_chunks;
 
-    dump_tree(info, sb.chunk_root, "",
-              !tree_id.has_value() || *tree_id == btrfs::CHUNK_TREE_OBJECTID,
-              print_physical, [&new_chunks](const btrfs::key& key, span<const uint8_t> item) {
-        if (key.type != btrfs::key_type::CHUNK_ITEM)
-            return;
-
-        const auto& c = *(chunk*)item.data();
-
-        if (item.size() < offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)))
-            throw runtime_error("chunk item truncated");
-
-        if (c.num_stripes > MAX_STRIPES) {
-            throw formatted_error("chunk num_stripes is {}, maximum supported is {}",
-                                  c.num_stripes, MAX_STRIPES);
-        }
-
-        new_chunks.insert(make_pair((uint64_t)key.offset, c));
+    dump_tree(info, out, btrfs::CHUNK_TREE_OBJECTID, sb.chunk_root,
+              stored(btrfs::CHUNK_TREE_OBJECTID),
+              [&new_chunks](const btrfs::key& key, span<const uint8_t> item) {
+        traverse::add_chunk_item(new_chunks, key, item);
     });
 
     info.chunks.swap(new_chunks);
 
-    if (!tree_id.has_value())
+    if (labels && wanted(btrfs::CHUNK_TREE_OBJECTID))
         cout << endl;
 
     if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE) {
-        if (!tree_id.has_value())
-            cout << "REMAP:" << endl;
+        if (labels && wanted(btrfs::REMAP_TREE_OBJECTID))
+            print_label(out, "REMAP");
 
-        dump_tree(info, sb.remap_root, "",
-                  !tree_id.has_value() || *tree_id == btrfs::REMAP_TREE_OBJECTID,
-                  print_physical, [&info](const btrfs::key& key, span<const uint8_t> item) {
-            switch (key.type) {
-                case btrfs::key_type::REMAP: {
-                    const auto& r = *(btrfs::remap_item*)item.data();
+        dump_tree(info, out, btrfs::REMAP_TREE_OBJECTID, sb.remap_root,
+                  stored(btrfs::REMAP_TREE_OBJECTID),
+                  [&info](const btrfs::key& key, span<const uint8_t> item) {
+            traverse::add_remap_item(info, key, item);
+        });
 
-                    if (item.size() < sizeof(btrfs::remap_item))
-                        throw runtime_error("remap item truncated");
+        if (labels && wanted(btrfs::REMAP_TREE_OBJECTID))
+            cout << endl;
+    }
 
-                    info.remaps.insert(make_pair(key.objectid, make_pair(key.offset, r.address)));
-                    break;
-                }
+    vol.set_chunks_loaded();
 
-                case btrfs::key_type::IDENTITY_REMAP:
-                    info.remaps.insert(make_pair(key.objectid, make_pair(key.offset, key.objectid)));
-                    break;
+    if (stored(btrfs::ROOT_TREE_OBJECTID)) {
+        if (labels)
+            print_label(out, "ROOT");
 
-                default:
-                    break;
-            }
+        dump_tree(info, out, btrfs::ROOT_TREE_OBJECTID, sb.root, true,
+                  [&note_root](const btrfs::key& key, span<const uint8_t> item) {
+            if (key.type == btrfs::key_type::ROOT_ITEM)
+                note_root(key.objectid, *(btrfs::root_item*)item.data());
         });
 
-        if (!tree_id.has_value())
+        if (labels)
             cout << endl;
     }
 
-    if (!tree_id.has_value())
-        cout << "ROOT:" << endl;
+    // Otherwise look up just the ROOT_ITEMs we need. The log tree is left
+    // out, as there often isn't one.
+    for (auto id : tree_ids) {
+        if (roots.contains(id) || id == btrfs::TREE_LOG_OBJECTID)
+            continue;
 
-    dump_tree(info, sb.root, "",
-              !tree_id.has_value() || *tree_id == btrfs::ROOT_TREE_OBJECTID,
-              print_physical, [&roots](const btrfs::key& key, span<const uint8_t> item) {
-        if (key.type != btrfs::key_type::ROOT_ITEM)
-            return;
+        if (auto ri = vol.find_root_item(id))
+            note_root(id, *ri);
+        else
+            vol.find_root(id); // in the superblock, or throws if there's no such tree
+    }
 
-        const auto& ri = *(btrfs::root_item*)item.data();
+    if (out.progress) {
+        // The ROOT_ITEMs say how much space each tree takes up, which is
+        // how much we've still got to read. This can't be more than the
+        // superblock's total, though, however out of date they are.
+        uint64_t est = 0;
 
-        roots.insert(make_pair(key.objectid, ri.bytenr));
-    });
+        for (auto [root_num, size] : root_sizes) {
+            if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE && root_num == btrfs::REMAP_TREE_OBJECTID)
+                continue;
 
-    if (!tree_id.has_value())
-        cout << endl;
+            if (wanted(root_num))
+                est += size;
+        }
 
-    if ((!tree_id.has_value() || *tree_id == btrfs::TREE_LOG_OBJECTID) && sb.log_root != 0) {
-        cout << "LOG:" << endl;
+        out.progress->set_total(out.progress->done() + min(est, (uint64_t)sb.bytes_used));
+    }
+
+    if (wanted(btrfs::TREE_LOG_OBJECTID) && sb.log_root != 0) {
+        if (text)
+            print_label(out, "LOG");
 
-        dump_tree(info, sb.log_root, "", true, print_physical,
+        dump_tree(info, out, btrfs::TREE_LOG_OBJECTID, sb.log_root, true,
                   [&log_roots](const btrfs::key& key, span<const uint8_t> item) {
             if (key.type != btrfs::key_type::ROOT_ITEM)
                 return;
@@ -1140,40 +581,41 @@ static void dump(const vector<filesystem::path>& fns, optional<uint64_t> tree_id
             log_roots.insert(make_pair(key.offset, ri.bytenr));
         });
 
-        cout << endl;
+        if (text)
+            cout << endl;
     }
 
-    if (tree_id.has_value() && (*tree_id == btrfs::ROOT_TREE_OBJECTID || *tree_id == btrfs::CHUNK_TREE_OBJECTID || *tree_id == btrfs::REMAP_TREE_OBJECTID))
-        return;
+    for (auto [root_num, bytenr] : roots) {
+        if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE && root_num == btrfs::REMAP_TREE_OBJECTID)
+            continue;
 
-    if (tree_id.has_value()) {
-        if (*tree_id != btrfs::TREE_LOG_OBJECTID) {
-            if (roots.count(*tree_id) == 0)
-                throw formatted_error("tree {:x} not found", *tree_id);
+        if (!wanted(root_num))
+            continue;
 
-            dump_tree(info, roots.at(*tree_id), "", true,
-                      print_physical);
-        }
-    } else {
-        for (auto [root_num, bytenr] : roots) {
-            if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE && root_num == btrfs::REMAP_TREE_OBJECTID)
-                continue;
+        if (labels)
+            print_label(out, format("Tree {:x}", (uint64_t)root_num));
 
-            cout << format("Tree {:x}:", (uint64_t)root_num) << endl;
+        dump_tree(info, out, root_num, bytenr, true);
 
-            dump_tree(info, bytenr, "", true, print_physical);
+        if (labels)
             cout << endl;
-        }
     }
 
-    if (!tree_id.has_value() || *tree_id == btrfs::TREE_LOG_OBJECTID) {
+    if (wanted(btrfs::TREE_LOG_OBJECTID)) {
         for (auto [root_num, bytenr] : log_roots) {
-            cout << format("Tree {:x} (log):", (uint64_t)root_num) << endl;
+            if (text)
+                print_label(out, format("Tree {:x} (log)", (uint64_t)root_num));
 
-            dump_tree(info, bytenr, "", true, print_physical);
-            cout << endl;
+            // log trees are all owned by TREE_LOG_OBJECTID
+            dump_tree(info, out, btrfs::TREE_LOG_OBJECTID, bytenr, true);
+
+            if (text)
+                cout << endl;
         }
     }
+
+    if (bin)
+        bin->finish();
 }
 
 static uint64_t parse_tree_id(string_view sv) {
@@ -1258,35 +700,275 @@ static uint64_t parse_tree_id(string_view sv) {
     throw formatted_error("unable to parse tree ID {}", orig_sv);
 }
 
+static output_format parse_output_format(string_view sv) {
+    if (sv == "text")
+        return output_format::text;
+    else if (sv == "binary")
+        return output_format::binary;
+    else if (sv == "jsonl")
+        return output_format::jsonl;
+    else
+        throw formatted_error("unrecognized output format {}", sv);
+}
+
+// Whether a section of a compressed dump, named by its label, is part of
+// the given tree. Returns the tree it belongs to if so.
+static optional<uint64_t> section_tree(string_view label, const set<uint64_t>& tree_ids) {
+    for (auto id : tree_ids) {
+        switch (id) {
+            case btrfs::ROOT_TREE_OBJECTID:
+                if (label == "ROOT")
+                    return id;
+                break;
+
+            case btrfs::CHUNK_TREE_OBJECTID:
+                if (label == "CHUNK")
+                    return id;
+                break;
+
+            case btrfs::REMAP_TREE_OBJECTID:
+                if (label == "REMAP")
+                    return id;
+                break;
+
+            case btrfs::TREE_LOG_OBJECTID:
+                if (label == "LOG" || label.ends_with(" (log)"))
+                    return id;
+                break;
+        }
+
+        if (label == format("Tree {:x}", id))
+            return id;
+    }
+
+    return nullopt;
+}
+
+static bool is_compressed_dump(const filesystem::path& fn) {
+    ifstream in(fn, ios::binary);
+
+    return in && zstdio::is_zstd(in);
+}
+
+// Prints trees from a dump compressed with --zstd. The label frame says
+// where each tree's section starts, so only those sections get
+// decompressed. Without -t, the whole dump is decompressed.
+static void extract_sections(const filesystem::path& fn, const set<uint64_t>& tree_ids) {
+    ifstream in(fn, ios::binary);
+    vector<char> buf(65536);
+
+    if (!in)
+        throw formatted_error("failed to open {}", fn.string());
+
+    if (tree_ids.empty()) {
+        zstdio::reader r(in);
+
+        while (auto n = r.sgetn(buf.data(), buf.size())) {
+            cout.write(buf.data(), n);
+        }
+
+        cout.flush();
+        return;
+    }
+
+    // as with a filesystem, a single tree is printed without its label
+    bool labels = tree_ids.size() != 1;
+    set<uint64_t> found;
+
+    for (const auto& s : zstdio::read_sections(in)) {
+        auto tree = section_tree(s.label, tree_ids);
+
+        if (!tree.has_value())
+            continue;
+
+        found.insert(*tree);
+
+        in.clear();
+        in.seekg(s.compressed_offset);
+
+        zstdio::reader r(in);
+        auto len = s.decompressed_size;
+
+        // the log trees keep their labels, as they do when read from a filesystem
+        if (!labels && *tree != btrfs::TREE_LOG_OBJECTID) {
+            // skip the label, and leave off the blank line at the end
+
+            while (len > 0) {
+                len--;
+
+                if (r.sbumpc() == '\n')
+                    break;
+            }
+
+            if (len > 0)
+                len--;
+        }
+
+        while (len > 0) {
+            auto n = r.sgetn(buf.data(), min(len, (uint64_t)buf.size()));
+
+            if (n == 0)
+                throw runtime_error("compressed dump is truncated");
+
+            cout.write(buf.data(), n);
+            len -= n;
+        }
+    }
+
+    for (auto id : tree_ids) {
+        // like a filesystem without a log tree, a dump without one gives nothing
+        if (id != btrfs::TREE_LOG_OBJECTID && !found.contains(id))
+            throw formatted_error("tree {:x} not found in {}", id, fn.string());
+    }
+
+    cout.flush();
+}
+
+// Sets up the chain of streambufs behind cout: optionally a zstd compressor,
+// and on top of that a byte counter if we're writing an index. With --stats
+// or --trace, the bottom of the chain is a buffer that times the writes.
+static void dump_to_stdout(const vector<filesystem::path>& fns, const set<uint64_t>& tree_ids,
+                           dump_output out, optional<size_t> zstd_frame_size,
+                           const optional<filesystem::path>& index_fn) {
+    auto orig = cout.rdbuf();
+    optional<timed_buf> timed;
+
+    if (out.stats || out.trace) {
+        timed.emplace(*orig);
+        cout.rdbuf(&*timed);
+    }
+
+    ostream raw(cout.rdbuf());
+    optional<zstdio::writer> zw;
+    optional<counting_buf> counter;
+    optional<ofstream> index;
+
+    if (index_fn.has_value()) {
+        index.emplace(*index_fn);
+
+        if (!*index)
+            throw formatted_error("failed to open index file {}", index_fn->string());
+
+        out.index = &*index;
+    }
+
+    if (zstd_frame_size.has_value()) {
+        zw.emplace(raw, *zstd_frame_size);
+        cout.rdbuf(&*zw);
+        out.zstd = &*zw;
+    }
+
+    if (index) {
+        counter.emplace(*cout.rdbuf());
+        cout.rdbuf(&*counter);
+        out.counter = &*counter;
+    }
+
+    try {
+        dump(fns, tree_ids, out);
+
+        if (zw)
+            zw->finish();
+
+        cout.flush();
+    } catch (...) {
+        cout.rdbuf(orig);
+        throw;
+    }
+
+    cout.rdbuf(orig);
+
+    if (index) {
+        index->flush();
+
+        if (index->fail())
+            throw formatted_error("error writing index file {}", index_fn->string());
+    }
+}
+
 int main(int argc, char** argv) {
-    bool print_version = false, print_usage = false, print_physical = false;
-    optional<uint64_t> tree_id;
+    bool print_version = false, print_usage = false;
+    bool compress = false, show_progress = false;
+    set<uint64_t> tree_ids;
+    optional<filesystem::path> index_fn, arrow_dir, trace_fn;
+    optional<output_format> format;
+    optional<columnar::exporter> columns;
+    optional<progress_meter> progress;
+    dump_output out;
+    size_t frame_size = zstdio::DEFAULT_FRAME_SIZE;
 
     try {
         while (true) {
             enum {
                 GETOPT_VAL_VERSION,
-                GETOPT_VAL_HELP
+                GETOPT_VAL_HELP,
+                GETOPT_VAL_FRAME_SIZE,
+                GETOPT_VAL_ARROW,
+                GETOPT_VAL_STATS,
+                GETOPT_VAL_TRACE,
+                GETOPT_VAL_PROGRESS
             };
 
             static const option long_opts[] = {
                 { "tree", required_argument, nullptr, 't' },
                 { "physical", no_argument, nullptr, 'p' },
+                { "format", required_argument, nullptr, 'f' },
+                { "zstd", no_argument, nullptr, 'z' },
+                { "frame-size", required_argument, nullptr, GETOPT_VAL_FRAME_SIZE },
+                { "index", required_argument, nullptr, 'i' },
+                { "arrow", required_argument, nullptr, GETOPT_VAL_ARROW },
+                { "stats", no_argument, nullptr, GETOPT_VAL_STATS },
+                { "trace", required_argument, nullptr, GETOPT_VAL_TRACE },
+                { "progress", no_argument, nullptr, GETOPT_VAL_PROGRESS },
                 { "version", no_argument, nullptr, GETOPT_VAL_VERSION },
                 { "help", no_argument, nullptr, GETOPT_VAL_HELP },
                 { nullptr, 0, nullptr, 0 }
             };
 
-            auto c = getopt_long(argc, argv, "pt:", long_opts, nullptr);
+            auto c = getopt_long(argc, argv, "pt:f:zi:", long_opts, nullptr);
             if (c < 0)
                 break;
 
             switch (c) {
                 case 'p':
-                    print_physical = true;
+                    out.print_physical = true;
                     break;
                 case 't':
-                    tree_id = parse_tree_id(optarg);
+                    tree_ids.insert(parse_tree_id(optarg));
+                    break;
+                case 'f':
+                    format = parse_output_format(optarg);
+                    break;
+                case 'z':
+                    compress = true;
+                    break;
+                case GETOPT_VAL_FRAME_SIZE: {
+                    auto sv = string_view(optarg);
+                    size_t mb;
+
+                    auto [ptr, ec] = from_chars(sv.begin(), sv.end(), mb);
+
+                    if (ptr != sv.end() || mb == 0 || mb >= 4096)
+                        throw formatted_error("invalid frame size {}", sv);
+
+                    frame_size = mb * 1024 * 1024;
+                    break;
+                }
+                case 'i':
+                    index_fn = optarg;
+                    break;
+                case GETOPT_VAL_ARROW:
+                    arrow_dir = optarg;
+                    break;
+                case GETOPT_VAL_STATS:
+                    out.stats = true;
+                    break;
+                case GETOPT_VAL_TRACE:
+                    trace_fn = optarg;
+                    out.trace = true;
+                    break;
+                case GETOPT_VAL_PROGRESS:
+                    show_progress = true;
                     break;
                 case GETOPT_VAL_VERSION:
                     print_version = true;
@@ -1310,21 +992,102 @@ Dump the metadata of a btrfs image in text format.
 
 Options:
     -t|--tree <tree_id> print only specified tree (string, decimal, or
-                        hexadecimal number)
+                        hexadecimal number), can be repeated
     -p|--physical       include physical addresses in tree headers
+    -f|--format <fmt>   output format: "text" (the default), "binary" (raw
+                        node images plus an index), or "jsonl" (one JSON
+                        object per line for each node and item)
+    -z|--zstd           compress output using zstd, with a new seekable
+                        frame for each tree
+    --frame-size <MiB>  maximum uncompressed size of each zstd frame
+                        (default 8)
+    -i|--index <file>   write the offset of each tree and node header in
+                        the output to file
+    --arrow <dir>       instead of printing, export items to dir as Arrow
+                        IPC files, one per item type
+    --stats             print read counts and timings to stderr at the end
+    --trace <file>      record the time spent on each node, read and write
+                        to file as Chrome trace-event JSON
+    --progress          print the rate and estimated time left to stderr
     --version           print version string
     --help              print this screen
 )";
             return 1;
         }
 
+        // checked here rather than as the options are read, so that the
+        // order they're given in doesn't matter
+        if (arrow_dir.has_value() && format.has_value())
+            throw runtime_error("--arrow cannot be combined with --format");
+
+        if (arrow_dir.has_value())
+            out.format = output_format::arrow;
+        else
+            out.format = format.value_or(output_format::text);
+
         vector<filesystem::path> fns;
 
         for (int i = optind; i < argc; i++) {
             fns.emplace_back(argv[i]);
         }
 
-        dump(fns, tree_id, print_physical);
+        if (fns.size() == 1 && is_compressed_dump(fns.front())) {
+            if (out.format != output_format::text || out.print_physical || compress ||
+                index_fn.has_value() || arrow_dir.has_value() || out.stats ||
+                trace_fn.has_value() || show_progress) {
+                throw runtime_error("only --tree can be used when reading a compressed dump");
+            }
+
+            extract_sections(fns.front(), tree_ids);
+            return 0;
+        }
+
+        if (out.format == output_format::binary) {
+            if (out.print_physical)
+                throw runtime_error("--physical is not supported for binary output");
+
+            if (compress)
+                throw runtime_error("--zstd is not supported for binary output");
+        }
+
+        if (index_fn.has_value() && out.format != output_format::text)
+            throw runtime_error("--index is only supported for text output");
+
+        if (arrow_dir.has_value()) {
+            if (compress || out.print_physical)
+                throw runtime_error("--arrow cannot be combined with --zstd or --physical");
+
+            columns.emplace(*arrow_dir);
+            out.columns = &*columns;
+        }
+
+        if (out.stats)
+            stats::enable();
+
+        if (trace_fn.has_value()) {
+            trace::open(*trace_fn, "btrfs-dump");
+            trace::thread_name("main");
+        }
+
+        if (show_progress) {
+            progress.emplace();
+            out.progress = &*progress;
+        }
+
+        dump_to_stdout(fns, tree_ids, out,
+                       compress ? optional<size_t>{frame_size} : nullopt,
+                       index_fn);
+
+        if (progress)
+            progress->finish();
+
+        if (columns)
+            columns->finish();
+
+        trace::close();
+
+        if (out.stats)
+            stats::report(cerr);
     } catch (const exception& e) {
         cerr << "Exception: " << e.what() << endl;
         return 1;
@@ -0,0 +1,114 @@
+#pragma once
+
+/*
+ * C interface to the code btrfs-dump uses to read filesystems, for programs
+ * that want individual items without running btrfs-dump and parsing its
+ * output. Link with -lbtrfsdump.
+ *
+ * Functions that can fail return 0 on success or a negative errno value, and
+ * btrfsdump_error() then gives a description. A btrfsdump_fs, and the
+ * btrfsdump_tree handles opened from it, must only be used by one thread at a
+ * time; separate btrfsdump_fs handles are independent.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BTRFSDUMP_API __attribute__((visibility("default")))
+
+typedef struct btrfsdump_fs btrfsdump_fs;
+typedef struct btrfsdump_tree btrfsdump_tree;
+
+typedef struct {
+    uint64_t objectid;
+    uint8_t type;
+    uint64_t offset;
+} btrfsdump_key;
+
+/* The message for the last error on this thread. */
+BTRFSDUMP_API const char* btrfsdump_error(void);
+
+/*
+ * Opens a filesystem from its devices, or from a binary dump. As with
+ * btrfs-dump, if given one device of several the others are found with
+ * libblkid. The chunk tree is read here, so that everything else can be.
+ */
+BTRFSDUMP_API int btrfsdump_open(const char* const* paths, size_t num_paths,
+                                 btrfsdump_fs** fs);
+
+/* Closes a filesystem. Any trees opened from it must be closed first. */
+BTRFSDUMP_API void btrfsdump_close(btrfsdump_fs* fs);
+
+/*
+ * Gives the IDs of the trees in the filesystem, in order. On return *count is
+ * the number of trees; if this is more than max, nothing is written and the
+ * result is -ERANGE.
+ */
+BTRFSDUMP_API int btrfsdump_list_trees(btrfsdump_fs* fs, uint64_t* ids, size_t max,
+                                       size_t* count);
+
+/*
+ * Opens a tree for searching and iterating, like the kernel's btrfs_path. The
+ * nodes from the root to the current leaf are kept, so lookups near each other
+ * only read the nodes that differ. It starts off not on any item.
+ */
+BTRFSDUMP_API int btrfsdump_tree_open(btrfsdump_fs* fs, uint64_t tree_id,
+                                      btrfsdump_tree** tree);
+
+BTRFSDUMP_API void btrfsdump_tree_close(btrfsdump_tree* tree);
+
+/*
+ * Moves to the first item whose key is at least *key. Returns 0 if its key is
+ * *key, 1 if it's a later one, or -ENOENT if there's no such item. In the
+ * last case the tree is left past its last item, so btrfsdump_tree_prev then
+ * gives the last item with a key less than *key.
+ */
+BTRFSDUMP_API int btrfsdump_tree_search(btrfsdump_tree* tree, const btrfsdump_key* key);
+
+/*
+ * Move to the first item of the tree, or the next or previous one. These
+ * return -ENOENT if there isn't one, after which the tree isn't on an item.
+ * Running off the end with btrfsdump_tree_next leaves it past the last item,
+ * from where btrfsdump_tree_prev goes back to it.
+ */
+BTRFSDUMP_API int btrfsdump_tree_first(btrfsdump_tree* tree);
+BTRFSDUMP_API int btrfsdump_tree_next(btrfsdump_tree* tree);
+BTRFSDUMP_API int btrfsdump_tree_prev(btrfsdump_tree* tree);
+
+/*
+ * Gives the key and contents of the current item, or -ENOENT if there isn't
+ * one. The data is valid until the tree is moved or closed. key, data and
+ * size may each be NULL.
+ */
+BTRFSDUMP_API int btrfsdump_tree_item(btrfsdump_tree* tree, btrfsdump_key* key,
+                                      const void** data, size_t* size);
+
+/*
+ * Copies the item with exactly the given key into buf. On return *size is
+ * the size of the item; if this is more than buf_size, nothing is copied and
+ * the result is -ERANGE. Returns -ENOENT if there's no such item. The path to
+ * the last item looked up in each tree is kept, so repeated calls are cheap.
+ */
+BTRFSDUMP_API int btrfsdump_get_item(btrfsdump_fs* fs, uint64_t tree_id,
+                                     const btrfsdump_key* key, void* buf,
+                                     size_t buf_size, size_t* size);
+
+/*
+ * Writes an item out as btrfs-dump would print it, e.g.
+ * "inode_item generation=... mode=40755 ...", as a null-terminated string.
+ * On return *len is the length of the text, not counting the terminator; if
+ * buf_size isn't more than this, nothing is written and the result is -ERANGE.
+ * If size is too small for the item's type, or the type isn't one btrfs-dump
+ * knows, the result is -EINVAL.
+ */
+BTRFSDUMP_API int btrfsdump_item_text(btrfsdump_fs* fs, const btrfsdump_key* key,
+                                      const void* data, size_t size, char* buf,
+                                      size_t buf_size, size_t* len);
+
+#ifdef __cplusplus
+}
+#endif
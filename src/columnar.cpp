@@ -0,0 +1,395 @@
+module;
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <concepts>
+#include <filesystem>
+#include <format>
+#include <map>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+export module columnar;
+
+import cxxbtrfs;
+import arrowipc;
+
+using namespace std;
+
+using arrowipc::column_type;
+
+// Every table starts with the tree and the key.
+static vector<arrowipc::column> with_key(vector<arrowipc::column> cols) {
+    vector<arrowipc::column> ret = {
+        { "tree", column_type::uint64 },
+        { "objectid", column_type::uint64 },
+        { "offset", column_type::uint64 },
+    };
+
+    ret.insert(ret.end(), cols.begin(), cols.end());
+
+    return ret;
+}
+
+static vector<arrowipc::column> timespec_cols(string_view name) {
+    return {
+        { format("{}_sec", name), column_type::int64 },
+        { format("{}_nsec", name), column_type::uint32 },
+    };
+}
+
+static vector<arrowipc::column> inode_item_cols() {
+    vector<arrowipc::column> cols = {
+        { "generation", column_type::uint64 },
+        { "transid", column_type::uint64 },
+        { "size", column_type::uint64 },
+        { "nbytes", column_type::uint64 },
+        { "block_group", column_type::uint64 },
+        { "nlink", column_type::uint32 },
+        { "uid", column_type::uint32 },
+        { "gid", column_type::uint32 },
+        { "mode", column_type::uint32 },
+        { "rdev", column_type::uint64 },
+        { "flags", column_type::uint64 },
+        { "sequence", column_type::uint64 },
+    };
+
+    for (auto n : { "atime", "ctime", "mtime", "otime" }) {
+        auto ts = timespec_cols(n);
+
+        cols.insert(cols.end(), ts.begin(), ts.end());
+    }
+
+    return with_key(move(cols));
+}
+
+// Items shorter than the structure (e.g. old-style root items) are padded
+// with zeroes.
+template<typename T>
+static T load(span<const uint8_t> item) {
+    T t;
+
+    memset(&t, 0, sizeof(T));
+    memcpy(&t, item.data(), min(item.size(), sizeof(T)));
+
+    return t;
+}
+
+export namespace columnar {
+
+// Writes one Arrow IPC file per item type into a directory, one row per
+// item (or per entry, for items such as inode_ref that can hold several).
+class exporter {
+public:
+    exporter(const filesystem::path& dir) : dir(dir) {
+        filesystem::create_directories(dir);
+    }
+
+    void add_item(uint64_t tree, const btrfs::key& key, span<const uint8_t> item) {
+        switch (key.type) {
+            using enum btrfs::key_type;
+
+            case INODE_ITEM: {
+                auto ii = load<btrfs::inode_item>(item);
+                auto& t = get("inode_item", inode_item_cols);
+
+                t << tree << key.objectid << key.offset << ii.generation << ii.transid
+                  << ii.size << ii.nbytes << ii.block_group << ii.nlink << ii.uid
+                  << ii.gid << ii.mode << ii.rdev << ii.flags << ii.sequence
+                  << ii.atime << ii.ctime << ii.mtime << ii.otime;
+                t.end_row();
+
+                break;
+            }
+
+            case INODE_REF: {
+                auto& t = get("inode_ref", []() {
+                    return with_key({
+                        { "index", column_type::uint64 },
+                        { "name", column_type::binary },
+                    });
+                });
+
+                while (item.size() >= sizeof(btrfs::inode_ref)) {
+                    const auto& ir = *(const btrfs::inode_ref*)item.data();
+                    auto name_len = min((size_t)ir.name_len, item.size() - sizeof(btrfs::inode_ref));
+
+                    t << tree << key.objectid << key.offset << ir.index
+                      << string_view((const char*)item.data() + sizeof(btrfs::inode_ref), name_len);
+                    t.end_row();
+
+                    item = item.subspan(sizeof(btrfs::inode_ref) + name_len);
+                }
+
+                break;
+            }
+
+            case DIR_ITEM:
+            case DIR_INDEX:
+            case XATTR_ITEM: {
+                auto& t = get("dir_item", []() {
+                    return with_key({
+                        { "key_type", column_type::utf8 },
+                        { "location_objectid", column_type::uint64 },
+                        { "location_type", column_type::uint8 },
+                        { "location_offset", column_type::uint64 },
+                        { "transid", column_type::uint64 },
+                        { "type", column_type::uint8 },
+                        { "name", column_type::binary },
+                        { "data_len", column_type::uint16 },
+                    });
+                });
+
+                auto type_name = format("{}", key.type);
+
+                while (item.size() >= sizeof(btrfs::dir_item)) {
+                    const auto& di = *(const btrfs::dir_item*)item.data();
+                    auto name_len = min((size_t)di.name_len, item.size() - sizeof(btrfs::dir_item));
+
+                    t << tree << key.objectid << key.offset << string_view(type_name)
+                      << di.location.objectid << (uint8_t)di.location.type
+                      << di.location.offset << di.transid << (uint8_t)di.type
+                      << string_view((const char*)item.data() + sizeof(btrfs::dir_item), name_len)
+                      << di.data_len;
+                    t.end_row();
+
+                    item = item.subspan(min(item.size(), sizeof(btrfs::dir_item) + di.name_len + di.data_len));
+                }
+
+                break;
+            }
+
+            case EXTENT_DATA: {
+                auto fei = load<btrfs::file_extent_item>(item);
+                auto& t = get("file_extent_item", []() {
+                    return with_key({
+                        { "generation", column_type::uint64 },
+                        { "ram_bytes", column_type::uint64 },
+                        { "compression", column_type::uint8 },
+                        { "encryption", column_type::uint8 },
+                        { "other_encoding", column_type::uint16 },
+                        { "type", column_type::uint8 },
+                        { "disk_bytenr", column_type::uint64 },
+                        { "disk_num_bytes", column_type::uint64 },
+                        { "extent_offset", column_type::uint64 },
+                        { "num_bytes", column_type::uint64 },
+                        { "inline_size", column_type::uint64 },
+                    });
+                });
+
+                bool is_inline = fei.type == btrfs::file_extent_item_type::inline_extent;
+                auto inline_size = is_inline && item.size() > offsetof(btrfs::file_extent_item, disk_bytenr)
+                                   ? item.size() - offsetof(btrfs::file_extent_item, disk_bytenr) : 0;
+
+                // the rest of an inline extent is data, not fields
+                if (is_inline) {
+                    fei.disk_bytenr = 0;
+                    fei.disk_num_bytes = 0;
+                    fei.offset = 0;
+                    fei.num_bytes = 0;
+                }
+
+                t << tree << key.objectid << key.offset << fei.generation << fei.ram_bytes
+                  << (uint8_t)fei.compression << fei.encryption << fei.other_encoding
+                  << (uint8_t)fei.type << fei.disk_bytenr << fei.disk_num_bytes
+                  << fei.offset << fei.num_bytes << inline_size;
+                t.end_row();
+
+                break;
+            }
+
+            case EXTENT_ITEM:
+            case METADATA_ITEM: {
+                auto ei = load<btrfs::extent_item>(item);
+                auto& t = get("extent_item", []() {
+                    return with_key({
+                        { "key_type", column_type::utf8 },
+                        { "refs", column_type::uint64 },
+                        { "generation", column_type::uint64 },
+                        { "flags", column_type::uint64 },
+                    });
+                });
+
+                t << tree << key.objectid << key.offset << string_view(format("{}", key.type))
+                  << ei.refs << ei.generation << ei.flags;
+                t.end_row();
+
+                break;
+            }
+
+            case ROOT_ITEM: {
+                auto ri = load<btrfs::root_item>(item);
+                auto& t = get("root_item", []() {
+                    return with_key({
+                        { "generation", column_type::uint64 },
+                        { "root_dirid", column_type::uint64 },
+                        { "bytenr", column_type::uint64 },
+                        { "byte_limit", column_type::uint64 },
+                        { "bytes_used", column_type::uint64 },
+                        { "last_snapshot", column_type::uint64 },
+                        { "flags", column_type::uint64 },
+                        { "refs", column_type::uint32 },
+                        { "level", column_type::uint8 },
+                        { "generation_v2", column_type::uint64 },
+                        { "uuid", column_type::utf8 },
+                        { "parent_uuid", column_type::utf8 },
+                        { "received_uuid", column_type::utf8 },
+                        { "ctransid", column_type::uint64 },
+                        { "otransid", column_type::uint64 },
+                        { "stransid", column_type::uint64 },
+                        { "rtransid", column_type::uint64 },
+                    });
+                });
+
+                t << tree << key.objectid << key.offset << ri.generation << ri.root_dirid
+                  << ri.bytenr << ri.byte_limit << ri.bytes_used << ri.last_snapshot
+                  << ri.flags << ri.refs << ri.level << ri.generation_v2
+                  << string_view(format("{}", ri.uuid))
+                  << string_view(format("{}", ri.parent_uuid))
+                  << string_view(format("{}", ri.received_uuid))
+                  << ri.ctransid << ri.otransid << ri.stransid << ri.rtransid;
+                t.end_row();
+
+                break;
+            }
+
+            case BLOCK_GROUP_ITEM: {
+                auto bgi = load<btrfs::block_group_item>(item);
+                auto& t = get("block_group_item", []() {
+                    return with_key({
+                        { "used", column_type::uint64 },
+                        { "chunk_objectid", column_type::uint64 },
+                        { "flags", column_type::uint64 },
+                    });
+                });
+
+                t << tree << key.objectid << key.offset << bgi.used
+                  << bgi.chunk_objectid << bgi.flags;
+                t.end_row();
+
+                break;
+            }
+
+            case DEV_EXTENT: {
+                auto de = load<btrfs::dev_extent>(item);
+                auto& t = get("dev_extent", []() {
+                    return with_key({
+                        { "chunk_tree", column_type::uint64 },
+                        { "chunk_objectid", column_type::uint64 },
+                        { "chunk_offset", column_type::uint64 },
+                        { "length", column_type::uint64 },
+                    });
+                });
+
+                t << tree << key.objectid << key.offset << de.chunk_tree
+                  << de.chunk_objectid << de.chunk_offset << de.length;
+                t.end_row();
+
+                break;
+            }
+
+            case CHUNK_ITEM: {
+                auto c = load<btrfs::chunk>(item);
+                auto& t = get("chunk_item", []() {
+                    return with_key({
+                        { "length", column_type::uint64 },
+                        { "owner", column_type::uint64 },
+                        { "stripe_len", column_type::uint64 },
+                        { "type", column_type::uint64 },
+                        { "io_align", column_type::uint32 },
+                        { "io_width", column_type::uint32 },
+                        { "sector_size", column_type::uint32 },
+                        { "num_stripes", column_type::uint16 },
+                        { "sub_stripes", column_type::uint16 },
+                    });
+                });
+
+                t << tree << key.objectid << key.offset << c.length << c.owner
+                  << c.stripe_len << c.type << c.io_align << c.io_width
+                  << c.sector_size << c.num_stripes << c.sub_stripes;
+                t.end_row();
+
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    void finish() {
+        for (auto& [name, t] : tables) {
+            t->w.finish();
+        }
+    }
+
+private:
+    // Appends columns in order with <<, so that each item type's code mirrors
+    // its column list.
+    struct table {
+        table(const filesystem::path& fn, vector<arrowipc::column> cols) : w(fn, move(cols)) { }
+
+        template<integral T>
+        table& operator<<(T v) {
+            w.append(col++, (uint64_t)v);
+            return *this;
+        }
+
+        table& operator<<(btrfs::le16 v) {
+            w.append(col++, (uint64_t)(uint16_t)v);
+            return *this;
+        }
+
+        table& operator<<(btrfs::le32 v) {
+            w.append(col++, (uint64_t)(uint32_t)v);
+            return *this;
+        }
+
+        table& operator<<(btrfs::le64 v) {
+            w.append(col++, (uint64_t)v);
+            return *this;
+        }
+
+        table& operator<<(const btrfs::timespec& ts) {
+            w.append(col++, (uint64_t)ts.sec);
+            w.append(col++, (uint64_t)ts.nsec);
+            return *this;
+        }
+
+        table& operator<<(string_view sv) {
+            w.append(col++, sv);
+            return *this;
+        }
+
+        void end_row() {
+            w.end_row();
+            col = 0;
+        }
+
+        arrowipc::writer w;
+        size_t col = 0;
+    };
+
+    template<typename F>
+    table& get(string_view name, F cols) {
+        auto it = tables.find(name);
+
+        if (it == tables.end()) {
+            auto fn = dir / format("{}.arrow", name);
+
+            it = tables.emplace(string{name}, make_unique<table>(fn, cols())).first;
+        }
+
+        return *it->second;
+    }
+
+    filesystem::path dir;
+    map<string, unique_ptr<table>, less<>> tables;
+};
+
+}
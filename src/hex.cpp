@@ -0,0 +1,169 @@
+module;
+
+#include <stdint.h>
+#include <stddef.h>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+export module hex;
+
+import formatted_error;
+
+using namespace std;
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    else if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    else
+        return -1;
+}
+
+// The vector versions decode as many whole blocks as they can, and return the
+// number of characters consumed. They stop at the first block containing
+// something that isn't a hex digit, and leave it to the scalar code to find
+// exactly where it is.
+using decode_fn = size_t (*)(const char* in, size_t len, uint8_t* out);
+
+static size_t decode_none(const char*, size_t, uint8_t*) {
+    return 0;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(const char* in, size_t len, uint8_t* out) {
+    const auto ascii0 = _mm_set1_epi8('0');
+    const auto asciia = _mm_set1_epi8('a');
+    const auto lower = _mm_set1_epi8(0x20);
+    const auto nine = _mm_set1_epi8(9);
+    const auto five = _mm_set1_epi8(5);
+    const auto ten = _mm_set1_epi8(10);
+    const auto weights = _mm_set1_epi16(0x0110); // 16 for the high nibble, 1 for the low
+    size_t done = 0;
+
+    while (len - done >= 16) {
+        auto v = _mm_loadu_si128((const __m128i*)(in + done));
+
+        auto digit = _mm_sub_epi8(v, ascii0);
+        auto alpha = _mm_sub_epi8(_mm_or_si128(v, lower), asciia);
+
+        // unsigned comparisons, so anything below '0' or 'a' wraps round
+        auto is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, nine), digit);
+        auto is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, five), alpha);
+
+        if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff)
+            break;
+
+        auto nibbles = _mm_or_si128(_mm_and_si128(is_digit, digit),
+                                    _mm_andnot_si128(is_digit, _mm_add_epi8(alpha, ten)));
+
+        auto bytes = _mm_packus_epi16(_mm_maddubs_epi16(nibbles, weights), _mm_setzero_si128());
+
+        _mm_storel_epi64((__m128i*)(out + (done / 2)), bytes);
+
+        done += 16;
+    }
+
+    return done;
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(const char* in, size_t len, uint8_t* out) {
+    const auto ascii0 = _mm256_set1_epi8('0');
+    const auto asciia = _mm256_set1_epi8('a');
+    const auto lower = _mm256_set1_epi8(0x20);
+    const auto nine = _mm256_set1_epi8(9);
+    const auto five = _mm256_set1_epi8(5);
+    const auto ten = _mm256_set1_epi8(10);
+    const auto weights = _mm256_set1_epi16(0x0110);
+    size_t done = 0;
+
+    while (len - done >= 32) {
+        auto v = _mm256_loadu_si256((const __m256i*)(in + done));
+
+        auto digit = _mm256_sub_epi8(v, ascii0);
+        auto alpha = _mm256_sub_epi8(_mm256_or_si256(v, lower), asciia);
+
+        auto is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, nine), digit);
+        auto is_alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, five), alpha);
+
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) != 0xffffffff)
+            break;
+
+        auto nibbles = _mm256_or_si256(_mm256_and_si256(is_digit, digit),
+                                       _mm256_andnot_si256(is_digit, _mm256_add_epi8(alpha, ten)));
+
+        // packus works within each 128-bit lane, so gather the two halves
+        // into the bottom lane afterwards
+        auto packed = _mm256_packus_epi16(_mm256_maddubs_epi16(nibbles, weights), _mm256_setzero_si256());
+        auto bytes = _mm256_permute4x64_epi64(packed, 0b1000);
+
+        _mm_storeu_si128((__m128i*)(out + (done / 2)), _mm256_castsi256_si128(bytes));
+
+        done += 32;
+    }
+
+    return decode_ssse3(in + done, len - done, out + (done / 2)) + done;
+}
+#endif
+
+static decode_fn pick_decoder() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return decode_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        return decode_ssse3;
+#endif
+
+    return decode_none;
+}
+
+export namespace hex {
+
+// Decodes in, which must be exactly twice the size of out, into out. Throws
+// if in contains anything other than hex digits, giving the position of the
+// first bad character.
+void decode(string_view in, span<uint8_t> out) {
+    static const decode_fn decode_vector = pick_decoder();
+
+    if (in.size() != out.size() * 2)
+        throw formatted_error("hex string has odd length");
+
+    auto done = decode_vector(in.data(), in.size(), out.data());
+
+    for (size_t i = done; i < in.size(); i += 2) {
+        auto hi = hex_value(in[i]);
+        auto lo = hex_value(in[i + 1]);
+
+        if (hi < 0)
+            throw formatted_error("invalid hex character '{}' at position {}", in[i], i);
+
+        if (lo < 0)
+            throw formatted_error("invalid hex character '{}' at position {}", in[i + 1], i + 1);
+
+        out[i / 2] = (uint8_t)((hi << 4) | lo);
+    }
+}
+
+vector<uint8_t> decode(string_view in) {
+    if (in.size() % 2 != 0)
+        throw formatted_error("hex string has odd length");
+
+    vector<uint8_t> ret(in.size() / 2);
+
+    decode(in, ret);
+
+    return ret;
+}
+
+}
@@ -0,0 +1,815 @@
+module;
+
+#include <stdint.h>
+#include <stddef.h>
+#include <format>
+#include <iostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+export module itemfmt;
+
+import cxxbtrfs;
+import b64;
+
+using namespace std;
+
+export namespace itemfmt {
+
+// The runs of set bits in a free space bitmap, as (address, length) pairs.
+vector<pair<uint64_t, uint64_t>> free_space_runs(span<const uint8_t> s, uint64_t offset,
+                                                 uint32_t sector_size) {
+    vector<pair<uint64_t, uint64_t>> runs;
+
+    uint64_t run_start = 0;
+    bool last_zero = true;
+
+    for (size_t i = 0; i < s.size(); i++) {
+        auto c = s[i];
+
+        for (unsigned int j = 0; j < 8; j++) {
+            if (c & 1) {
+                if (last_zero)
+                    run_start = (i * 8) + j;
+
+                last_zero = false;
+            } else {
+                if (!last_zero) {
+                    runs.emplace_back(offset + (run_start * sector_size),
+                                      (((i * 8) + j) - run_start) * sector_size);
+                }
+
+                last_zero = true;
+            }
+
+            c >>= 1;
+        }
+    }
+
+    if (!last_zero) {
+        runs.emplace_back(offset + (run_start * sector_size),
+                          ((s.size() * 8) - run_start) * sector_size);
+    }
+
+    return runs;
+}
+
+}
+
+static string free_space_bitmap(span<const uint8_t> s, uint64_t offset,
+                                uint32_t sector_size) {
+    string runs;
+
+    for (auto [addr, len] : itemfmt::free_space_runs(s, offset, sector_size)) {
+        if (!runs.empty())
+            runs += "; ";
+
+        runs += format("{:x}, {:x}", addr, len);
+    }
+
+    return runs;
+}
+
+export namespace itemfmt {
+
+// Returns whether dump_item can print an item of this type and size without
+// reading past the end: whether the structures it's made of, and the names
+// and stripes that follow them, all fit. Unknown types aren't accepted.
+bool check_item(span<const uint8_t> s, const btrfs::key& key, const btrfs::super_block& sb) {
+    if ((uint8_t)key.type == 0 && key.objectid == btrfs::FREE_SPACE_OBJECTID)
+        return s.size() >= sizeof(btrfs::free_space_header);
+    else if (key.objectid == btrfs::BALANCE_OBJECTID && key.type == btrfs::key_type::TEMPORARY_ITEM)
+        return s.size() >= sizeof(btrfs::balance_item);
+
+    switch (key.type) {
+        using enum btrfs::key_type;
+
+        case INODE_ITEM:
+            return s.size() >= sizeof(btrfs::inode_item);
+
+        case INODE_REF:
+            do {
+                if (s.size() < sizeof(btrfs::inode_ref))
+                    return false;
+
+                auto len = sizeof(btrfs::inode_ref) + ((const btrfs::inode_ref*)s.data())->name_len;
+
+                if (s.size() < len)
+                    return false;
+
+                s = s.subspan(len);
+            } while (!s.empty());
+
+            return true;
+
+        case INODE_EXTREF:
+            do {
+                if (s.size() < offsetof(btrfs::inode_extref, name))
+                    return false;
+
+                auto len = offsetof(btrfs::inode_extref, name) + ((const btrfs::inode_extref*)s.data())->name_len;
+
+                if (s.size() < len)
+                    return false;
+
+                s = s.subspan(len);
+            } while (!s.empty());
+
+            return true;
+
+        case XATTR_ITEM:
+        case DIR_ITEM:
+        case DIR_INDEX:
+            do {
+                if (s.size() < sizeof(btrfs::dir_item))
+                    return false;
+
+                const auto& di = *(const btrfs::dir_item*)s.data();
+                auto len = sizeof(btrfs::dir_item) + di.name_len + di.data_len;
+
+                if (s.size() < len)
+                    return false;
+
+                s = s.subspan(len);
+            } while (!s.empty() && key.type != DIR_INDEX);
+
+            return true;
+
+        case VERITY_DESC_ITEM:
+            if (key.offset == 0)
+                return s.size() >= sizeof(btrfs::verity_descriptor_item);
+
+            return s.size() >= sizeof(btrfs::fsverity_descriptor) &&
+                   ((const btrfs::fsverity_descriptor*)s.data())->salt_size <= sizeof(btrfs::fsverity_descriptor::salt);
+
+        case VERITY_MERKLE_ITEM:
+        case ORPHAN_ITEM:
+        case EXTENT_CSUM:
+        case TREE_BLOCK_REF:
+        case SHARED_BLOCK_REF:
+        case FREE_SPACE_EXTENT:
+        case FREE_SPACE_BITMAP:
+        case RAID_STRIPE:
+        case IDENTITY_REMAP:
+        case QGROUP_RELATION:
+        case PERSISTENT_ITEM:
+            return true;
+
+        case DIR_LOG_INDEX:
+            return s.size() >= sizeof(btrfs::dir_log_item);
+
+        case EXTENT_DATA: {
+            if (s.size() < offsetof(btrfs::file_extent_item, disk_bytenr))
+                return false;
+
+            const auto& fei = *(const btrfs::file_extent_item*)s.data();
+
+            if (fei.type != btrfs::file_extent_item_type::inline_extent)
+                return s.size() >= sizeof(btrfs::file_extent_item);
+
+            if (fei.compression != btrfs::compression_type::none)
+                return true;
+
+            return s.size() - offsetof(btrfs::file_extent_item, disk_bytenr) >= fei.ram_bytes;
+        }
+
+        case ROOT_ITEM:
+            return s.size() >= sizeof(btrfs::root_item);
+
+        case ROOT_BACKREF:
+        case ROOT_REF:
+            return s.size() >= sizeof(btrfs::root_ref) &&
+                   s.size() >= sizeof(btrfs::root_ref) + ((const btrfs::root_ref*)s.data())->name_len;
+
+        case EXTENT_ITEM:
+        case METADATA_ITEM: {
+            if (s.size() < sizeof(btrfs::extent_item))
+                return false;
+
+            const auto& ei = *(const btrfs::extent_item*)s.data();
+
+            s = s.subspan(sizeof(btrfs::extent_item));
+
+            if (key.type == EXTENT_ITEM && ei.flags & btrfs::EXTENT_FLAG_TREE_BLOCK) {
+                if (s.size() < sizeof(btrfs::tree_block_info))
+                    return false;
+
+                s = s.subspan(sizeof(btrfs::tree_block_info));
+            }
+
+            while (s.size() >= sizeof(btrfs::extent_inline_ref)) {
+                size_t len = sizeof(btrfs::extent_inline_ref);
+
+                switch (((const btrfs::extent_inline_ref*)s.data())->type) {
+                    case TREE_BLOCK_REF:
+                    case SHARED_BLOCK_REF:
+                    case EXTENT_OWNER_REF:
+                        break;
+
+                    case EXTENT_DATA_REF:
+                        len += sizeof(btrfs::extent_data_ref) - sizeof(btrfs::le64);
+                        break;
+
+                    case SHARED_DATA_REF:
+                        len += sizeof(btrfs::shared_data_ref);
+                        break;
+
+                    default:
+                        return true; // the rest is printed as hex
+                }
+
+                if (s.size() < len)
+                    return false;
+
+                s = s.subspan(len);
+            }
+
+            return true;
+        }
+
+        case EXTENT_DATA_REF:
+            return s.size() >= sizeof(btrfs::extent_data_ref);
+
+        case SHARED_DATA_REF:
+            return s.size() >= sizeof(btrfs::shared_data_ref);
+
+        case BLOCK_GROUP_ITEM:
+            if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE)
+                return s.size() >= sizeof(btrfs::block_group_item_v2);
+            else
+                return s.size() >= sizeof(btrfs::block_group_item);
+
+        case FREE_SPACE_INFO:
+            return s.size() >= sizeof(btrfs::free_space_info);
+
+        case DEV_EXTENT:
+            return s.size() >= sizeof(btrfs::dev_extent);
+
+        case DEV_ITEM:
+            return s.size() >= sizeof(btrfs::dev_item);
+
+        case CHUNK_ITEM:
+            return s.size() >= offsetof(btrfs::chunk, stripe) &&
+                   s.size() >= offsetof(btrfs::chunk, stripe) + (((const btrfs::chunk*)s.data())->num_stripes * sizeof(btrfs::stripe));
+
+        case REMAP:
+        case REMAP_BACKREF:
+            return s.size() >= sizeof(btrfs::remap_item);
+
+        case QGROUP_STATUS:
+            return s.size() >= sizeof(btrfs::qgroup_status_item);
+
+        case QGROUP_INFO:
+            return s.size() >= sizeof(btrfs::qgroup_info_item);
+
+        case QGROUP_LIMIT:
+            return s.size() >= sizeof(btrfs::qgroup_limit_item);
+
+        case DEV_REPLACE:
+            return s.size() >= sizeof(btrfs::dev_replace_item);
+
+        case UUID_SUBVOL:
+        case UUID_RECEIVED_SUBVOL:
+            return s.size() >= sizeof(btrfs::le64);
+
+        default:
+            return false;
+    }
+}
+
+// Prints an item's contents on one line, as btrfs-dump does, after pref.
+void dump_item(ostream& os, span<const uint8_t> s, string_view pref,
+                      const btrfs::key& key, const btrfs::super_block& sb) {
+    // FIXME - handle short items (see check_item)
+
+    os << pref;
+
+    if ((uint8_t)key.type == 0 && key.objectid == btrfs::FREE_SPACE_OBJECTID) {
+        const auto& fsh = *(btrfs::free_space_header*)s.data();
+
+        os << format("free_space {}", fsh);
+
+        s = s.subspan(sizeof(btrfs::free_space_header));
+    } else if (key.objectid == btrfs::BALANCE_OBJECTID && key.type == btrfs::key_type::TEMPORARY_ITEM) {
+        const auto& bi = *(btrfs::balance_item*)s.data();
+
+        os << format("balance {}", bi);
+
+        s = s.subspan(sizeof(btrfs::balance_item));
+    } else {
+        switch (key.type) {
+            using enum btrfs::key_type;
+
+            case INODE_ITEM: {
+                const auto& ii = *(btrfs::inode_item*)s.data();
+
+                os << format("inode_item {}", ii);
+
+                s = s.subspan(sizeof(btrfs::inode_item));
+
+                break;
+            }
+
+            case INODE_REF: {
+                os << "inode_ref";
+
+                do {
+                    const auto& ir = *(btrfs::inode_ref*)s.data();
+
+                    os << format(" {}", ir);
+
+                    s = s.subspan(sizeof(btrfs::inode_ref) + ir.name_len);
+                } while (!s.empty());
+
+                break;
+            }
+
+            case INODE_EXTREF: {
+                os << "inode_extref";
+
+                do {
+                    const auto& ier = *(btrfs::inode_extref*)s.data();
+
+                    os << format(" {}", ier);
+
+                    s = s.subspan(offsetof(btrfs::inode_extref, name) + ier.name_len);
+                } while (!s.empty());
+
+                break;
+            }
+
+            case XATTR_ITEM: {
+                os << "xattr_item";
+
+                do {
+                    const auto& di = *(btrfs::dir_item*)s.data();
+
+                    os << format(" {}", di);
+
+                    s = s.subspan(sizeof(btrfs::dir_item) + di.data_len + di.name_len);
+                } while (!s.empty());
+
+                break;
+            };
+
+            case VERITY_DESC_ITEM: {
+                if (key.offset == 0) {
+                    const auto& vdi = *(btrfs::verity_descriptor_item*)s.data();
+
+                    os << format("verity_desc_item {}", vdi);
+                    s = s.subspan(sizeof(btrfs::verity_descriptor_item));
+                } else {
+                    const auto& desc = *(btrfs::fsverity_descriptor*)s.data();
+
+                    os << format("fsverity_descriptor {}", desc);
+                    s = s.subspan(sizeof(btrfs::fsverity_descriptor));
+
+                    if (!s.empty()) {
+                        os << format(" sig={}", b64encode(s));
+                        s = s.subspan(s.size());
+                    }
+                }
+
+                break;
+            }
+
+            case VERITY_MERKLE_ITEM: {
+                os << "verity_merkle_item";
+
+                for (size_t i = 0; i < s.size(); i++) {
+                    if (i % 32 == 0)
+                        os << " ";
+
+                    os << format("{:02x}", s[i]);
+                }
+
+                s = s.subspan(s.size());
+
+                break;
+            }
+
+            case ORPHAN_ITEM:
+                os << "orphan_item";
+                break;
+
+            case DIR_LOG_INDEX: {
+                const auto& dli = *(btrfs::dir_log_item*)s.data();
+
+                os << format("dir_log_index {}", dli);
+
+                s = s.subspan(sizeof(btrfs::dir_log_item));
+
+                break;
+            }
+
+            case DIR_ITEM: {
+                os << "dir_item";
+
+                do {
+                    const auto& di = *(btrfs::dir_item*)s.data();
+
+                    os << format(" {}", di);
+
+                    s = s.subspan(sizeof(btrfs::dir_item) + di.data_len + di.name_len);
+                } while (!s.empty());
+
+                break;
+            }
+
+            case DIR_INDEX: {
+                const auto& di = *(btrfs::dir_item*)s.data();
+
+                os << format("dir_index {}", di);
+
+                s = s.subspan(sizeof(btrfs::dir_item) + di.data_len + di.name_len);
+
+                break;
+            }
+
+            case EXTENT_DATA: {
+                const auto& fei = *(btrfs::file_extent_item*)s.data();
+
+                os << format("extent_data {}", fei);
+
+                if (fei.type == btrfs::file_extent_item_type::inline_extent) {
+                    if (fei.compression != btrfs::compression_type::none) {
+                        // if compressed inline extent, don't bother checking for over- or underrun
+                        s = s.subspan(s.size());
+                    } else {
+                        s = s.subspan(offsetof(btrfs::file_extent_item, disk_bytenr));
+                        s = s.subspan(fei.ram_bytes);
+                    }
+                } else
+                    s = s.subspan(sizeof(btrfs::file_extent_item));
+
+                break;
+            }
+
+            case EXTENT_CSUM: {
+                os << format("extent_csum");
+
+                switch (sb.csum_type) {
+                    case btrfs::csum_type::CRC32: {
+                        auto nums = span((btrfs::le32*)s.data(), s.size() / sizeof(btrfs::le32));
+
+                        for (auto n : nums) {
+                            os << format(" {:08x}", n);
+                        }
+
+                        s = s.subspan(nums.size_bytes());
+                        break;
+                    }
+
+                    case btrfs::csum_type::XXHASH: {
+                        auto nums = span((btrfs::le64*)s.data(), s.size() / sizeof(btrfs::le64));
+
+                        for (auto n : nums) {
+                            os << format(" {:016x}", n);
+                        }
+
+                        s = s.subspan(nums.size_bytes());
+                        break;
+                    }
+
+                    case btrfs::csum_type::SHA256:
+                    case btrfs::csum_type::BLAKE2: {
+                        using arr = array<btrfs::le64, 4>;
+                        auto nums = span((arr*)s.data(), s.size() / sizeof(arr));
+
+                        for (auto n : nums) {
+                            os << format(" {:016x}{:016x}{:016x}{:016x}",
+                                        n[0], n[1], n[2], n[3]);
+                        }
+
+                        s = s.subspan(nums.size_bytes());
+                        break;
+                    }
+                }
+
+                break;
+            }
+
+            case ROOT_ITEM: {
+                const auto& ri = *(btrfs::root_item*)s.data();
+
+                os << format("root_item {}", ri);
+
+                s = s.subspan(sizeof(btrfs::root_item));
+
+                break;
+            }
+
+            case ROOT_BACKREF:
+            case ROOT_REF: {
+                const auto& rr = *(btrfs::root_ref*)s.data();
+
+                os << format("{} {}", key.type == ROOT_BACKREF ? "root_backref" : "root_ref",
+                            rr);
+
+                s = s.subspan(sizeof(btrfs::root_ref) + rr.name_len);
+
+                break;
+            }
+
+            case EXTENT_ITEM:
+            case METADATA_ITEM: {
+                const auto& ei = *(btrfs::extent_item*)s.data();
+
+                if (key.type == METADATA_ITEM)
+                    os << format("metadata_item {}", ei);
+                else
+                    os << format("extent_item {}", ei);
+
+                // FIXME - EXTENT_ITEM_V0(?)
+
+                s = s.subspan(sizeof(btrfs::extent_item));
+
+                if (key.type == EXTENT_ITEM && ei.flags & btrfs::EXTENT_FLAG_TREE_BLOCK) {
+                    const auto& tbi = *(btrfs::tree_block_info*)s.data();
+
+                    os << format(" {}", tbi);
+                    s = s.subspan(sizeof(btrfs::tree_block_info));
+                }
+
+                while (s.size() >= sizeof(btrfs::extent_inline_ref)) {
+                    bool handled = true;
+                    const auto& eir = *(btrfs::extent_inline_ref*)s.data();
+
+                    s = s.subspan(sizeof(btrfs::extent_inline_ref));
+
+                    switch (eir.type) {
+                        case TREE_BLOCK_REF:
+                            os << format(" tree_block_ref root={:x}", eir.offset);
+                        break;
+
+                        case SHARED_BLOCK_REF:
+                            os << format(" shared_block_ref offset={:x}", eir.offset);
+                        break;
+
+                        case EXTENT_DATA_REF: {
+                            const auto& edr = *(btrfs::extent_data_ref*)&eir.offset;
+
+                            os << format(" extent_data_ref {}", edr);
+                            s = s.subspan(sizeof(btrfs::extent_data_ref) - sizeof(btrfs::le64));
+                            break;
+                        }
+
+                        case SHARED_DATA_REF: {
+                            const auto& sdr = *(btrfs::shared_data_ref*)((uint8_t*)&eir + sizeof(btrfs::extent_inline_ref));
+
+                            os << format(" shared_data_ref offset={:x} {}", eir.offset, sdr);
+                            s = s.subspan(sizeof(btrfs::shared_data_ref));
+                            break;
+                        }
+
+                        case EXTENT_OWNER_REF:
+                            os << format(" extent_owner_ref root={:x}", eir.offset);
+                        break;
+
+                        default:
+                            os << format(" {:02x}", (uint8_t)eir.type);
+                            handled = false;
+                        break;
+                    }
+
+                    if (!handled)
+                        break;
+                }
+
+                break;
+            }
+
+            case TREE_BLOCK_REF:
+                os << "tree_block_ref";
+                break;
+
+            case EXTENT_DATA_REF: {
+                const auto& edr = *(btrfs::extent_data_ref*)s.data();
+
+                os << format("extent_data_ref {}", edr);
+
+                s = s.subspan(sizeof(btrfs::extent_data_ref));
+
+                break;
+            }
+
+            // } elsif ($type == 0xb4) { # EXTENT_REF_V0
+            //     @b = unpack("QQQv", $s);
+            //     $s = substr($s, 28);
+            //
+            //     printf("extent_ref_v0 root=%x gen=%x objid=%x count=%x", @b);
+
+            case SHARED_BLOCK_REF:
+                os << "shared_block_ref";
+                break;
+
+            case SHARED_DATA_REF: {
+                const auto& sdr = *(btrfs::shared_data_ref*)s.data();
+
+                os << format("shared_data_ref {}", sdr);
+
+                s = s.subspan(sizeof(btrfs::shared_data_ref));
+
+                break;
+            }
+
+            case BLOCK_GROUP_ITEM: {
+                if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE) {
+                    const auto& bgi = *(btrfs::block_group_item_v2*)s.data();
+
+                    os << format("block_group_item {}", bgi);
+
+                    s = s.subspan(sizeof(btrfs::block_group_item_v2));
+                } else {
+                    const auto& bgi = *(btrfs::block_group_item*)s.data();
+
+                    os << format("block_group_item {}", bgi);
+
+                    s = s.subspan(sizeof(btrfs::block_group_item));
+                }
+                break;
+            }
+
+            case FREE_SPACE_INFO: {
+                const auto& fsi = *(btrfs::free_space_info*)s.data();
+
+                os << format("free_space_info {}", fsi);
+
+                s = s.subspan(sizeof(btrfs::free_space_info));
+                break;
+            }
+
+            case FREE_SPACE_EXTENT: {
+                os << format("free_space_extent");
+                break;
+            }
+
+            case FREE_SPACE_BITMAP: {
+                os << format("free_space_bitmap {}",
+                               free_space_bitmap(s, key.objectid, sb.sectorsize));
+                s = s.subspan(s.size());
+                break;
+            }
+
+            case DEV_EXTENT: {
+                const auto& de = *(btrfs::dev_extent*)s.data();
+
+                os << format("dev_extent {}", de);
+
+                s = s.subspan(sizeof(btrfs::dev_extent));
+                break;
+            }
+
+            case DEV_ITEM: {
+                const auto& d = *(btrfs::dev_item*)s.data();
+
+                os << format("dev_item {}", d);
+
+                s = s.subspan(sizeof(btrfs::dev_item));
+                break;
+            }
+
+            case CHUNK_ITEM: {
+                const auto& c = *(btrfs::chunk*)s.data();
+
+                os << format("chunk_item {}", c);
+
+                s = s.subspan(offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)));
+                break;
+            }
+
+            case RAID_STRIPE: {
+                const auto* rs = (btrfs::raid_stride*)s.data();
+
+                os << "raid_stripe";
+
+                bool first = true;
+                while (s.size() >= sizeof(btrfs::raid_stride)) {
+                    if (!first)
+                        os << ";";
+
+                    os << format(" {}", *rs);
+
+                    s = s.subspan(sizeof(btrfs::raid_stride));
+                    rs++;
+                    first = false;
+                }
+
+                break;
+            }
+
+            case IDENTITY_REMAP: {
+                os << format("identity_remap");
+                break;
+            }
+
+            case REMAP: {
+                const auto& r = *(btrfs::remap_item*)s.data();
+
+                os << format("remap {}", r);
+
+                s = s.subspan(sizeof(btrfs::remap_item));
+                break;
+            }
+
+            case REMAP_BACKREF: {
+                const auto& r = *(btrfs::remap_item*)s.data();
+
+                os << format("remap_backref {}", r);
+
+                s = s.subspan(sizeof(btrfs::remap_item));
+                break;
+            }
+
+            case QGROUP_STATUS: {
+                const auto& qsi = *(btrfs::qgroup_status_item*)s.data();
+
+                os << format("qgroup_status {}", qsi);
+
+                s = s.subspan(sizeof(btrfs::qgroup_status_item));
+                break;
+            }
+
+            case QGROUP_INFO: {
+                const auto& qi = *(btrfs::qgroup_info_item*)s.data();
+
+                os << format("qgroup_info {}", qi);
+
+                s = s.subspan(sizeof(btrfs::qgroup_info_item));
+                break;
+            }
+
+            case QGROUP_LIMIT: {
+                const auto& qli = *(btrfs::qgroup_limit_item*)s.data();
+
+                os << format("qgroup_limit {}", qli);
+
+                s = s.subspan(sizeof(btrfs::qgroup_limit_item));
+                break;
+            }
+
+            case QGROUP_RELATION:
+                os << "qgroup_relation";
+                break;
+
+            case PERSISTENT_ITEM: {
+                auto nums = span((btrfs::le64*)s.data(), s.size() / sizeof(btrfs::le64));
+
+                os << format("dev_stats");
+
+                for (auto n : nums) {
+                    os << format(" {:x}", n);
+                }
+
+                s = s.subspan(nums.size_bytes());
+                break;
+            }
+
+            case DEV_REPLACE: {
+                const auto& dri = *(btrfs::dev_replace_item*)s.data();
+
+                os << format("dev_replace {}", dri);
+
+                s = s.subspan(sizeof(btrfs::dev_replace_item));
+                break;
+            }
+
+            case UUID_SUBVOL: {
+                auto num = *(btrfs::le64*)s.data();
+
+                os << format("uuid_subvol {:x}", num);
+
+                s = s.subspan(sizeof(num));
+                break;
+            }
+
+            case UUID_RECEIVED_SUBVOL: {
+                auto num = *(btrfs::le64*)s.data();
+
+                os << format("uuid_rec_subvol {:x}", num);
+
+                s = s.subspan(sizeof(num));
+                break;
+            }
+
+            default:
+                cerr << format("ERROR - unknown type {} (size {:x})", key.type, s.size()) << endl;
+
+                os << format("unknown (size={:x})", s.size());
+        }
+    }
+
+    if (!s.empty()) {
+        os << " extra=";
+        for (auto b : s) {
+            os << format("{:02x}", b);
+        }
+    }
+
+    os << endl;
+}
+
+}
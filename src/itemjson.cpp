@@ -0,0 +1,1010 @@
+module;
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <array>
+#include <format>
+#include <iterator>
+#include <span>
+#include <string>
+#include <string_view>
+
+export module itemjson;
+
+import cxxbtrfs;
+import jsonl;
+import itemfmt;
+
+using namespace std;
+
+// Items as JSON members, for --format=jsonl. The fields are read straight out
+// of the structures and have the same names as in the text output, but
+// numbers are JSON numbers, keys and times are objects, and names are given
+// as they are on disk if they're valid UTF-8, or in hex as name_hex if not.
+// xattr values can be anything, so are always hex. Where an item is shorter
+// than its structure, what's left is given as hex in "extra", as the text
+// output does with any excess.
+
+static string hex(span<const uint8_t> s) {
+    string ret;
+
+    ret.reserve(s.size() * 2);
+
+    for (auto b : s) {
+        format_to(back_inserter(ret), "{:02x}", b);
+    }
+
+    return ret;
+}
+
+static string csum_str(const uint8_t* csum, btrfs::csum_type csum_type) {
+    switch (csum_type) {
+        case btrfs::csum_type::CRC32:
+            return format("{:08x}", *(btrfs::le32*)csum);
+
+        case btrfs::csum_type::XXHASH:
+            return format("{:016x}", *(btrfs::le64*)csum);
+
+        case btrfs::csum_type::SHA256:
+        case btrfs::csum_type::BLAKE2: {
+            const auto& n = *(array<btrfs::le64, 4>*)csum;
+
+            return format("{:016x}{:016x}{:016x}{:016x}", n[0], n[1], n[2], n[3]);
+        }
+
+        default:
+            return hex(span(csum, 32));
+    }
+}
+
+// The T at the start of s, or nullptr if s is shorter than len.
+template<typename T>
+static const T* peek(span<const uint8_t> s, size_t len = sizeof(T)) {
+    if (s.size() < len)
+        return nullptr;
+
+    return (const T*)s.data();
+}
+
+static string_view bytes(const void* p, size_t len) {
+    return string_view((const char*)p, len);
+}
+
+static void fields(jsonl::writer& w, const btrfs::key& k) {
+    w.num("objectid", k.objectid);
+    w.str("type", format("{}", k.type));
+    w.num("offset", k.offset);
+}
+
+static void fields(jsonl::writer& w, const btrfs::timespec& t) {
+    w.num("sec", t.sec);
+    w.num("nsec", t.nsec);
+}
+
+static void fields(jsonl::writer& w, const btrfs::dev_item& d);
+static void fields(jsonl::writer& w, const btrfs::chunk& c);
+static void fields(jsonl::writer& w, const btrfs::inode_item& ii);
+static void fields(jsonl::writer& w, const btrfs::root_item& ri);
+static void fields(jsonl::writer& w, const btrfs::dir_item& di);
+static void fields(jsonl::writer& w, const btrfs::file_extent_item& fei);
+static void fields(jsonl::writer& w, const btrfs::extent_data_ref& edr);
+static void fields(jsonl::writer& w, const btrfs::disk_balance_args& dba);
+
+template<typename T>
+static void object(jsonl::writer& w, string_view name, const T& t) {
+    w.begin_object(name);
+    fields(w, t);
+    w.end_object();
+}
+
+static void fields(jsonl::writer& w, const btrfs::dev_item& d) {
+    w.num("devid", d.devid);
+    w.num("total_bytes", d.total_bytes);
+    w.num("bytes_used", d.bytes_used);
+    w.num("io_align", d.io_align);
+    w.num("io_width", d.io_width);
+    w.num("sector_size", d.sector_size);
+    w.num("type", d.type);
+    w.num("generation", d.generation);
+    w.num("start_offset", d.start_offset);
+    w.num("dev_group", d.dev_group);
+    w.num("seek_speed", d.seek_speed);
+    w.num("bandwidth", d.bandwidth);
+    w.str("uuid", format("{}", d.uuid));
+    w.str("fsid", format("{}", d.fsid));
+}
+
+// Only call this once the stripes have been checked to be there.
+static void fields(jsonl::writer& w, const btrfs::chunk& c) {
+    w.num("length", c.length);
+    w.num("owner", c.owner);
+    w.num("stripe_len", c.stripe_len);
+    w.num("type", c.type);
+    w.num("io_align", c.io_align);
+    w.num("io_width", c.io_width);
+    w.num("sector_size", c.sector_size);
+    w.num("num_stripes", c.num_stripes);
+    w.num("sub_stripes", c.sub_stripes);
+
+    w.begin_array("stripes");
+
+    for (unsigned int i = 0; i < c.num_stripes; i++) {
+        const auto& s = c.stripe[i];
+
+        w.begin_object();
+        w.num("devid", s.devid);
+        w.num("offset", s.offset);
+        w.str("dev_uuid", format("{}", s.dev_uuid));
+        w.end_object();
+    }
+
+    w.end_array();
+}
+
+static void fields(jsonl::writer& w, const btrfs::root_backup& b) {
+    w.num("tree_root", b.tree_root);
+    w.num("tree_root_gen", b.tree_root_gen);
+    w.num("chunk_root", b.chunk_root);
+    w.num("chunk_root_gen", b.chunk_root_gen);
+    w.num("extent_root", b.extent_root);
+    w.num("extent_root_gen", b.extent_root_gen);
+    w.num("fs_root", b.fs_root);
+    w.num("fs_root_gen", b.fs_root_gen);
+    w.num("dev_root", b.dev_root);
+    w.num("dev_root_gen", b.dev_root_gen);
+    w.num("csum_root", b.csum_root);
+    w.num("csum_root_gen", b.csum_root_gen);
+    w.num("total_bytes", b.total_bytes);
+    w.num("bytes_used", b.bytes_used);
+    w.num("num_devices", b.num_devices);
+    w.num("tree_root_level", b.tree_root_level);
+    w.num("chunk_root_level", b.chunk_root_level);
+    w.num("extent_root_level", b.extent_root_level);
+    w.num("fs_root_level", b.fs_root_level);
+    w.num("dev_root_level", b.dev_root_level);
+    w.num("csum_root_level", b.csum_root_level);
+}
+
+static void fields(jsonl::writer& w, const btrfs::inode_item& ii) {
+    w.num("generation", ii.generation);
+    w.num("transid", ii.transid);
+    w.num("size", ii.size);
+    w.num("nbytes", ii.nbytes);
+    w.num("block_group", ii.block_group);
+    w.num("nlink", ii.nlink);
+    w.num("uid", ii.uid);
+    w.num("gid", ii.gid);
+    w.num("mode", ii.mode);
+    w.num("rdev", ii.rdev);
+    w.num("flags", ii.flags);
+    w.num("sequence", ii.sequence);
+    object(w, "atime", ii.atime);
+    object(w, "ctime", ii.ctime);
+    object(w, "mtime", ii.mtime);
+    object(w, "otime", ii.otime);
+}
+
+static void fields(jsonl::writer& w, const btrfs::root_item& ri) {
+    object(w, "inode", ri.inode);
+    w.num("generation", ri.generation);
+    w.num("root_dirid", ri.root_dirid);
+    w.num("bytenr", ri.bytenr);
+    w.num("byte_limit", ri.byte_limit);
+    w.num("bytes_used", ri.bytes_used);
+    w.num("last_snapshot", ri.last_snapshot);
+    w.num("flags", ri.flags);
+    w.num("refs", ri.refs);
+    object(w, "drop_progress", ri.drop_progress);
+    w.num("drop_level", ri.drop_level);
+    w.num("level", ri.level);
+    w.num("generation_v2", ri.generation_v2);
+    w.str("uuid", format("{}", ri.uuid));
+    w.str("parent_uuid", format("{}", ri.parent_uuid));
+    w.str("received_uuid", format("{}", ri.received_uuid));
+    w.num("ctransid", ri.ctransid);
+    w.num("otransid", ri.otransid);
+    w.num("stransid", ri.stransid);
+    w.num("rtransid", ri.rtransid);
+    object(w, "ctime", ri.ctime);
+    object(w, "otime", ri.otime);
+    object(w, "stime", ri.stime);
+    object(w, "rtime", ri.rtime);
+}
+
+// The name and data follow the dir_item, and have been checked to be there.
+static void fields(jsonl::writer& w, const btrfs::dir_item& di) {
+    auto name = (const char*)&di + sizeof(btrfs::dir_item);
+
+    object(w, "location", di.location);
+    w.num("transid", di.transid);
+    w.num("data_len", di.data_len);
+    w.num("name_len", di.name_len);
+    w.str("type", format("{}", di.type));
+    w.text("name", bytes(name, di.name_len));
+
+    if (di.data_len != 0)
+        w.str("data", hex(span((const uint8_t*)name + di.name_len, di.data_len)));
+}
+
+static void fields(jsonl::writer& w, const btrfs::file_extent_item& fei) {
+    w.num("generation", fei.generation);
+    w.num("ram_bytes", fei.ram_bytes);
+    w.str("compression", format("{}", fei.compression));
+    w.num("encryption", fei.encryption);
+    w.num("other_encoding", fei.other_encoding);
+    w.str("type", format("{}", fei.type));
+
+    if (fei.type != btrfs::file_extent_item_type::inline_extent) {
+        w.num("disk_bytenr", fei.disk_bytenr);
+        w.num("disk_num_bytes", fei.disk_num_bytes);
+        w.num("offset", fei.offset);
+        w.num("num_bytes", fei.num_bytes);
+    }
+}
+
+static void fields(jsonl::writer& w, const btrfs::extent_data_ref& edr) {
+    w.num("root", edr.root);
+    w.num("objectid", edr.objectid);
+    w.num("offset", edr.offset);
+    w.num("count", edr.count);
+}
+
+static void fields(jsonl::writer& w, const btrfs::disk_balance_args& dba) {
+    if (dba.flags & btrfs::BALANCE_ARGS_PROFILES)
+        w.num("profiles", dba.profiles);
+
+    if (dba.flags & btrfs::BALANCE_ARGS_USAGE)
+        w.num("usage", dba.usage);
+    else if (dba.flags & btrfs::BALANCE_ARGS_USAGE_RANGE) {
+        w.num("usage_min", dba.s1.usage_min);
+        w.num("usage_max", dba.s1.usage_max);
+    }
+
+    if (dba.flags & btrfs::BALANCE_ARGS_DEVID)
+        w.num("devid", dba.devid);
+
+    if (dba.flags & btrfs::BALANCE_ARGS_DRANGE) {
+        w.num("pstart", dba.pstart);
+        w.num("pend", dba.pend);
+    }
+
+    if (dba.flags & btrfs::BALANCE_ARGS_VRANGE) {
+        w.num("vstart", dba.vstart);
+        w.num("vend", dba.vend);
+    }
+
+    if (dba.flags & btrfs::BALANCE_ARGS_CONVERT)
+        w.num("target", dba.target);
+
+    w.num("flags", dba.flags);
+
+    if (dba.flags & btrfs::BALANCE_ARGS_LIMIT)
+        w.num("limit", dba.limit);
+
+    if (dba.flags & btrfs::BALANCE_ARGS_LIMIT_RANGE) {
+        w.num("limit_min", dba.s2.limit_min);
+        w.num("limit_max", dba.s2.limit_max);
+    }
+
+    if (dba.flags & btrfs::BALANCE_ARGS_STRIPES_RANGE) {
+        w.num("stripes_min", dba.stripes_min);
+        w.num("stripes_max", dba.stripes_max);
+    }
+}
+
+// The inline refs following an extent_item or metadata_item, as "refs" makes
+// up the item's own count.
+static void inline_refs(jsonl::writer& w, span<const uint8_t>& s) {
+    w.begin_array("inline_refs");
+
+    while (auto eir = peek<btrfs::extent_inline_ref>(s)) {
+        switch (eir->type) {
+            using enum btrfs::key_type;
+
+            case TREE_BLOCK_REF:
+            case EXTENT_OWNER_REF:
+                w.begin_object();
+                w.str("type", format("{}", eir->type));
+                w.num("root", eir->offset);
+                w.end_object();
+                s = s.subspan(sizeof(btrfs::extent_inline_ref));
+                continue;
+
+            case SHARED_BLOCK_REF:
+                w.begin_object();
+                w.str("type", format("{}", eir->type));
+                w.num("offset", eir->offset);
+                w.end_object();
+                s = s.subspan(sizeof(btrfs::extent_inline_ref));
+                continue;
+
+            case EXTENT_DATA_REF: {
+                auto len = offsetof(btrfs::extent_inline_ref, offset) + sizeof(btrfs::extent_data_ref);
+
+                if (s.size() < len)
+                    break;
+
+                w.begin_object();
+                w.str("type", format("{}", eir->type));
+                fields(w, *(const btrfs::extent_data_ref*)&eir->offset);
+                w.end_object();
+                s = s.subspan(len);
+                continue;
+            }
+
+            case SHARED_DATA_REF: {
+                auto len = sizeof(btrfs::extent_inline_ref) + sizeof(btrfs::shared_data_ref);
+
+                if (s.size() < len)
+                    break;
+
+                const auto& sdr = *(const btrfs::shared_data_ref*)(s.data() + sizeof(btrfs::extent_inline_ref));
+
+                w.begin_object();
+                w.str("type", format("{}", eir->type));
+                w.num("offset", eir->offset);
+                w.num("count", sdr.count);
+                w.end_object();
+                s = s.subspan(len);
+                continue;
+            }
+
+            default:
+                break;
+        }
+
+        // unknown or cut short - leave the rest for "extra"
+        break;
+    }
+
+    w.end_array();
+}
+
+export namespace itemjson {
+
+// The superblock's fields, with the bootstrap chunks and backup roots as
+// arrays.
+void superblock(jsonl::writer& w, const btrfs::super_block& sb) {
+    auto label = string_view(sb.label.data(), sb.label.size());
+
+    if (auto nul = label.find('\0'); nul != string_view::npos)
+        label = label.substr(0, nul);
+
+    w.str("csum", csum_str(sb.csum.data(), sb.csum_type));
+    w.str("fsid", format("{}", sb.fsid));
+    w.num("bytenr", sb.bytenr);
+    w.num("flags", sb.flags);
+    w.text("magic", bytes(&sb.magic, sizeof(sb.magic)));
+    w.num("generation", sb.generation);
+    w.num("root", sb.root);
+    w.num("chunk_root", sb.chunk_root);
+    w.num("log_root", sb.log_root);
+    w.num("log_root_transid", sb.__unused_log_root_transid);
+    w.num("total_bytes", sb.total_bytes);
+    w.num("bytes_used", sb.bytes_used);
+    w.num("root_dir_objectid", sb.root_dir_objectid);
+    w.num("num_devices", sb.num_devices);
+    w.num("sectorsize", sb.sectorsize);
+    w.num("nodesize", sb.nodesize);
+    w.num("leafsize", sb.__unused_leafsize);
+    w.num("stripesize", sb.stripesize);
+    w.num("sys_chunk_array_size", sb.sys_chunk_array_size);
+    w.num("chunk_root_generation", sb.chunk_root_generation);
+    w.num("compat_flags", sb.compat_flags);
+    w.num("compat_ro_flags", sb.compat_ro_flags);
+    w.num("incompat_flags", sb.incompat_flags);
+    w.str("csum_type", format("{}", sb.csum_type));
+    w.num("root_level", sb.root_level);
+    w.num("chunk_root_level", sb.chunk_root_level);
+    w.num("log_root_level", sb.log_root_level);
+    object(w, "dev_item", sb.dev_item);
+    w.text("label", label);
+    w.num("cache_generation", sb.cache_generation);
+    w.num("uuid_tree_generation", sb.uuid_tree_generation);
+    w.str("metadata_uuid", format("{}", sb.metadata_uuid));
+
+    if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE) {
+        w.num("remap_root", sb.remap_root);
+        w.num("remap_root_generation", sb.remap_root_generation);
+        w.num("remap_root_level", sb.remap_root_level);
+    }
+
+    w.begin_array("bootstrap");
+
+    auto bootstrap = span(sb.sys_chunk_array.data(),
+                          min<size_t>(sb.sys_chunk_array_size, sb.sys_chunk_array.size()));
+
+    while (auto k = peek<btrfs::key>(bootstrap, sizeof(btrfs::key) + offsetof(btrfs::chunk, stripe))) {
+        const auto& c = *(const btrfs::chunk*)(bootstrap.data() + sizeof(btrfs::key));
+        auto len = sizeof(btrfs::key) + offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe));
+
+        if (bootstrap.size() < len)
+            break;
+
+        w.begin_object();
+        object(w, "key", *k);
+        object(w, "chunk", c);
+        w.end_object();
+
+        bootstrap = bootstrap.subspan(len);
+    }
+
+    w.end_array();
+
+    w.begin_array("backups");
+
+    for (const auto& b : sb.super_roots) {
+        w.begin_object();
+        fields(w, b);
+        w.end_object();
+    }
+
+    w.end_array();
+}
+
+// A tree node's header.
+void header(jsonl::writer& w, const btrfs::header& h, btrfs::csum_type csum_type) {
+    w.str("csum", csum_str(h.csum.data(), csum_type));
+    w.str("fsid", format("{}", h.fsid));
+    w.num("bytenr", h.bytenr);
+    w.num("flags", h.flags);
+    w.str("chunk_tree_uuid", format("{}", h.chunk_tree_uuid));
+    w.num("generation", h.generation);
+    w.num("owner", h.owner);
+    w.num("nritems", h.nritems);
+    w.num("level", h.level);
+}
+
+// An item's contents, as "item" (the name the text output starts the line
+// with) and "data", which is an object for items holding one structure and
+// an array for those holding several.
+void item(jsonl::writer& w, span<const uint8_t> s, const btrfs::key& key,
+          const btrfs::super_block& sb) {
+    if ((uint8_t)key.type == 0 && key.objectid == btrfs::FREE_SPACE_OBJECTID) {
+        w.str("item", "free_space");
+
+        if (auto fsh = peek<btrfs::free_space_header>(s)) {
+            w.begin_object("data");
+            object(w, "location", fsh->location);
+            w.num("generation", fsh->generation);
+            w.num("num_entries", fsh->num_entries);
+            w.num("num_bitmaps", fsh->num_bitmaps);
+            w.end_object();
+
+            s = s.subspan(sizeof(btrfs::free_space_header));
+        }
+    } else if (key.objectid == btrfs::BALANCE_OBJECTID && key.type == btrfs::key_type::TEMPORARY_ITEM) {
+        w.str("item", "balance");
+
+        if (auto bi = peek<btrfs::balance_item>(s)) {
+            w.begin_object("data");
+            w.num("flags", bi->flags);
+            object(w, "data", bi->data);
+            object(w, "meta", bi->meta);
+            object(w, "sys", bi->sys);
+            w.end_object();
+
+            s = s.subspan(sizeof(btrfs::balance_item));
+        }
+    } else {
+        switch (key.type) {
+            using enum btrfs::key_type;
+
+            case INODE_ITEM:
+                w.str("item", "inode_item");
+
+                if (auto ii = peek<btrfs::inode_item>(s)) {
+                    object(w, "data", *ii);
+                    s = s.subspan(sizeof(btrfs::inode_item));
+                }
+                break;
+
+            case INODE_REF:
+                w.str("item", "inode_ref");
+                w.begin_array("data");
+
+                while (auto ir = peek<btrfs::inode_ref>(s)) {
+                    auto len = sizeof(btrfs::inode_ref) + ir->name_len;
+
+                    if (s.size() < len)
+                        break;
+
+                    w.begin_object();
+                    w.num("index", ir->index);
+                    w.num("name_len", ir->name_len);
+                    w.text("name", bytes(ir + 1, ir->name_len));
+                    w.end_object();
+
+                    s = s.subspan(len);
+                }
+
+                w.end_array();
+                break;
+
+            case INODE_EXTREF:
+                w.str("item", "inode_extref");
+                w.begin_array("data");
+
+                while (auto ier = peek<btrfs::inode_extref>(s, offsetof(btrfs::inode_extref, name))) {
+                    auto len = offsetof(btrfs::inode_extref, name) + ier->name_len;
+
+                    if (s.size() < len)
+                        break;
+
+                    w.begin_object();
+                    w.num("parent_objectid", ier->parent_objectid);
+                    w.num("index", ier->index);
+                    w.num("name_len", ier->name_len);
+                    w.text("name", bytes(ier->name, ier->name_len));
+                    w.end_object();
+
+                    s = s.subspan(len);
+                }
+
+                w.end_array();
+                break;
+
+            case XATTR_ITEM:
+            case DIR_ITEM:
+                w.str("item", key.type == XATTR_ITEM ? "xattr_item" : "dir_item");
+                w.begin_array("data");
+
+                while (auto di = peek<btrfs::dir_item>(s)) {
+                    auto len = sizeof(btrfs::dir_item) + di->name_len + di->data_len;
+
+                    if (s.size() < len)
+                        break;
+
+                    object(w, "", *di);
+                    s = s.subspan(len);
+                }
+
+                w.end_array();
+                break;
+
+            case DIR_INDEX:
+                w.str("item", "dir_index");
+
+                if (auto di = peek<btrfs::dir_item>(s)) {
+                    auto len = sizeof(btrfs::dir_item) + di->name_len + di->data_len;
+
+                    if (s.size() >= len) {
+                        object(w, "data", *di);
+                        s = s.subspan(len);
+                    }
+                }
+                break;
+
+            case VERITY_DESC_ITEM:
+                if (key.offset == 0) {
+                    w.str("item", "verity_desc_item");
+
+                    if (auto vdi = peek<btrfs::verity_descriptor_item>(s)) {
+                        w.begin_object("data");
+                        w.num("size", vdi->size);
+                        w.num("encryption", vdi->encryption);
+                        w.end_object();
+
+                        s = s.subspan(sizeof(btrfs::verity_descriptor_item));
+                    }
+                } else {
+                    w.str("item", "fsverity_descriptor");
+
+                    if (auto desc = peek<btrfs::fsverity_descriptor>(s)) {
+                        auto hash_len = desc->hash_algorithm == btrfs::fsverity_hash_algorithm::SHA256 ? 32 : 64;
+
+                        w.begin_object("data");
+                        w.num("version", desc->version);
+                        w.str("hash_algorithm", format("{}", desc->hash_algorithm));
+                        w.num("log_blocksize", desc->log_blocksize);
+                        w.num("salt_size", desc->salt_size);
+                        w.num("data_size", desc->data_size);
+                        w.str("root_hash", hex(span(desc->root_hash, hash_len)));
+
+                        if (desc->salt_size != 0)
+                            w.str("salt", hex(span(desc->salt, min<size_t>(desc->salt_size, sizeof(desc->salt)))));
+
+                        s = s.subspan(sizeof(btrfs::fsverity_descriptor));
+
+                        if (!s.empty()) {
+                            w.str("sig", hex(s));
+                            s = s.subspan(s.size());
+                        }
+
+                        w.end_object();
+                    }
+                }
+                break;
+
+            case VERITY_MERKLE_ITEM:
+                w.str("item", "verity_merkle_item");
+                w.str("data", hex(s));
+                s = s.subspan(s.size());
+                break;
+
+            case ORPHAN_ITEM:
+                w.str("item", "orphan_item");
+                break;
+
+            case DIR_LOG_INDEX:
+                w.str("item", "dir_log_index");
+
+                if (auto dli = peek<btrfs::dir_log_item>(s)) {
+                    w.begin_object("data");
+                    w.num("end", dli->end);
+                    w.end_object();
+
+                    s = s.subspan(sizeof(btrfs::dir_log_item));
+                }
+                break;
+
+            case EXTENT_DATA:
+                w.str("item", "extent_data");
+
+                if (auto fei = peek<btrfs::file_extent_item>(s, offsetof(btrfs::file_extent_item, disk_bytenr))) {
+                    if (fei->type == btrfs::file_extent_item_type::inline_extent) {
+                        object(w, "data", *fei);
+                        s = s.subspan(offsetof(btrfs::file_extent_item, disk_bytenr));
+
+                        // the inline data itself isn't given, as in the text output
+
+                        if (fei->compression != btrfs::compression_type::none)
+                            s = s.subspan(s.size());
+                        else
+                            s = s.subspan(min<size_t>(fei->ram_bytes, s.size()));
+                    } else if (s.size() >= sizeof(btrfs::file_extent_item)) {
+                        object(w, "data", *fei);
+                        s = s.subspan(sizeof(btrfs::file_extent_item));
+                    }
+                }
+                break;
+
+            case EXTENT_CSUM: {
+                size_t csum_len;
+
+                switch (sb.csum_type) {
+                    case btrfs::csum_type::CRC32:
+                        csum_len = sizeof(btrfs::le32);
+                        break;
+
+                    case btrfs::csum_type::XXHASH:
+                        csum_len = sizeof(btrfs::le64);
+                        break;
+
+                    default:
+                        csum_len = 4 * sizeof(btrfs::le64);
+                        break;
+                }
+
+                w.str("item", "extent_csum");
+                w.begin_array("data");
+
+                while (s.size() >= csum_len) {
+                    w.str("", csum_str(s.data(), sb.csum_type));
+                    s = s.subspan(csum_len);
+                }
+
+                w.end_array();
+                break;
+            }
+
+            case ROOT_ITEM:
+                w.str("item", "root_item");
+
+                if (auto ri = peek<btrfs::root_item>(s)) {
+                    object(w, "data", *ri);
+                    s = s.subspan(sizeof(btrfs::root_item));
+                }
+                break;
+
+            case ROOT_BACKREF:
+            case ROOT_REF:
+                w.str("item", key.type == ROOT_BACKREF ? "root_backref" : "root_ref");
+
+                if (auto rr = peek<btrfs::root_ref>(s)) {
+                    auto len = sizeof(btrfs::root_ref) + rr->name_len;
+
+                    if (s.size() >= len) {
+                        w.begin_object("data");
+                        w.num("dirid", rr->dirid);
+                        w.num("sequence", rr->sequence);
+                        w.num("name_len", rr->name_len);
+                        w.text("name", bytes(rr + 1, rr->name_len));
+                        w.end_object();
+
+                        s = s.subspan(len);
+                    }
+                }
+                break;
+
+            case EXTENT_ITEM:
+            case METADATA_ITEM:
+                w.str("item", key.type == METADATA_ITEM ? "metadata_item" : "extent_item");
+
+                if (auto ei = peek<btrfs::extent_item>(s)) {
+                    w.begin_object("data");
+                    w.num("refs", ei->refs);
+                    w.num("generation", ei->generation);
+                    w.num("flags", ei->flags);
+
+                    s = s.subspan(sizeof(btrfs::extent_item));
+
+                    if (key.type == EXTENT_ITEM && ei->flags & btrfs::EXTENT_FLAG_TREE_BLOCK) {
+                        if (auto tbi = peek<btrfs::tree_block_info>(s)) {
+                            object(w, "key", tbi->key);
+                            w.num("level", tbi->level);
+                            s = s.subspan(sizeof(btrfs::tree_block_info));
+                        }
+                    }
+
+                    inline_refs(w, s);
+                    w.end_object();
+                }
+                break;
+
+            case TREE_BLOCK_REF:
+                w.str("item", "tree_block_ref");
+                break;
+
+            case EXTENT_DATA_REF:
+                w.str("item", "extent_data_ref");
+
+                if (auto edr = peek<btrfs::extent_data_ref>(s)) {
+                    object(w, "data", *edr);
+                    s = s.subspan(sizeof(btrfs::extent_data_ref));
+                }
+                break;
+
+            case SHARED_BLOCK_REF:
+                w.str("item", "shared_block_ref");
+                break;
+
+            case SHARED_DATA_REF:
+                w.str("item", "shared_data_ref");
+
+                if (auto sdr = peek<btrfs::shared_data_ref>(s)) {
+                    w.begin_object("data");
+                    w.num("count", sdr->count);
+                    w.end_object();
+
+                    s = s.subspan(sizeof(btrfs::shared_data_ref));
+                }
+                break;
+
+            case BLOCK_GROUP_ITEM: {
+                bool v2 = sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE;
+                auto len = v2 ? sizeof(btrfs::block_group_item_v2) : sizeof(btrfs::block_group_item);
+
+                w.str("item", "block_group_item");
+
+                if (auto bgi = peek<btrfs::block_group_item_v2>(s, len)) {
+                    w.begin_object("data");
+                    w.num("used", bgi->used);
+                    w.num("chunk_objectid", bgi->chunk_objectid);
+                    w.num("flags", bgi->flags);
+
+                    if (v2) {
+                        w.num("remap_bytes", bgi->remap_bytes);
+                        w.num("identity_remap_count", bgi->identity_remap_count);
+                    }
+
+                    w.end_object();
+
+                    s = s.subspan(len);
+                }
+                break;
+            }
+
+            case FREE_SPACE_INFO:
+                w.str("item", "free_space_info");
+
+                if (auto fsi = peek<btrfs::free_space_info>(s)) {
+                    w.begin_object("data");
+                    w.num("extent_count", fsi->extent_count);
+                    w.num("flags", fsi->flags);
+                    w.end_object();
+
+                    s = s.subspan(sizeof(btrfs::free_space_info));
+                }
+                break;
+
+            case FREE_SPACE_EXTENT:
+                w.str("item", "free_space_extent");
+                break;
+
+            case FREE_SPACE_BITMAP:
+                w.str("item", "free_space_bitmap");
+                w.begin_array("data");
+
+                for (auto [addr, len] : itemfmt::free_space_runs(s, key.objectid, sb.sectorsize)) {
+                    w.begin_object();
+                    w.num("offset", addr);
+                    w.num("length", len);
+                    w.end_object();
+                }
+
+                w.end_array();
+
+                s = s.subspan(s.size());
+                break;
+
+            case DEV_EXTENT:
+                w.str("item", "dev_extent");
+
+                if (auto de = peek<btrfs::dev_extent>(s)) {
+                    w.begin_object("data");
+                    w.num("chunk_tree", de->chunk_tree);
+                    w.num("chunk_objectid", de->chunk_objectid);
+                    w.num("chunk_offset", de->chunk_offset);
+                    w.num("length", de->length);
+                    w.str("chunk_tree_uuid", format("{}", de->chunk_tree_uuid));
+                    w.end_object();
+
+                    s = s.subspan(sizeof(btrfs::dev_extent));
+                }
+                break;
+
+            case DEV_ITEM:
+                w.str("item", "dev_item");
+
+                if (auto d = peek<btrfs::dev_item>(s)) {
+                    object(w, "data", *d);
+                    s = s.subspan(sizeof(btrfs::dev_item));
+                }
+                break;
+
+            case CHUNK_ITEM:
+                w.str("item", "chunk_item");
+
+                if (auto c = peek<btrfs::chunk>(s, offsetof(btrfs::chunk, stripe))) {
+                    auto len = offsetof(btrfs::chunk, stripe) + (c->num_stripes * sizeof(btrfs::stripe));
+
+                    if (s.size() >= len) {
+                        object(w, "data", *c);
+                        s = s.subspan(len);
+                    }
+                }
+                break;
+
+            case RAID_STRIPE:
+                w.str("item", "raid_stripe");
+                w.begin_array("data");
+
+                while (auto rs = peek<btrfs::raid_stride>(s)) {
+                    w.begin_object();
+                    w.num("devid", rs->devid);
+                    w.num("physical", rs->physical);
+                    w.end_object();
+
+                    s = s.subspan(sizeof(btrfs::raid_stride));
+                }
+
+                w.end_array();
+                break;
+
+            case IDENTITY_REMAP:
+                w.str("item", "identity_remap");
+                break;
+
+            case REMAP:
+            case REMAP_BACKREF:
+                w.str("item", key.type == REMAP ? "remap" : "remap_backref");
+
+                if (auto r = peek<btrfs::remap_item>(s)) {
+                    w.begin_object("data");
+                    w.num("address", r->address);
+                    w.end_object();
+
+                    s = s.subspan(sizeof(btrfs::remap_item));
+                }
+                break;
+
+            case QGROUP_STATUS:
+                w.str("item", "qgroup_status");
+
+                if (auto qsi = peek<btrfs::qgroup_status_item>(s)) {
+                    w.begin_object("data");
+                    w.num("version", qsi->version);
+                    w.num("generation", qsi->generation);
+                    w.num("flags", qsi->flags);
+                    w.num("rescan", qsi->rescan);
+                    w.num("enable_gen", qsi->enable_gen);
+                    w.end_object();
+
+                    s = s.subspan(sizeof(btrfs::qgroup_status_item));
+                }
+                break;
+
+            case QGROUP_INFO:
+                w.str("item", "qgroup_info");
+
+                if (auto qi = peek<btrfs::qgroup_info_item>(s)) {
+                    w.begin_object("data");
+                    w.num("generation", qi->generation);
+                    w.num("rfer", qi->rfer);
+                    w.num("rfer_cmpr", qi->rfer_cmpr);
+                    w.num("excl", qi->excl);
+                    w.num("excl_cmpr", qi->excl_cmpr);
+                    w.end_object();
+
+                    s = s.subspan(sizeof(btrfs::qgroup_info_item));
+                }
+                break;
+
+            case QGROUP_LIMIT:
+                w.str("item", "qgroup_limit");
+
+                if (auto qli = peek<btrfs::qgroup_limit_item>(s)) {
+                    w.begin_object("data");
+                    w.num("flags", qli->flags);
+                    w.num("max_rfer", qli->max_rfer);
+                    w.num("max_excl", qli->max_excl);
+                    w.num("rsv_rfer", qli->rsv_rfer);
+                    w.num("rsv_excl", qli->rsv_excl);
+                    w.end_object();
+
+                    s = s.subspan(sizeof(btrfs::qgroup_limit_item));
+                }
+                break;
+
+            case QGROUP_RELATION:
+                w.str("item", "qgroup_relation");
+                break;
+
+            case PERSISTENT_ITEM:
+                w.str("item", "dev_stats");
+                w.begin_array("data");
+
+                while (auto n = peek<btrfs::le64>(s)) {
+                    w.num("", *n);
+                    s = s.subspan(sizeof(btrfs::le64));
+                }
+
+                w.end_array();
+                break;
+
+            case DEV_REPLACE:
+                w.str("item", "dev_replace");
+
+                if (auto dri = peek<btrfs::dev_replace_item>(s)) {
+                    w.begin_object("data");
+                    w.num("src_devid", dri->src_devid);
+                    w.num("cursor_left", dri->cursor_left);
+                    w.num("cursor_right", dri->cursor_right);
+                    w.num("cont_reading_from_srcdev_mode", dri->cont_reading_from_srcdev_mode);
+                    w.num("replace_state", dri->replace_state);
+                    w.num("time_started", dri->time_started);
+                    w.num("time_stopped", dri->time_stopped);
+                    w.num("num_write_errors", dri->num_write_errors);
+                    w.num("num_uncorrectable_read_errors", dri->num_uncorrectable_read_errors);
+                    w.end_object();
+
+                    s = s.subspan(sizeof(btrfs::dev_replace_item));
+                }
+                break;
+
+            case UUID_SUBVOL:
+            case UUID_RECEIVED_SUBVOL:
+                w.str("item", key.type == UUID_SUBVOL ? "uuid_subvol" : "uuid_rec_subvol");
+                w.begin_array("data");
+
+                while (auto n = peek<btrfs::le64>(s)) {
+                    w.num("", *n);
+                    s = s.subspan(sizeof(btrfs::le64));
+                }
+
+                w.end_array();
+                break;
+
+            default:
+                w.str("item", "unknown");
+                break;
+        }
+    }
+
+    if (!s.empty())
+        w.str("extra", hex(s));
+}
+
+}
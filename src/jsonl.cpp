@@ -0,0 +1,214 @@
+module;
+
+#include <stdint.h>
+#include <format>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+export module jsonl;
+
+using namespace std;
+
+// The length of the UTF-8 sequence starting at sv[i], or 0 if it isn't a
+// valid one. Overlong forms, surrogates and anything past U+10FFFF are
+// rejected, as strict JSON readers do.
+static size_t utf8_len(string_view sv, size_t i) {
+    auto c = (uint8_t)sv[i];
+    size_t len;
+    uint8_t lo = 0x80, hi = 0xbf;
+
+    if (c < 0x80)
+        return 1;
+    else if (c >= 0xc2 && c <= 0xdf)
+        len = 2;
+    else if (c >= 0xe0 && c <= 0xef) {
+        len = 3;
+
+        if (c == 0xe0)
+            lo = 0xa0;
+        else if (c == 0xed)
+            hi = 0x9f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        len = 4;
+
+        if (c == 0xf0)
+            lo = 0x90;
+        else if (c == 0xf4)
+            hi = 0x8f;
+    } else
+        return 0;
+
+    if (sv.size() - i < len)
+        return 0;
+
+    for (size_t j = 1; j < len; j++) {
+        auto d = (uint8_t)sv[i + j];
+
+        if (d < lo || d > hi)
+            return 0;
+
+        lo = 0x80;
+        hi = 0xbf;
+    }
+
+    return len;
+}
+
+export namespace jsonl {
+
+bool valid_utf8(string_view sv) {
+    for (size_t i = 0; i < sv.size(); ) {
+        auto len = utf8_len(sv, i);
+
+        if (len == 0)
+            return false;
+
+        i += len;
+    }
+
+    return true;
+}
+
+// Appends sv to out as a quoted JSON string. Runs of characters that don't
+// need escaping, which is nearly all of them, are copied in one go. Bytes
+// that aren't valid UTF-8 become U+FFFD, so that the line is still valid
+// JSON; writer::text is for where they need to be kept.
+void escape(string& out, string_view sv) {
+    static constexpr char hex[] = "0123456789abcdef";
+    size_t run = 0;
+
+    out += '"';
+
+    for (size_t i = 0; i < sv.size(); i++) {
+        auto c = (uint8_t)sv[i];
+
+        if (c >= 0x80) {
+            auto len = utf8_len(sv, i);
+
+            if (len != 0) {
+                i += len - 1;
+                continue;
+            }
+
+            out.append(sv.data() + run, i - run);
+            run = i + 1;
+            out += "\\ufffd";
+            continue;
+        }
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        out.append(sv.data() + run, i - run);
+        run = i + 1;
+
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+
+            case '\\':
+                out += "\\\\";
+                break;
+
+            case '\n':
+                out += "\\n";
+                break;
+
+            case '\r':
+                out += "\\r";
+                break;
+
+            case '\t':
+                out += "\\t";
+                break;
+
+            default:
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xf];
+                break;
+        }
+    }
+
+    out.append(sv.data() + run, sv.size() - run);
+    out += '"';
+}
+
+// Appends the members of a JSON object to a string, putting in the commas.
+// Members are added after whatever out already has, so the caller writes the
+// opening brace and any members of its own first. An empty name is for the
+// elements of an array.
+class writer {
+public:
+    writer(string& out) : out(out) { }
+
+    void num(string_view name, uint64_t v) {
+        key(name);
+        format_to(back_inserter(out), "{}", v);
+    }
+
+    void str(string_view name, string_view v) {
+        key(name);
+        escape(out, v);
+    }
+
+    // For names and labels, which are just bytes on disk: as a string if
+    // they're valid UTF-8, or otherwise in hex as name_hex.
+    void text(string_view name, string_view v) {
+        if (valid_utf8(v)) {
+            str(name, v);
+            return;
+        }
+
+        key(format("{}_hex", name));
+        out += '"';
+
+        for (auto c : v) {
+            format_to(back_inserter(out), "{:02x}", (uint8_t)c);
+        }
+
+        out += '"';
+    }
+
+    void begin_object(string_view name = {}) {
+        key(name);
+        out += '{';
+        first = true;
+    }
+
+    void end_object() {
+        out += '}';
+        first = false;
+    }
+
+    void begin_array(string_view name = {}) {
+        key(name);
+        out += '[';
+        first = true;
+    }
+
+    void end_array() {
+        out += ']';
+        first = false;
+    }
+
+private:
+    void key(string_view name) {
+        if (!first)
+            out += ',';
+
+        first = false;
+
+        if (!name.empty()) {
+            escape(out, name);
+            out += ':';
+        }
+    }
+
+    string& out;
+    bool first = false;
+};
+
+}
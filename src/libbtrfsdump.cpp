@@ -0,0 +1,295 @@
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <map>
+#include <new>
+#include <set>
+#include <span>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "btrfsdump.h"
+
+import cxxbtrfs;
+import formatted_error;
+import traverse;
+import itemfmt;
+
+using namespace std;
+
+// The C interface in btrfsdump.h, over the traverse module. No exceptions
+// get out: they're turned into error numbers, with the message kept for
+// btrfsdump_error.
+
+struct btrfsdump_fs {
+    btrfsdump_fs(const vector<filesystem::path>& fns) : vol(fns) { }
+
+    traverse::volume vol;
+    map<uint64_t, traverse::cursor> cursors; // for btrfsdump_get_item
+};
+
+struct btrfsdump_tree {
+    traverse::cursor c;
+};
+
+static thread_local string last_error;
+
+static int set_error(int err, string_view msg) {
+    last_error = msg;
+
+    return err;
+}
+
+// Runs f, catching anything it throws.
+template<typename F>
+static int guard(F f) {
+    try {
+        return f();
+    } catch (const bad_alloc&) {
+        return set_error(-ENOMEM, "out of memory");
+    } catch (const exception& e) {
+        return set_error(-EIO, e.what());
+    }
+}
+
+static btrfs::key to_key(const btrfsdump_key& k) {
+    btrfs::key ret;
+
+    ret.objectid = k.objectid;
+    ret.type = (btrfs::key_type)k.type;
+    ret.offset = k.offset;
+
+    return ret;
+}
+
+static int at_item(const btrfsdump_tree& t) {
+    if (!t.c.valid())
+        return set_error(-ENOENT, "no item");
+
+    return 0;
+}
+
+extern "C" {
+
+const char* btrfsdump_error(void) {
+    return last_error.c_str();
+}
+
+int btrfsdump_open(const char* const* paths, size_t num_paths, btrfsdump_fs** fs) {
+    if (!paths || num_paths == 0 || !fs)
+        return set_error(-EINVAL, "no devices given");
+
+    return guard([&] {
+        vector<filesystem::path> fns(paths, paths + num_paths);
+        auto ret = new btrfsdump_fs(fns);
+
+        try {
+            ret->vol.load_chunks();
+        } catch (...) {
+            delete ret;
+            throw;
+        }
+
+        *fs = ret;
+
+        return 0;
+    });
+}
+
+void btrfsdump_close(btrfsdump_fs* fs) {
+    delete fs;
+}
+
+int btrfsdump_list_trees(btrfsdump_fs* fs, uint64_t* ids, size_t max, size_t* count) {
+    if (!fs || !count || (max != 0 && !ids))
+        return set_error(-EINVAL, "invalid argument");
+
+    return guard([&] {
+        const auto& sb = fs->vol.sb();
+        set<uint64_t> trees;
+
+        // the trees whose roots are in the superblock, then everything else
+
+        trees.insert(btrfs::ROOT_TREE_OBJECTID);
+        trees.insert(btrfs::CHUNK_TREE_OBJECTID);
+
+        if (sb.log_root != 0)
+            trees.insert(btrfs::TREE_LOG_OBJECTID);
+
+        if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE)
+            trees.insert(btrfs::REMAP_TREE_OBJECTID);
+
+        for (auto [id, bytenr] : fs->vol.roots()) {
+            trees.insert(id);
+        }
+
+        *count = trees.size();
+
+        if (trees.size() > max)
+            return set_error(-ERANGE, format("{} trees, but only room for {}", trees.size(), max));
+
+        ranges::copy(trees, ids);
+
+        return 0;
+    });
+}
+
+int btrfsdump_tree_open(btrfsdump_fs* fs, uint64_t tree_id, btrfsdump_tree** tree) {
+    if (!fs || !tree)
+        return set_error(-EINVAL, "invalid argument");
+
+    return guard([&] {
+        *tree = new btrfsdump_tree{fs->vol.open_tree(tree_id)};
+
+        return 0;
+    });
+}
+
+void btrfsdump_tree_close(btrfsdump_tree* tree) {
+    delete tree;
+}
+
+int btrfsdump_tree_search(btrfsdump_tree* tree, const btrfsdump_key* key) {
+    if (!tree || !key)
+        return set_error(-EINVAL, "invalid argument");
+
+    return guard([&] {
+        auto exact = tree->c.search_slot(to_key(*key));
+
+        if (auto err = at_item(*tree); err != 0)
+            return err;
+
+        return exact ? 0 : 1;
+    });
+}
+
+int btrfsdump_tree_first(btrfsdump_tree* tree) {
+    if (!tree)
+        return set_error(-EINVAL, "invalid argument");
+
+    return guard([&] {
+        tree->c.first();
+
+        return at_item(*tree);
+    });
+}
+
+int btrfsdump_tree_next(btrfsdump_tree* tree) {
+    if (!tree)
+        return set_error(-EINVAL, "invalid argument");
+
+    return guard([&] {
+        tree->c.next_item();
+
+        return at_item(*tree);
+    });
+}
+
+int btrfsdump_tree_prev(btrfsdump_tree* tree) {
+    if (!tree)
+        return set_error(-EINVAL, "invalid argument");
+
+    return guard([&] {
+        tree->c.prev_item();
+
+        return at_item(*tree);
+    });
+}
+
+int btrfsdump_tree_item(btrfsdump_tree* tree, btrfsdump_key* key, const void** data,
+                        size_t* size) {
+    if (!tree)
+        return set_error(-EINVAL, "invalid argument");
+
+    return guard([&] {
+        if (auto err = at_item(*tree); err != 0)
+            return err;
+
+        const auto& k = tree->c.key();
+        auto item = tree->c.item();
+
+        if (key) {
+            key->objectid = k.objectid;
+            key->type = (uint8_t)k.type;
+            key->offset = k.offset;
+        }
+
+        if (data)
+            *data = item.data();
+
+        if (size)
+            *size = item.size();
+
+        return 0;
+    });
+}
+
+int btrfsdump_get_item(btrfsdump_fs* fs, uint64_t tree_id, const btrfsdump_key* key,
+                       void* buf, size_t buf_size, size_t* size) {
+    if (!fs || !key || !size || (buf_size != 0 && !buf))
+        return set_error(-EINVAL, "invalid argument");
+
+    return guard([&] {
+        auto it = fs->cursors.find(tree_id);
+
+        if (it == fs->cursors.end())
+            it = fs->cursors.emplace(tree_id, fs->vol.open_tree(tree_id)).first;
+
+        auto& c = it->second;
+
+        if (!c.search_slot(to_key(*key))) {
+            return set_error(-ENOENT, format("item ({:x},{:x},{:x}) not found in tree {:x}",
+                                             key->objectid, key->type, key->offset, tree_id));
+        }
+
+        auto item = c.item();
+
+        *size = item.size();
+
+        if (item.size() > buf_size)
+            return set_error(-ERANGE, format("item is {} bytes, but buffer is {}", item.size(), buf_size));
+
+        memcpy(buf, item.data(), item.size());
+
+        return 0;
+    });
+}
+
+int btrfsdump_item_text(btrfsdump_fs* fs, const btrfsdump_key* key, const void* data,
+                        size_t size, char* buf, size_t buf_size, size_t* len) {
+    if (!fs || !key || (size != 0 && !data) || !len || (buf_size != 0 && !buf))
+        return set_error(-EINVAL, "invalid argument");
+
+    return guard([&] {
+        auto item = span((const uint8_t*)data, size);
+        auto k = to_key(*key);
+        ostringstream ss;
+
+        // the data needn't have come from the filesystem, so make sure it's
+        // all there before printing it
+        if (!itemfmt::check_item(item, k, fs->vol.sb())) {
+            return set_error(-EINVAL, format("not a valid item of type {:x} ({} bytes)", key->type, size));
+        }
+
+        itemfmt::dump_item(ss, item, "", k, fs->vol.sb());
+
+        auto text = ss.view();
+
+        if (!text.empty() && text.back() == '\n')
+            text.remove_suffix(1);
+
+        *len = text.size();
+
+        if (text.size() >= buf_size)
+            return set_error(-ERANGE, format("text is {} bytes, but buffer is {}", text.size() + 1, buf_size));
+
+        memcpy(buf, text.data(), text.size());
+        buf[text.size()] = 0;
+
+        return 0;
+    });
+}
+
+}
@@ -0,0 +1,95 @@
+module;
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <bit>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+export module phash;
+
+using namespace std;
+
+export namespace phash {
+
+// FNV-1a, seeded so that we can look for a seed without collisions.
+constexpr uint32_t hash(string_view sv, uint32_t seed) {
+    uint32_t h = 0x811c9dc5 ^ seed;
+
+    for (auto c : sv) {
+        h ^= (uint8_t)c;
+        h *= 0x01000193;
+    }
+
+    return h;
+}
+
+// Perfect hash table of strings, built at compile time. A lookup is one hash,
+// one load, and one string comparison to rule out names that aren't in the
+// table.
+template<typename T, size_t N>
+class table {
+public:
+    static constexpr size_t num_slots = bit_ceil(N * 4);
+
+    consteval table(const pair<string_view, T> (&entries)[N]) {
+        for (size_t i = 0; i < N; i++) {
+            names[i] = entries[i].first;
+            values[i] = entries[i].second;
+        }
+
+        for (size_t i = 0; i < N; i++) {
+            for (size_t j = i + 1; j < N; j++) {
+                if (names[i] == names[j])
+                    throw logic_error("duplicate name in perfect hash table");
+            }
+        }
+
+        for (seed = 0; seed < 0x100000; seed++) {
+            if (try_seed())
+                return;
+        }
+
+        throw logic_error("no perfect hash found");
+    }
+
+    constexpr optional<T> find(string_view sv) const {
+        auto i = slots[hash(sv, seed) & (num_slots - 1)];
+
+        if (i == 0 || names[i - 1] != sv)
+            return nullopt;
+
+        return values[i - 1];
+    }
+
+private:
+    consteval bool try_seed() {
+        slots.fill(0);
+
+        for (size_t i = 0; i < N; i++) {
+            auto& s = slots[hash(names[i], seed) & (num_slots - 1)];
+
+            if (s != 0)
+                return false;
+
+            s = (uint16_t)(i + 1);
+        }
+
+        return true;
+    }
+
+    uint32_t seed = 0;
+    array<uint16_t, num_slots> slots{};
+    array<string_view, N> names{};
+    array<T, N> values{};
+};
+
+template<typename T, size_t N>
+consteval table<T, N> make_table(const pair<string_view, T> (&entries)[N]) {
+    return table<T, N>(entries);
+}
+
+}
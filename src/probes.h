@@ -0,0 +1,14 @@
+#pragma once
+
+#include "config.h"
+
+// Static tracepoints for bpftrace, SystemTap and perf. Without <sys/sdt.h>
+// they compile to nothing; with it, each is a single nop until something
+// attaches to it, and the arguments are only read then.
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE(provider, name, ...) STAP_PROBEV(provider, name, __VA_ARGS__)
+#else
+#define PROBE(provider, name, ...) do { } while (0)
+#endif
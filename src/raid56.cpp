@@ -0,0 +1,161 @@
+module;
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <span>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+export module raid56;
+
+using namespace std;
+
+// The parity kernels below all follow the same scheme as the kernel's
+// lib/raid6: P is the XOR of the data stripes, and Q is the sum of g^i D_i
+// in GF(2^8), with generator g = 2 and polynomial 0x11d. Q is worked out by
+// Horner's rule, starting at the last stripe and multiplying by 2 each time.
+
+using gen_fn = void (*)(span<const span<const uint8_t>> data, uint8_t* p, uint8_t* q,
+                        size_t start, size_t end);
+
+// multiplies each of the eight bytes of v by 2 in GF(2^8)
+static uint64_t mul2_u64(uint64_t v) {
+    auto mask = v & 0x8080808080808080;
+
+    mask = (mask << 1) - (mask >> 7);
+
+    return ((v << 1) & 0xfefefefefefefefe) ^ (mask & 0x1d1d1d1d1d1d1d1d);
+}
+
+static void gen_scalar(span<const span<const uint8_t>> data, uint8_t* p, uint8_t* q,
+                       size_t start, size_t end) {
+    auto last = data.size() - 1;
+    size_t i = start;
+
+    for (; i + sizeof(uint64_t) <= end; i += sizeof(uint64_t)) {
+        uint64_t wp, wq;
+
+        memcpy(&wp, data[last].data() + i, sizeof(uint64_t));
+        wq = wp;
+
+        for (size_t d = last; d-- > 0; ) {
+            uint64_t v;
+
+            memcpy(&v, data[d].data() + i, sizeof(uint64_t));
+
+            wp ^= v;
+
+            if (q)
+                wq = mul2_u64(wq) ^ v;
+        }
+
+        memcpy(p + i, &wp, sizeof(uint64_t));
+
+        if (q)
+            memcpy(q + i, &wq, sizeof(uint64_t));
+    }
+
+    for (; i < end; i++) {
+        uint8_t wp = data[last][i];
+        uint8_t wq = wp;
+
+        for (size_t d = last; d-- > 0; ) {
+            wp ^= data[d][i];
+
+            if (q)
+                wq = (uint8_t)((wq << 1) ^ (wq & 0x80 ? 0x1d : 0)) ^ data[d][i];
+        }
+
+        p[i] = wp;
+
+        if (q)
+            q[i] = wq;
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void gen_avx2(span<const span<const uint8_t>> data, uint8_t* p, uint8_t* q,
+                     size_t start, size_t end) {
+    const auto poly = _mm256_set1_epi8(0x1d);
+    const auto zero = _mm256_setzero_si256();
+    auto last = data.size() - 1;
+    size_t i = start;
+
+    for (; i + 32 <= end; i += 32) {
+        auto wp = _mm256_loadu_si256((const __m256i*)(data[last].data() + i));
+        auto wq = wp;
+
+        for (size_t d = last; d-- > 0; ) {
+            auto v = _mm256_loadu_si256((const __m256i*)(data[d].data() + i));
+
+            wp = _mm256_xor_si256(wp, v);
+
+            if (q) {
+                // bytes with their top bit set need reducing by the polynomial
+                auto mask = _mm256_cmpgt_epi8(zero, wq);
+
+                wq = _mm256_add_epi8(wq, wq);
+                wq = _mm256_xor_si256(wq, _mm256_and_si256(mask, poly));
+                wq = _mm256_xor_si256(wq, v);
+            }
+        }
+
+        _mm256_storeu_si256((__m256i*)(p + i), wp);
+
+        if (q)
+            _mm256_storeu_si256((__m256i*)(q + i), wq);
+    }
+
+    gen_scalar(data, p, q, i, end);
+}
+#endif
+
+static gen_fn pick_gen() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return gen_avx2;
+#endif
+
+    return gen_scalar;
+}
+
+// q is null for RAID5
+static void gen(span<const span<const uint8_t>> data, span<uint8_t> p, uint8_t* q) {
+    static const gen_fn gen_vector = pick_gen();
+
+    if (data.empty())
+        throw invalid_argument("no data stripes");
+
+    for (const auto& d : data) {
+        if (d.size() != p.size())
+            throw invalid_argument("data stripes not all the same size");
+    }
+
+    gen_vector(data, p.data(), q, 0, p.size());
+}
+
+export namespace raid56 {
+
+// Computes the RAID5 parity of the data stripes, which must all be the same
+// size as p.
+void gen_p(span<const span<const uint8_t>> data, span<uint8_t> p) {
+    gen(data, p, nullptr);
+}
+
+// Computes the RAID6 P and Q stripes of the data stripes, which must all be
+// the same size as p and q.
+void gen_pq(span<const span<const uint8_t>> data, span<uint8_t> p, span<uint8_t> q) {
+    if (q.size() != p.size())
+        throw invalid_argument("Q stripe not the same size as P stripe");
+
+    gen(data, p, q.data());
+}
+
+}
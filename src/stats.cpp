@@ -0,0 +1,435 @@
+module;
+
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <format>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+export module stats;
+
+using namespace std;
+
+export namespace stats {
+
+enum class timer : unsigned int {
+    other,
+    read_data,
+    format,
+    output
+};
+
+constexpr size_t NUM_TIMERS = 4;
+
+struct io_count {
+    uint64_t nodes = 0;
+    uint64_t bytes = 0;
+};
+
+// A log-linear histogram, in the style of HdrHistogram: each power of two is
+// split into 16 buckets, so any value is recorded to within about 6%.
+class histogram {
+public:
+    void record(uint64_t v) {
+        counts[bucket(v)]++;
+        count++;
+        total += v;
+
+        if (v > max)
+            max = v;
+    }
+
+    void merge(const histogram& h) {
+        for (size_t i = 0; i < NUM_BUCKETS; i++) {
+            counts[i] += h.counts[i];
+        }
+
+        count += h.count;
+        total += h.total;
+
+        if (h.max > max)
+            max = h.max;
+    }
+
+    // p is between 0 and 100
+    uint64_t percentile(unsigned int p) const {
+        if (count == 0)
+            return 0;
+
+        auto target = (count * p + 99) / 100;
+        uint64_t seen = 0;
+
+        if (target == 0)
+            target = 1;
+
+        for (size_t i = 0; i < NUM_BUCKETS; i++) {
+            seen += counts[i];
+
+            if (seen >= target)
+                return min(midpoint(i), max);
+        }
+
+        return max;
+    }
+
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+private:
+    static constexpr unsigned int SUB_BITS = 4;
+    static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr size_t NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static size_t bucket(uint64_t v) {
+        if (v < SUB_BUCKETS)
+            return v;
+
+        auto shift = bit_width(v) - 1 - SUB_BITS;
+
+        return ((shift + 1) * SUB_BUCKETS) + ((v >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t midpoint(size_t i) {
+        if (i < SUB_BUCKETS)
+            return i;
+
+        auto shift = (i / SUB_BUCKETS) - 1;
+        auto low = (SUB_BUCKETS + (i % SUB_BUCKETS)) << shift;
+
+        return low + ((uint64_t)1 << shift) / 2;
+    }
+
+    array<uint64_t, NUM_BUCKETS> counts = {};
+};
+
+// Each thread has its own counters, so that nothing on the hot path needs
+// to be atomic. They are only added together when the report is printed.
+struct counters {
+    map<uint64_t, io_count> devices;
+    map<uint64_t, io_count> trees;
+    map<uint64_t, histogram> latencies; // per device, in nanoseconds
+    uint64_t ns[NUM_TIMERS] = {};
+    uint64_t chunk_lookups = 0;
+    uint64_t remap_lookups = 0;
+    uint64_t buffer_bytes = 0;
+    uint64_t peak_buffer_bytes = 0;
+
+    // the timer currently running, and when it was last charged
+    timer current = timer::other;
+    chrono::steady_clock::time_point last;
+};
+
+}
+
+// Nothing is recorded unless it's been asked for. Reading the clock isn't
+// free, and each thread's counters are kept in the registry until the
+// report, which for a long-running program using libbtrfsdump would never
+// come.
+static bool enabled = false;
+static chrono::steady_clock::time_point start_time;
+
+static mutex registry_lock;
+static vector<shared_ptr<stats::counters>> registry;
+static map<uint64_t, string> device_names;
+
+static stats::counters& local() {
+    thread_local shared_ptr<stats::counters> c;
+
+    if (!c) [[unlikely]] {
+        c = make_shared<stats::counters>();
+
+        lock_guard lg(registry_lock);
+        registry.push_back(c);
+    }
+
+    return *c;
+}
+
+static void charge(stats::counters& c, chrono::steady_clock::time_point now) {
+    if (c.current != stats::timer::other)
+        c.ns[(unsigned int)c.current] += chrono::duration_cast<chrono::nanoseconds>(now - c.last).count();
+
+    c.last = now;
+}
+
+static string device_label(uint64_t devid) {
+    lock_guard lg(registry_lock);
+
+    if (auto it = device_names.find(devid); it != device_names.end())
+        return format("{} ({})", devid, it->second);
+
+    return format("{}", devid);
+}
+
+static string duration_str(uint64_t ns) {
+    if (ns < 1000)
+        return format("{} ns", ns);
+    else if (ns < 1000000)
+        return format("{:.1f} us", (double)ns / 1000.0);
+    else if (ns < 1000000000)
+        return format("{:.2f} ms", (double)ns / 1000000.0);
+    else
+        return format("{:.2f} s", (double)ns / 1000000000.0);
+}
+
+// A device is flagged if its median read latency is many times that of the
+// median device, which is what one failing disk in an array looks like.
+static void report_slow_devices(ostream& os, const map<uint64_t, stats::histogram>& latencies) {
+    static constexpr uint64_t SLOW_FACTOR = 4;
+    static constexpr uint64_t MIN_READS = 16;
+
+    vector<uint64_t> p50s;
+
+    for (const auto& [devid, h] : latencies) {
+        if (h.count >= MIN_READS)
+            p50s.push_back(h.percentile(50));
+    }
+
+    if (p50s.size() < 2)
+        return;
+
+    ranges::sort(p50s);
+
+    auto typical = p50s[(p50s.size() - 1) / 2];
+
+    for (const auto& [devid, h] : latencies) {
+        if (h.count < MIN_READS)
+            continue;
+
+        auto p50 = h.percentile(50);
+
+        if (p50 > typical * SLOW_FACTOR) {
+            os << format("device {} is slow: median latency {}, against {} for the others\n",
+                         device_label(devid), duration_str(p50), duration_str(typical));
+        }
+    }
+}
+
+export namespace stats {
+
+// Starts the counters and timers, and the wall clock that the report is
+// measured against.
+void enable() {
+    enabled = true;
+    start_time = chrono::steady_clock::now();
+}
+
+void name_device(uint64_t devid, string_view name) {
+    lock_guard lg(registry_lock);
+
+    device_names[devid] = name;
+}
+
+void device_read(uint64_t devid, uint64_t bytes) {
+    if (!enabled)
+        return;
+
+    auto& d = local().devices[devid];
+
+    d.nodes++;
+    d.bytes += bytes;
+}
+
+void tree_read(uint64_t tree, uint64_t bytes) {
+    if (!enabled)
+        return;
+
+    auto& t = local().trees[tree];
+
+    t.nodes++;
+    t.bytes += bytes;
+}
+
+void chunk_lookup() {
+    if (!enabled)
+        return;
+
+    local().chunk_lookups++;
+}
+
+void remap_lookup() {
+    if (!enabled)
+        return;
+
+    local().remap_lookups++;
+}
+
+// Charges the time until it goes out of scope to a timer. Scopes can nest,
+// in which case the inner one's time isn't counted against the outer one.
+class scope {
+public:
+    scope(timer t) {
+        if (!enabled)
+            return;
+
+        auto& c = local();
+
+        charge(c, chrono::steady_clock::now());
+        prev = c.current;
+        c.current = t;
+        active = true;
+    }
+
+    ~scope() {
+        if (!active)
+            return;
+
+        auto& c = local();
+
+        charge(c, chrono::steady_clock::now());
+        c.current = prev;
+    }
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+private:
+    timer prev = timer::other;
+    bool active = false;
+};
+
+// Records how long a read from a device took, for its latency histogram.
+class read_timer {
+public:
+    read_timer(uint64_t devid) : devid(devid) {
+        if (enabled)
+            start = chrono::steady_clock::now();
+    }
+
+    ~read_timer() {
+        if (!enabled)
+            return;
+
+        auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+        local().latencies[devid].record(ns);
+    }
+
+    read_timer(const read_timer&) = delete;
+    read_timer& operator=(const read_timer&) = delete;
+
+private:
+    uint64_t devid;
+    chrono::steady_clock::time_point start;
+};
+
+// Accounts for a buffer for as long as it's alive.
+class buffer {
+public:
+    buffer(uint64_t size) : size(size) {
+        if (!enabled)
+            return;
+
+        auto& c = local();
+
+        c.buffer_bytes += size;
+
+        if (c.buffer_bytes > c.peak_buffer_bytes)
+            c.peak_buffer_bytes = c.buffer_bytes;
+
+        active = true;
+    }
+
+    ~buffer() {
+        if (active)
+            local().buffer_bytes -= size;
+    }
+
+    buffer(const buffer&) = delete;
+    buffer& operator=(const buffer&) = delete;
+
+private:
+    uint64_t size;
+    bool active = false;
+};
+
+// Adds up the counters of every thread. The peak buffer figure is the sum of
+// each thread's peak, so is an upper bound if there's more than one.
+counters merge() {
+    counters ret;
+
+    lock_guard lg(registry_lock);
+
+    for (const auto& c : registry) {
+        for (const auto& [devid, d] : c->devices) {
+            ret.devices[devid].nodes += d.nodes;
+            ret.devices[devid].bytes += d.bytes;
+        }
+
+        for (const auto& [tree, t] : c->trees) {
+            ret.trees[tree].nodes += t.nodes;
+            ret.trees[tree].bytes += t.bytes;
+        }
+
+        for (const auto& [devid, h] : c->latencies) {
+            ret.latencies[devid].merge(h);
+        }
+
+        for (size_t i = 0; i < NUM_TIMERS; i++) {
+            ret.ns[i] += c->ns[i];
+        }
+
+        ret.chunk_lookups += c->chunk_lookups;
+        ret.remap_lookups += c->remap_lookups;
+        ret.peak_buffer_bytes += c->peak_buffer_bytes;
+    }
+
+    return ret;
+}
+
+void report(ostream& os) {
+    auto c = merge();
+
+    for (const auto& [devid, d] : c.devices) {
+        os << format("device {}: {} nodes, {} bytes read\n", device_label(devid), d.nodes, d.bytes);
+
+        if (auto it = c.latencies.find(devid); it != c.latencies.end() && it->second.count != 0) {
+            const auto& h = it->second;
+
+            os << format("device {}: latency p50 {}, p99 {}, max {}, {:.1f} MiB/s\n",
+                         device_label(devid), duration_str(h.percentile(50)),
+                         duration_str(h.percentile(99)), duration_str(h.max),
+                         h.total == 0 ? 0.0 : ((double)d.bytes * 1000000000.0) / ((double)h.total * 1048576.0));
+        }
+    }
+
+    report_slow_devices(os, c.latencies);
+
+    for (const auto& [tree, t] : c.trees) {
+        os << format("tree {:x}: {} nodes, {} bytes read\n", tree, t.nodes, t.bytes);
+    }
+
+    if (enabled) {
+        auto total = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count();
+        auto timed = c.ns[(unsigned int)timer::read_data] + c.ns[(unsigned int)timer::format] + c.ns[(unsigned int)timer::output];
+
+        c.ns[(unsigned int)timer::other] = total > timed ? total - timed : 0;
+
+        static const pair<timer, string_view> names[] = {
+            { timer::read_data, "read_data" },
+            { timer::format, "formatting" },
+            { timer::output, "output writes" },
+            { timer::other, "other" },
+        };
+
+        for (const auto& [t, n] : names) {
+            auto ns = c.ns[(unsigned int)t];
+
+            os << format("time in {}: {}.{:03} ms ({}%)\n", n, ns / 1000000, (ns / 1000) % 1000,
+                         total == 0 ? 0 : (ns * 100) / total);
+        }
+    }
+
+    os << format("chunk lookups: {}, remap lookups: {}\n", c.chunk_lookups, c.remap_lookups);
+    os << format("peak buffer memory: {} bytes\n", c.peak_buffer_bytes);
+}
+
+}
@@ -0,0 +1,176 @@
+module;
+
+#include <stdint.h>
+#include <unistd.h>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+export module trace;
+
+import formatted_error;
+
+using namespace std;
+
+// Spans are written in the Chrome trace-event format, as complete ("X")
+// events, which chrome://tracing and Perfetto can both load. Each thread
+// builds up its events in its own buffer, and only takes the lock to hand
+// over a full one.
+
+static constexpr size_t FLUSH_SIZE = 1024 * 1024;
+
+static bool enabled = false;
+static chrono::steady_clock::time_point start_time;
+static mutex file_lock;
+static ofstream file;
+
+static void write_events(string_view sv) {
+    lock_guard lg(file_lock);
+
+    if (file.is_open())
+        file.write(sv.data(), sv.size());
+}
+
+struct thread_buffer {
+    thread_buffer() : tid(gettid()) { }
+
+    ~thread_buffer() {
+        write_events(buf);
+    }
+
+    void maybe_flush() {
+        if (buf.size() >= FLUSH_SIZE) {
+            write_events(buf);
+            buf.clear();
+        }
+    }
+
+    pid_t tid;
+    string buf;
+};
+
+static thread_buffer& local() {
+    thread_local thread_buffer tb;
+
+    return tb;
+}
+
+static uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count();
+}
+
+export namespace trace {
+
+void open(const filesystem::path& fn, string_view process_name) {
+    lock_guard lg(file_lock);
+
+    file.open(fn, ios::binary | ios::trunc);
+
+    if (!file)
+        throw formatted_error("failed to open trace file {}", fn.string());
+
+    start_time = chrono::steady_clock::now();
+    enabled = true;
+
+    // every event after this one starts with a comma
+    file << format("{{\"traceEvents\":[\n{{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":{},\"args\":{{\"name\":\"{}\"}}}}",
+                   getpid(), process_name);
+}
+
+// Writes out the calling thread's events and finishes the file. Any other
+// threads should have exited by now.
+void close() {
+    if (!enabled)
+        return;
+
+    auto& tb = local();
+
+    write_events(tb.buf);
+    tb.buf.clear();
+
+    lock_guard lg(file_lock);
+
+    enabled = false;
+    file << "\n]}\n";
+    file.close();
+
+    if (file.fail())
+        throw runtime_error("error writing trace file");
+}
+
+bool active() {
+    return enabled;
+}
+
+// Labels the calling thread in the trace.
+void thread_name(string_view name) {
+    if (!enabled)
+        return;
+
+    auto& tb = local();
+
+    format_to(back_inserter(tb.buf), ",\n{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":{},\"tid\":{},\"args\":{{\"name\":\"{}\"}}}}",
+              getpid(), tb.tid, name);
+}
+
+// Records the time from its construction to its destruction. The name and
+// argument names aren't escaped, so should be literals.
+class span {
+public:
+    span(string_view name) : name(name) {
+        if (enabled)
+            start = now_ns();
+    }
+
+    ~span() {
+        if (!enabled)
+            return;
+
+        auto end = now_ns();
+        auto& tb = local();
+
+        format_to(back_inserter(tb.buf), ",\n{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":{},\"tid\":{},\"ts\":{}.{:03},\"dur\":{}.{:03}",
+                  name, getpid(), tb.tid, start / 1000, start % 1000, (end - start) / 1000, (end - start) % 1000);
+
+        if (!args.empty())
+            format_to(back_inserter(tb.buf), ",\"args\":{{{}}}", args);
+
+        tb.buf += '}';
+        tb.maybe_flush();
+    }
+
+    span(const span&) = delete;
+    span& operator=(const span&) = delete;
+
+    void arg(string_view key, uint64_t val) {
+        if (!enabled)
+            return;
+
+        if (!args.empty())
+            args += ',';
+
+        format_to(back_inserter(args), "\"{}\":{}", key, val);
+    }
+
+    // for addresses, which are easier to read in hex
+    void hex_arg(string_view key, uint64_t val) {
+        if (!enabled)
+            return;
+
+        if (!args.empty())
+            args += ',';
+
+        format_to(back_inserter(args), "\"{}\":\"{:x}\"", key, val);
+    }
+
+private:
+    string_view name;
+    uint64_t start = 0;
+    string args;
+};
+
+}
@@ -0,0 +1,950 @@
+module;
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <generator>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <blkid.h>
+#include "probes.h"
+
+export module traverse;
+
+import cxxbtrfs;
+import formatted_error;
+import bindump;
+import stats;
+import trace;
+
+using namespace std;
+
+// Everything needed to read the trees of a filesystem, whether from its
+// devices or from a binary dump: finding the devices, mapping logical
+// addresses to physical ones, and walking the trees. None of this prints
+// anything, so it can be used in-process by other programs.
+
+class blkid_cache_putter {
+public:
+    using pointer = blkid_cache;
+
+    void operator()(blkid_cache cache) {
+        blkid_put_cache(cache);
+    }
+};
+
+using blkid_cache_ptr = unique_ptr<blkid_cache, blkid_cache_putter>;
+
+class blkid_dev_iterate_ender {
+public:
+    using pointer = blkid_dev_iterate;
+
+    void operator()(blkid_dev_iterate iter) {
+        blkid_dev_iterate_end(iter);
+    }
+};
+
+using blkid_dev_iterate_ptr = unique_ptr<blkid_dev_iterate, blkid_dev_iterate_ender>;
+
+export namespace traverse {
+
+constexpr unsigned int MAX_STRIPES = 16;
+
+struct chunk : btrfs::chunk {
+    btrfs::stripe next_stripes[MAX_STRIPES - 1];
+};
+
+struct device {
+    device(ifstream& f, string_view name) : f(f), name(name) { }
+
+    ifstream& f;
+    string name;
+    btrfs::super_block sb;
+};
+
+struct fs_info {
+    map<uint64_t, device> devices;
+    map<uint64_t, chunk> chunks, sys_chunks;
+    map<uint64_t, pair<uint64_t, uint64_t>> remaps;
+    const bindump::reader* archive = nullptr;
+};
+
+void read_superblock(device& d) {
+    d.f.seekg(btrfs::superblock_addrs[0]);
+    d.f.read((char*)&d.sb, sizeof(d.sb));
+}
+
+const pair<uint64_t, const chunk&> find_chunk(const map<uint64_t, chunk>& chunks,
+                                              uint64_t address) {
+    stats::chunk_lookup();
+
+    auto it = chunks.upper_bound(address);
+
+    if (it == chunks.begin())
+        throw formatted_error("could not find address {:x} in chunks", address);
+
+    const auto& p = *prev(it);
+
+    if (p.first + p.second.length <= address)
+        throw formatted_error("could not find address {:x} in chunks", address);
+
+    return p;
+}
+
+}
+
+static void read_device(const traverse::fs_info& info, uint64_t addr, uint64_t devid, uint64_t physical,
+                        string& buf) {
+    trace::span sp("read");
+
+    sp.arg("devid", devid);
+    sp.hex_arg("physical", physical);
+
+    if (info.devices.count(devid) == 0)
+        throw formatted_error("device {} not found", devid);
+
+    auto& d = info.devices.at(devid);
+
+    PROBE(btrfs_dump, read_device_entry, addr, devid, physical, buf.size());
+
+    {
+        stats::read_timer rt(devid);
+
+        d.f.seekg(physical);
+        d.f.read(buf.data(), buf.size());
+    }
+
+    PROBE(btrfs_dump, read_device_return, addr, devid, physical, buf.size());
+
+    stats::device_read(devid, buf.size());
+}
+
+export namespace traverse {
+
+string read_data(const fs_info& info, uint64_t addr, uint64_t size,
+                 bool ignore_remap = false) {
+    stats::scope t(stats::timer::read_data);
+    trace::span sp("read_data");
+
+    sp.hex_arg("addr", addr);
+
+    PROBE(btrfs_dump, read_data_entry, addr, size);
+
+    if (info.archive) {
+        auto node = info.archive->find(addr);
+
+        if (!node.has_value())
+            throw formatted_error("address {:x} not found in binary dump", addr);
+
+        if (node->size() < size)
+            throw formatted_error("short read at {:x} in binary dump", addr);
+
+        PROBE(btrfs_dump, read_data_return, addr, size);
+
+        return string((const char*)node->data(), size);
+    }
+
+    auto& chunks = info.chunks.empty() ? info.sys_chunks : info.chunks;
+    auto& [chunk_start, c] = find_chunk(chunks, addr);
+
+    if (!ignore_remap && c.type & btrfs::BLOCK_GROUP_REMAPPED) {
+        stats::remap_lookup();
+
+        auto it = info.remaps.upper_bound(addr);
+
+        if (it == info.remaps.begin())
+            throw formatted_error("could not find address {:x} in remap tree", addr);
+
+        const auto& r = *prev(it);
+
+        if (r.first + r.second.first <= addr)
+            throw formatted_error("could not find address {:x} in remap tree", addr);
+
+        auto new_addr = addr - r.first + r.second.second;
+
+        return read_data(info, new_addr, size, true);
+    }
+
+    string ret;
+
+    ret.resize(size);
+
+    // FIXME - handle degraded reads?
+
+    switch (btrfs::get_chunk_raid_type(c)) {
+        case btrfs::raid_type::RAID5:
+        case btrfs::raid_type::RAID6: {
+            auto data_stripes = c.num_stripes - 1;
+
+            if (btrfs::get_chunk_raid_type(c) == btrfs::raid_type::RAID6)
+                data_stripes--;
+
+            auto stripeoff = (addr - chunk_start) % (data_stripes * c.stripe_len);
+            auto parity = (((addr - chunk_start) / (data_stripes * c.stripe_len)) + c.num_stripes - 1) % c.num_stripes;
+            auto stripe2 = stripeoff / c.stripe_len;
+            auto stripe = (parity + stripe2 + 1) % c.num_stripes;
+
+            read_device(info, addr, c.stripe[stripe].devid,
+                        c.stripe[stripe].offset + (((addr - chunk_start) / (data_stripes * c.stripe_len)) * c.stripe_len) + (stripeoff % c.stripe_len),
+                        ret);
+
+            break;
+        }
+
+        case btrfs::raid_type::RAID10: {
+            auto stripe_num = (addr - chunk_start) / c.stripe_len;
+            auto stripe_offset = (addr - chunk_start) % c.stripe_len;
+            auto stripe = (stripe_num % (c.num_stripes / c.sub_stripes)) * c.sub_stripes;
+
+            read_device(info, addr, c.stripe[stripe].devid,
+                        c.stripe[stripe].offset + ((stripe_num / (c.num_stripes / c.sub_stripes)) * c.stripe_len) + stripe_offset,
+                        ret);
+
+            break;
+        }
+
+        case btrfs::raid_type::RAID0: {
+            auto stripe_num = (addr - chunk_start) / c.stripe_len;
+            auto stripe_offset = (addr - chunk_start) % c.stripe_len;
+            auto stripe = stripe_num % c.num_stripes;
+
+            read_device(info, addr, c.stripe[stripe].devid,
+                        c.stripe[stripe].offset + ((stripe_num / c.num_stripes) * c.stripe_len) + stripe_offset,
+                        ret);
+
+            break;
+        }
+
+        default: { // SINGLE, DUP, RAID1, RAID1C3, RAID1C4
+            read_device(info, addr, c.stripe[0].devid, c.stripe[0].offset + addr - chunk_start, ret);
+
+            break;
+        }
+    }
+
+    PROBE(btrfs_dump, read_data_return, addr, size);
+
+    return ret;
+}
+
+map<uint64_t, chunk> load_sys_chunks(const btrfs::super_block& sb) {
+    map<uint64_t, chunk> sys_chunks;
+
+    auto sys_array = span(sb.sys_chunk_array.data(), sb.sys_chunk_array_size);
+
+    while (!sys_array.empty()) {
+        if (sys_array.size() < sizeof(btrfs::key))
+            throw runtime_error("sys array truncated");
+
+        auto& k = *(btrfs::key*)sys_array.data();
+
+        if (k.type != btrfs::key_type::CHUNK_ITEM)
+            throw formatted_error("unexpected key type {} in sys array", k.type);
+
+        sys_array = sys_array.subspan(sizeof(btrfs::key));
+
+        if (sys_array.size() < offsetof(btrfs::chunk, stripe))
+            throw runtime_error("sys array truncated");
+
+        auto& c = *(chunk*)sys_array.data();
+
+        if (sys_array.size() < offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)))
+            throw runtime_error("sys array truncated");
+
+        if (c.num_stripes > MAX_STRIPES) {
+            throw formatted_error("chunk num_stripes is {}, maximum supported is {}",
+                                  c.num_stripes, MAX_STRIPES);
+        }
+
+        sys_array = sys_array.subspan(offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)));
+
+        sys_chunks.insert(make_pair((uint64_t)k.offset, c));
+    }
+
+    return sys_chunks;
+}
+
+vector<string> find_devices(const btrfs::uuid& fsid) {
+    vector<string> ret;
+    blkid_cache_ptr cache;
+
+    if (blkid_get_cache(out_ptr(cache), nullptr) < 0)
+        throw runtime_error("blkid_get_cache failed");
+
+    if (blkid_probe_all(cache.get()) < 0)
+        throw runtime_error("blkid_probe_all failed");
+
+    {
+        blkid_dev_iterate_ptr iter{blkid_dev_iterate_begin(cache.get())};
+        blkid_dev dev;
+
+        auto fsid_str = format("{}", fsid);
+
+        blkid_dev_set_search(iter.get(), "TYPE", "btrfs");
+        blkid_dev_set_search(iter.get(), "UUID", fsid_str.c_str());
+
+        while (blkid_dev_next(iter.get(), &dev) == 0) {
+            ret.emplace_back(blkid_dev_devname(dev));
+        }
+    }
+
+    return ret;
+}
+
+// Adds a CHUNK_ITEM to a chunk map, as found when walking the chunk tree.
+void add_chunk_item(map<uint64_t, chunk>& chunks, const btrfs::key& key, span<const uint8_t> item) {
+    if (key.type != btrfs::key_type::CHUNK_ITEM)
+        return;
+
+    const auto& c = *(chunk*)item.data();
+
+    if (item.size() < offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)))
+        throw runtime_error("chunk item truncated");
+
+    if (c.num_stripes > MAX_STRIPES) {
+        throw formatted_error("chunk num_stripes is {}, maximum supported is {}",
+                              c.num_stripes, MAX_STRIPES);
+    }
+
+    chunks.insert(make_pair((uint64_t)key.offset, c));
+}
+
+// Adds a REMAP or IDENTITY_REMAP item to the remap map, as found when walking
+// the remap tree.
+void add_remap_item(fs_info& info, const btrfs::key& key, span<const uint8_t> item) {
+    switch (key.type) {
+        case btrfs::key_type::REMAP: {
+            const auto& r = *(btrfs::remap_item*)item.data();
+
+            if (item.size() < sizeof(btrfs::remap_item))
+                throw runtime_error("remap item truncated");
+
+            info.remaps.insert(make_pair(key.objectid, make_pair(key.offset, r.address)));
+            break;
+        }
+
+        case btrfs::key_type::IDENTITY_REMAP:
+            info.remaps.insert(make_pair(key.objectid, make_pair(key.offset, key.objectid)));
+            break;
+
+        default:
+            break;
+    }
+}
+
+enum class event_type {
+    node,
+    item,
+    ptr
+};
+
+// What walk yields: each node as it's read, followed by its items if it's a
+// leaf, or its key pointers if it isn't, each of which is followed by the
+// subtree it points to. This is the order that btrfs-dump prints them in.
+// The spans point into the node, which lives until the walk moves past it.
+struct tree_event {
+    event_type type;
+    unsigned int depth; // 0 for the root
+    uint64_t addr; // of the node
+    span<const uint8_t> node;
+    const btrfs::header* header;
+    size_t slot = 0; // for items and pointers
+    btrfs::key key; // for items and pointers
+    span<const uint8_t> item; // for items
+    const btrfs::key_ptr* ptr = nullptr; // for pointers
+};
+
+// Walks the tree at addr depth-first, reading each node only when it's
+// reached. tree_id is only used for the statistics.
+generator<const tree_event&> walk(const fs_info& info, uint64_t tree_id, uint64_t addr,
+                                  unsigned int depth = 0) {
+    const auto& sb = info.devices.begin()->second.sb;
+    trace::span sp("node");
+
+    sp.hex_arg("tree", tree_id);
+    sp.hex_arg("bytenr", addr);
+
+    auto tree = read_data(info, addr, sb.nodesize, false);
+    stats::buffer tree_buf(tree.size());
+
+    stats::tree_read(tree_id, tree.size());
+
+    const auto& h = *(btrfs::header*)tree.data();
+
+    // FIXME - also die on generation or level mismatch? Or option to struggle on manfully?
+
+    if (h.bytenr != addr)
+        throw formatted_error("Address mismatch: expected {:x}, got {:x}", addr, h.bytenr);
+
+    PROBE(btrfs_dump, node, (uint64_t)h.bytenr, h.level, (uint64_t)h.owner, (uint32_t)h.nritems);
+
+    tree_event ev;
+
+    ev.type = event_type::node;
+    ev.depth = depth;
+    ev.addr = addr;
+    ev.node = span((const uint8_t*)tree.data(), tree.size());
+    ev.header = &h;
+
+    co_yield ev;
+
+    if (h.level == 0) {
+        auto items = span((const btrfs::item*)((const uint8_t*)&h + sizeof(btrfs::header)), h.nritems);
+
+        ev.type = event_type::item;
+
+        for (const auto& it : items) {
+            ev.slot = &it - items.data();
+            ev.key = it.key;
+            ev.item = span((const uint8_t*)tree.data() + sizeof(btrfs::header) + it.offset, it.size);
+
+            co_yield ev;
+        }
+    } else {
+        auto items = span((const btrfs::key_ptr*)((const uint8_t*)&h + sizeof(btrfs::header)), h.nritems);
+
+        for (const auto& it : items) {
+            ev.type = event_type::ptr;
+            ev.slot = &it - items.data();
+            ev.key = it.key;
+            ev.item = {};
+            ev.ptr = &it;
+
+            co_yield ev;
+
+            co_yield ranges::elements_of(walk(info, tree_id, it.blockptr, depth + 1));
+        }
+    }
+}
+
+struct item_ref {
+    btrfs::key key;
+    span<const uint8_t> item;
+    const btrfs::header& header; // of the leaf the item is in
+};
+
+// Just the items of the tree at addr, in key order.
+generator<item_ref> items(const fs_info& info, uint64_t tree_id, uint64_t addr) {
+    for (const auto& ev : walk(info, tree_id, addr)) {
+        if (ev.type == event_type::item)
+            co_yield item_ref{ev.key, ev.item, *ev.header};
+    }
+}
+
+// A position in a tree, like the kernel's btrfs_path: the nodes from the
+// root down to a leaf, and the slot in each. The nodes are kept between
+// searches, so a lookup near the last one only reads the nodes that differ.
+class cursor {
+public:
+    cursor(const fs_info& info, uint64_t tree_id, uint64_t root)
+        : info(info), tree_id(tree_id), root(root) { }
+
+    // Moves to the first item whose key is at least key, going on to the
+    // next leaf if need be, and returns whether it's an exact match. If
+    // there's no such item, valid() becomes false, but as in the kernel the
+    // cursor is left just past the last item, so that prev_item() gives the
+    // last key less than key.
+    bool search_slot(const btrfs::key& key) {
+        uint64_t addr = root;
+        optional<uint8_t> expected_level;
+
+        for (size_t depth = 0; ; depth++) {
+            auto& l = load(depth, addr);
+            const auto& h = header(l);
+
+            if (expected_level.has_value() && h.level != *expected_level) {
+                throw formatted_error("node {:x} has level {}, expected {}", addr, h.level,
+                                      *expected_level);
+            }
+
+            if (h.level == 0) {
+                auto items = leaf_items(l);
+                auto it = ranges::lower_bound(items, key, {}, &btrfs::item::key);
+
+                path.resize(depth + 1);
+                l.slot = it - items.begin();
+
+                if (l.slot < items.size()) {
+                    at_item = true;
+                    at_end = false;
+                    return items[l.slot].key == key;
+                }
+
+                step_leaf(true);
+
+                return false;
+            }
+
+            auto ptrs = key_ptrs(l);
+
+            if (ptrs.empty())
+                throw formatted_error("internal node {:x} has no items", addr);
+
+            auto it = ranges::upper_bound(ptrs, key, {}, &btrfs::key_ptr::key);
+
+            l.slot = it == ptrs.begin() ? 0 : (unsigned int)(it - ptrs.begin()) - 1;
+            expected_level = h.level - 1;
+            addr = ptrs[l.slot].blockptr;
+        }
+    }
+
+    // Moves to the first item of the tree.
+    bool first() {
+        btrfs::key k;
+
+        memset(&k, 0, sizeof(k));
+
+        search_slot(k);
+
+        return at_item;
+    }
+
+    // Moves to the next item, crossing into the next leaf if need be.
+    // Returns false if there isn't one, leaving the cursor past the end.
+    bool next_item() {
+        if (!at_item)
+            return false;
+
+        auto& leaf = path.back();
+
+        if (leaf.slot + 1 < header(leaf).nritems) {
+            leaf.slot++;
+            return true;
+        }
+
+        return step_leaf(true);
+    }
+
+    // Moves to the previous item, crossing into the previous leaf if need
+    // be, or to the last item if the cursor is past the end. Returns false
+    // if there isn't one.
+    bool prev_item() {
+        if (!at_item && !at_end)
+            return false;
+
+        auto& leaf = path.back();
+
+        if (leaf.slot > 0) {
+            leaf.slot--;
+            at_item = true;
+            at_end = false;
+            return true;
+        }
+
+        return step_leaf(false);
+    }
+
+    bool valid() const {
+        return at_item;
+    }
+
+    // the rest are only meaningful if valid() is true
+
+    const btrfs::key& key() const {
+        const auto& leaf = path.back();
+
+        return leaf_items(leaf)[leaf.slot].key;
+    }
+
+    span<const uint8_t> item() const {
+        const auto& leaf = path.back();
+        const auto& it = leaf_items(leaf)[leaf.slot];
+        auto data_size = leaf.node.size() - sizeof(btrfs::header);
+
+        if (it.offset > data_size || it.size > data_size - it.offset)
+            throw formatted_error("item {} of leaf {:x} runs off the end", leaf.slot, leaf.addr);
+
+        return span((const uint8_t*)leaf.node.data() + sizeof(btrfs::header) + it.offset, it.size);
+    }
+
+    const btrfs::header& leaf() const {
+        return header(path.back());
+    }
+
+    uint64_t leaf_addr() const {
+        return path.back().addr;
+    }
+
+    unsigned int slot() const {
+        return path.back().slot;
+    }
+
+private:
+    struct level {
+        uint64_t addr;
+        string node;
+        unsigned int slot = 0;
+    };
+
+    static const btrfs::header& header(const level& l) {
+        return *(const btrfs::header*)l.node.data();
+    }
+
+    static span<const btrfs::item> leaf_items(const level& l) {
+        return span((const btrfs::item*)(l.node.data() + sizeof(btrfs::header)), header(l).nritems);
+    }
+
+    static span<const btrfs::key_ptr> key_ptrs(const level& l) {
+        return span((const btrfs::key_ptr*)(l.node.data() + sizeof(btrfs::header)), header(l).nritems);
+    }
+
+    // Returns the node at depth, reading it unless it's already there.
+    level& load(size_t depth, uint64_t addr) {
+        if (depth < path.size() && path[depth].addr == addr)
+            return path[depth];
+
+        const auto& sb = info.devices.begin()->second.sb;
+
+        if (path.size() <= depth)
+            path.resize(depth + 1);
+
+        auto& l = path[depth];
+
+        l.addr = addr;
+        l.node = read_data(info, addr, sb.nodesize);
+        l.slot = 0;
+
+        stats::tree_read(tree_id, l.node.size());
+
+        const auto& h = header(l);
+
+        if (h.bytenr != addr)
+            throw formatted_error("Address mismatch: expected {:x}, got {:x}", addr, h.bytenr);
+
+        auto entry_size = h.level == 0 ? sizeof(btrfs::item) : sizeof(btrfs::key_ptr);
+
+        if (h.nritems > (sb.nodesize - sizeof(btrfs::header)) / entry_size)
+            throw formatted_error("node {:x} has too many items ({})", addr, h.nritems);
+
+        return l;
+    }
+
+    // Moves to the first item of the next leaf, or the last item of the
+    // previous one, skipping any empty leaves. Going forward from the last
+    // leaf leaves the cursor past its end.
+    bool step_leaf(bool forward) {
+        auto depth = path.size() - 1;
+
+        while (depth-- > 0) {
+            auto& l = path[depth];
+
+            if (forward ? l.slot + 1 >= header(l).nritems : l.slot == 0)
+                continue;
+
+            if (forward)
+                l.slot++;
+            else
+                l.slot--;
+
+            // go back down the edge of the subtree
+
+            for (auto d = depth; d + 1 < path.size(); d++) {
+                auto child = key_ptrs(path[d])[path[d].slot].blockptr;
+                auto& c = load(d + 1, child);
+                auto n = header(c).nritems;
+
+                c.slot = forward || n == 0 ? 0 : n - 1;
+            }
+
+            if (header(path.back()).nritems != 0) {
+                at_item = true;
+                at_end = false;
+                return true;
+            }
+
+            depth = path.size() - 1;
+        }
+
+        if (forward)
+            path.back().slot = header(path.back()).nritems;
+
+        at_item = false;
+        at_end = forward;
+
+        return false;
+    }
+
+    const fs_info& info;
+    uint64_t tree_id;
+    uint64_t root;
+    vector<level> path; // the root first
+    bool at_item = false;
+    bool at_end = false; // just past the last item
+};
+
+// An open filesystem. Given one device of a multi-device filesystem, it uses
+// libblkid to find the others. Given a binary dump, it reads from that
+// instead.
+class volume {
+public:
+    volume(const vector<filesystem::path>& fns) {
+        for (const auto& p : fns) {
+            files.emplace_back(p, p.string());
+
+            if (files.back().first.fail())
+                throw formatted_error("Failed to open {}", p.string()); // FIXME - include why
+        }
+
+        if (fns.size() == 1 && bindump::is_archive(fns.front())) {
+            archive.emplace(fns.front());
+            fs.archive = &*archive;
+        }
+
+        auto& devices = fs.devices;
+
+        for (auto& f : files) {
+            device d(f.first, f.second);
+
+            if (archive)
+                d.sb = archive->superblock();
+            else
+                read_superblock(d);
+
+            if (d.sb.magic != btrfs::MAGIC)
+                throw runtime_error("not a btrfs device");
+
+            if (devices.count(d.sb.dev_item.devid) != 0)
+                throw formatted_error("device {} specified more than once", d.sb.dev_item.devid);
+
+            devices.emplace(d.sb.dev_item.devid, move(d));
+        }
+
+        const auto& sb = devices.begin()->second.sb;
+
+        if (archive) {
+            // everything we need is in the dump itself
+        } else if (fns.size() == 1 && sb.num_devices > 1) {
+            auto other_fns = find_devices(sb.fsid);
+            string unopened;
+
+            // blkid's cache can have stale entries, so this only matters if
+            // it leaves us short of devices
+
+            for (const auto& n : other_fns) {
+                files.emplace_back(n, n);
+
+                if (files.back().first.fail())
+                    unopened += format(" {}", n); // FIXME - include why
+            }
+
+            if (!unopened.empty())
+                unopened = format(" (failed to open{})", unopened);
+
+            for (auto& f : files) {
+                if (&f == &files.front())
+                    continue;
+
+                if (f.first.fail())
+                    continue;
+
+                device d(f.first, f.second);
+
+                read_superblock(d);
+
+                // FIXME - close irrelevant files
+
+                if (d.sb.magic != btrfs::MAGIC)
+                    continue;
+
+                if (d.sb.fsid != sb.fsid)
+                    continue;
+
+                if (devices.count(d.sb.dev_item.devid) != 0)
+                    continue;
+
+                devices.emplace(d.sb.dev_item.devid, move(d));
+            }
+
+            if (devices.size() != sb.num_devices) {
+                if (devices.size() == 1) {
+                    throw formatted_error("filesystem has {} devices, unable to find the others{}",
+                                          sb.num_devices, unopened);
+                } else {
+                    throw formatted_error("filesystem has {} devices, only able to find {} of them{}",
+                                          sb.num_devices, devices.size(), unopened);
+                }
+            }
+        } else {
+            if (devices.size() > 1) {
+                for (const auto& [dev_id, d] : devices) {
+                    if (d.sb.fsid != sb.fsid) {
+                        throw formatted_error("fsid mismatch (device {} is {}, device {} is {})",
+                                              sb.dev_item.devid, sb.fsid, dev_id,
+                                              d.sb.fsid);
+                    }
+                }
+            }
+
+            if (devices.size() != sb.num_devices) {
+                throw formatted_error("filesystem has {} devices, only {} found",
+                                      sb.num_devices, devices.size());
+            }
+        }
+
+        // FIXME - do we need to check that generation numbers match?
+
+        fs.sys_chunks = load_sys_chunks(sb);
+    }
+
+    volume(const volume&) = delete;
+    volume& operator=(const volume&) = delete;
+
+    fs_info& info() {
+        return fs;
+    }
+
+    const fs_info& info() const {
+        return fs;
+    }
+
+    const btrfs::super_block& sb() const {
+        return fs.devices.begin()->second.sb;
+    }
+
+    // Reads the chunk tree, and the remap tree if there is one, so that
+    // addresses outside the system chunks can be read.
+    void load_chunks() {
+        if (chunks_loaded)
+            return;
+
+        const auto& sb = this->sb();
+        decltype(fs.chunks) new_chunks;
+
+        for (const auto& it : traverse::items(fs, btrfs::CHUNK_TREE_OBJECTID, sb.chunk_root)) {
+            add_chunk_item(new_chunks, it.key, it.item);
+        }
+
+        fs.chunks.swap(new_chunks);
+
+        if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE) {
+            for (const auto& it : traverse::items(fs, btrfs::REMAP_TREE_OBJECTID, sb.remap_root)) {
+                add_remap_item(fs, it.key, it.item);
+            }
+        }
+
+        chunks_loaded = true;
+    }
+
+    // For callers that have read the chunk and remap trees themselves, while
+    // printing them say, so that load_chunks doesn't read them again.
+    void set_chunks_loaded() {
+        chunks_loaded = true;
+    }
+
+    // The address of the root of each tree, from the ROOT_ITEMs in the
+    // root tree.
+    map<uint64_t, uint64_t> roots() {
+        map<uint64_t, uint64_t> ret;
+
+        load_chunks();
+
+        for (const auto& it : traverse::items(fs, btrfs::ROOT_TREE_OBJECTID, sb().root)) {
+            if (it.key.type != btrfs::key_type::ROOT_ITEM || it.item.size() < sizeof(btrfs::root_item))
+                continue;
+
+            const auto& ri = *(const btrfs::root_item*)it.item.data();
+
+            ret.insert(make_pair((uint64_t)it.key.objectid, (uint64_t)ri.bytenr));
+        }
+
+        return ret;
+    }
+
+    // The address of the root of a tree. Trees whose roots are in the
+    // superblock are found directly, and the rest by looking up their
+    // ROOT_ITEM.
+    uint64_t find_root(uint64_t tree_id) {
+        const auto& sb = this->sb();
+        uint64_t addr = 0;
+
+        if (tree_id == btrfs::CHUNK_TREE_OBJECTID)
+            addr = sb.chunk_root;
+        else {
+            load_chunks();
+
+            if (tree_id == btrfs::ROOT_TREE_OBJECTID)
+                addr = sb.root;
+            else if (tree_id == btrfs::TREE_LOG_OBJECTID)
+                addr = sb.log_root;
+            else if (tree_id == btrfs::REMAP_TREE_OBJECTID && sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE)
+                addr = sb.remap_root;
+            else if (auto ri = find_root_item(tree_id))
+                addr = ri->bytenr;
+        }
+
+        if (addr == 0)
+            throw formatted_error("tree {:x} not found", tree_id);
+
+        return addr;
+    }
+
+    // A tree's ROOT_ITEM, or nullopt if it hasn't got one, as with the trees
+    // whose roots are in the superblock. Items from before generation_v2 was
+    // added are padded with zeroes. Rather than reading the whole root tree,
+    // which can be large if there are a lot of snapshots, each is looked up
+    // with the same cursor, so nodes are only read once.
+    optional<btrfs::root_item> find_root_item(uint64_t tree_id) {
+        load_chunks();
+
+        if (!root_cursor)
+            root_cursor.emplace(fs, btrfs::ROOT_TREE_OBJECTID, sb().root);
+
+        auto& c = *root_cursor;
+        btrfs::key k;
+
+        k.objectid = tree_id;
+        k.type = btrfs::key_type::ROOT_ITEM;
+        k.offset = 0;
+
+        c.search_slot(k);
+
+        if (!c.valid() || c.key().objectid != tree_id || c.key().type != btrfs::key_type::ROOT_ITEM)
+            return nullopt;
+
+        auto item = c.item();
+
+        if (item.size() < offsetof(btrfs::root_item, generation_v2))
+            return nullopt;
+
+        btrfs::root_item ri;
+
+        memset(&ri, 0, sizeof(ri));
+        memcpy(&ri, item.data(), min(item.size(), sizeof(ri)));
+
+        return ri;
+    }
+
+    // The items of a tree, in key order.
+    generator<item_ref> items(uint64_t tree_id) {
+        auto addr = find_root(tree_id);
+
+        co_yield ranges::elements_of(traverse::items(fs, tree_id, addr));
+    }
+
+    // A cursor for point lookups in a tree.
+    cursor open_tree(uint64_t tree_id) {
+        auto addr = find_root(tree_id);
+
+        return cursor(fs, tree_id, addr);
+    }
+
+private:
+    list<pair<ifstream, string>> files;
+    optional<bindump::reader> archive;
+    fs_info fs;
+    bool chunks_loaded = false;
+    optional<cursor> root_cursor; // for find_root_item
+};
+
+}
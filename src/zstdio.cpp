@@ -0,0 +1,502 @@
+module;
+
+#include <stdint.h>
+#include <string.h>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <format>
+#include <zstd.h>
+
+export module zstdio;
+
+import cxxbtrfs;
+import formatted_error;
+
+using namespace std;
+
+export namespace zstdio {
+
+// Compressed output uses the zstd seekable format: a series of independent
+// zstd frames, followed by a skippable frame holding the seek table (the
+// compressed and decompressed size of every frame). btrfs-dump starts a new
+// frame at every tree label, and whenever the current frame reaches
+// frame_size bytes.
+//
+// Just before the seek table there is one more skippable frame listing the
+// labels, so that a reader can find where e.g. "Tree 5" starts without
+// decompressing anything before it. It has an entry in the seek table with
+// a decompressed size of zero, so the offsets of the other frames are
+// unaffected. Plain zstd ignores both skippable frames.
+
+constexpr uint32_t SEEKABLE_MAGIC = 0x8f92eab1;
+constexpr uint32_t SEEK_TABLE_MAGIC = 0x184d2a5e;
+constexpr uint32_t LABELS_MAGIC = 0x184d2a5b;
+
+constexpr size_t DEFAULT_FRAME_SIZE = 8 * 1024 * 1024;
+constexpr int DEFAULT_LEVEL = 3;
+
+struct seek_table_entry {
+    btrfs::le32 compressed_size;
+    btrfs::le32 decompressed_size;
+} __attribute__((packed));
+
+static_assert(sizeof(seek_table_entry) == 8);
+
+struct seek_table_footer {
+    btrfs::le32 num_frames;
+    uint8_t descriptor;
+    btrfs::le32 magic;
+} __attribute__((packed));
+
+static_assert(sizeof(seek_table_footer) == 9);
+
+struct label_entry {
+    btrfs::le32 frame;
+    btrfs::le16 len;
+} __attribute__((packed));
+
+static_assert(sizeof(label_entry) == 6);
+
+bool is_zstd(istream& in) {
+    uint32_t magic;
+
+    if (!in.read((char*)&magic, sizeof(magic))) {
+        in.clear();
+        in.seekg(0);
+        return false;
+    }
+
+    in.seekg(0);
+
+    return magic == ZSTD_MAGICNUMBER ||
+           (magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START;
+}
+
+class writer : public streambuf {
+public:
+    writer(ostream& out, size_t frame_size = DEFAULT_FRAME_SIZE, int level = DEFAULT_LEVEL)
+        : out(out), level(level), frame_size(frame_size) {
+        if (frame_size == 0 || frame_size > UINT32_MAX)
+            throw formatted_error("invalid zstd frame size {}", frame_size);
+
+        buf.resize(frame_size);
+        setp(buf.data(), buf.data() + buf.size());
+
+        t = thread([this]() {
+            compress_thread();
+        });
+    }
+
+    ~writer() {
+        if (!t.joinable())
+            return;
+
+        {
+            lock_guard lg(lock);
+            done = true;
+        }
+
+        cv.notify_all();
+        t.join();
+    }
+
+    writer(const writer&) = delete;
+    writer& operator=(const writer&) = delete;
+
+    // Ends the current frame and starts a new one, beginning with the section
+    // label, which is recorded in the index.
+    void new_frame(string_view label) {
+        submit();
+        next_label = label;
+    }
+
+    void finish() {
+        submit();
+
+        {
+            lock_guard lg(lock);
+            done = true;
+        }
+
+        cv.notify_all();
+        t.join();
+
+        if (err)
+            rethrow_exception(err);
+
+        write_index();
+
+        out.flush();
+
+        if (out.fail())
+            throw runtime_error("error writing compressed output");
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        submit();
+
+        if (ch != traits_type::eof()) {
+            *pptr() = (char)ch;
+            pbump(1);
+        }
+
+        return traits_type::not_eof(ch);
+    }
+
+    streamsize xsputn(const char* s, streamsize n) override {
+        auto left = n;
+
+        while (left > 0) {
+            auto space = epptr() - pptr();
+
+            if (space == 0) {
+                submit();
+                continue;
+            }
+
+            auto to_copy = min(space, left);
+
+            memcpy(pptr(), s, to_copy);
+            pbump((int)to_copy);
+            s += to_copy;
+            left -= to_copy;
+        }
+
+        return n;
+    }
+
+    // Deliberately doesn't end the frame, as btrfs-dump calls endl on every
+    // line.
+    int sync() override {
+        return 0;
+    }
+
+private:
+    struct job {
+        vector<char> data;
+        string label;
+    };
+
+    void submit() {
+        auto len = pptr() - pbase();
+
+        if (len == 0)
+            return;
+
+        {
+            unique_lock ul(lock);
+
+            // keep at most two frames queued, so memory use is bounded
+            cv.wait(ul, [this]() { return queue.size() < 2 || err; });
+
+            if (err)
+                rethrow_exception(err);
+
+            buf.resize(len);
+            queue.push_back({move(buf), move(next_label)});
+            next_label.clear();
+        }
+
+        cv.notify_all();
+
+        buf.resize(frame_size);
+        setp(buf.data(), buf.data() + buf.size());
+    }
+
+    void compress_thread() {
+        ZSTD_CCtx* cctx = ZSTD_createCCtx();
+        vector<uint8_t> cbuf;
+
+        try {
+            if (!cctx)
+                throw runtime_error("ZSTD_createCCtx failed");
+
+            while (true) {
+                job j;
+
+                {
+                    unique_lock ul(lock);
+
+                    cv.wait(ul, [this]() { return !queue.empty() || done; });
+
+                    if (queue.empty())
+                        break;
+
+                    j = move(queue.front());
+                    queue.pop_front();
+                }
+
+                cv.notify_all();
+
+                cbuf.resize(ZSTD_compressBound(j.data.size()));
+
+                auto ret = ZSTD_compressCCtx(cctx, cbuf.data(), cbuf.size(),
+                                             j.data.data(), j.data.size(), level);
+                if (ZSTD_isError(ret))
+                    throw formatted_error("ZSTD_compressCCtx failed: {}", ZSTD_getErrorName(ret));
+
+                out.write((const char*)cbuf.data(), ret);
+
+                if (out.fail())
+                    throw runtime_error("error writing compressed output");
+
+                if (!j.label.empty())
+                    labels.emplace_back((uint32_t)frames.size(), move(j.label));
+
+                auto& e = frames.emplace_back();
+
+                e.compressed_size = (uint32_t)ret;
+                e.decompressed_size = (uint32_t)j.data.size();
+            }
+        } catch (...) {
+            lock_guard lg(lock);
+            err = current_exception();
+        }
+
+        ZSTD_freeCCtx(cctx);
+
+        cv.notify_all();
+    }
+
+    void write_index() {
+        // labels frame
+
+        string payload;
+
+        for (const auto& [frame, name] : labels) {
+            label_entry le;
+
+            le.frame = frame;
+            le.len = (uint16_t)name.size();
+
+            payload.append((const char*)&le, sizeof(le));
+            payload.append(name);
+        }
+
+        write_skippable(LABELS_MAGIC, payload);
+
+        auto& e = frames.emplace_back();
+
+        e.compressed_size = (uint32_t)(payload.size() + 8);
+        e.decompressed_size = 0;
+
+        // seek table
+
+        seek_table_footer f;
+
+        f.num_frames = (uint32_t)frames.size();
+        f.descriptor = 0;
+        f.magic = SEEKABLE_MAGIC;
+
+        payload.assign((const char*)frames.data(), frames.size() * sizeof(seek_table_entry));
+        payload.append((const char*)&f, sizeof(f));
+
+        write_skippable(SEEK_TABLE_MAGIC, payload);
+    }
+
+    void write_skippable(uint32_t magic, string_view payload) {
+        btrfs::le32 hdr[2];
+
+        hdr[0] = magic;
+        hdr[1] = (uint32_t)payload.size();
+
+        out.write((const char*)hdr, sizeof(hdr));
+        out.write(payload.data(), payload.size());
+    }
+
+    ostream& out;
+    int level;
+    size_t frame_size;
+    vector<char> buf;
+    string next_label;
+    thread t;
+    mutex lock;
+    condition_variable cv;
+    deque<job> queue;
+    bool done = false;
+    exception_ptr err;
+    vector<seek_table_entry> frames; // only touched by compression thread until joined
+    vector<pair<uint32_t, string>> labels;
+};
+
+// Decompresses a stream of zstd frames, skipping over the skippable frames.
+class reader : public streambuf {
+public:
+    reader(istream& in) : in(in) {
+        dctx = ZSTD_createDCtx();
+        if (!dctx)
+            throw runtime_error("ZSTD_createDCtx failed");
+
+        inbuf.resize(ZSTD_DStreamInSize());
+        outbuf.resize(ZSTD_DStreamOutSize());
+    }
+
+    ~reader() {
+        ZSTD_freeDCtx(dctx);
+    }
+
+    reader(const reader&) = delete;
+    reader& operator=(const reader&) = delete;
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+
+        while (true) {
+            if (input.pos == input.size) {
+                in.read((char*)inbuf.data(), inbuf.size());
+
+                input.src = inbuf.data();
+                input.size = in.gcount();
+                input.pos = 0;
+
+                if (input.size == 0) {
+                    if (last_ret != 0)
+                        throw runtime_error("compressed input is truncated");
+
+                    return traits_type::eof();
+                }
+            }
+
+            ZSTD_outBuffer output = { outbuf.data(), outbuf.size(), 0 };
+
+            last_ret = ZSTD_decompressStream(dctx, &output, &input);
+            if (ZSTD_isError(last_ret))
+                throw formatted_error("ZSTD_decompressStream failed: {}", ZSTD_getErrorName(last_ret));
+
+            if (output.pos > 0) {
+                setg(outbuf.data(), outbuf.data(), outbuf.data() + output.pos);
+                return traits_type::to_int_type(*gptr());
+            }
+        }
+    }
+
+private:
+    istream& in;
+    ZSTD_DCtx* dctx;
+    vector<uint8_t> inbuf;
+    vector<char> outbuf;
+    ZSTD_inBuffer input = { nullptr, 0, 0 };
+    size_t last_ret = 0;
+};
+
+struct section {
+    string label;
+    uint64_t compressed_offset;
+    uint64_t decompressed_offset;
+    uint64_t decompressed_size; // up to the next section, or the end
+};
+
+// Reads the seek table and label frame from the end of a compressed dump.
+// Seeking the input to compressed_offset and wrapping it in a reader will
+// start decompressing at the beginning of that section.
+vector<section> read_sections(istream& in) {
+    seek_table_footer f;
+    btrfs::le32 hdr[2];
+
+    in.seekg(-(streamoff)sizeof(f), ios::end);
+    auto footer_pos = (uint64_t)in.tellg();
+
+    if (!in.read((char*)&f, sizeof(f)) || f.magic != SEEKABLE_MAGIC)
+        throw runtime_error("compressed input has no seek table");
+
+    if (f.descriptor & 0x7c)
+        throw runtime_error("reserved bits set in seek table descriptor");
+
+    auto entry_size = f.descriptor & 0x80 ? sizeof(seek_table_entry) + sizeof(uint32_t) : sizeof(seek_table_entry);
+    auto table_size = (uint64_t)f.num_frames * entry_size;
+
+    if (table_size + sizeof(hdr) > footer_pos)
+        throw runtime_error("seek table is truncated");
+
+    in.seekg(footer_pos - table_size - sizeof(hdr));
+
+    vector<uint8_t> table(sizeof(hdr) + table_size);
+
+    if (!in.read((char*)table.data(), table.size()))
+        throw runtime_error("error reading seek table");
+
+    memcpy(hdr, table.data(), sizeof(hdr));
+
+    if (hdr[0] != SEEK_TABLE_MAGIC || hdr[1] != table_size + sizeof(f))
+        throw runtime_error("seek table header is invalid");
+
+    vector<pair<uint64_t, uint64_t>> offsets;
+    uint64_t coff = 0, doff = 0;
+
+    for (uint32_t i = 0; i < f.num_frames; i++) {
+        const auto& e = *(const seek_table_entry*)(table.data() + sizeof(hdr) + (i * entry_size));
+
+        offsets.emplace_back(coff, doff);
+        coff += e.compressed_size;
+        doff += e.decompressed_size;
+    }
+
+    if (offsets.empty())
+        return {};
+
+    // labels frame is the last one before the seek table
+
+    auto labels_off = offsets.back().first;
+    uint64_t labels_size = coff - labels_off;
+
+    if (labels_size < sizeof(hdr))
+        throw runtime_error("compressed input has no label frame");
+
+    vector<char> labels(labels_size);
+
+    in.seekg(labels_off);
+
+    if (!in.read(labels.data(), labels.size()))
+        throw runtime_error("error reading label frame");
+
+    memcpy(hdr, labels.data(), sizeof(hdr));
+
+    if (hdr[0] != LABELS_MAGIC || hdr[1] != labels_size - sizeof(hdr))
+        throw runtime_error("label frame is invalid");
+
+    vector<section> ret;
+    auto sv = string_view(labels).substr(sizeof(hdr));
+
+    while (!sv.empty()) {
+        if (sv.size() < sizeof(label_entry))
+            throw runtime_error("label frame is truncated");
+
+        const auto& le = *(const label_entry*)sv.data();
+
+        if (sv.size() < sizeof(label_entry) + le.len || le.frame >= offsets.size())
+            throw runtime_error("label frame is invalid");
+
+        if (!ret.empty() && offsets[le.frame].second < ret.back().decompressed_offset)
+            throw runtime_error("label frame is out of order");
+
+        ret.emplace_back(string{sv.substr(sizeof(label_entry), le.len)},
+                         offsets[le.frame].first, offsets[le.frame].second, 0);
+
+        sv = sv.substr(sizeof(label_entry) + le.len);
+    }
+
+    for (size_t i = 0; i < ret.size(); i++) {
+        auto end = i + 1 < ret.size() ? ret[i + 1].decompressed_offset : doff;
+
+        ret[i].decompressed_size = end - ret[i].decompressed_offset;
+    }
+
+    in.clear();
+    in.seekg(0);
+
+    return ret;
+}
+
+}